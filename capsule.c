@@ -0,0 +1,194 @@
+/** \file
+ * UEFI capsule file parsing.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "capsule.h"
+#include "uefi_index.h"
+
+#define EFI_CAPSULE_GUID "3b6686bd-0d76-4030-b70e-b5519e2fc5a0"
+#define EFI_INTEL_CAPSULE_GUID "539182b9-abb5-4391-b69a-e3a943f72fcc"
+#define EFI_FMP_CAPSULE_GUID "6dcbd5ed-e82d-4c44-bda1-7194199ad92a"
+#define APTIO_SIGNED_CAPSULE_GUID "4a3ca68b-7723-48fb-803d-578cc1fec44d"
+#define APTIO_UNSIGNED_CAPSULE_GUID "14eebb90-890a-43db-aed1-5d3c4588a418"
+
+#define WIN_CERT_REVISION 0x0200
+#define WIN_CERT_TYPE_EFI_GUID 0x0EF1
+
+
+static int
+capsule_add(
+	capsule_t * const cap,
+	uint64_t offset,
+	uint64_t len,
+	const uint8_t * const guid
+)
+{
+	if (cap->num_payloads == CAPSULE_MAX_PAYLOADS || len == 0)
+		return -1;
+
+	capsule_payload_t * const p = &cap->payloads[cap->num_payloads++];
+	p->offset = offset;
+	p->len = len;
+	memcpy(p->guid, guid, sizeof(p->guid));
+	return 0;
+}
+
+
+/*
+ * An FMP image may start with EFI_FIRMWARE_IMAGE_AUTHENTICATION:
+ * a monotonic count followed by a WIN_CERTIFICATE_UEFI_GUID, whose
+ * length covers the certificate.  The image follows it.
+ */
+static uint64_t
+fmp_auth_len(
+	const uint8_t * const image,
+	uint64_t len
+)
+{
+	uint32_t cert_len;
+	uint16_t revision, type;
+
+	if (len < 8 + 8)
+		return 0;
+
+	memcpy(&cert_len, image + 8, sizeof(cert_len));
+	memcpy(&revision, image + 12, sizeof(revision));
+	memcpy(&type, image + 14, sizeof(type));
+
+	if (revision != WIN_CERT_REVISION
+	||  type != WIN_CERT_TYPE_EFI_GUID
+	||  cert_len < 8
+	||  cert_len > len - 8)
+		return 0;
+
+	return 8 + cert_len;
+}
+
+
+static int
+fmp_parse(
+	capsule_t * const cap,
+	const uint8_t * const buf,
+	uint64_t start,
+	uint64_t end
+)
+{
+	struct fmp_capsule_header fmp;
+	if (start + sizeof(fmp) > end)
+		return -1;
+	memcpy(&fmp, buf + start, sizeof(fmp));
+
+	const unsigned items = fmp.driver_count + fmp.payload_count;
+	if (start + sizeof(fmp) + items * 8ULL > end)
+		return -1;
+
+	// the embedded drivers come first and are of no interest
+	for (unsigned i = fmp.driver_count ; i < items ; i++)
+	{
+		uint64_t item;
+		memcpy(&item, buf + start + sizeof(fmp) + i * 8, sizeof(item));
+		if (item > end - start)
+			return -1;
+
+		struct fmp_image_header image;
+		const uint64_t image_offset = start + item;
+		memset(&image, 0, sizeof(image));
+		if (image_offset + 0x20 > end)
+			return -1;
+		memcpy(&image, buf + image_offset,
+			end - image_offset < sizeof(image) ? end - image_offset : sizeof(image));
+
+		const uint64_t header_len = image.version >= 3 ? 0x30
+			: image.version == 2 ? 0x28 : 0x20;
+		uint64_t offset = image_offset + header_len;
+		uint64_t len = image.image_len;
+		if (offset > end || len > end - offset)
+			return -1;
+
+		const uint64_t auth = fmp_auth_len(buf + offset, len);
+		offset += auth;
+		len -= auth;
+
+		if (capsule_add(cap, offset, len, image.type_guid) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+int
+capsule_parse(
+	capsule_t * const cap,
+	const void * const buf,
+	uint64_t size
+)
+{
+	struct efi_capsule_header header;
+	char guid[GUID_STR_LEN];
+
+	memset(cap, 0, sizeof(*cap));
+	if (size < sizeof(header))
+		return -1;
+
+	memcpy(&header, buf, sizeof(header));
+	if (header.header_len < sizeof(header)
+	||  header.len <= header.header_len
+	||  header.len > size)
+		return -1;
+
+	memcpy(cap->guid, header.guid, sizeof(cap->guid));
+	cap->flags = header.flags;
+	guid_format(guid, header.guid);
+
+	if (strcmp(guid, EFI_FMP_CAPSULE_GUID) == 0)
+	{
+		cap->type = CAPSULE_TYPE_FMP;
+		if (fmp_parse(cap, buf, header.header_len, header.len) < 0
+		||  cap->num_payloads == 0)
+			return -1;
+		return 0;
+	}
+
+	if (strcmp(guid, APTIO_SIGNED_CAPSULE_GUID) == 0
+	||  strcmp(guid, APTIO_UNSIGNED_CAPSULE_GUID) == 0)
+	{
+		struct aptio_capsule_header aptio;
+		if (header.len < sizeof(aptio))
+			return -1;
+		memcpy(&aptio, buf, sizeof(aptio));
+		if (aptio.rom_offset < sizeof(aptio)
+		||  aptio.rom_offset >= header.len)
+			return -1;
+
+		cap->type = CAPSULE_TYPE_APTIO;
+		return capsule_add(cap, aptio.rom_offset,
+			header.len - aptio.rom_offset, header.guid);
+	}
+
+	if (strcmp(guid, EFI_CAPSULE_GUID) == 0
+	||  strcmp(guid, EFI_INTEL_CAPSULE_GUID) == 0)
+	{
+		cap->type = CAPSULE_TYPE_EFI;
+		return capsule_add(cap, header.header_len,
+			header.len - header.header_len, header.guid);
+	}
+
+	return -1;
+}
+
+
+const char *
+capsule_type_name(
+	int type
+)
+{
+	switch (type)
+	{
+	case CAPSULE_TYPE_EFI: return "efi";
+	case CAPSULE_TYPE_FMP: return "fmp";
+	case CAPSULE_TYPE_APTIO: return "aptio";
+	default: return "unknown";
+	}
+}
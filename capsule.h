@@ -0,0 +1,83 @@
+/** \file
+ * UEFI capsule file parsing.
+ *
+ * Vendor updates are distributed as capsules: a plain EFI capsule
+ * header in front of the image, an AMI Aptio header that points to
+ * the ROM image, or an FMP capsule that lists one or more payloads,
+ * each with its own image header and optional authentication.  The
+ * payloads are returned as offsets into the capsule, so callers can
+ * work on a mapped capsule without copying the image out of it.
+ */
+#ifndef _capsule_h_
+#define _capsule_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CAPSULE_MAX_PAYLOADS 16
+
+#define CAPSULE_TYPE_EFI 1
+#define CAPSULE_TYPE_FMP 2
+#define CAPSULE_TYPE_APTIO 3
+
+struct efi_capsule_header {
+	uint8_t guid[16];               // 0x00
+	uint32_t header_len;            // 0x10
+	uint32_t flags;                 // 0x14
+	uint32_t len;                   // 0x18 including the header
+} __attribute__((__packed__));
+
+struct fmp_capsule_header {
+	uint32_t version;               // 0x00
+	uint16_t driver_count;          // 0x04
+	uint16_t payload_count;         // 0x06
+	// uint64_t item_offsets[driver_count + payload_count];
+} __attribute__((__packed__));
+
+struct fmp_image_header {
+	uint32_t version;               // 0x00
+	uint8_t type_guid[16];          // 0x04
+	uint8_t index;                  // 0x14
+	uint8_t reserved[3];
+	uint32_t image_len;             // 0x18
+	uint32_t vendor_len;            // 0x1c
+	uint64_t hardware_instance;     // 0x20 version 2 and later
+	uint64_t capsule_support;       // 0x28 version 3 and later
+} __attribute__((__packed__));
+
+struct aptio_capsule_header {
+	struct efi_capsule_header capsule;
+	uint16_t rom_offset;            // 0x1c from the capsule header
+	uint16_t layout_offset;         // 0x1e
+} __attribute__((__packed__));
+
+typedef struct {
+	uint64_t offset;        // of the image in the capsule file
+	uint64_t len;
+	uint8_t guid[16];       // FMP image type, or the capsule GUID
+} capsule_payload_t;
+
+typedef struct {
+	int type;
+	uint8_t guid[16];
+	uint32_t flags;
+	unsigned num_payloads;
+	capsule_payload_t payloads[CAPSULE_MAX_PAYLOADS];
+} capsule_t;
+
+
+// Returns 0 if buf holds a recognised capsule, -1 if not
+extern int
+capsule_parse(
+	capsule_t * cap,
+	const void * buf,
+	uint64_t size
+);
+
+
+extern const char *
+capsule_type_name(
+	int type
+);
+
+#endif
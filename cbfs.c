@@ -10,18 +10,11 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <lzma.h>
 #include "util.h"
-
-#define CBFS_HEADER_MAGIC  0x4F524243
-#define CBFS_HEADER_VERSION1 0x31313131
-#define CBFS_HEADER_VERSION2 0x31313132
-#define CBFS_HEADER_VERSION  CBFS_HEADER_VERSION2
-
-#define MAX_CBFS_FILE_HEADER_BUFFER 1024
-#define CBFS_CONTENT_DEFAULT_VALUE	(-1)
-#define CBFS_FILENAME_ALIGN	(16)
-#define CBFS_COMPONENT_RAW 0x50
-#define CBFS_COMPONENT_NULL 0xFFFFFFFF
+#include "cbfs_index.h"
+#include "descriptor.h"
+#include "lz4.h"
 
 int verbose = 0;
 
@@ -33,6 +26,7 @@ static const struct option long_options[] = {
 	{ "rom",		1, NULL, 'o' },
 	{ "list",		0, NULL, 'l' },
 	{ "type",		1, NULL, 't' },
+	{ "compress",		1, NULL, 'c' },
 	{ "help",		0, NULL, 'h' },
 	{ NULL,			0, NULL, 0 },
 };
@@ -49,52 +43,50 @@ static const char usage[] =
 "    -a | --add name -f | --file path   Add a CBFS file\n"
 "    -d | --delete name                 Delete a CBFS file\n"
 "    -t | --type 50                     Filter/set to CBFS file type (hex)\n"
+"    -c | --compress lz4|lzma           Compress the added file if smaller\n"
 "\n";
 
-struct cbfs_header {
-	uint32_t magic;
-	uint32_t version;
-	uint32_t romsize;
-	uint32_t bootblocksize;
-	uint32_t align; /* hard coded to 64 byte */
-	uint32_t offset;
-	uint32_t architecture;  /* Version 2 */
-	uint32_t pad[1];
-};
+/*
+ * coreboot's LZMA files have the 13 byte .lzma header, with the
+ * uncompressed size filled in.  Returns 0 if the result does not
+ * fit in dst_len bytes.
+ */
+static size_t lzma_compress(void *dst, size_t dst_len,
+	const void *src, size_t len)
+{
+	lzma_options_lzma options;
+	lzma_stream strm = LZMA_STREAM_INIT;
 
-#define CBFS_FILE_MAGIC "LARCHIVE"
-
-struct cbfs_file {
-	uint8_t magic[8];
-	/* length of file data */
-	uint32_t len;
-	uint32_t type;
-	/* offset to struct cbfs_file_attribute or 0 */
-	uint32_t attributes_offset;
-	/* length of header incl. variable data */
-	uint32_t offset;
-	char filename[];
-};
+	if (dst_len < 13 || lzma_lzma_preset(&options, LZMA_PRESET_DEFAULT)) {
+		return 0;
+	}
+	if (lzma_alone_encoder(&strm, &options) != LZMA_OK) {
+		return 0;
+	}
 
-size_t cbfs_calculate_file_header_size(const char *name)
-{
-	return (sizeof(struct cbfs_file) +
-		align_up(strlen(name) + 1, CBFS_FILENAME_ALIGN));
-}
+	strm.next_in = src;
+	strm.avail_in = len;
+	strm.next_out = dst;
+	strm.avail_out = dst_len;
 
-struct cbfs_file *cbfs_create_file_header(int type,
-          size_t len, const char *name)
-{
-	struct cbfs_file *entry = malloc(MAX_CBFS_FILE_HEADER_BUFFER);
-	memset(entry, CBFS_CONTENT_DEFAULT_VALUE, MAX_CBFS_FILE_HEADER_BUFFER);
-	memcpy(entry->magic, CBFS_FILE_MAGIC, sizeof(entry->magic));
-	entry->type = htonl(type);
-	entry->len = htonl(len);
-	entry->attributes_offset = 0;
-	entry->offset = htonl(cbfs_calculate_file_header_size(name));
-	memset(entry->filename, 0, ntohl(entry->offset) - sizeof(*entry));
-	strcpy(entry->filename, name);
-	return entry;
+	lzma_ret rc;
+	do {
+		rc = lzma_code(&strm, LZMA_FINISH);
+	} while (rc == LZMA_OK && strm.avail_out != 0);
+
+	const size_t out_len = strm.total_out;
+	lzma_end(&strm);
+	if (rc != LZMA_STREAM_END) {
+		return 0;
+	}
+
+	// the streaming encoder writes an unknown size
+	uint8_t *size_field = (uint8_t *)dst + 5;
+	for (int i = 0 ; i < 8 ; i++) {
+		size_field[i] = (uint64_t) len >> (8 * i);
+	}
+
+	return out_len;
 }
 
 int main(int argc, char** argv) {
@@ -113,10 +105,11 @@ int main(int argc, char** argv) {
 	int do_list = 0;
 	int do_type = 0;
 	uint32_t cbfs_file_type = 0;
+	uint32_t compression = CBFS_COMPRESS_NONE;
 	const char * romname = NULL;
 	const char * cbfsname = NULL;
 	const char * filename = NULL;
-	while ((opt = getopt_long(argc, argv, "h?vld:a:f:o:r:t:",
+	while ((opt = getopt_long(argc, argv, "h?vld:a:f:o:r:t:c:",
 		long_options, NULL)) != -1)
 	{
 		switch(opt)
@@ -150,6 +143,16 @@ int main(int argc, char** argv) {
 			do_type = 1;
 			cbfs_file_type = strtoul(optarg, NULL, 16);
 			break;
+		case 'c':
+			if (strcmp(optarg, "lz4") == 0) {
+				compression = CBFS_COMPRESS_LZ4;
+			} else if (strcmp(optarg, "lzma") == 0) {
+				compression = CBFS_COMPRESS_LZMA;
+			} else {
+				fprintf(stderr, "%s: unknown compression\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case '?': case 'h':
 			fprintf(stderr, "%s", usage);
 			return EXIT_SUCCESS;
@@ -191,11 +194,27 @@ int main(int argc, char** argv) {
 				strerror(errno));
 			return EXIT_FAILURE;
 		}
+
+		// a full chip dump is parsed like the BIOS region alone
+		uint64_t bios_offset, bios_len;
+		if (descriptor_bios_region(rom, size, &bios_offset, &bios_len) > 0 &&
+			verbose
+		) {
+			fprintf(stderr, "BIOS region           : %lx[%lx]\n",
+				bios_offset, bios_len);
+		}
+		rom += bios_offset;
+		size = bios_len;
+
 		header_delta = *((int32_t *)(rom + size - 4));
 		memcpy(&header, rom + size + header_delta, sizeof(header));
 	} else {
-		copy_physical(mem_end - 4, sizeof(header_delta), &header_delta);
-		copy_physical(mem_end + header_delta, sizeof(header), &header);
+		if (copy_physical(mem_end - 4, sizeof(header_delta), &header_delta) < 0 ||
+			copy_physical(mem_end + header_delta, sizeof(header), &header) < 0
+		) {
+			perror("mmap");
+			return EXIT_FAILURE;
+		}
 	}
 
 	header.magic = ntohl(header.magic);
@@ -228,7 +247,8 @@ int main(int argc, char** argv) {
 	}
 
 	// Setup file to add to ROM
-	struct cbfs_file *add_file;
+	struct cbfs_file *add_file = NULL;
+	const void *add_data = NULL;
 	void *add, *empty_start = NULL, *empty_end = NULL;
 	uint64_t add_need_size = 0;
 	if (do_add) {
@@ -251,11 +271,54 @@ int main(int argc, char** argv) {
 			return EXIT_FAILURE;
 		}
 
+		// compress straight from the mapping; the output buffer is
+		// only as large as the file would be stored raw, so anything
+		// that does not come out smaller is stored raw instead
+		add_data = add;
+		uint64_t add_len = add_size;
+		const size_t attr_size = sizeof(struct cbfs_file_attr_compression);
+		if (compression != CBFS_COMPRESS_NONE) {
+			uint8_t *packed = NULL;
+			size_t packed_len = 0;
+			if (add_size > attr_size) {
+				packed = malloc(add_size - attr_size);
+			}
+			if (packed && compression == CBFS_COMPRESS_LZ4) {
+				packed_len = lz4_frame_compress(packed,
+					add_size - attr_size, add, add_size);
+			} else if (packed) {
+				packed_len = lzma_compress(packed,
+					add_size - attr_size, add, add_size);
+			}
+
+			if (packed_len == 0) {
+				if (verbose) {
+					fprintf(stderr, "'%s' does not compress, adding it raw\n",
+						filename);
+				}
+				free(packed);
+				compression = CBFS_COMPRESS_NONE;
+			} else {
+				if (verbose) {
+					fprintf(stderr, "Compressed '%s': %lx -> %zx\n",
+						filename, add_size, packed_len);
+				}
+				add_data = packed;
+				add_len = packed_len;
+			}
+		}
+
 		add_file = cbfs_create_file_header(
 			do_type ? cbfs_file_type : CBFS_COMPONENT_RAW,
-			add_size,
+			add_len,
 			cbfsname
 		);
+		if (compression != CBFS_COMPRESS_NONE &&
+			cbfs_add_compression_attribute(add_file, compression, add_size) < 0
+		) {
+			fprintf(stderr, "No room for the compression attribute\n");
+			return EXIT_FAILURE;
+		}
 		add_need_size = align_up(ntohl(add_file->offset) + ntohl(add_file->len),
 			(uint32_t)header.align);
 
@@ -408,7 +471,7 @@ int main(int argc, char** argv) {
 		// copy new file header
 		memcpy(empty_start, add_file, file_offset);
 		// copy new file data
-		memcpy(empty_start+file_offset, add, ntohl(add_file->len));
+		memcpy(empty_start+file_offset, add_data, ntohl(add_file->len));
 
 		empty_start += add_need_size;
 		uint32_t min_entry_size = cbfs_calculate_file_header_size("");
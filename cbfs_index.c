@@ -0,0 +1,195 @@
+/** \file
+ * coreboot file system (CBFS) parsing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "cbfs_index.h"
+#include "descriptor.h"
+
+size_t cbfs_calculate_file_header_size(const char *name)
+{
+	return (sizeof(struct cbfs_file) +
+		align_up(strlen(name) + 1, CBFS_FILENAME_ALIGN));
+}
+
+struct cbfs_file *cbfs_create_file_header(int type,
+          size_t len, const char *name)
+{
+	struct cbfs_file *entry = malloc(MAX_CBFS_FILE_HEADER_BUFFER);
+	memset(entry, CBFS_CONTENT_DEFAULT_VALUE, MAX_CBFS_FILE_HEADER_BUFFER);
+	memcpy(entry->magic, CBFS_FILE_MAGIC, sizeof(entry->magic));
+	entry->type = htonl(type);
+	entry->len = htonl(len);
+	entry->attributes_offset = 0;
+	entry->offset = htonl(cbfs_calculate_file_header_size(name));
+	memset(entry->filename, 0, ntohl(entry->offset) - sizeof(*entry));
+	strcpy(entry->filename, name);
+	return entry;
+}
+
+int cbfs_add_compression_attribute(struct cbfs_file *entry,
+          uint32_t compression, uint32_t decompressed_size)
+{
+	struct cbfs_file_attr_compression attr;
+	uint32_t offset = ntohl(entry->offset);
+	if (offset + sizeof(attr) > MAX_CBFS_FILE_HEADER_BUFFER ||
+		entry->attributes_offset != 0
+	) {
+		return -1;
+	}
+
+	attr.tag = htonl(CBFS_FILE_ATTR_TAG_COMPRESSION);
+	attr.len = htonl(sizeof(attr));
+	attr.compression = htonl(compression);
+	attr.decompressed_size = htonl(decompressed_size);
+	memcpy((uint8_t *)entry + offset, &attr, sizeof(attr));
+
+	entry->attributes_offset = htonl(offset);
+	entry->offset = htonl(offset + sizeof(attr));
+	return 0;
+}
+
+int cbfs_index_build(
+	cbfs_index_t *idx,
+	const void *rom,
+	uint64_t size,
+	const allocator_t *alloc
+) {
+	memset(idx, 0, sizeof(*idx));
+	idx->alloc = alloc;
+
+	// in a full chip dump CBFS ends with the BIOS region, and
+	// offsets are still those of the whole image
+	uint64_t start, len;
+	descriptor_bios_region(rom, size, &start, &len);
+	size = start + len;
+	if (len < sizeof(struct cbfs_header) + 4) {
+		return -1;
+	}
+
+	// the last word of the ROM is a relative pointer to the header
+	int32_t header_delta;
+	memcpy(&header_delta, rom + size - 4, sizeof(header_delta));
+	if (header_delta >= 0 || (uint64_t) -(int64_t) header_delta > len ||
+		(uint64_t) -(int64_t) header_delta < sizeof(struct cbfs_header)
+	) {
+		return -1;
+	}
+
+	struct cbfs_header *header = &idx->header;
+	idx->header_offset = size + header_delta;
+	memcpy(header, rom + idx->header_offset, sizeof(*header));
+	header->magic = ntohl(header->magic);
+	header->version = ntohl(header->version);
+	header->romsize = ntohl(header->romsize);
+	header->bootblocksize = ntohl(header->bootblocksize);
+	header->align = ntohl(header->align);
+	header->offset = ntohl(header->offset);
+	header->architecture = ntohl(header->architecture);
+
+	if (header->magic != CBFS_HEADER_MAGIC) {
+		return -1;
+	}
+	if (header->align == 0 || (header->align & (header->align - 1))) {
+		header->align = 64;
+	}
+
+	// offsets are relative to a ROM of romsize bytes that
+	// ends at the end of this image
+	idx->base = start;
+	if (header->romsize != 0 && header->romsize <= len) {
+		idx->base = size - header->romsize;
+	}
+
+	size_t max_files = 0;
+	uint64_t off = idx->base + header->offset;
+	while (off + sizeof(struct cbfs_file) <= size) {
+		struct cbfs_file file;
+		memcpy(&file, rom + off, sizeof(file));
+		if (strncmp((char *)file.magic, CBFS_FILE_MAGIC, 8) != 0) {
+			break;
+		}
+
+		file.len = ntohl(file.len);
+		file.type = ntohl(file.type);
+		file.attributes_offset = ntohl(file.attributes_offset);
+		file.offset = ntohl(file.offset);
+
+		if (file.offset < sizeof(file) ||
+			(uint64_t) file.offset + file.len > size - off
+		) {
+			break;
+		}
+
+		if (idx->num_files == max_files) {
+			max_files = max_files ? max_files * 2 : 64;
+			cbfs_entry_t *n = allocator_realloc(idx->alloc, idx->files,
+				max_files * sizeof(*idx->files));
+			if (n == NULL) {
+				cbfs_index_free(idx);
+				return -1;
+			}
+			idx->files = n;
+		}
+
+		cbfs_entry_t *e = &idx->files[idx->num_files++];
+		e->offset = off;
+		e->header_len = file.offset;
+		e->len = file.len;
+		e->type = file.type;
+		e->attributes_offset = file.attributes_offset;
+		e->inc = align_up(file.offset + (uint64_t) file.len, header->align);
+
+		size_t name_size = file.offset - sizeof(file);
+		if (name_size >= sizeof(e->name)) {
+			name_size = sizeof(e->name) - 1;
+		}
+		memcpy(e->name, rom + off + sizeof(file), name_size);
+		e->name[name_size] = '\0';
+
+		off += e->inc;
+	}
+
+	return 0;
+}
+
+void cbfs_index_free(cbfs_index_t *idx) {
+	allocator_free(idx->alloc, idx->files);
+	memset(idx, 0, sizeof(*idx));
+}
+
+const void *cbfs_file_attr(
+	const void *rom,
+	const cbfs_entry_t *e,
+	uint32_t tag,
+	uint32_t *len
+) {
+	const uint8_t *header = (const uint8_t *) rom + e->offset;
+	uint32_t off = e->attributes_offset;
+
+	// the attributes run from their offset up to the data
+	while (off != 0 && (uint64_t) off + 8 <= e->header_len) {
+		uint32_t attr[2];
+		memcpy(attr, header + off, sizeof(attr));
+		const uint32_t attr_tag = ntohl(attr[0]);
+		const uint32_t attr_len = ntohl(attr[1]);
+		if (attr_tag == 0 || attr_tag == 0xFFFFFFFF ||
+			attr_len < sizeof(attr) ||
+			attr_len > e->header_len - off
+		) {
+			break;
+		}
+
+		if (attr_tag == tag) {
+			*len = attr_len;
+			return header + off;
+		}
+		off += attr_len;
+	}
+
+	return NULL;
+}
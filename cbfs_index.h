@@ -0,0 +1,132 @@
+/** \file
+ * coreboot file system (CBFS) parsing.
+ */
+#ifndef _cbfs_index_h_
+#define _cbfs_index_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "util.h"
+
+#define CBFS_HEADER_MAGIC  0x4F524243
+#define CBFS_HEADER_VERSION1 0x31313131
+#define CBFS_HEADER_VERSION2 0x31313132
+#define CBFS_HEADER_VERSION  CBFS_HEADER_VERSION2
+
+#define MAX_CBFS_FILE_HEADER_BUFFER 1024
+#define CBFS_CONTENT_DEFAULT_VALUE	(-1)
+#define CBFS_FILENAME_ALIGN	(16)
+#define CBFS_COMPONENT_RAW 0x50
+#define CBFS_COMPONENT_MICROCODE 0x53
+#define CBFS_COMPONENT_NULL 0xFFFFFFFF
+
+struct cbfs_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t romsize;
+	uint32_t bootblocksize;
+	uint32_t align; /* hard coded to 64 byte */
+	uint32_t offset;
+	uint32_t architecture;  /* Version 2 */
+	uint32_t pad[1];
+};
+
+#define CBFS_FILE_MAGIC "LARCHIVE"
+
+struct cbfs_file {
+	uint8_t magic[8];
+	/* length of file data */
+	uint32_t len;
+	uint32_t type;
+	/* offset to struct cbfs_file_attribute or 0 */
+	uint32_t attributes_offset;
+	/* length of header incl. variable data */
+	uint32_t offset;
+	char filename[];
+};
+
+/*
+ * Attributes follow the name in the file header, at attributes_offset,
+ * and the data offset is moved past them.  All fields are big endian.
+ */
+#define CBFS_FILE_ATTR_TAG_COMPRESSION 0x42435a4c
+#define CBFS_FILE_ATTR_TAG_STAGEHEADER 0x53746748
+
+#define CBFS_COMPRESS_NONE 0
+#define CBFS_COMPRESS_LZMA 1
+#define CBFS_COMPRESS_LZ4  2
+
+struct cbfs_file_attr_compression {
+	uint32_t tag;
+	/* length of the attribute */
+	uint32_t len;
+	uint32_t compression;
+	uint32_t decompressed_size;
+};
+
+/*
+ * Stages have carried their header as an attribute since coreboot 4.17;
+ * older stages start their data with it instead.
+ */
+struct cbfs_file_attr_stageheader {
+	uint32_t tag;
+	uint32_t len;
+	uint64_t loadaddr;
+	uint32_t entry_offset;      // from loadaddr
+	uint32_t memlen;
+} __attribute__((packed));
+
+extern size_t cbfs_calculate_file_header_size(const char *name);
+
+extern struct cbfs_file *cbfs_create_file_header(int type,
+          size_t len, const char *name);
+
+/* Append a compression attribute to a header from cbfs_create_file_header */
+extern int cbfs_add_compression_attribute(struct cbfs_file *entry,
+          uint32_t compression, uint32_t decompressed_size);
+
+/*
+ * Index of the files in a ROM image, found by following the master
+ * header pointer in the last four bytes of the image.  The header
+ * and the entries are converted to host byte order.
+ */
+#define CBFS_NAME_LEN 256
+
+typedef struct {
+	uint64_t offset;            // of the file header in the ROM
+	uint32_t header_len;        // offset of the data from the header
+	uint32_t len;               // of the data
+	uint32_t type;
+	uint32_t attributes_offset;
+	uint64_t inc;               // aligned size of the whole entry
+	char name[CBFS_NAME_LEN];
+} cbfs_entry_t;
+
+typedef struct {
+	struct cbfs_header header;
+	uint64_t header_offset;     // of the master header in the ROM
+	uint64_t base;              // ROM offset that CBFS offsets are relative to
+	cbfs_entry_t *files;
+	size_t num_files;
+	const allocator_t *alloc;
+} cbfs_index_t;
+
+// alloc may be NULL to use libc; it is kept for cbfs_index_free
+extern int cbfs_index_build(
+	cbfs_index_t *idx,
+	const void *rom,
+	uint64_t size,
+	const allocator_t *alloc
+);
+
+extern void cbfs_index_free(cbfs_index_t *idx);
+
+// The attribute with this tag in a file header, or NULL; *len is its length
+extern const void *cbfs_file_attr(
+	const void *rom,
+	const cbfs_entry_t *e,
+	uint32_t tag,
+	uint32_t *len
+);
+
+#endif
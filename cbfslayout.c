@@ -0,0 +1,696 @@
+/** \file
+ * Rearrange CBFS so that the files read at boot are contiguous and in
+ * the order that they are read.
+ *
+ * The order comes from a list of CBFS names, or from the timestamps
+ * that `cbmem -t` prints, whose stage loads name the stages.  Files
+ * that cannot move keep their offsets: the master header, the
+ * bootblock, microcode and FSP (which the FIT and the FSP headers point
+ * at) and stages that execute in place, whose load address is in the
+ * flash mapping; a stage whose header can not be read is kept too.
+ * The boot files are then packed in read order into the space around
+ * them, from the start of CBFS, followed by the rest of the files; the
+ * remaining space becomes empty files.
+ *
+ * The read pattern of the boot files is estimated for the old and the
+ * new layout: the CBFS headers walked to find each file, the jumps
+ * between the files, and the 4 KiB pages of flash that are touched.
+ * Without -w only the estimate is printed.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "cbfs_index.h"
+
+#define CBFS_COMPONENT_DELETED 0x00000000
+#define CBFS_COMPONENT_BOOTBLOCK 0x01
+#define CBFS_COMPONENT_CBFSHEADER 0x02
+#define CBFS_COMPONENT_STAGE 0x10
+#define CBFS_COMPONENT_FSP 0x60
+
+#define LAYOUT_MAX_PINS 32
+#define LAYOUT_PAGE 4096
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "boot-order",		1, NULL, 'b' },
+	{ "timestamps",		1, NULL, 't' },
+	{ "pin",		1, NULL, 'x' },
+	{ "write",		1, NULL, 'w' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: cbfslayout [options] rom.bin\n"
+"\n"
+"    -h | -? | --help           This help\n"
+"    -v | --verbose             Increase verbosity\n"
+"    -b | --boot-order file     CBFS names in the order they are read\n"
+"    -t | --timestamps file     Take the order from `cbmem -t` output\n"
+"    -x | --pin name            Do not move this file (may be repeated)\n"
+"    -w | --write out.rom       Write the rearranged image\n"
+"\n";
+
+
+// The stage loads in the coreboot timestamps, in boot order
+static const struct {
+	uint32_t id;
+	const char * name;
+} timestamp_files[] = {
+	{ 19, "fallback/verstage" },
+	{ 13, "fallback/romstage" },
+	{ 950, "fspm.bin" },
+	{ 100, "fallback/postcar" },
+	{ 8, "fallback/ramstage" },
+	{ 954, "fsps.bin" },
+	{ 90, "fallback/payload" },
+};
+
+
+// The pre-attribute stage header, little endian
+struct cbfs_stage {
+	uint32_t compression;
+	uint64_t entry;
+	uint64_t load;
+	uint32_t len;
+	uint32_t memlen;
+} __attribute__((__packed__));
+
+
+typedef struct {
+	const cbfs_entry_t * e;
+	int pinned;
+	int boot_rank;              // in the boot order, or -1
+	uint64_t new_offset;
+	int placed;
+} layout_file_t;
+
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+} segment_t;
+
+typedef struct {
+	unsigned headers;           // walked to find the boot files
+	unsigned jumps;             // reads that do not follow the last
+	unsigned backward;
+	uint64_t seek_bytes;
+	uint64_t span;
+	unsigned pages;
+} read_stats_t;
+
+
+static int
+is_empty(
+	const cbfs_entry_t * const e
+)
+{
+	return e->type == CBFS_COMPONENT_NULL || e->type == CBFS_COMPONENT_DELETED;
+}
+
+
+static int
+must_pin(
+	const cbfs_entry_t * const e,
+	const uint8_t * const rom,
+	const cbfs_index_t * const idx,
+	char ** const pins,
+	unsigned num_pins
+)
+{
+	for (unsigned i = 0 ; i < num_pins ; i++)
+		if (strcmp(pins[i], e->name) == 0)
+			return 1;
+
+	if (e->type == CBFS_COMPONENT_BOOTBLOCK
+	||  e->type == CBFS_COMPONENT_CBFSHEADER
+	||  e->type == CBFS_COMPONENT_MICROCODE
+	||  e->type == CBFS_COMPONENT_FSP)
+		return 1;
+
+	if (e->type != CBFS_COMPONENT_STAGE)
+		return 0;
+
+	// an uncompressed stage loaded at its address in flash runs there
+	const uint64_t flash_base = 0x100000000ULL - idx->header.romsize;
+	uint32_t compression;
+	uint64_t load;
+	uint32_t attr_len;
+
+	const struct cbfs_file_attr_stageheader * const sh = cbfs_file_attr(
+		rom, e, CBFS_FILE_ATTR_TAG_STAGEHEADER, &attr_len);
+	if (sh)
+	{
+		if (attr_len < sizeof(*sh))
+			return 1;
+
+		// loadaddr is a big endian 64-bit field
+		const uint8_t * const addr = (const uint8_t *) &sh->loadaddr;
+		load = 0;
+		for (unsigned i = 0 ; i < 8 ; i++)
+			load = load << 8 | addr[i];
+
+		const struct cbfs_file_attr_compression * const comp
+			= cbfs_file_attr(rom, e, CBFS_FILE_ATTR_TAG_COMPRESSION,
+				&attr_len);
+		compression = CBFS_COMPRESS_NONE;
+		if (comp)
+		{
+			struct cbfs_file_attr_compression c;
+			if (attr_len < sizeof(c))
+				return 1;
+			memcpy(&c, comp, sizeof(c));
+			compression = ntohl(c.compression);
+		}
+	} else {
+		// a stage that is not understood may be XIP, so it stays
+		struct cbfs_stage stage;
+		if (e->len < sizeof(stage))
+			return 1;
+		memcpy(&stage, rom + e->offset + e->header_len, sizeof(stage));
+		if (stage.compression > CBFS_COMPRESS_LZ4)
+			return 1;
+		compression = stage.compression;
+		load = stage.load;
+	}
+
+	return compression == CBFS_COMPRESS_NONE
+		&& load >= flash_base
+		&& load < 0x100000000ULL;
+}
+
+
+// Exact name, or the same file name in another prefix (normal/ for fallback/)
+static layout_file_t *
+file_find(
+	layout_file_t * const files,
+	size_t num_files,
+	const char * name
+)
+{
+	for (size_t i = 0 ; i < num_files ; i++)
+		if (strcmp(files[i].e->name, name) == 0)
+			return &files[i];
+
+	const char * const base = strrchr(name, '/');
+	const char * const want = base ? base + 1 : name;
+	for (size_t i = 0 ; i < num_files ; i++)
+	{
+		const char * const slash = strrchr(files[i].e->name, '/');
+		if (slash && strcmp(slash + 1, want) == 0)
+			return &files[i];
+	}
+
+	return NULL;
+}
+
+
+static void
+boot_order_add(
+	layout_file_t * const files,
+	size_t num_files,
+	const char * name,
+	int * const rank
+)
+{
+	layout_file_t * const f = file_find(files, num_files, name);
+	if (!f)
+	{
+		if (verbose)
+			fprintf(stderr, "%s: not in CBFS\n", name);
+		return;
+	}
+
+	if (f->boot_rank < 0 && !is_empty(f->e))
+		f->boot_rank = (*rank)++;
+}
+
+
+static int
+boot_order_read(
+	layout_file_t * const files,
+	size_t num_files,
+	const char * filename,
+	int from_timestamps
+)
+{
+	FILE * const f = fopen(filename, "r");
+	if (!f)
+		return -1;
+
+	int rank = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (!from_timestamps)
+		{
+			const char * name = line + strspn(line, " \t");
+			if (*name != '\0' && *name != '#')
+				boot_order_add(files, num_files, name, &rank);
+			continue;
+		}
+
+		// "   13:starting to load romstage    123 (45)"
+		char * end;
+		const unsigned long id = strtoul(line, &end, 10);
+		if (end == line || *end != ':')
+			continue;
+
+		for (unsigned i = 0 ; i < sizeof(timestamp_files)/sizeof(*timestamp_files) ; i++)
+			if (timestamp_files[i].id == id)
+				boot_order_add(files, num_files,
+					timestamp_files[i].name, &rank);
+	}
+
+	fclose(f);
+	return rank;
+}
+
+
+/*
+ * Place an entry of len bytes: at the cursor if the segment there has
+ * room, otherwise in the first segment that does.  Segments are only
+ * allocated from the front, and a remainder too small for an empty
+ * file's header is not left behind.
+ */
+static int
+segment_alloc(
+	segment_t * const segs,
+	unsigned num_segs,
+	uint64_t len,
+	uint64_t cursor,
+	uint64_t min_entry,
+	uint64_t * const offset
+)
+{
+	int best = -1;
+	for (unsigned i = 0 ; i < num_segs ; i++)
+	{
+		const uint64_t room = segs[i].end - segs[i].start;
+		if (room != len && (room < len || room - len < min_entry))
+			continue;
+		if (segs[i].start == cursor)
+		{
+			best = i;
+			break;
+		}
+		if (best < 0)
+			best = i;
+	}
+
+	if (best < 0)
+		return -1;
+
+	*offset = segs[best].start;
+	segs[best].start += len;
+	return 0;
+}
+
+
+static int
+offset_cmp(
+	const void * a,
+	const void * b
+)
+{
+	const uint64_t x = *(const uint64_t *) a;
+	const uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+
+static int
+interval_cmp(
+	const void * a,
+	const void * b
+)
+{
+	const segment_t * const x = a;
+	const segment_t * const y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+
+/*
+ * Estimate the flash reads to load the boot files, given where each
+ * file is and where every entry (including empty ones) starts: a
+ * lookup reads every header from the start of CBFS up to the file,
+ * then the file is read from its header to the end of its data.
+ */
+static void
+read_stats(
+	read_stats_t * const s,
+	const layout_file_t * const files,
+	size_t num_files,
+	int use_new,
+	const uint64_t * entry_offsets,
+	size_t num_entries,
+	uint32_t align
+)
+{
+	memset(s, 0, sizeof(*s));
+
+	segment_t * const reads = calloc(num_files + 1, sizeof(*reads));
+	if (!reads)
+		return;
+
+	size_t n = 0;
+	for (int rank = 0 ; ; rank++)
+	{
+		size_t i;
+		for (i = 0 ; i < num_files ; i++)
+			if (files[i].boot_rank == rank)
+				break;
+		if (i == num_files)
+			break;
+
+		const cbfs_entry_t * const e = files[i].e;
+		const uint64_t start = use_new ? files[i].new_offset : e->offset;
+		reads[n].start = start;
+		reads[n].end = start + e->header_len + e->len;
+
+		for (size_t j = 0 ; j < num_entries ; j++)
+			if (entry_offsets[j] <= start)
+				s->headers++;
+
+		// reading on into the next entry is sequential
+		const uint64_t last_end = n ? align_up(reads[n-1].end, align) : 0;
+		if (n && start != last_end)
+		{
+			s->jumps++;
+			if (start < last_end)
+				s->backward++;
+			s->seek_bytes += start > last_end
+				? start - last_end : last_end - start;
+		}
+
+		n++;
+	}
+
+	if (n == 0)
+	{
+		free(reads);
+		return;
+	}
+
+	qsort(reads, n, sizeof(*reads), interval_cmp);
+
+	int64_t last_page = -1;
+	uint64_t hi = 0;
+	for (size_t i = 0 ; i < n ; i++)
+	{
+		int64_t p0 = reads[i].start / LAYOUT_PAGE;
+		const int64_t p1 = (reads[i].end - 1) / LAYOUT_PAGE;
+		if (p0 <= last_page)
+			p0 = last_page + 1;
+		if (p0 <= p1)
+		{
+			s->pages += p1 - p0 + 1;
+			last_page = p1;
+		}
+		if (reads[i].end > hi)
+			hi = reads[i].end;
+	}
+
+	s->span = hi - reads[0].start;
+	free(reads);
+}
+
+
+static void
+print_stats(
+	const read_stats_t * const before,
+	const read_stats_t * const after
+)
+{
+	printf("%-24s %12s %12s\n", "", "before", "after");
+	printf("%-24s %12u %12u\n", "headers walked",
+		before->headers, after->headers);
+	printf("%-24s %12u %12u\n", "non-sequential reads",
+		before->jumps, after->jumps);
+	printf("%-24s %12u %12u\n", "backward reads",
+		before->backward, after->backward);
+	printf("%-24s %12"PRIu64" %12"PRIu64"\n", "bytes skipped",
+		before->seek_bytes, after->seek_bytes);
+	printf("%-24s %12"PRIu64" %12"PRIu64"\n", "span of boot files",
+		before->span, after->span);
+	printf("%-24s %12u %12u\n", "4 KiB pages read",
+		before->pages, after->pages);
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * order_name = NULL;
+	int from_timestamps = 0;
+	const char * out_name = NULL;
+	char * pins[LAYOUT_MAX_PINS];
+	unsigned num_pins = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?vb:t:x:w:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'b':
+			order_name = optarg;
+			from_timestamps = 0;
+			break;
+		case 't':
+			order_name = optarg;
+			from_timestamps = 1;
+			break;
+		case 'x':
+			if (num_pins == LAYOUT_MAX_PINS)
+			{
+				fprintf(stderr, "Too many pinned files\n");
+				return EXIT_FAILURE;
+			}
+			pins[num_pins++] = optarg;
+			break;
+		case 'w':
+			out_name = optarg;
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || !order_name)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	const char * const rom_name = argv[0];
+	uint64_t size;
+	const uint8_t * const rom = map_file(rom_name, &size, 1);
+	if (!rom)
+	{
+		fprintf(stderr, "%s: %s\n", rom_name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	cbfs_index_t idx;
+	if (cbfs_index_build(&idx, rom, size, NULL) < 0 || idx.num_files == 0)
+	{
+		fprintf(stderr, "%s: no CBFS found\n", rom_name);
+		return EXIT_FAILURE;
+	}
+
+	const uint32_t align = idx.header.align;
+	const uint64_t min_entry = cbfs_calculate_file_header_size("");
+	const uint64_t area_start = idx.files[0].offset;
+	const cbfs_entry_t * const last = &idx.files[idx.num_files - 1];
+	const uint64_t area_end = last->offset + last->inc;
+
+	layout_file_t * const files = calloc(idx.num_files, sizeof(*files));
+	segment_t * const segs = calloc(idx.num_files + 1, sizeof(*segs));
+	uint64_t * const old_entries = calloc(idx.num_files, sizeof(*old_entries));
+	uint64_t * const new_entries = calloc(2 * idx.num_files + 1, sizeof(*new_entries));
+	if (!files || !segs || !old_entries || !new_entries)
+	{
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 0 ; i < idx.num_files ; i++)
+	{
+		const cbfs_entry_t * const e = &idx.files[i];
+		files[i].e = e;
+		files[i].boot_rank = -1;
+		files[i].pinned = !is_empty(e)
+			&& must_pin(e, rom, &idx, pins, num_pins);
+		old_entries[i] = e->offset;
+	}
+
+	const int num_boot = boot_order_read(files, idx.num_files,
+		order_name, from_timestamps);
+	if (num_boot < 0)
+	{
+		fprintf(stderr, "%s: %s\n", order_name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (num_boot == 0)
+	{
+		fprintf(stderr, "%s: no CBFS files in the boot order\n", order_name);
+		return EXIT_FAILURE;
+	}
+
+	// the free space is everything around the pinned files
+	unsigned num_segs = 0;
+	uint64_t pos = area_start;
+	for (size_t i = 0 ; i < idx.num_files ; i++)
+	{
+		if (!files[i].pinned)
+			continue;
+		if (files[i].e->offset > pos)
+			segs[num_segs++] = (segment_t) { pos, files[i].e->offset };
+		files[i].new_offset = files[i].e->offset;
+		files[i].placed = 1;
+		pos = files[i].e->offset + files[i].e->inc;
+	}
+	if (area_end > pos)
+		segs[num_segs++] = (segment_t) { pos, area_end };
+
+	// boot files in read order, each following the last if it can
+	uint64_t cursor = area_start;
+	for (int rank = 0 ; rank < num_boot ; rank++)
+	{
+		for (size_t i = 0 ; i < idx.num_files ; i++)
+		{
+			layout_file_t * const f = &files[i];
+			if (f->boot_rank != rank)
+				continue;
+
+			if (f->pinned)
+			{
+				if (verbose)
+					fprintf(stderr, "%s: pinned at %08"PRIx64"\n",
+						f->e->name, f->e->offset);
+				cursor = f->e->offset + f->e->inc;
+			} else
+			if (segment_alloc(segs, num_segs, f->e->inc, cursor,
+				min_entry, &f->new_offset) == 0)
+			{
+				f->placed = 1;
+				cursor = f->new_offset + f->e->inc;
+			}
+			break;
+		}
+	}
+
+	// then everything else, in its old order
+	for (size_t i = 0 ; i < idx.num_files ; i++)
+	{
+		layout_file_t * const f = &files[i];
+		if (f->placed || is_empty(f->e))
+			continue;
+		if (segment_alloc(segs, num_segs, f->e->inc, UINT64_MAX,
+			min_entry, &f->new_offset) == 0)
+			f->placed = 1;
+	}
+
+	size_t num_new = 0;
+	for (size_t i = 0 ; i < idx.num_files ; i++)
+	{
+		const layout_file_t * const f = &files[i];
+		if (is_empty(f->e))
+			continue;
+		if (!f->placed)
+		{
+			fprintf(stderr, "%s: no room left after packing\n", f->e->name);
+			return EXIT_FAILURE;
+		}
+		new_entries[num_new++] = f->new_offset;
+		if (verbose && f->new_offset != f->e->offset)
+			fprintf(stderr, "%s: %08"PRIx64" -> %08"PRIx64"\n",
+				f->e->name, f->e->offset, f->new_offset);
+	}
+	for (unsigned i = 0 ; i < num_segs ; i++)
+		if (segs[i].end > segs[i].start)
+			new_entries[num_new++] = segs[i].start;
+	qsort(new_entries, num_new, sizeof(*new_entries), offset_cmp);
+
+	read_stats_t before, after;
+	read_stats(&before, files, idx.num_files, 0,
+		old_entries, idx.num_files, align);
+	read_stats(&after, files, idx.num_files, 1,
+		new_entries, num_new, align);
+
+	printf("%d boot files:", num_boot);
+	for (int rank = 0 ; rank < num_boot ; rank++)
+		for (size_t i = 0 ; i < idx.num_files ; i++)
+			if (files[i].boot_rank == rank)
+				printf(" %s", files[i].e->name);
+	printf("\n\n");
+	print_stats(&before, &after);
+
+	if (!out_name)
+		return EXIT_SUCCESS;
+
+	uint8_t * const out = malloc(size);
+	if (!out)
+	{
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	memcpy(out, rom, size);
+	memset(out + area_start, CBFS_CONTENT_DEFAULT_VALUE, area_end - area_start);
+
+	for (size_t i = 0 ; i < idx.num_files ; i++)
+	{
+		const cbfs_entry_t * const e = files[i].e;
+		if (!is_empty(e))
+			memcpy(out + files[i].new_offset, rom + e->offset,
+				e->header_len + e->len);
+	}
+
+	for (unsigned i = 0 ; i < num_segs ; i++)
+	{
+		const uint64_t len = segs[i].end - segs[i].start;
+		if (len == 0)
+			continue;
+
+		struct cbfs_file * const empty = cbfs_create_file_header(
+			CBFS_COMPONENT_NULL, len - min_entry, "");
+		memcpy(out + segs[i].start, empty, ntohl(empty->offset));
+		free(empty);
+	}
+
+	FILE * const f = fopen(out_name, "wb");
+	if (!f || fwrite(out, 1, size, f) != size || fclose(f) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", out_name, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
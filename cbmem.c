@@ -0,0 +1,781 @@
+/** \file
+ * Read the coreboot boot timestamps and console from CBMEM.
+ *
+ * coreboot leaves a small table in low memory (the first page or the
+ * legacy BIOS area) that usually forwards to the full table at the top
+ * of RAM.  Its records point at the CBMEM areas: the timestamp table,
+ * which is printed with the time spent in each stage, and the console
+ * ring buffer, which can be followed as firmware (such as SMM) keeps
+ * writing to it.
+ *
+ * Every physical window is mapped once: the two low memory areas to
+ * find the table, the table itself, and each CBMEM area at the size
+ * the table gives for it.  With -o the same is done on a dump of
+ * physical memory, in which the file offset is the address.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "util.h"
+
+#define LB_SIGNATURE "LBIO"
+#define LB_TAG_VERSION 0x0004
+#define LB_TAG_FORWARD 0x0011
+#define LB_TAG_TIMESTAMPS 0x0016
+#define LB_TAG_CBMEM_CONSOLE 0x0017
+#define LB_TAG_CBMEM_ENTRY 0x0031
+
+#define CBMEM_ID_CONSOLE 0x434f4e53
+#define CBMEM_ID_TIMESTAMP 0x54494d45
+
+#define CBMC_CURSOR_MASK ((1U << 28) - 1)
+#define CBMC_OVERFLOW (1U << 31)
+
+#define CBMEM_FOLLOW_NS 100000000
+
+struct lb_header {
+	uint8_t signature[4];
+	uint32_t header_bytes;
+	uint32_t header_checksum;
+	uint32_t table_bytes;
+	uint32_t table_checksum;
+	uint32_t table_entries;
+} __attribute__((__packed__));
+
+struct lb_record {
+	uint32_t tag;
+	uint32_t size;
+} __attribute__((__packed__));
+
+// LB_TAG_FORWARD, LB_TAG_TIMESTAMPS and LB_TAG_CBMEM_CONSOLE
+struct lb_ref {
+	uint32_t tag;
+	uint32_t size;
+	uint64_t addr;
+} __attribute__((__packed__));
+
+struct lb_cbmem_entry {
+	uint32_t tag;
+	uint32_t size;
+	uint64_t addr;
+	uint32_t entry_size;
+	uint32_t id;
+} __attribute__((__packed__));
+
+struct timestamp_entry {
+	uint32_t entry_id;
+	int64_t entry_stamp;
+} __attribute__((__packed__));
+
+struct timestamp_table {
+	uint64_t base_time;
+	uint16_t max_entries;
+	uint16_t tick_freq_mhz;
+	uint32_t num_entries;
+	struct timestamp_entry entries[];
+} __attribute__((__packed__));
+
+struct cbmem_console {
+	uint32_t size;
+	uint32_t cursor;
+	uint8_t body[];
+} __attribute__((__packed__));
+
+
+// The stages and steps in src/commonlib/include/commonlib/timestamp_serialized.h
+static const struct {
+	uint32_t id;
+	const char * name;
+} timestamp_names[] = {
+	{ 0, "1st timestamp" },
+	{ 1, "start of romstage" },
+	{ 2, "before RAM initialization" },
+	{ 3, "after RAM initialization" },
+	{ 4, "end of romstage" },
+	{ 5, "start of verified boot" },
+	{ 6, "end of verified boot" },
+	{ 8, "starting to load ramstage" },
+	{ 9, "finished loading ramstage" },
+	{ 10, "start of ramstage" },
+	{ 11, "start of bootblock" },
+	{ 12, "end of bootblock" },
+	{ 13, "starting to load romstage" },
+	{ 14, "finished loading romstage" },
+	{ 15, "starting LZMA decompress (ignore for x86)" },
+	{ 16, "finished LZMA decompress (ignore for x86)" },
+	{ 17, "starting LZ4 decompress (ignore for x86)" },
+	{ 18, "finished LZ4 decompress (ignore for x86)" },
+	{ 19, "starting to load verstage" },
+	{ 20, "finished loading verstage" },
+	{ 21, "starting to initialize TPM" },
+	{ 22, "finished TPM initialization" },
+	{ 30, "device enumeration" },
+	{ 40, "device configuration" },
+	{ 50, "device enable" },
+	{ 60, "device initialization" },
+	{ 65, "opROM initialization" },
+	{ 66, "opROM copy done" },
+	{ 67, "opROM run done" },
+	{ 70, "device setup done" },
+	{ 75, "cbmem post" },
+	{ 80, "write tables" },
+	{ 85, "finalize chips" },
+	{ 90, "load payload" },
+	{ 98, "ACPI wake jump" },
+	{ 99, "selfboot jump" },
+	{ 100, "start of postcar" },
+	{ 101, "end of postcar" },
+	{ 950, "calling FspMemoryInit" },
+	{ 951, "returning from FspMemoryInit" },
+	{ 952, "calling FspTempRamExit" },
+	{ 953, "returning from FspTempRamExit" },
+	{ 954, "calling FspSiliconInit" },
+	{ 955, "returning from FspSiliconInit" },
+	{ 956, "calling FspNotify(AfterPciEnumeration)" },
+	{ 957, "returning from FspNotify(AfterPciEnumeration)" },
+	{ 958, "calling FspNotify(ReadyToBoot)" },
+	{ 959, "returning from FspNotify(ReadyToBoot)" },
+	{ 960, "calling FspNotify(EndOfFirmware)" },
+	{ 961, "returning from FspNotify(EndOfFirmware)" },
+	{ 1000, "depthcharge start" },
+	{ 1100, "kernel start" },
+};
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "timestamps",		0, NULL, 't' },
+	{ "console",		0, NULL, 'c' },
+	{ "follow",		0, NULL, 'f' },
+	{ "list",		0, NULL, 'l' },
+	{ "mhz",		1, NULL, 'M' },
+	{ "mem",		1, NULL, 'o' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: sudo cbmem [options]\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -t | --timestamps      Print the boot timestamps and stage durations\n"
+"    -c | --console         Print the CBMEM console\n"
+"    -f | --follow          Keep printing what is added to the console\n"
+"    -l | --list            List the CBMEM areas\n"
+"    -M | --mhz N           Timestamp tick rate, if coreboot did not record it\n"
+"    -o | --mem file        Use a physical memory dump instead of /dev/mem\n"
+"\n";
+
+
+// The 16 bit one's complement sum that the coreboot tables use
+static uint16_t
+ip_checksum(
+	const void * buf,
+	size_t len
+)
+{
+	const uint8_t * const p = buf;
+	uint32_t sum = 0;
+
+	for (size_t i = 0 ; i < len ; i++)
+	{
+		sum += (i & 1) ? (uint32_t) p[i] << 8 : p[i];
+		if (sum > 0xFFFF)
+			sum = (sum + (sum >> 16)) & 0xFFFF;
+	}
+
+	return ~sum & 0xFFFF;
+}
+
+
+typedef struct {
+	uint64_t addr;
+	uint32_t size;              // 0 if the table did not give one
+	uint32_t id;
+} cbmem_area_t;
+
+#define CBMEM_MAX_AREAS 64
+
+typedef struct {
+	const uint8_t * table;      // the records, mapped
+	uint64_t table_addr;
+	uint32_t table_bytes;
+	uint64_t timestamps;
+	uint64_t console;
+	cbmem_area_t areas[CBMEM_MAX_AREAS];
+	unsigned num_areas;
+} lb_table_t;
+
+
+// Returns the offset of a valid header in buf, or -1
+static int64_t
+lb_header_find(
+	const uint8_t * buf,
+	size_t len
+)
+{
+	for (size_t off = 0 ; off + sizeof(struct lb_header) <= len ; off += 16)
+	{
+		const struct lb_header * const h = (const void *)(buf + off);
+		if (memcmp(h->signature, LB_SIGNATURE, 4) != 0
+		||  h->header_bytes != sizeof(*h)
+		||  ip_checksum(h, sizeof(*h)) != 0)
+			continue;
+		return off;
+	}
+
+	return -1;
+}
+
+
+/*
+ * Map the table at a header address and record the references in it.
+ * Returns the address of a forwarded table, 0 if this is the full
+ * table, or -1 on error.
+ */
+static int64_t
+lb_table_parse(
+	lb_table_t * const lb,
+	uint64_t addr,
+	const struct lb_header * const h
+)
+{
+	const uint8_t * const table = map_window(addr + h->header_bytes,
+		h->table_bytes);
+	if (!table)
+		return -1;
+
+	if (ip_checksum(table, h->table_bytes) != h->table_checksum)
+	{
+		fprintf(stderr, "%08"PRIx64": bad table checksum\n", addr);
+		unmap_window(table, h->table_bytes);
+		return -1;
+	}
+
+	if (verbose)
+		fprintf(stderr, "%08"PRIx64": coreboot table, %u entries\n",
+			addr, h->table_entries);
+
+	uint64_t forward = 0;
+	for (uint32_t off = 0 ; off + sizeof(struct lb_record) <= h->table_bytes ; )
+	{
+		struct lb_record rec;
+		memcpy(&rec, table + off, sizeof(rec));
+		if (rec.size < sizeof(rec) || rec.size > h->table_bytes - off)
+			break;
+
+		const uint8_t * const p = table + off;
+		struct lb_ref ref = { 0, 0, 0 };
+		if (rec.size >= sizeof(ref))
+			memcpy(&ref, p, sizeof(ref));
+
+		if (rec.tag == LB_TAG_FORWARD && rec.size >= sizeof(ref))
+			forward = ref.addr;
+		else
+		if (rec.tag == LB_TAG_TIMESTAMPS && rec.size >= sizeof(ref))
+			lb->timestamps = ref.addr;
+		else
+		if (rec.tag == LB_TAG_CBMEM_CONSOLE && rec.size >= sizeof(ref))
+			lb->console = ref.addr;
+		else
+		if (rec.tag == LB_TAG_CBMEM_ENTRY
+		&&  rec.size >= sizeof(struct lb_cbmem_entry)
+		&&  lb->num_areas < CBMEM_MAX_AREAS)
+		{
+			struct lb_cbmem_entry e;
+			memcpy(&e, p, sizeof(e));
+			lb->areas[lb->num_areas++] = (cbmem_area_t) {
+				.addr = e.addr,
+				.size = e.entry_size,
+				.id = e.id,
+			};
+		} else
+		if (rec.tag == LB_TAG_VERSION && verbose)
+			fprintf(stderr, "coreboot version: %.*s\n",
+				(int)(rec.size - sizeof(rec)), p + sizeof(rec));
+
+		off += rec.size;
+	}
+
+	if (forward)
+	{
+		unmap_window(table, h->table_bytes);
+		return forward;
+	}
+
+	// the references are older than the area list, but either will do
+	for (unsigned i = 0 ; i < lb->num_areas ; i++)
+	{
+		if (!lb->timestamps && lb->areas[i].id == CBMEM_ID_TIMESTAMP)
+			lb->timestamps = lb->areas[i].addr;
+		if (!lb->console && lb->areas[i].id == CBMEM_ID_CONSOLE)
+			lb->console = lb->areas[i].addr;
+	}
+
+	lb->table = table;
+	lb->table_addr = addr;
+	lb->table_bytes = h->table_bytes;
+	return 0;
+}
+
+
+static int
+lb_table_load(
+	lb_table_t * const lb
+)
+{
+	static const struct {
+		uint64_t addr;
+		size_t len;
+	} windows[] = {
+		{ 0x00000, 0x1000 },
+		{ 0xF0000, 0x10000 },
+	};
+
+	memset(lb, 0, sizeof(*lb));
+
+	uint64_t addr = 0;
+	int found = 0;
+	struct lb_header h;
+	for (unsigned i = 0 ; i < sizeof(windows)/sizeof(*windows) ; i++)
+	{
+		const uint8_t * const buf = map_window(windows[i].addr,
+			windows[i].len);
+		if (!buf)
+			continue;
+
+		const int64_t off = lb_header_find(buf, windows[i].len);
+		if (off >= 0)
+		{
+			found = 1;
+			addr = windows[i].addr + off;
+			memcpy(&h, buf + off, sizeof(h));
+		}
+
+		unmap_window(buf, windows[i].len);
+		if (off >= 0)
+			break;
+	}
+
+	if (!found)
+	{
+		fprintf(stderr, "No coreboot table found in low memory\n");
+		return -1;
+	}
+
+	// follow forward records to the full table at the top of RAM
+	for (unsigned depth = 0 ; depth < 4 ; depth++)
+	{
+		const int64_t forward = lb_table_parse(lb, addr, &h);
+		if (forward <= 0)
+			return forward;
+
+		const void * const hp = map_window(forward, sizeof(h));
+		if (!hp)
+			return -1;
+		memcpy(&h, hp, sizeof(h));
+		unmap_window(hp, sizeof(h));
+
+		if (memcmp(h.signature, LB_SIGNATURE, 4) != 0
+		||  ip_checksum(&h, sizeof(h)) != 0)
+		{
+			fprintf(stderr, "%08"PRIx64": bad forwarded table\n", forward);
+			return -1;
+		}
+
+		addr = forward;
+	}
+
+	return -1;
+}
+
+
+// The size of a CBMEM area from the table, or 0 if it is not listed
+static uint32_t
+cbmem_area_size(
+	const lb_table_t * const lb,
+	uint64_t addr
+)
+{
+	for (unsigned i = 0 ; i < lb->num_areas ; i++)
+		if (lb->areas[i].addr == addr)
+			return lb->areas[i].size;
+	return 0;
+}
+
+
+/*
+ * Map a CBMEM area whose size is in its first word: at the size the
+ * coreboot table lists, or (on coreboot too old to list the areas)
+ * the header first and then the whole area.
+ */
+static const void *
+cbmem_area_map(
+	const lb_table_t * const lb,
+	uint64_t addr,
+	size_t header_len,
+	size_t (*area_len)(const void * header),
+	size_t * const len
+)
+{
+	*len = cbmem_area_size(lb, addr);
+	if (*len == 0)
+	{
+		const void * const hdr = map_window(addr, header_len);
+		if (!hdr)
+			return NULL;
+		*len = area_len(hdr);
+		unmap_window(hdr, header_len);
+	}
+
+	if (*len < header_len)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return map_window(addr, *len);
+}
+
+
+static size_t
+timestamp_table_len(
+	const void * hdr
+)
+{
+	const struct timestamp_table * const t = hdr;
+	return sizeof(*t) + t->max_entries * sizeof(t->entries[0]);
+}
+
+
+static size_t
+console_len(
+	const void * hdr
+)
+{
+	const struct cbmem_console * const c = hdr;
+	return sizeof(*c) + c->size;
+}
+
+
+static const char *
+timestamp_name(
+	uint32_t id
+)
+{
+	for (unsigned i = 0 ; i < sizeof(timestamp_names)/sizeof(*timestamp_names) ; i++)
+		if (timestamp_names[i].id == id)
+			return timestamp_names[i].name;
+	return "";
+}
+
+
+// Older coreboot does not record the TSC rate; the brand string has it
+static unsigned
+cpuinfo_mhz(void)
+{
+	FILE * const f = fopen("/proc/cpuinfo", "r");
+	if (!f)
+		return 0;
+
+	char line[256];
+	unsigned mhz = 0;
+	while (!mhz && fgets(line, sizeof(line), f))
+	{
+		if (strncmp(line, "model name", 10) != 0)
+			continue;
+
+		const char * const at = strchr(line, '@');
+		double ghz;
+		if (at && sscanf(at + 1, "%lfGHz", &ghz) == 1)
+			mhz = ghz * 1000;
+	}
+
+	fclose(f);
+	return mhz;
+}
+
+
+static int
+print_timestamps(
+	const lb_table_t * const lb,
+	unsigned mhz
+)
+{
+	if (!lb->timestamps)
+	{
+		fprintf(stderr, "No timestamp table\n");
+		return -1;
+	}
+
+	size_t len;
+	const struct timestamp_table * const t = cbmem_area_map(lb,
+		lb->timestamps, sizeof(*t), timestamp_table_len, &len);
+	if (!t)
+	{
+		perror("timestamps");
+		return -1;
+	}
+
+	if (!mhz)
+		mhz = t->tick_freq_mhz;
+	if (!mhz)
+		mhz = cpuinfo_mhz();
+	if (!mhz)
+	{
+		fprintf(stderr, "Unknown timestamp tick rate, use --mhz\n");
+		unmap_window(t, len);
+		return -1;
+	}
+
+	size_t count = t->num_entries;
+	if (count > (len - sizeof(*t)) / sizeof(t->entries[0]))
+		count = (len - sizeof(*t)) / sizeof(t->entries[0]);
+
+	/*
+	 * Stamps are relative to the base time; the first entry is the
+	 * base itself.  The table is written in boot order, so the time
+	 * since the previous entry is the time spent in that step.
+	 */
+	printf("%u entries total:\n\n", (unsigned) count + 1);
+	printf("%5u:%-45s %12"PRIu64"\n", 0, timestamp_name(0),
+		t->base_time / mhz);
+
+	uint64_t prev = 0;
+	for (size_t i = 0 ; i < count ; i++)
+	{
+		const struct timestamp_entry * const e = &t->entries[i];
+		const uint64_t stamp = e->entry_stamp < 0 ? 0 : e->entry_stamp;
+		const uint64_t delta = stamp > prev ? stamp - prev : 0;
+
+		printf("%5u:%-45s %12"PRIu64" (%"PRIu64")\n",
+			e->entry_id, timestamp_name(e->entry_id),
+			(t->base_time + stamp) / mhz, delta / mhz);
+
+		prev = stamp;
+	}
+
+	printf("\nTotal Time: %"PRIu64" us\n", prev / mhz);
+	if (verbose)
+		fprintf(stderr, "%u MHz timestamp clock\n", mhz);
+
+	unmap_window(t, len);
+	return 0;
+}
+
+
+static void
+write_all(
+	const void * buf,
+	size_t len
+)
+{
+	const uint8_t * p = buf;
+	while (len)
+	{
+		const ssize_t rc = write(STDOUT_FILENO, p, len);
+		if (rc <= 0)
+		{
+			if (rc < 0 && errno == EINTR)
+				continue;
+			exit(EXIT_FAILURE);
+		}
+		p += rc;
+		len -= rc;
+	}
+}
+
+
+// Write the console from one cursor position to another, around the ring
+static void
+console_write(
+	const volatile struct cbmem_console * const c,
+	uint32_t size,
+	uint32_t from,
+	uint32_t to
+)
+{
+	const uint8_t * const body = (const uint8_t *) c->body;
+	if (to < from)
+	{
+		write_all(body + from, size - from);
+		from = 0;
+	}
+	write_all(body + from, to - from);
+}
+
+
+static int
+print_console(
+	const lb_table_t * const lb,
+	int follow
+)
+{
+	if (!lb->console)
+	{
+		fprintf(stderr, "No CBMEM console\n");
+		return -1;
+	}
+
+	size_t len;
+	const volatile struct cbmem_console * const c = cbmem_area_map(lb,
+		lb->console, sizeof(*c), console_len, &len);
+	if (!c)
+	{
+		perror("console");
+		return -1;
+	}
+
+	uint32_t size = c->size;
+	if (size > len - sizeof(*c))
+		size = len - sizeof(*c);
+
+	// once the ring has wrapped the oldest data is after the cursor
+	const uint32_t cursor_word = c->cursor;
+	uint32_t cursor = cursor_word & CBMC_CURSOR_MASK;
+	if (cursor > size)
+		cursor = size;
+	if (cursor_word & CBMC_OVERFLOW)
+	{
+		fprintf(stderr, "*** console overflowed, earlier output lost ***\n");
+		console_write(c, size, cursor, size);
+		console_write(c, size, 0, cursor);
+	} else {
+		console_write(c, size, 0, cursor);
+	}
+
+	while (follow)
+	{
+		const struct timespec delay = { 0, CBMEM_FOLLOW_NS };
+		nanosleep(&delay, NULL);
+
+		uint32_t now = c->cursor & CBMC_CURSOR_MASK;
+		if (now > size)
+			now = size;
+		if (now == cursor)
+			continue;
+
+		console_write(c, size, cursor, now);
+		cursor = now;
+	}
+
+	unmap_window((const void *) c, len);
+	return 0;
+}
+
+
+static void
+print_areas(
+	const lb_table_t * const lb
+)
+{
+	printf("coreboot table: %08"PRIx64"[%x]\n",
+		lb->table_addr, lb->table_bytes);
+
+	for (unsigned i = 0 ; i < lb->num_areas ; i++)
+	{
+		const cbmem_area_t * const a = &lb->areas[i];
+		char id[5];
+		for (unsigned j = 0 ; j < 4 ; j++)
+		{
+			const char ch = a->id >> (24 - 8 * j);
+			id[j] = ch >= 0x20 && ch < 0x7F ? ch : '.';
+		}
+		id[4] = '\0';
+
+		printf("%08x %s %08"PRIx64" %08x\n", a->id, id, a->addr, a->size);
+	}
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	int do_timestamps = 0;
+	int do_console = 0;
+	int do_follow = 0;
+	int do_list = 0;
+	unsigned mhz = 0;
+	const char * mem_name = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?vtcflM:o:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 't':
+			do_timestamps = 1;
+			break;
+		case 'c':
+			do_console = 1;
+			break;
+		case 'f':
+			do_console = 1;
+			do_follow = 1;
+			break;
+		case 'l':
+			do_list = 1;
+			break;
+		case 'M':
+			mhz = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			mem_name = optarg;
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc || !(do_timestamps || do_console || do_list))
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	if (mem_name)
+	{
+		if (map_window_image(mem_name) < 0)
+		{
+			perror(mem_name);
+			return EXIT_FAILURE;
+		}
+
+		// a dump does not change, so there is nothing to follow
+		do_follow = 0;
+	}
+
+	lb_table_t lb;
+	if (lb_table_load(&lb) < 0)
+		return EXIT_FAILURE;
+
+	int rc = 0;
+	if (do_list)
+		print_areas(&lb);
+	if (do_timestamps)
+		rc |= print_timestamps(&lb, mhz);
+	if (do_console)
+		rc |= print_console(&lb, do_follow);
+
+	return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,364 @@
+/** \file
+ * Content addressed chunk store for ROM images.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "chunkstore.h"
+
+#define CHUNKSTORE_PATH_LEN 4096
+#define MANIFEST_MAGIC "flashtools-manifest 1"
+
+
+// gear table from splitmix64, so that it does not need to be stored
+static void
+gear_init(
+	uint64_t gear[256]
+)
+{
+	uint64_t x = 0x666c617368746f6f; // "flashtoo"
+	for (int i = 0 ; i < 256 ; i++)
+	{
+		uint64_t z = (x += 0x9E3779B97F4A7C15);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+
+static int
+manifest_add(
+	manifest_t * const m,
+	uint64_t offset,
+	uint32_t len
+)
+{
+	if ((m->num_chunks & (m->num_chunks - 1)) == 0)
+	{
+		const size_t n = m->num_chunks ? m->num_chunks * 2 : 64;
+		chunk_t * const c = realloc(m->chunks, n * sizeof(*c));
+		if (!c)
+			return -1;
+		m->chunks = c;
+	}
+
+	chunk_t * const c = &m->chunks[m->num_chunks++];
+	c->offset = offset;
+	c->len = len;
+	return 0;
+}
+
+
+int
+chunk_split(
+	const uint8_t * const buf,
+	uint64_t len,
+	uint32_t block_size,
+	manifest_t * const m
+)
+{
+	if (block_size == 0 || (block_size & (block_size - 1)) != 0)
+		return -1;
+
+	uint64_t gear[256];
+	gear_init(gear);
+
+	memset(m, 0, sizeof(*m));
+	m->size = len;
+
+	// the top bits of the hash depend on the last 64 bytes
+	const uint64_t mask = ~0ULL << (64 - CHUNK_AVG_BITS);
+	uint64_t start = 0;
+
+	while (start < len)
+	{
+		// never cross an erase block, so that identical blocks
+		// always produce identical chunks
+		uint64_t end = (start | (block_size - 1)) + 1;
+		if (end > len)
+			end = len;
+		if (end - start > CHUNK_MAX_SIZE)
+			end = start + CHUNK_MAX_SIZE;
+
+		uint64_t cut = end;
+		uint64_t h = 0;
+		for (uint64_t i = start ; i < end ; i++)
+		{
+			h = (h << 1) + gear[buf[i]];
+			if (i - start + 1 < CHUNK_MIN_SIZE)
+				continue;
+			if ((h & mask) == 0)
+			{
+				cut = i + 1;
+				break;
+			}
+		}
+
+		if (manifest_add(m, start, cut - start) < 0)
+		{
+			manifest_free(m);
+			return -1;
+		}
+
+		start = cut;
+	}
+
+	for (size_t i = 0 ; i < m->num_chunks ; i++)
+	{
+		chunk_t * const c = &m->chunks[i];
+		sha256(buf + c->offset, c->len, c->hash);
+	}
+
+	return 0;
+}
+
+
+static void
+object_path(
+	char * const path,
+	const char * const store,
+	const uint8_t * const hash
+)
+{
+	char hex[2 * SHA256_LEN + 1];
+	hex_digest(hex, hash, SHA256_LEN);
+	snprintf(path, CHUNKSTORE_PATH_LEN, "%s/objects/%.2s/%s", store, hex, hex + 2);
+}
+
+
+static int
+make_dirs(
+	const char * const store,
+	const uint8_t * const hash
+)
+{
+	char path[CHUNKSTORE_PATH_LEN];
+
+	snprintf(path, sizeof(path), "%s", store);
+	if (mkdir(path, 0777) < 0 && errno != EEXIST)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/objects", store);
+	if (mkdir(path, 0777) < 0 && errno != EEXIST)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/objects/%02x", store, hash[0]);
+	if (mkdir(path, 0777) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+
+static int
+write_file(
+	const char * const path,
+	const void * const buf,
+	size_t len
+)
+{
+	FILE * const f = fopen(path, "wb");
+	if (!f)
+		return -1;
+
+	const size_t n = fwrite(buf, 1, len, f);
+	if (fclose(f) != 0 || n != len)
+		return -1;
+
+	return 0;
+}
+
+
+int
+chunkstore_put(
+	const char * const store,
+	const uint8_t * const buf,
+	const manifest_t * const m,
+	unsigned * const stored,
+	uint64_t * const stored_bytes
+)
+{
+	char path[CHUNKSTORE_PATH_LEN];
+	char tmp[CHUNKSTORE_PATH_LEN + 32];
+	unsigned count = 0;
+	uint64_t bytes = 0;
+
+	for (size_t i = 0 ; i < m->num_chunks ; i++)
+	{
+		const chunk_t * const c = &m->chunks[i];
+
+		object_path(path, store, c->hash);
+		if (access(path, F_OK) == 0)
+			continue;
+
+		if (make_dirs(store, c->hash) < 0)
+			return -1;
+
+		// write then rename so that a chunk is either complete
+		// or absent, even if we are interrupted
+		snprintf(tmp, sizeof(tmp), "%s.tmp%ld", path, (long) getpid());
+		if (write_file(tmp, buf + c->offset, c->len) < 0
+		||  rename(tmp, path) < 0)
+		{
+			const int tmp_errno = errno;
+			remove(tmp);
+			errno = tmp_errno;
+			return -1;
+		}
+
+		count++;
+		bytes += c->len;
+	}
+
+	if (stored)
+		*stored = count;
+	if (stored_bytes)
+		*stored_bytes = bytes;
+
+	return 0;
+}
+
+
+int
+chunkstore_get(
+	const char * const store,
+	const manifest_t * const m,
+	uint8_t * const buf
+)
+{
+	char path[CHUNKSTORE_PATH_LEN];
+
+	for (size_t i = 0 ; i < m->num_chunks ; i++)
+	{
+		const chunk_t * const c = &m->chunks[i];
+
+		object_path(path, store, c->hash);
+		FILE * const f = fopen(path, "rb");
+		if (!f)
+			return -1;
+
+		const size_t n = fread(buf + c->offset, 1, c->len, f);
+		const int extra = fgetc(f) != EOF;
+		fclose(f);
+
+		uint8_t hash[SHA256_LEN];
+		sha256(buf + c->offset, c->len, hash);
+
+		if (n != c->len || extra || memcmp(hash, c->hash, SHA256_LEN) != 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+int
+manifest_write(
+	const char * const filename,
+	const manifest_t * const m
+)
+{
+	FILE * const f = strcmp(filename, "-") == 0
+		? stdout : fopen(filename, "w");
+	if (!f)
+		return -1;
+
+	fprintf(f, "%s\nsize %"PRIx64"\n", MANIFEST_MAGIC, m->size);
+
+	char hex[2 * SHA256_LEN + 1];
+	for (size_t i = 0 ; i < m->num_chunks ; i++)
+	{
+		const chunk_t * const c = &m->chunks[i];
+		fprintf(f, "%08"PRIx64" %x %s\n", c->offset, c->len,
+			hex_digest(hex, c->hash, SHA256_LEN));
+	}
+
+	if (f == stdout)
+		return fflush(f) == 0 ? 0 : -1;
+
+	return fclose(f) == 0 ? 0 : -1;
+}
+
+
+int
+manifest_read(
+	const char * const filename,
+	manifest_t * const m
+)
+{
+	memset(m, 0, sizeof(*m));
+
+	FILE * const f = strcmp(filename, "-") == 0
+		? stdin : fopen(filename, "r");
+	if (!f)
+		return -1;
+
+	char line[256];
+	if (!fgets(line, sizeof(line), f)
+	||  strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0
+	||  !fgets(line, sizeof(line), f)
+	||  sscanf(line, "size %"SCNx64, &m->size) != 1)
+		goto fail;
+
+	uint64_t expected = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		uint64_t offset;
+		unsigned len;
+		char hex[2 * SHA256_LEN + 1];
+
+		if (sscanf(line, "%"SCNx64" %x %64s", &offset, &len, hex) != 3
+		||  strlen(hex) != 2 * SHA256_LEN
+		||  offset != expected
+		||  len == 0 || len > m->size - offset)
+			goto fail;
+
+		if (manifest_add(m, offset, len) < 0)
+			goto fail;
+
+		chunk_t * const c = &m->chunks[m->num_chunks - 1];
+		for (int i = 0 ; i < SHA256_LEN ; i++)
+		{
+			unsigned byte;
+			if (sscanf(hex + 2*i, "%2x", &byte) != 1)
+				goto fail;
+			c->hash[i] = byte;
+		}
+
+		expected = offset + len;
+	}
+
+	if (expected != m->size)
+		goto fail;
+
+	if (f != stdin)
+		fclose(f);
+	return 0;
+
+fail:
+	if (f != stdin)
+		fclose(f);
+	manifest_free(m);
+	errno = EINVAL;
+	return -1;
+}
+
+
+void
+manifest_free(
+	manifest_t * const m
+)
+{
+	free(m->chunks);
+	m->chunks = NULL;
+	m->num_chunks = 0;
+}
@@ -0,0 +1,85 @@
+/** \file
+ * Content addressed chunk store for ROM images.
+ *
+ * Images are split into chunks at every erase block boundary and at
+ * content defined points in between, found with a gear rolling hash
+ * so that an insertion only changes the chunks around it.  Each
+ * chunk is stored once under its SHA-256 in STORE/objects/xx/...,
+ * and an image is kept as a small text manifest listing its chunks.
+ */
+#ifndef _chunkstore_h_
+#define _chunkstore_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sha256.h"
+
+#define CHUNK_MIN_SIZE 0x400
+#define CHUNK_AVG_BITS 12 // 4 KiB average between block boundaries
+#define CHUNK_MAX_SIZE 0x10000
+#define CHUNK_BLOCK_SIZE 0x10000 // default forced cut interval
+
+typedef struct {
+	uint64_t offset;
+	uint32_t len;
+	uint8_t hash[SHA256_LEN];
+} chunk_t;
+
+typedef struct {
+	uint64_t size;
+	chunk_t * chunks;
+	size_t num_chunks;
+} manifest_t;
+
+
+// Split and hash buf; block_size must be a power of two
+extern int
+chunk_split(
+	const uint8_t * buf,
+	uint64_t len,
+	uint32_t block_size,
+	manifest_t * m
+);
+
+
+// Store the chunks that are not already present.  stored and
+// stored_bytes, if not NULL, are set to what was actually written.
+extern int
+chunkstore_put(
+	const char * store,
+	const uint8_t * buf,
+	const manifest_t * m,
+	unsigned * stored,
+	uint64_t * stored_bytes
+);
+
+
+// Reassemble an image into buf (m->size bytes), verifying each chunk
+extern int
+chunkstore_get(
+	const char * store,
+	const manifest_t * m,
+	uint8_t * buf
+);
+
+
+extern int
+manifest_write(
+	const char * filename,
+	const manifest_t * m
+);
+
+
+extern int
+manifest_read(
+	const char * filename,
+	manifest_t * m
+);
+
+
+extern void
+manifest_free(
+	manifest_t * m
+);
+
+#endif
@@ -0,0 +1,291 @@
+/** \file
+ * Intel flash descriptor parsing.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "descriptor.h"
+
+
+static uint32_t
+read32(
+	const void * const rom,
+	uint64_t offset
+)
+{
+	uint32_t x;
+	memcpy(&x, (const uint8_t *) rom + offset, sizeof(x));
+	return x;
+}
+
+
+int
+descriptor_find(
+	flash_descriptor_t * const fd,
+	const void * const rom,
+	uint64_t size
+)
+{
+	static const uint64_t offsets[] = { 0x10, 0x0 };
+
+	for (unsigned i = 0 ; i < sizeof(offsets)/sizeof(*offsets) ; i++)
+	{
+		const uint64_t offset = offsets[i];
+		if (offset + 16 > size || read32(rom, offset) != FD_SIGNATURE)
+			continue;
+
+		memset(fd, 0, sizeof(*fd));
+		fd->offset = offset;
+		fd->flmap0 = read32(rom, offset + 4);
+		fd->flmap1 = read32(rom, offset + 8);
+		fd->flmap2 = read32(rom, offset + 12);
+
+		// FRBA is bits 23:16 of FLMAP0, in units of 16 bytes
+		fd->frba = ((fd->flmap0 >> 16) & 0xff) << 4;
+		fd->fcba = (fd->flmap0 & 0xff) << 4;
+		if (fd->frba == 0
+		||  (uint64_t) fd->frba + FD_MAX_REGIONS * 4 > size)
+			continue;
+
+		return 0;
+	}
+
+	return -1;
+}
+
+
+int
+descriptor_region(
+	const flash_descriptor_t * const fd,
+	const void * const rom,
+	uint64_t size,
+	unsigned region,
+	uint64_t * const offset,
+	uint64_t * const len
+)
+{
+	if (region >= FD_MAX_REGIONS)
+		return -1;
+
+	const uint32_t freg = read32(rom, fd->frba + region * 4);
+	const uint64_t base = (uint64_t)(freg & 0x7fff) << 12;
+	const uint64_t limit = ((uint64_t)((freg >> 16) & 0x7fff) << 12) | 0xfff;
+
+	// region not in use, or the dump is shorter than the chip
+	if (limit < base || limit >= size)
+		return -1;
+
+	*offset = base;
+	*len = limit - base + 1;
+	return 0;
+}
+
+
+int
+descriptor_bios_region(
+	const void * const rom,
+	uint64_t size,
+	uint64_t * const offset,
+	uint64_t * const len
+)
+{
+	flash_descriptor_t fd;
+
+	*offset = 0;
+	*len = size;
+
+	if (descriptor_find(&fd, rom, size) < 0)
+		return 0;
+
+	if (descriptor_region(&fd, rom, size, FD_REGION_BIOS, offset, len) < 0)
+		return -1;
+
+	return 1;
+}
+
+
+const char *
+descriptor_region_name(
+	unsigned region
+)
+{
+	static const char * const names[] = {
+		"descriptor", "bios", "me", "gbe", "pdr",
+		"devexp", "bios2", "reserved", "ec", "devexp2",
+		"ie", "10gbe0", "10gbe1", "reserved", "reserved", "ptt",
+	};
+
+	return region < FD_MAX_REGIONS ? names[region] : "unknown";
+}
+
+
+uint32_t
+descriptor_flcomp(
+	const flash_descriptor_t * const fd,
+	const void * const rom,
+	uint64_t size
+)
+{
+	if (fd->fcba == 0 || (uint64_t) fd->fcba + 4 > size)
+		return 0;
+	return read32(rom, fd->fcba);
+}
+
+
+/*
+ * The clock encodings are shared by all of the FLCOMP clock fields of
+ * a descriptor but differ between the versions: version 1 (up to the
+ * 9 series) defines 20, 33 and 50 MHz, and version 2 (100 series and
+ * later) 48, 30 and 17 MHz, where 4 means 30 MHz instead of 50.  The
+ * other codes are reserved.
+ */
+typedef struct {
+	unsigned code;
+	unsigned mhz;
+	const char * name;
+} flcomp_freq_t;
+
+static const flcomp_freq_t flcomp_freqs_v1[] = {
+	{ 0, 20, "20 MHz" },
+	{ 1, 33, "33 MHz" },
+	{ 4, 50, "50 MHz" },
+	{ 0, 0, NULL },
+};
+
+static const flcomp_freq_t flcomp_freqs_v2[] = {
+	{ 2, 48, "48 MHz" },
+	{ 4, 30, "30 MHz" },
+	{ 6, 17, "17 MHz" },
+	{ 0, 0, NULL },
+};
+
+
+static const flcomp_freq_t *
+flcomp_freqs(
+	int version
+)
+{
+	if (version == FD_VERSION_1)
+		return flcomp_freqs_v1;
+	if (version == FD_VERSION_2)
+		return flcomp_freqs_v2;
+	return NULL;
+}
+
+
+int
+descriptor_version(
+	uint32_t flcomp
+)
+{
+	// the read clock is fixed for each version, like ifdtool checks
+	switch ((flcomp >> FLCOMP_READ_FREQ_SHIFT) & FLCOMP_FREQ_MASK)
+	{
+	case 0:
+		return FD_VERSION_1;
+	case 4:
+	case 6:
+		return FD_VERSION_2;
+	default:
+		return -1;
+	}
+}
+
+
+const char *
+descriptor_freq_name(
+	int version,
+	unsigned code
+)
+{
+	const flcomp_freq_t * f = flcomp_freqs(version);
+	for ( ; f && f->name ; f++)
+		if (f->code == code)
+			return f->name;
+	return NULL;
+}
+
+
+int
+descriptor_freq_code(
+	int version,
+	unsigned mhz
+)
+{
+	const flcomp_freq_t * f = flcomp_freqs(version);
+	for ( ; f && f->name ; f++)
+		if (f->mhz == mhz)
+			return f->code;
+	return -1;
+}
+
+
+unsigned
+descriptor_chips(
+	const flash_descriptor_t * const fd,
+	const void * const rom,
+	uint64_t size,
+	uint32_t * const jedec_ids,
+	unsigned max
+)
+{
+	// FLUMAP1: VTBA in bits 7:0 (16 byte units), VTL in 15:8 (dwords)
+	// the ICH8 layout, with the signature at 0, has no upper map
+	if (fd->offset == 0 || FD_UPPER_MAP + 4 > size)
+		return 0;
+
+	const uint32_t flumap1 = read32(rom, FD_UPPER_MAP);
+	const uint32_t vtba = (flumap1 & 0xff) << 4;
+	const unsigned entries = ((flumap1 >> 8) & 0xff) / 2;
+	unsigned count = 0;
+
+	for (unsigned i = 0 ; i < entries && count < max ; i++)
+	{
+		const uint64_t off = vtba + i * 8;
+		if (vtba == 0 || off + 8 > size)
+			break;
+
+		// JID: vendor in 7:0, device ID bytes in 15:8 and 23:16
+		const uint32_t jid = read32(rom, off);
+		if (jid == 0 || jid == 0xFFFFFFFF)
+			continue;
+		jedec_ids[count++] = (jid & 0xff) << 16
+			| ((jid >> 8) & 0xff) << 8
+			| ((jid >> 16) & 0xff);
+	}
+
+	return count;
+}
+
+
+/*
+ * Chips that turn up in the VSCC tables of the machines this is used
+ * on.  All of these run the fast read at 50 MHz or more, which is the
+ * most the descriptor can ask for.  Macronix reused its IDs across
+ * parts with and without the dual output read, so those are listed
+ * without it.
+ */
+static const flash_chip_t flash_chips[] = {
+	{ 0xBF2541, "SST25VF016B", 50, 0 },
+	{ 0xBF254A, "SST25VF032B", 50, 0 },
+	{ 0xBF254B, "SST25VF064C", 50, 1 },
+	{ 0xC22016, "MX25L32xx", 50, 0 },
+	{ 0xC22017, "MX25L64xx", 50, 0 },
+	{ 0xC22018, "MX25L128xx", 50, 0 },
+	{ 0xEF4016, "W25Q32", 50, 1 },
+	{ 0xEF4017, "W25Q64", 50, 1 },
+	{ 0xEF4018, "W25Q128", 50, 1 },
+	{ 0x20BA17, "N25Q064", 50, 1 },
+	{ 0x20BA18, "N25Q128", 50, 1 },
+};
+
+
+const flash_chip_t *
+descriptor_chip_lookup(
+	uint32_t jedec_id
+)
+{
+	for (unsigned i = 0 ; i < sizeof(flash_chips)/sizeof(*flash_chips) ; i++)
+		if (flash_chips[i].jedec_id == jedec_id)
+			return &flash_chips[i];
+	return NULL;
+}
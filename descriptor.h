@@ -0,0 +1,156 @@
+/** \file
+ * Intel flash descriptor parsing.
+ *
+ * A full chip dump starts with a flash descriptor: the signature at
+ * offset 0x10 (0x0 on ICH8) is followed by FLMAP0, which locates the
+ * region section.  Each FREG entry there gives the base and limit of
+ * one region in 4 KiB units; the BIOS region is what the chipset maps
+ * below 4 GB and is where CBFS and the firmware volumes live.
+ *
+ * FLMAP0 also locates the component section, whose FLCOMP word sets
+ * the SPI clocks and read modes that the chipset uses for the flash,
+ * and the upper map at 0xEFC locates the VSCC table, which lists the
+ * JEDEC IDs of the flash chips that the image was built for.
+ */
+#ifndef _descriptor_h_
+#define _descriptor_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FD_SIGNATURE 0x0FF0A55A
+#define FD_MAX_REGIONS 16
+
+#define FD_REGION_DESCRIPTOR 0
+#define FD_REGION_BIOS 1
+#define FD_REGION_ME 2
+#define FD_REGION_GBE 3
+#define FD_REGION_PDR 4
+
+#define FD_DESCRIPTOR_SIZE 0x1000
+#define FD_UPPER_MAP 0xEFC
+#define FD_MAX_CHIPS 8
+
+// FLCOMP fields
+#define FLCOMP_READ_FREQ_SHIFT 17       // normal read clock
+#define FLCOMP_FAST_READ (1U << 20)
+#define FLCOMP_FAST_FREQ_SHIFT 21       // fast read clock
+#define FLCOMP_WRITE_FREQ_SHIFT 24      // write and erase clock
+#define FLCOMP_ID_FREQ_SHIFT 27         // read ID and status clock
+#define FLCOMP_FREQ_MASK 0x7
+#define FLCOMP_DUAL_OUTPUT (1U << 30)
+
+// descriptor versions, which encode the FLCOMP clocks differently
+#define FD_VERSION_1 1
+#define FD_VERSION_2 2
+
+typedef struct {
+	uint64_t offset;        // of the signature in the image
+	uint32_t flmap0;
+	uint32_t flmap1;
+	uint32_t flmap2;
+	uint32_t frba;          // offset of the FREG entries in the image
+	uint32_t fcba;          // offset of FLCOMP in the image
+} flash_descriptor_t;
+
+typedef struct {
+	uint32_t jedec_id;      // vendor << 16 | device
+	const char * name;
+	unsigned max_mhz;       // fastest fast read clock the descriptor can set
+	int dual_output;        // supports the 1-1-2 fast read (0x3B)
+} flash_chip_t;
+
+
+// Returns 0 if the image starts with a flash descriptor, -1 if not
+extern int
+descriptor_find(
+	flash_descriptor_t * fd,
+	const void * rom,
+	uint64_t size
+);
+
+
+// Offset and length of a region; -1 if it is unused or out of the image
+extern int
+descriptor_region(
+	const flash_descriptor_t * fd,
+	const void * rom,
+	uint64_t size,
+	unsigned region,
+	uint64_t * offset,
+	uint64_t * len
+);
+
+
+/*
+ * Narrow an image to its BIOS region.  Returns 1 if a descriptor was
+ * found, 0 if not, and -1 if there is a descriptor without a usable
+ * BIOS region; in the last two cases the whole image is returned.
+ */
+extern int
+descriptor_bios_region(
+	const void * rom,
+	uint64_t size,
+	uint64_t * offset,
+	uint64_t * len
+);
+
+extern const char *
+descriptor_region_name(
+	unsigned region
+);
+
+
+// The FLCOMP word, or 0 if it is outside the image
+extern uint32_t
+descriptor_flcomp(
+	const flash_descriptor_t * fd,
+	const void * rom,
+	uint64_t size
+);
+
+
+// FD_VERSION_1 or FD_VERSION_2 from the FLCOMP read clock, -1 if unknown
+extern int
+descriptor_version(
+	uint32_t flcomp
+);
+
+
+// "20 MHz" etc for a FLCOMP clock field, NULL if reserved
+extern const char *
+descriptor_freq_name(
+	int version,
+	unsigned code
+);
+
+
+// The FLCOMP clock field for a frequency, -1 if there is none
+extern int
+descriptor_freq_code(
+	int version,
+	unsigned mhz
+);
+
+
+/*
+ * JEDEC IDs from the VSCC table.  Returns the number found, at most
+ * max; descriptors older than the table have none.
+ */
+extern unsigned
+descriptor_chips(
+	const flash_descriptor_t * fd,
+	const void * rom,
+	uint64_t size,
+	uint32_t * jedec_ids,
+	unsigned max
+);
+
+
+// The read modes of a known chip, NULL if it is not known
+extern const flash_chip_t *
+descriptor_chip_lookup(
+	uint32_t jedec_id
+);
+
+#endif
@@ -5,18 +5,34 @@
  * The flash ROM needs to be in an unlocked state before this can
  * be used. Doing so is left as an exercise to the user.
  */
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <time.h>
 #include <getopt.h>
 #include "spiflash.h"
+#include "pciexbar.h"
+#include "chunkstore.h"
+#include "capsule.h"
+#include "descriptor.h"
+#include "mask.h"
+#include "util.h"
 
 static int force = 0;
 int verbose = 0;
 
+// with a chunk store, -r and -w take manifests instead of images
+static const char * store = NULL;
+static uint32_t store_block_size = CHUNK_BLOCK_SIZE;
+
+// which payload of a capsule file -w programs
+static unsigned capsule_payload = 0;
+
 static const struct option long_options[] = {
 	{ "force",		0, NULL, 'f' },
 	{ "verbose",		0, NULL, 'v' },
@@ -33,6 +49,17 @@ static const struct option long_options[] = {
 	{ "prr1",               1, NULL, '1' },
 	{ "prr2",               1, NULL, '2' },
 	{ "prr3",               1, NULL, '3' },
+	{ "store",              1, NULL, 'S' },
+	{ "block",              1, NULL, 'b' },
+	{ "payload",            1, NULL, 'P' },
+	{ "descriptor",         0, NULL, 'D' },
+	{ "flcomp",             1, NULL, 'C' },
+	{ "rom",                1, NULL, 'o' },
+	{ "readconfig",         1, NULL, 'R' },
+	{ "benchmark",          0, NULL, 'T' },
+	{ "verify",             1, NULL, 'V' },
+	{ "mask",               1, NULL, 'x' },
+	{ "mask-file",          1, NULL, 'X' },
 	{ NULL,			0, NULL, 0 },
 };
 
@@ -48,6 +75,27 @@ static const char usage[] =
 "    -n | --length N        Length in bytes to read/write (default whole ROM)\n"
 "    -p | --pcibar 0x....   PCIE XBAR address\n"
 "    -f | --force           Write all flash pages, not just the changed ones\n"
+"    -S | --store DIR       Read into / write from a chunk store; the file\n"
+"                           for -r and -w is then a manifest\n"
+"    -b | --block N         Erase block size for store chunking (0x10000)\n"
+"    -P | --payload N       Capsule payload to write (default 0); a capsule\n"
+"                           given to -w is programmed from its payload\n"
+"\n"
+"Verify options:\n"
+"    -V | --verify file     Compare the flash at the offset with a golden\n"
+"                           image and list the erase blocks that differ\n"
+"    -x | --mask RULE,...   Skip volatile parts: fmap:NAME, cbfs:NAME,\n"
+"                           fv:GUID or range:OFFSET:LEN in the image\n"
+"    -X | --mask-file FILE  Read mask rules from a file, one per line\n"
+"\n"
+"Flash descriptor options:\n"
+"    -D | --descriptor      Show the SPI clocks and read modes (FLCOMP)\n"
+"    -C | --flcomp key=val,...  Change them: freq, readfreq, writefreq,\n"
+"                           idfreq (MHz), fastread, dual (0 or 1).\n"
+"                           Version 1 descriptors take 20, 33 or 50 MHz\n"
+"                           and version 2 ones 17, 30 or 48 MHz; readfreq\n"
+"                           other than 20 (17 on version 2) needs -f\n"
+"    -o | --rom file        Use a ROM image instead of the flash\n"
 "\n"
 "Platform lockdown options:\n"
 "    -i | --info            Read the BIOS_CNTL and PRR registers\n"
@@ -59,12 +107,100 @@ static const char usage[] =
 "    -3 | --prr3 0xXXXX     Set Protected Range Register 3\n"
 "    -4 | --prr4 0xXXXX     Set Protected Range Register 4\n"
 "\n"
+"Memory-mapped read options:\n"
+"    -R | --readconfig N    Set the BIOS_CNTL SPI read configuration:\n"
+"                           0 cache, 1 neither, 2 prefetch and cache\n"
+"    -T | --benchmark       Time reads of the BIOS window (the top -n\n"
+"                           bytes below 4 GB, default 1 MiB) with each\n"
+"                           read configuration\n"
+"\n"
 "WARNING: This tool can permanently brick your machine!\n"
 "Use with caution, especially if you do not have an ISP to fix the\n"
 "SPI flash ROM chip through hardware.\n"
 "\n";
 
 
+static int
+store_image(
+	const uint8_t * const buf,
+	unsigned length,
+	const char * const manifest_name
+)
+{
+	manifest_t m;
+	if (chunk_split(buf, length, store_block_size, &m) < 0)
+	{
+		fprintf(stderr, "chunk_split failed\n");
+		return EXIT_FAILURE;
+	}
+
+	unsigned stored;
+	uint64_t stored_bytes;
+	if (chunkstore_put(store, buf, &m, &stored, &stored_bytes) < 0)
+	{
+		perror(store);
+		return EXIT_FAILURE;
+	}
+
+	if (manifest_write(manifest_name, &m) < 0)
+	{
+		perror(manifest_name);
+		return EXIT_FAILURE;
+	}
+
+	if (verbose)
+		fprintf(stderr, "store: %zu chunks, %u new (0x%"PRIx64" bytes)\n",
+			m.num_chunks, stored, stored_bytes);
+
+	manifest_free(&m);
+	return EXIT_SUCCESS;
+}
+
+
+static uint8_t *
+load_manifest(
+	const char * const manifest_name,
+	unsigned * const read_len,
+	unsigned max_len
+)
+{
+	manifest_t m;
+	if (manifest_read(manifest_name, &m) < 0)
+	{
+		perror(manifest_name);
+		return NULL;
+	}
+
+	if (m.size > max_len)
+	{
+		fprintf(stderr, "%s: image size %"PRIx64" > flash size %x\n",
+			manifest_name, m.size, max_len);
+		manifest_free(&m);
+		return NULL;
+	}
+
+	uint8_t * const buf = calloc(1, max_len + 1);
+	if (!buf)
+	{
+		perror("calloc");
+		manifest_free(&m);
+		return NULL;
+	}
+
+	if (chunkstore_get(store, &m, buf) < 0)
+	{
+		perror(store);
+		manifest_free(&m);
+		free(buf);
+		return NULL;
+	}
+
+	*read_len = m.size;
+	manifest_free(&m);
+	return buf;
+}
+
+
 static int
 read_from_spi(
 	spiflash_t * const sp,
@@ -108,6 +244,9 @@ read_from_spi(
 		return EXIT_FAILURE;
 	}
 
+	if (store)
+		return store_image(buf, length, filename);
+
 	FILE * file;
 	if (strcmp(filename, "-") == 0)
 	{
@@ -136,24 +275,63 @@ write_to_spi(
 	unsigned length
 )
 {
-	// if a filename was given, read it in
-	FILE * file;
-	if (strcmp(filename, "-") == 0)
+	const unsigned flash_size = spiflash_size(sp);
+	const uint8_t * buf;
+	unsigned read_len;
+
+	if (store)
+	{
+		// reassemble the image from the chunks in the store
+		buf = load_manifest(filename, &read_len, flash_size);
+		if (!buf)
+			return EXIT_FAILURE;
+	} else
+	if (strcmp(filename, "-") != 0)
 	{
-		file = stdin;
+		// program straight out of the mapped file, and out of
+		// the payload if it is a capsule, without a copy
+		uint64_t size;
+		buf = map_file(filename, &size, 1);
+		if (!buf)
+		{
+			fprintf(stderr, "%s: %s\n", filename,
+				errno ? strerror(errno) : "empty file");
+			return EXIT_FAILURE;
+		}
+
+		capsule_t cap;
+		if (capsule_parse(&cap, buf, size) == 0)
+		{
+			if (capsule_payload >= cap.num_payloads)
+			{
+				fprintf(stderr, "%s: %s capsule has %u payloads\n",
+					filename, capsule_type_name(cap.type),
+					cap.num_payloads);
+				return EXIT_FAILURE;
+			}
+
+			const capsule_payload_t * const p = &cap.payloads[capsule_payload];
+			if (verbose)
+				printf("capsule: %s payload %u at %08"PRIx64": 0x%"PRIx64" bytes\n",
+					capsule_type_name(cap.type), capsule_payload,
+					p->offset, p->len);
+			buf += p->offset;
+			size = p->len;
+		}
+
+		// too large is reported below, like a short read would be
+		read_len = size > flash_size ? flash_size + 1 : size;
 	} else {
-		file = fopen(filename, "r");
-		if (!file)
+		uint8_t * const stdin_buf = calloc(1, flash_size+1);
+		if (!stdin_buf)
 		{
-			perror(filename);
+			perror("calloc");
 			return EXIT_FAILURE;
 		}
+		read_len = fread(stdin_buf, 1, flash_size+1, stdin);
+		buf = stdin_buf;
 	}
 
-	const unsigned flash_size = spiflash_size(sp);
-
-	uint8_t * const buf = calloc(1, flash_size+1);
-	const unsigned read_len = fread(buf, 1, flash_size+1, file);
 	if (length == 0)
 	{
 		// they didn't tell us how much, use this value
@@ -200,13 +378,504 @@ write_to_spi(
 	return EXIT_SUCCESS;
 }
 
-//TODO: BEGIN NEEDS AUTODISCOVERING
-#ifdef __darwin__
-#define PCIEXBAR 0xE0000000 // MBP11,2
-#else
-#define PCIEXBAR 0x80000000 // Winterfell
-//#define PCIEXBAR 0xF8000000 // x230
-#endif
+/*
+ * Compare the flash with a golden image.  The mask is resolved from
+ * the image, and masked ranges are not read from the flash at all.
+ */
+static int
+verify_spi(
+	spiflash_t * const sp,
+	const char * const filename,
+	unsigned offset,
+	const mask_spec_t * const mask_spec
+)
+{
+	const unsigned flash_size = spiflash_size(sp);
+	const unsigned chunk_size = 0x10000;
+
+	uint64_t size;
+	const uint8_t * const rom = map_file(filename, &size, 1);
+	if (!rom)
+	{
+		fprintf(stderr, "%s: %s\n", filename,
+			errno ? strerror(errno) : "empty file");
+		return EXIT_FAILURE;
+	}
+
+	if (offset + size > flash_size)
+	{
+		fprintf(stderr, "offset %08x + length %08"PRIx64" > flash_size %08x\n",
+			offset, size, flash_size);
+		return EXIT_FAILURE;
+	}
+
+	mask_t mask = {};
+	const int matched = mask_resolve(&mask, mask_spec, rom, size);
+	if (matched < 0)
+	{
+		fprintf(stderr, "%s: unable to resolve the mask\n", filename);
+		mask_free(&mask);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t * const buf = malloc(chunk_size);
+	if (!buf)
+	{
+		perror("malloc");
+		mask_free(&mask);
+		return EXIT_FAILURE;
+	}
+
+	if (verbose && mask_spec->num_rules)
+		fprintf(stderr, "%s: %d of %u mask rules matched\n",
+			filename, matched, mask_spec->num_rules);
+
+	// changed erase blocks are printed as spans of flash addresses
+	int64_t run_start = -1;
+	uint64_t run_end = 0;
+	unsigned spans = 0;
+	uint64_t read_bytes = 0;
+	uint64_t pos = 0;
+	uint64_t len;
+
+	while ((pos = mask_next(&mask, pos, size, &len)), len != 0)
+	{
+		if (len > chunk_size)
+			len = chunk_size;
+
+		if (spiflash_read(sp, offset + pos, buf, len) < 0)
+		{
+			fprintf(stderr, "spiflash_read(%08"PRIx64",%08"PRIx64") failed?\n",
+				offset + pos, len);
+			mask_free(&mask);
+			free(buf);
+			return EXIT_FAILURE;
+		}
+		read_bytes += len;
+
+		for (uint64_t i = 0 ; i < len ; )
+		{
+			if (buf[i] == rom[pos + i])
+			{
+				i++;
+				continue;
+			}
+
+			// skip to the end of the erase block with the change
+			const uint64_t fladdr = offset + pos + i;
+			const int erase_size = spiflash_erase_size(sp, fladdr);
+			if (erase_size < 0)
+			{
+				fprintf(stderr, "%08"PRIx64": unknown erase size\n",
+					fladdr);
+				mask_free(&mask);
+				free(buf);
+				return EXIT_FAILURE;
+			}
+
+			const uint64_t erase = erase_size;
+			const uint64_t block = fladdr & ~(erase - 1);
+
+			if (run_start >= 0 && block > run_end)
+			{
+				printf("  %-9s %08"PRIx64"-%08"PRIx64"\n",
+					"modified", run_start, run_end - 1);
+				spans++;
+				run_start = -1;
+			}
+			if (run_start < 0)
+				run_start = block;
+			run_end = block + erase;
+
+			i = run_end - offset - pos;
+		}
+
+		pos += len;
+	}
+
+	if (run_start >= 0)
+	{
+		printf("  %-9s %08"PRIx64"-%08"PRIx64"\n",
+			"modified", run_start, run_end - 1);
+		spans++;
+	}
+
+	if (verbose)
+		fprintf(stderr, "verify: read 0x%"PRIx64" bytes, skipped 0x%"PRIx64
+			" masked\n", read_bytes, mask_bytes(&mask, size));
+
+	printf("%s: %s\n", filename, spans ? "differs" : "matches");
+
+	mask_free(&mask);
+	free(buf);
+	return spans ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ * Read the top of the BIOS window under each SPI read configuration.
+ * The first pass after a change shows the cold read rate, the best of
+ * the later ones what caching adds; the original setting is restored.
+ */
+static int
+benchmark_window(
+	spiflash_t * const sp,
+	unsigned length
+)
+{
+	const uint64_t mem_end = 0x100000000;
+	const unsigned passes = 4;
+
+	if (length == 0)
+		length = 0x100000;
+
+	const volatile uint8_t * const window = map_physical(mem_end - length, length);
+	if (!window)
+	{
+		perror("map_physical");
+		return EXIT_FAILURE;
+	}
+
+	uint8_t * const buf = malloc(length);
+	if (!buf)
+	{
+		perror("malloc");
+		unmap_physical((volatile void *) window, length);
+		return EXIT_FAILURE;
+	}
+
+	const unsigned old = spiflash_read_config(sp);
+	printf("%-22s %12s %12s\n", "read configuration", "first MB/s", "best MB/s");
+
+	for (unsigned src = 0 ; src <= SPIFLASH_SRC_PREFETCH_CACHE ; src++)
+	{
+		if (spiflash_set_read_config(sp, src) < 0)
+		{
+			printf("%-22s (could not be set)\n",
+				spiflash_read_config_name(src));
+			continue;
+		}
+
+		uint64_t first = 0, best = UINT64_MAX;
+		for (unsigned pass = 0 ; pass < passes ; pass++)
+		{
+			const uint64_t start = now_ns();
+			memcpy_width(buf, window, length, 4, MEM_SET);
+			const uint64_t elapsed = now_ns() - start + 1;
+
+			if (pass == 0)
+				first = elapsed;
+			else
+			if (elapsed < best)
+				best = elapsed;
+		}
+
+		printf("%-22s %12.1f %12.1f%s\n",
+			spiflash_read_config_name(src),
+			length * 1e3 / first, length * 1e3 / best,
+			src == old ? " (current)" : "");
+	}
+
+	spiflash_set_read_config(sp, old);
+	unmap_physical((volatile void *) window, length);
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
+
+static void
+flcomp_print(
+	uint32_t flcomp,
+	int version
+)
+{
+	static const struct {
+		const char * label;
+		unsigned shift;
+	} clocks[] = {
+		{ "Read clock", FLCOMP_READ_FREQ_SHIFT },
+		{ "Fast read clock", FLCOMP_FAST_FREQ_SHIFT },
+		{ "Write/erase clock", FLCOMP_WRITE_FREQ_SHIFT },
+		{ "Read ID/status clock", FLCOMP_ID_FREQ_SHIFT },
+	};
+
+	printf("FLCOMP: %08x (descriptor version %s)\n", flcomp,
+		version == FD_VERSION_2 ? "2" : version == FD_VERSION_1 ? "1" : "unknown");
+	for (unsigned i = 0 ; i < sizeof(clocks)/sizeof(*clocks) ; i++)
+	{
+		const unsigned code = (flcomp >> clocks[i].shift) & FLCOMP_FREQ_MASK;
+		const char * const name = descriptor_freq_name(version, code);
+		printf("  %-22s %s\n", clocks[i].label, name ? name : "reserved");
+	}
+
+	printf("  %-22s %s\n", "Fast read",
+		flcomp & FLCOMP_FAST_READ ? "supported" : "not supported");
+	printf("  %-22s %s\n", "Dual output fast read",
+		flcomp & FLCOMP_DUAL_OUTPUT ? "supported" : "not supported");
+}
+
+
+/*
+ * Apply a list of key=value changes to FLCOMP and check the result
+ * against the chips in the descriptor's VSCC table.  Returns -1 if
+ * the list is bad or asks for something the chips can not do.
+ */
+static int
+flcomp_edit(
+	uint32_t * const flcomp,
+	int version,
+	const char * spec,
+	const uint32_t * const chips,
+	unsigned num_chips
+)
+{
+	static const struct {
+		const char * key;
+		unsigned shift;
+	} clocks[] = {
+		{ "freq", FLCOMP_FAST_FREQ_SHIFT },
+		{ "readfreq", FLCOMP_READ_FREQ_SHIFT },
+		{ "writefreq", FLCOMP_WRITE_FREQ_SHIFT },
+		{ "idfreq", FLCOMP_ID_FREQ_SHIFT },
+	};
+
+	uint32_t v = *flcomp;
+	unsigned max_mhz = 0;
+
+	if (version < 0)
+	{
+		fprintf(stderr, "cannot tell the descriptor version%s\n",
+			force ? ", assuming version 1" : ", use -f to assume version 1");
+		if (!force)
+			return -1;
+		version = FD_VERSION_1;
+	}
+
+	while (*spec)
+	{
+		const size_t len = strcspn(spec, ",");
+		char key[32];
+		const char * const eq = memchr(spec, '=', len);
+		if (!eq || (size_t)(eq - spec) >= sizeof(key))
+		{
+			fprintf(stderr, "%.*s: expected key=value\n", (int) len, spec);
+			return -1;
+		}
+
+		memcpy(key, spec, eq - spec);
+		key[eq - spec] = '\0';
+		const unsigned long value = strtoul(eq + 1, NULL, 0);
+
+		int found = 0;
+		for (unsigned i = 0 ; i < sizeof(clocks)/sizeof(*clocks) ; i++)
+		{
+			if (strcmp(key, clocks[i].key) != 0)
+				continue;
+
+			const int code = descriptor_freq_code(version, value);
+			if (code < 0)
+			{
+				fprintf(stderr, "%s: %lu MHz is not a version %d"
+					" descriptor clock (%s)\n", key, value, version,
+					version == FD_VERSION_2 ? "17, 30 or 48" : "20, 33 or 50");
+				return -1;
+			}
+
+			// each version defines a single read clock, which is
+			// also how the version is told, the rest are reserved
+			const unsigned read_mhz = version == FD_VERSION_2 ? 17 : 20;
+			if (clocks[i].shift == FLCOMP_READ_FREQ_SHIFT && value != read_mhz)
+			{
+				fprintf(stderr, "%s: only %u MHz is defined%s\n", key,
+					read_mhz,
+					force ? " but forcing anyway" : ", use -f to force");
+				if (!force)
+					return -1;
+			}
+
+			v &= ~(FLCOMP_FREQ_MASK << clocks[i].shift);
+			v |= (uint32_t) code << clocks[i].shift;
+			found = 1;
+		}
+
+		if (strcmp(key, "fastread") == 0 || strcmp(key, "dual") == 0)
+		{
+			const uint32_t bit = key[0] == 'f'
+				? FLCOMP_FAST_READ : FLCOMP_DUAL_OUTPUT;
+			v = value ? v | bit : v & ~bit;
+			found = 1;
+		}
+
+		if (!found)
+		{
+			fprintf(stderr, "%s: unknown FLCOMP field\n", key);
+			return -1;
+		}
+
+		spec += len;
+		if (*spec == ',')
+			spec++;
+	}
+
+	if ((v & FLCOMP_DUAL_OUTPUT) && !(v & FLCOMP_FAST_READ))
+	{
+		fprintf(stderr, "dual output needs fast read\n");
+		return -1;
+	}
+
+	// the fastest clock that is being set
+	for (unsigned i = 0 ; i < sizeof(clocks)/sizeof(*clocks) ; i++)
+	{
+		const unsigned code = (v >> clocks[i].shift) & FLCOMP_FREQ_MASK;
+		const char * const name = descriptor_freq_name(version, code);
+		const unsigned mhz = name ? strtoul(name, NULL, 10) : 0;
+		if (mhz > max_mhz)
+			max_mhz = mhz;
+	}
+
+	// every chip the image may be fitted with must do what is asked
+	int unknown = num_chips == 0;
+	for (unsigned i = 0 ; i < num_chips ; i++)
+	{
+		const flash_chip_t * const chip = descriptor_chip_lookup(chips[i]);
+		if (!chip)
+		{
+			fprintf(stderr, "%06x: unknown flash chip\n", chips[i]);
+			unknown = 1;
+			continue;
+		}
+
+		if (verbose)
+			fprintf(stderr, "%06x: %s\n", chips[i], chip->name);
+
+		if (max_mhz > chip->max_mhz)
+		{
+			fprintf(stderr, "%s: clocks above %u MHz not supported\n",
+				chip->name, chip->max_mhz);
+			return -1;
+		}
+
+		if ((v & FLCOMP_DUAL_OUTPUT) && !chip->dual_output)
+		{
+			fprintf(stderr, "%s: dual output fast read not supported\n",
+				chip->name);
+			return -1;
+		}
+	}
+
+	// 20 MHz single output reads are safe on any chip
+	const int needs_chip = max_mhz > 20 || (v & FLCOMP_DUAL_OUTPUT);
+	if (unknown && needs_chip && v != *flcomp)
+	{
+		fprintf(stderr, "cannot check the chip's read modes%s\n",
+			force ? " but forcing anyway" : ", use -f to force");
+		if (!force)
+			return -1;
+	}
+
+	*flcomp = v;
+	return 0;
+}
+
+
+/*
+ * Show and change FLCOMP in the descriptor at the start of buf, which
+ * is a ROM image or the descriptor block read from the flash.
+ * Returns 1 if FLCOMP was changed, 0 if not and -1 on error.
+ */
+static int
+descriptor_edit(
+	uint8_t * const buf,
+	uint64_t size,
+	const char * const spec
+)
+{
+	flash_descriptor_t fd;
+	if (descriptor_find(&fd, buf, size) < 0
+	||  fd.fcba == 0
+	||  (uint64_t) fd.fcba + 4 > size)
+	{
+		fprintf(stderr, "no flash descriptor\n");
+		return -1;
+	}
+
+	uint32_t chips[FD_MAX_CHIPS];
+	const unsigned num_chips = descriptor_chips(&fd, buf, size,
+		chips, FD_MAX_CHIPS);
+	const uint32_t old = descriptor_flcomp(&fd, buf, size);
+	const int version = descriptor_version(old);
+	uint32_t flcomp = old;
+
+	for (unsigned i = 0 ; i < num_chips ; i++)
+	{
+		const flash_chip_t * const chip = descriptor_chip_lookup(chips[i]);
+		printf("VSCC chip %u: %06x %s\n", i, chips[i],
+			chip ? chip->name : "(unknown)");
+	}
+
+	if (spec && flcomp_edit(&flcomp, version, spec, chips, num_chips) < 0)
+		return -1;
+
+	flcomp_print(flcomp, version);
+	if (flcomp == old)
+		return 0;
+
+	if (verbose)
+		fprintf(stderr, "FLCOMP %08x -> %08x\n", old, flcomp);
+	memcpy(buf + fd.fcba, &flcomp, sizeof(flcomp));
+	return 1;
+}
+
+
+// Only the descriptor block is read and, if FLCOMP changes, reprogrammed
+static int
+descriptor_spi(
+	spiflash_t * const sp,
+	const char * const spec
+)
+{
+	uint8_t old[FD_DESCRIPTOR_SIZE];
+	uint8_t new[FD_DESCRIPTOR_SIZE];
+
+	if (spiflash_read(sp, 0, old, sizeof(old)) < 0)
+	{
+		fprintf(stderr, "spiflash_read(descriptor) failed?\n");
+		return EXIT_FAILURE;
+	}
+
+	memcpy(new, old, sizeof(new));
+	const int rc = descriptor_edit(new, sizeof(new), spec);
+	if (rc <= 0)
+		return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	if (spiflash_write_enable(sp) < 0)
+	{
+		fprintf(stderr, "spiflash: unable to enable writes\n");
+		return EXIT_FAILURE;
+	}
+
+	if (spiflash_program_delta(sp, 0, old, new, sizeof(new)) < 0)
+	{
+		fprintf(stderr, "descriptor write failed!"
+			" (is the descriptor region locked?)\n");
+		return EXIT_FAILURE;
+	}
+
+	if (verbose)
+		printf("success! the new clocks take effect at the next reset\n");
+
+	return EXIT_SUCCESS;
+}
+
 
 int
 main(
@@ -233,12 +902,19 @@ main(
 	uint16_t bios_cntl = 0;
 	int do_flockdn = 0;
 	int do_prr = 0;
+	int do_descriptor = 0;
+	const char * flcomp_spec = NULL;
+	const char * romname = NULL;
+	int read_config = -1;
+	int do_benchmark = 0;
+	const char * verify_name = NULL;
+	mask_spec_t mask_spec = {};
 
 	spiflash_t * sp = calloc(1, sizeof(*sp));
 	if (!sp)
 		return EXIT_FAILURE;
 
-	while ((opt = getopt_long(argc, argv, "h?fviO:n:r:w:p:0:1:2:3:4:F:B:", long_options, NULL)) != -1)
+	while ((opt = getopt_long(argc, argv, "h?fviO:n:r:w:p:0:1:2:3:4:F:B:S:b:P:DC:o:R:TV:x:X:", long_options, NULL)) != -1)
 	{
 		switch(opt)
 		{
@@ -279,6 +955,50 @@ main(
 			do_write = 1;
 			filename = optarg;
 			break;
+		case 'S':
+			store = optarg;
+			break;
+		case 'b':
+			store_block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			capsule_payload = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			do_descriptor = 1;
+			break;
+		case 'C':
+			do_descriptor = 1;
+			flcomp_spec = optarg;
+			break;
+		case 'o':
+			romname = optarg;
+			break;
+		case 'R':
+			read_config = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			do_benchmark = 1;
+			break;
+		case 'V':
+			verify_name = optarg;
+			break;
+		case 'x':
+			if (mask_spec_add(&mask_spec, optarg) < 0)
+			{
+				fprintf(stderr, "%s: bad mask rule '%s'\n",
+					prog_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'X':
+			if (mask_spec_load(&mask_spec, optarg) < 0)
+			{
+				fprintf(stderr, "%s: bad mask file '%s'\n",
+					prog_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
 		case '?': case 'h':
 			printf("%s", usage);
 			return EXIT_SUCCESS;
@@ -296,6 +1016,28 @@ main(
 		return EXIT_FAILURE;
 	}
 
+	if (romname && !do_descriptor)
+	{
+		fprintf(stderr, "-o is only for the descriptor options\n");
+		return EXIT_FAILURE;
+	}
+
+	if (romname)
+	{
+		// an image is changed in place
+		uint64_t size;
+		uint8_t * const rom = map_file(romname, &size, flcomp_spec == NULL);
+		if (!rom)
+		{
+			fprintf(stderr, "%s: %s\n", romname,
+				errno ? strerror(errno) : "empty file");
+			return EXIT_FAILURE;
+		}
+
+		return descriptor_edit(rom, size, flcomp_spec) < 0
+			? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
 	sp->verbose = verbose;
 
 	if (spiflash_init(sp, pcie_xbar) < 0)
@@ -335,6 +1077,26 @@ main(
 		return EXIT_SUCCESS;
 	}
 
+	if (do_descriptor)
+		return descriptor_spi(sp, flcomp_spec);
+
+	if (do_benchmark)
+		return benchmark_window(sp, length);
+
+	if (read_config >= 0)
+	{
+		if (spiflash_set_read_config(sp, read_config) < 0)
+		{
+			fprintf(stderr, "SPI read configuration %d could not be set\n",
+				read_config);
+			return EXIT_FAILURE;
+		}
+
+		if (verbose)
+			spiflash_info(sp);
+		return EXIT_SUCCESS;
+	}
+
 	if (show_info)
 	{
 		// we're not flashing, we're just reading the info
@@ -354,12 +1116,15 @@ main(
 	}
 
 
-	if (do_read && do_write)
+	if (do_read + do_write + (verify_name != NULL) > 1)
 	{
-		fprintf(stderr, "Only one of read or write may be used\n");
+		fprintf(stderr, "Only one of read, write or verify may be used\n");
 		return EXIT_FAILURE;
 	}
 
+	if (verify_name)
+		return verify_spi(sp, verify_name, offset, &mask_spec);
+
 	if (do_read)
 		return read_from_spi(sp, filename, offset, length);
 
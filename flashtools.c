@@ -0,0 +1,462 @@
+/** \file
+ * libflashtools handle based API.
+ *
+ * See flashtools.h; this file only wraps the per-module routines
+ * with ownership and error codes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "flashtools.h"
+#include "pciexbar.h"
+
+typedef enum {
+	ROM_BUFFER,
+	ROM_FILE,
+	ROM_PHYSICAL,
+} rom_kind_t;
+
+struct ft_rom {
+	const allocator_t * alloc;
+	rom_kind_t kind;
+	uint8_t * data;
+	uint64_t size;
+	int writable;
+};
+
+struct ft_flash {
+	const allocator_t * alloc;
+	spiflash_t sp;
+};
+
+
+const char *
+ft_strerror(
+	ft_err_t err
+)
+{
+	switch (err)
+	{
+	case FT_OK: return "success";
+	case FT_ERR_NOMEM: return "out of memory";
+	case FT_ERR_IO: return "I/O error";
+	case FT_ERR_INVALID: return "invalid argument";
+	case FT_ERR_RANGE: return "out of range";
+	case FT_ERR_FORMAT: return "unrecognized image format";
+	case FT_ERR_NOT_FOUND: return "not found";
+	case FT_ERR_FLASH: return "flash controller error";
+	case FT_ERR_READONLY: return "read only";
+	}
+
+	return "unknown error";
+}
+
+
+static ft_err_t
+rom_alloc(
+	ft_rom_t ** const rom,
+	const allocator_t * const alloc
+)
+{
+	ft_rom_t * const r = allocator_realloc(alloc, NULL, sizeof(*r));
+	if (r == NULL)
+		return FT_ERR_NOMEM;
+
+	memset(r, 0, sizeof(*r));
+	r->alloc = alloc;
+	*rom = r;
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_rom_open_file(
+	ft_rom_t ** const rom,
+	const char * const path,
+	int writable,
+	const allocator_t * const alloc
+)
+{
+	if (rom == NULL || path == NULL)
+		return FT_ERR_INVALID;
+
+	uint64_t size;
+	uint8_t * const data = map_file(path, &size, !writable);
+	if (data == NULL)
+		return errno ? FT_ERR_IO : FT_ERR_FORMAT;
+
+	ft_err_t err = rom_alloc(rom, alloc);
+	if (err != FT_OK)
+	{
+		munmap(data, size);
+		return err;
+	}
+
+	(*rom)->kind = ROM_FILE;
+	(*rom)->data = data;
+	(*rom)->size = size;
+	(*rom)->writable = writable;
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_rom_open_physical(
+	ft_rom_t ** const rom,
+	uint64_t phys_addr,
+	size_t len,
+	const allocator_t * const alloc
+)
+{
+	if (rom == NULL || len == 0)
+		return FT_ERR_INVALID;
+
+	uint8_t * const data = map_physical(phys_addr, len);
+	if (data == NULL)
+		return FT_ERR_IO;
+
+	ft_err_t err = rom_alloc(rom, alloc);
+	if (err != FT_OK)
+	{
+		unmap_physical(data, len);
+		return err;
+	}
+
+	// physical windows are read only; writes go through ft_flash
+	(*rom)->kind = ROM_PHYSICAL;
+	(*rom)->data = data;
+	(*rom)->size = len;
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_rom_open_buffer(
+	ft_rom_t ** const rom,
+	void * const buf,
+	size_t len,
+	int writable,
+	const allocator_t * const alloc
+)
+{
+	if (rom == NULL || buf == NULL)
+		return FT_ERR_INVALID;
+
+	ft_err_t err = rom_alloc(rom, alloc);
+	if (err != FT_OK)
+		return err;
+
+	(*rom)->kind = ROM_BUFFER;
+	(*rom)->data = buf;
+	(*rom)->size = len;
+	(*rom)->writable = writable;
+	return FT_OK;
+}
+
+
+void
+ft_rom_close(
+	ft_rom_t * const rom
+)
+{
+	if (rom == NULL)
+		return;
+
+	if (rom->kind == ROM_FILE)
+		munmap(rom->data, rom->size);
+	else
+	if (rom->kind == ROM_PHYSICAL)
+		unmap_physical(rom->data, rom->size);
+
+	allocator_free(rom->alloc, rom);
+}
+
+
+uint8_t *
+ft_rom_data(
+	const ft_rom_t * const rom,
+	uint64_t * const size
+)
+{
+	if (size)
+		*size = rom->size;
+	return rom->data;
+}
+
+
+ft_err_t
+ft_rom_read(
+	const ft_rom_t * const rom,
+	uint64_t offset,
+	void * const buf,
+	size_t len
+)
+{
+	if (offset > rom->size || len > rom->size - offset)
+		return FT_ERR_RANGE;
+
+	memcpy(buf, rom->data + offset, len);
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_rom_write(
+	ft_rom_t * const rom,
+	uint64_t offset,
+	const void * const buf,
+	size_t len
+)
+{
+	if (!rom->writable)
+		return FT_ERR_READONLY;
+	if (offset > rom->size || len > rom->size - offset)
+		return FT_ERR_RANGE;
+
+	memcpy(rom->data + offset, buf, len);
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_cbfs_index(
+	const ft_rom_t * const rom,
+	cbfs_index_t * const idx
+)
+{
+	errno = 0;
+	if (cbfs_index_build(idx, rom->data, rom->size, rom->alloc) == 0)
+		return FT_OK;
+
+	// otherwise the master header was not found
+	return errno == ENOMEM ? FT_ERR_NOMEM : FT_ERR_FORMAT;
+}
+
+
+ft_err_t
+ft_uefi_index(
+	const ft_rom_t * const rom,
+	uefi_index_t * const idx
+)
+{
+	if (uefi_index_build(idx, rom->data, rom->size, rom->alloc) < 0)
+		return FT_ERR_NOMEM;
+	if (idx->num_volumes == 0)
+		return FT_ERR_FORMAT;
+
+	return FT_OK;
+}
+
+
+const cbfs_entry_t *
+ft_cbfs_find(
+	const cbfs_index_t * const idx,
+	const char * const name
+)
+{
+	for (size_t i = 0 ; i < idx->num_files ; i++)
+		if (strcmp(idx->files[i].name, name) == 0)
+			return &idx->files[i];
+
+	return NULL;
+}
+
+
+const uefi_file_t *
+ft_uefi_find(
+	const uefi_index_t * const idx,
+	const uint8_t guid[16]
+)
+{
+	for (size_t i = 0 ; i < idx->num_files ; i++)
+		if (memcmp(idx->files[i].guid, guid, 16) == 0)
+			return &idx->files[i];
+
+	return NULL;
+}
+
+
+ft_err_t
+ft_flash_open(
+	ft_flash_t ** const flash,
+	uint64_t pcie_xbar,
+	const allocator_t * const alloc
+)
+{
+	if (flash == NULL)
+		return FT_ERR_INVALID;
+
+	ft_flash_t * const f = allocator_realloc(alloc, NULL, sizeof(*f));
+	if (f == NULL)
+		return FT_ERR_NOMEM;
+
+	memset(f, 0, sizeof(*f));
+	f->alloc = alloc;
+
+	if (spiflash_init(&f->sp, pcie_xbar ? pcie_xbar : PCIEXBAR) < 0)
+	{
+		spiflash_fini(&f->sp);
+		allocator_free(alloc, f);
+		return FT_ERR_IO;
+	}
+
+	*flash = f;
+	return FT_OK;
+}
+
+
+void
+ft_flash_close(
+	ft_flash_t * const flash
+)
+{
+	if (flash == NULL)
+		return;
+
+	spiflash_fini(&flash->sp);
+	allocator_free(flash->alloc, flash);
+}
+
+
+spiflash_t *
+ft_flash_spi(
+	ft_flash_t * const flash
+)
+{
+	return &flash->sp;
+}
+
+
+ft_err_t
+ft_flash_region(
+	ft_flash_t * const flash,
+	unsigned region,
+	uint32_t * const base,
+	uint32_t * const limit
+)
+{
+	if (spiflash_region(&flash->sp, region, base, limit) < 0)
+		return FT_ERR_NOT_FOUND;
+
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_flash_read(
+	ft_flash_t * const flash,
+	uint32_t fladdr,
+	void * const buf,
+	size_t len
+)
+{
+	if (len > UINT32_MAX - fladdr)
+		return FT_ERR_RANGE;
+	if (spiflash_read(&flash->sp, fladdr, buf, len) < 0)
+		return FT_ERR_FLASH;
+
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_flash_readv(
+	ft_flash_t * const flash,
+	spiflash_iovec_t * const iov,
+	size_t count
+)
+{
+	if (count > UINT32_MAX)
+		return FT_ERR_INVALID;
+
+	for (size_t i = 0 ; i < count ; i++)
+		if (iov[i].len > UINT32_MAX - iov[i].fladdr)
+			return FT_ERR_RANGE;
+
+	if (spiflash_readv(&flash->sp, iov, count) < 0)
+		return FT_ERR_FLASH;
+
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_flash_write_enable(
+	ft_flash_t * const flash
+)
+{
+	if (spiflash_write_enable(&flash->sp) < 0)
+		return FT_ERR_READONLY;
+
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_flash_program_delta(
+	ft_flash_t * const flash,
+	uint32_t fladdr,
+	const void * const old,
+	const void * const new,
+	size_t len,
+	unsigned * const blocks
+)
+{
+	if (len > UINT32_MAX - fladdr)
+		return FT_ERR_RANGE;
+
+	const int rc = spiflash_program_delta(&flash->sp, fladdr, old, new, len);
+	if (rc < 0)
+		return FT_ERR_FLASH;
+
+	if (blocks)
+		*blocks = rc;
+	return FT_OK;
+}
+
+
+ft_err_t
+ft_phys_read(
+	uint64_t phys_addr,
+	void * const buf,
+	size_t len,
+	size_t width
+)
+{
+	if (width == 0 || len % width != 0)
+		return FT_ERR_INVALID;
+
+	volatile void * const mem = map_physical(phys_addr, len);
+	if (mem == NULL)
+		return FT_ERR_IO;
+
+	const int rc = memcpy_width(buf, mem, len, width, MEM_SET);
+	unmap_physical(mem, len);
+
+	return rc < 0 ? FT_ERR_INVALID : FT_OK;
+}
+
+
+ft_err_t
+ft_phys_write(
+	uint64_t phys_addr,
+	const void * const buf,
+	size_t len,
+	size_t width,
+	mem_op_t op
+)
+{
+	if (width == 0 || len % width != 0)
+		return FT_ERR_INVALID;
+
+	volatile void * const mem = map_physical(phys_addr, len);
+	if (mem == NULL)
+		return FT_ERR_IO;
+
+	const int rc = memcpy_width(mem, buf, len, width, op);
+	unmap_physical(mem, len);
+
+	return rc < 0 ? FT_ERR_INVALID : FT_OK;
+}
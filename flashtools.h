@@ -0,0 +1,225 @@
+/** \file
+ * libflashtools: embeddable interface to the flash tools.
+ *
+ * The command line tools are thin wrappers around the same objects
+ * that make up libflashtools.a and libflashtools.so.  The ft_ calls
+ * never exit: every call returns an ft_err_t, the state of an image
+ * or flash lives in the handle that the caller owns, and heap memory
+ * comes from the allocator passed in at open time (NULL uses libc).
+ * Distinct handles may be used from different threads.
+ *
+ * Besides the ft_ calls, libflashtools.so exports only the spiflash_,
+ * cbfs_index_ and uefi_index_ functions that go with the types above;
+ * the static archive carries every object that the tools share.
+ * Those lower level objects are not as quiet:
+ *
+ * - spiflash, which the flash handles call, writes diagnostics to
+ *   stderr, some of them always; spiflash_info() prints to stdout
+ * - cpu_has_sha() caches the CPUID answer in a static
+ * - mmio_trace keeps process wide state: the simulated controller
+ *   that spireplay drives and, when a TRACE=1 build records flash
+ *   accesses, the trace file and regions, closed with atexit()
+ */
+#ifndef _flashtools_h_
+#define _flashtools_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "util.h"
+#include "spiflash.h"
+#include "cbfs_index.h"
+#include "uefi_index.h"
+
+typedef enum {
+	FT_OK = 0,
+	FT_ERR_NOMEM = -1,
+	FT_ERR_IO = -2,         // errno has the reason
+	FT_ERR_INVALID = -3,    // bad argument
+	FT_ERR_RANGE = -4,      // offset or length outside the image
+	FT_ERR_FORMAT = -5,     // no CBFS or UEFI structures found
+	FT_ERR_NOT_FOUND = -6,
+	FT_ERR_FLASH = -7,      // SPI controller reported a failure
+	FT_ERR_READONLY = -8,
+} ft_err_t;
+
+extern const char *
+ft_strerror(
+	ft_err_t err
+);
+
+
+/*
+ * ROM images: a file mapping, a physical memory window or a caller
+ * buffer.  The data is never copied; the indexes below point into it.
+ */
+typedef struct ft_rom ft_rom_t;
+
+extern ft_err_t
+ft_rom_open_file(
+	ft_rom_t ** rom,
+	const char * path,
+	int writable,
+	const allocator_t * alloc
+);
+
+extern ft_err_t
+ft_rom_open_physical(
+	ft_rom_t ** rom,
+	uint64_t phys_addr,
+	size_t len,
+	const allocator_t * alloc
+);
+
+// buf must outlive the handle
+extern ft_err_t
+ft_rom_open_buffer(
+	ft_rom_t ** rom,
+	void * buf,
+	size_t len,
+	int writable,
+	const allocator_t * alloc
+);
+
+extern void
+ft_rom_close(
+	ft_rom_t * rom
+);
+
+extern uint8_t *
+ft_rom_data(
+	const ft_rom_t * rom,
+	uint64_t * size
+);
+
+extern ft_err_t
+ft_rom_read(
+	const ft_rom_t * rom,
+	uint64_t offset,
+	void * buf,
+	size_t len
+);
+
+extern ft_err_t
+ft_rom_write(
+	ft_rom_t * rom,
+	uint64_t offset,
+	const void * buf,
+	size_t len
+);
+
+
+/*
+ * Component indexes over an open ROM.  Free them with the
+ * matching cbfs_index_free() or uefi_index_free().
+ */
+extern ft_err_t
+ft_cbfs_index(
+	const ft_rom_t * rom,
+	cbfs_index_t * idx
+);
+
+extern ft_err_t
+ft_uefi_index(
+	const ft_rom_t * rom,
+	uefi_index_t * idx
+);
+
+extern const cbfs_entry_t *
+ft_cbfs_find(
+	const cbfs_index_t * idx,
+	const char * name
+);
+
+extern const uefi_file_t *
+ft_uefi_find(
+	const uefi_index_t * idx,
+	const uint8_t guid[16]
+);
+
+
+/*
+ * SPI flash controller sessions.
+ */
+typedef struct ft_flash ft_flash_t;
+
+// pcie_xbar of 0 uses the compiled in PCIEXBAR
+extern ft_err_t
+ft_flash_open(
+	ft_flash_t ** flash,
+	uint64_t pcie_xbar,
+	const allocator_t * alloc
+);
+
+extern void
+ft_flash_close(
+	ft_flash_t * flash
+);
+
+// The underlying driver handle, for the spiflash_* calls
+extern spiflash_t *
+ft_flash_spi(
+	ft_flash_t * flash
+);
+
+extern ft_err_t
+ft_flash_region(
+	ft_flash_t * flash,
+	unsigned region,
+	uint32_t * base,
+	uint32_t * limit
+);
+
+extern ft_err_t
+ft_flash_read(
+	ft_flash_t * flash,
+	uint32_t fladdr,
+	void * buf,
+	size_t len
+);
+
+// Scatter read; iov is sorted in place, see spiflash_readv
+extern ft_err_t
+ft_flash_readv(
+	ft_flash_t * flash,
+	spiflash_iovec_t * iov,
+	size_t count
+);
+
+extern ft_err_t
+ft_flash_write_enable(
+	ft_flash_t * flash
+);
+
+// Erase and program only the erase blocks where old and new differ
+extern ft_err_t
+ft_flash_program_delta(
+	ft_flash_t * flash,
+	uint32_t fladdr,
+	const void * old,
+	const void * new,
+	size_t len,
+	unsigned * blocks
+);
+
+
+/*
+ * Physical memory access at a fixed bus width (1, 2, 4 or 8).
+ */
+extern ft_err_t
+ft_phys_read(
+	uint64_t phys_addr,
+	void * buf,
+	size_t len,
+	size_t width
+);
+
+extern ft_err_t
+ft_phys_write(
+	uint64_t phys_addr,
+	const void * buf,
+	size_t len,
+	size_t width,
+	mem_op_t op
+);
+
+#endif
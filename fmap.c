@@ -0,0 +1,92 @@
+/** \file
+ * Flash map parsing.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "fmap.h"
+
+
+static int
+fmap_valid(
+	const uint8_t * const rom,
+	uint64_t size,
+	uint64_t offset
+)
+{
+	if (offset + sizeof(struct fmap) > size)
+		return 0;
+
+	const struct fmap * const fmap = (const void *)(rom + offset);
+	if (memcmp(fmap->signature, FMAP_SIGNATURE, 8) != 0
+	||  fmap->ver_major != FMAP_VER_MAJOR)
+		return 0;
+
+	// the signature string also appears in the code that looks
+	// for it, so require the area table to fit in the image
+	const uint64_t len = sizeof(*fmap)
+		+ fmap->nareas * (uint64_t) sizeof(struct fmap_area);
+	return fmap->nareas != 0 && offset + len <= size;
+}
+
+
+int64_t
+fmap_find(
+	const void * const rom_ptr,
+	uint64_t size
+)
+{
+	const uint8_t * const rom = rom_ptr;
+	uint64_t offset = 0;
+
+	while (offset < size)
+	{
+		const uint8_t * const p = memchr(rom + offset, '_', size - offset);
+		if (!p)
+			break;
+
+		offset = p - rom;
+		if (fmap_valid(rom, size, offset))
+			return offset;
+		offset++;
+	}
+
+	return -1;
+}
+
+
+int
+fmap_area(
+	const void * const rom,
+	uint64_t size,
+	const char * const name,
+	uint64_t * const offset,
+	uint64_t * const len
+)
+{
+	const int64_t fmap_offset = fmap_find(rom, size);
+	if (fmap_offset < 0)
+		return -1;
+
+	const struct fmap * const fmap = (const void *)
+		((const uint8_t *) rom + fmap_offset);
+
+	// a BIOS region dump is the top of the chip
+	const uint64_t missing = fmap->size > size ? fmap->size - size : 0;
+
+	for (unsigned i = 0 ; i < fmap->nareas ; i++)
+	{
+		const struct fmap_area * const area = &fmap->areas[i];
+		if (strncmp((const char *) area->name, name, FMAP_NAME_LEN) != 0)
+			continue;
+
+		if (area->offset < missing
+		||  area->offset - missing + (uint64_t) area->size > size)
+			return -1;
+
+		*offset = area->offset - missing;
+		*len = area->size;
+		return 0;
+	}
+
+	return -1;
+}
@@ -0,0 +1,62 @@
+/** \file
+ * Flash map parsing.
+ *
+ * coreboot and ChromeOS images carry an FMAP that names the areas of
+ * the flash chip: the read-only and read-write CBFS copies, the MRC
+ * training cache, the SMMSTORE and event log, and so on.  The area
+ * offsets are relative to the start of the chip, so for a dump of
+ * only the BIOS region they are moved down by the part of the chip
+ * that is missing from the dump.
+ */
+#ifndef _fmap_h_
+#define _fmap_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FMAP_SIGNATURE "__FMAP__"
+#define FMAP_VER_MAJOR 1
+#define FMAP_NAME_LEN 32
+
+struct fmap_area {
+	uint32_t offset;                // from the start of the chip
+	uint32_t size;
+	uint8_t name[FMAP_NAME_LEN];
+	uint16_t flags;
+} __attribute__((__packed__));
+
+struct fmap {
+	uint8_t signature[8];
+	uint8_t ver_major;
+	uint8_t ver_minor;
+	uint64_t base;                  // physical address of the chip
+	uint32_t size;                  // of the chip
+	uint8_t name[FMAP_NAME_LEN];
+	uint16_t nareas;
+	struct fmap_area areas[];
+} __attribute__((__packed__));
+
+
+// Offset of the FMAP in the image, or -1 if there is none
+extern int64_t
+fmap_find(
+	const void * rom,
+	uint64_t size
+);
+
+
+/*
+ * Offset and length in the image of a named area.  Returns -1 if
+ * there is no FMAP, no area of that name, or the area is not inside
+ * the image.
+ */
+extern int
+fmap_area(
+	const void * rom,
+	uint64_t size,
+	const char * name,
+	uint64_t * offset,
+	uint64_t * len
+);
+
+#endif
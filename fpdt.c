@@ -0,0 +1,571 @@
+/** \file
+ * Report the UEFI boot performance records from the ACPI FPDT.
+ *
+ * The Firmware Performance Data Table holds pointers to two tables
+ * in reserved memory: the basic boot performance table, with the end
+ * of reset and the times that the OS loader was loaded and started
+ * and called ExitBootServices, and the S3 performance table, with the
+ * last suspend and the resume times.  The FPDT is read from sysfs if
+ * the kernel exports it, otherwise it is found from the RSDP.
+ *
+ * All of the times are in nanoseconds since the platform reset.
+ * With -1 the report is a single line of name=value pairs, in
+ * microseconds, to collect from many machines.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <getopt.h>
+#include "util.h"
+
+#define FPDT_SYSFS "/sys/firmware/acpi/tables/FPDT"
+#define EFI_SYSTAB "/sys/firmware/efi/systab"
+
+#define FPDT_FBPT_POINTER 0x0000
+#define FPDT_S3PT_POINTER 0x0001
+#define FBPT_BOOT_RECORD 0x0002
+#define S3PT_RESUME_RECORD 0x0000
+#define S3PT_SUSPEND_RECORD 0x0001
+
+struct acpi_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((__packed__));
+
+struct acpi_rsdp {
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt;
+	uint32_t length;            // revision 2 and later
+	uint64_t xsdt;
+	uint8_t extended_checksum;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct perf_record {
+	uint16_t type;
+	uint8_t length;
+	uint8_t revision;
+} __attribute__((__packed__));
+
+struct perf_pointer {
+	struct perf_record hdr;
+	uint32_t reserved;
+	uint64_t addr;
+} __attribute__((__packed__));
+
+// the FBPT and S3PT are not ACPI tables, they only have these
+struct perf_table {
+	char signature[4];
+	uint32_t length;
+} __attribute__((__packed__));
+
+struct fbpt_boot {
+	struct perf_record hdr;
+	uint32_t reserved;
+	uint64_t reset_end;
+	uint64_t load_image_start;
+	uint64_t start_image_start;
+	uint64_t exit_boot_services_entry;
+	uint64_t exit_boot_services_exit;
+} __attribute__((__packed__));
+
+struct s3pt_resume {
+	struct perf_record hdr;
+	uint32_t resume_count;
+	uint64_t full_resume;
+	uint64_t average_resume;
+} __attribute__((__packed__));
+
+struct s3pt_suspend {
+	struct perf_record hdr;
+	uint64_t suspend_start;
+	uint64_t suspend_end;
+} __attribute__((__packed__));
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "one-line",		0, NULL, '1' },
+	{ "table",		1, NULL, 'f' },
+	{ "mem",		1, NULL, 'o' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: sudo fpdt [options]\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -1 | --one-line        Print name=value pairs on a single line\n"
+"    -f | --table file      Read the FPDT from a file instead of sysfs\n"
+"    -o | --mem file        Use a physical memory dump instead of /dev/mem\n"
+"\n";
+
+
+/*
+ * Copy a table that starts with its signature and a 32-bit length,
+ * checking the signature before trusting the length.
+ */
+static void *
+copy_table(
+	uint64_t phys,
+	const char * signature
+)
+{
+	const struct perf_table * const hdr = map_window(phys, sizeof(*hdr));
+	if (!hdr)
+		return NULL;
+
+	const int match = memcmp(hdr->signature, signature, 4) == 0;
+	const uint32_t len = hdr->length;
+	unmap_window(hdr, sizeof(*hdr));
+
+	if (!match || len < sizeof(*hdr) || len > 0x100000)
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	const void * const table = map_window(phys, len);
+	if (!table)
+		return NULL;
+
+	void * const copy = malloc(len);
+	if (copy)
+		memcpy(copy, table, len);
+	unmap_window(table, len);
+	return copy;
+}
+
+
+static void *
+read_file(
+	const char * name,
+	size_t * len
+)
+{
+	FILE * const f = fopen(name, "rb");
+	if (!f)
+		return NULL;
+
+	size_t size = 0, cap = 0;
+	uint8_t * buf = NULL;
+	while (1)
+	{
+		if (size == cap)
+		{
+			cap = cap ? 2 * cap : 4096;
+			uint8_t * const nbuf = realloc(buf, cap);
+			if (!nbuf)
+			{
+				free(buf);
+				fclose(f);
+				return NULL;
+			}
+			buf = nbuf;
+		}
+
+		const size_t rc = fread(buf + size, 1, cap - size, f);
+		if (rc == 0)
+			break;
+		size += rc;
+	}
+
+	fclose(f);
+	*len = size;
+	return buf;
+}
+
+
+// The RSDP address from the EFI system table, or the legacy BIOS area
+static uint64_t
+rsdp_find(void)
+{
+	if (!map_window_is_image())
+	{
+		FILE * const f = fopen(EFI_SYSTAB, "r");
+		char line[128];
+		uint64_t addr = 0;
+		while (f && !addr && fgets(line, sizeof(line), f))
+			if (sscanf(line, "ACPI20=%"SCNx64, &addr) != 1)
+				sscanf(line, "ACPI=%"SCNx64, &addr);
+		if (f)
+			fclose(f);
+		if (addr)
+			return addr;
+	}
+
+	const uint64_t base = 0xE0000;
+	const size_t len = 0x20000;
+	const uint8_t * const bios = map_window(base, len);
+	if (!bios)
+		return 0;
+
+	uint64_t addr = 0;
+	for (size_t off = 0 ; off + 20 <= len ; off += 16)
+	{
+		if (memcmp(bios + off, "RSD PTR ", 8) == 0
+		&&  sum8(bios + off, 20) == 0)
+		{
+			addr = base + off;
+			break;
+		}
+	}
+
+	unmap_window(bios, len);
+	return addr;
+}
+
+
+// Walk the XSDT (or RSDT) to the FPDT
+static void *
+fpdt_find(
+	size_t * const len
+)
+{
+	const uint64_t rsdp_addr = rsdp_find();
+	if (!rsdp_addr)
+	{
+		fprintf(stderr, "No RSDP found\n");
+		return NULL;
+	}
+
+	struct acpi_rsdp rsdp;
+	const void * const p = map_window(rsdp_addr, sizeof(rsdp));
+	if (!p)
+		return NULL;
+	memcpy(&rsdp, p, sizeof(rsdp));
+	unmap_window(p, sizeof(rsdp));
+
+	const int use_xsdt = rsdp.revision >= 2 && rsdp.xsdt != 0;
+	const uint64_t sdt_addr = use_xsdt ? rsdp.xsdt : rsdp.rsdt;
+	const size_t entry_size = use_xsdt ? 8 : 4;
+	if (verbose)
+		fprintf(stderr, "RSDP %08"PRIx64": %s %08"PRIx64"\n",
+			rsdp_addr, use_xsdt ? "XSDT" : "RSDT", sdt_addr);
+
+	uint8_t * const sdt = copy_table(sdt_addr, use_xsdt ? "XSDT" : "RSDT");
+	if (!sdt)
+	{
+		fprintf(stderr, "%08"PRIx64": bad root table\n", sdt_addr);
+		return NULL;
+	}
+
+	const uint32_t sdt_len = ((struct acpi_header *) sdt)->length;
+	void * fpdt = NULL;
+	for (size_t off = sizeof(struct acpi_header)
+	;    !fpdt && off + entry_size <= sdt_len
+	;    off += entry_size)
+	{
+		uint64_t addr = 0;
+		memcpy(&addr, sdt + off, entry_size);
+
+		fpdt = copy_table(addr, "FPDT");
+		if (fpdt)
+			*len = ((struct acpi_header *) fpdt)->length;
+	}
+
+	free(sdt);
+	if (!fpdt)
+		fprintf(stderr, "No FPDT in the %s\n", use_xsdt ? "XSDT" : "RSDT");
+	return fpdt;
+}
+
+
+typedef struct {
+	const char * name;
+	uint64_t ns;
+} timing_t;
+
+#define MAX_TIMINGS 16
+
+
+static void
+timing_add(
+	timing_t * const t,
+	unsigned * const n,
+	const char * name,
+	uint64_t ns
+)
+{
+	if (*n < MAX_TIMINGS)
+		t[(*n)++] = (timing_t) { name, ns };
+}
+
+
+static void
+fbpt_decode(
+	const uint8_t * const fbpt,
+	timing_t * const t,
+	unsigned * const n
+)
+{
+	const uint32_t len = ((const struct perf_table *) fbpt)->length;
+
+	for (uint32_t off = sizeof(struct perf_table) ; off + sizeof(struct perf_record) <= len ; )
+	{
+		struct perf_record rec;
+		memcpy(&rec, fbpt + off, sizeof(rec));
+		if (rec.length < sizeof(rec) || rec.length > len - off)
+			break;
+
+		if (rec.type == FBPT_BOOT_RECORD && rec.length >= sizeof(struct fbpt_boot))
+		{
+			struct fbpt_boot b;
+			memcpy(&b, fbpt + off, sizeof(b));
+			timing_add(t, n, "reset_end", b.reset_end);
+			timing_add(t, n, "os_loader_load", b.load_image_start);
+			timing_add(t, n, "os_loader_start", b.start_image_start);
+			timing_add(t, n, "exit_boot_services_entry",
+				b.exit_boot_services_entry);
+			timing_add(t, n, "exit_boot_services_exit",
+				b.exit_boot_services_exit);
+		} else
+		if (verbose)
+			fprintf(stderr, "FBPT: skipping record type %04x\n", rec.type);
+
+		off += rec.length;
+	}
+}
+
+
+static void
+s3pt_decode(
+	const uint8_t * const s3pt,
+	timing_t * const t,
+	unsigned * const n,
+	uint32_t * const resume_count
+)
+{
+	const uint32_t len = ((const struct perf_table *) s3pt)->length;
+
+	for (uint32_t off = sizeof(struct perf_table) ; off + sizeof(struct perf_record) <= len ; )
+	{
+		struct perf_record rec;
+		memcpy(&rec, s3pt + off, sizeof(rec));
+		if (rec.length < sizeof(rec) || rec.length > len - off)
+			break;
+
+		if (rec.type == S3PT_RESUME_RECORD && rec.length >= sizeof(struct s3pt_resume))
+		{
+			struct s3pt_resume r;
+			memcpy(&r, s3pt + off, sizeof(r));
+			*resume_count = r.resume_count;
+			timing_add(t, n, "s3_resume", r.full_resume);
+			timing_add(t, n, "s3_resume_average", r.average_resume);
+		} else
+		if (rec.type == S3PT_SUSPEND_RECORD && rec.length >= sizeof(struct s3pt_suspend))
+		{
+			struct s3pt_suspend s;
+			memcpy(&s, s3pt + off, sizeof(s));
+			timing_add(t, n, "s3_suspend_start", s.suspend_start);
+			timing_add(t, n, "s3_suspend_end", s.suspend_end);
+		} else
+		if (verbose)
+			fprintf(stderr, "S3PT: skipping record type %04x\n", rec.type);
+
+		off += rec.length;
+	}
+}
+
+
+static uint64_t
+timing_get(
+	const timing_t * const t,
+	unsigned n,
+	const char * name
+)
+{
+	for (unsigned i = 0 ; i < n ; i++)
+		if (strcmp(t[i].name, name) == 0)
+			return t[i].ns;
+	return 0;
+}
+
+
+// The time between two events, if the firmware recorded both
+static void
+print_phase(
+	const timing_t * const t,
+	unsigned n,
+	const char * label,
+	const char * from,
+	const char * to
+)
+{
+	const uint64_t start = timing_get(t, n, from);
+	const uint64_t end = timing_get(t, n, to);
+	if (!end || end < start)
+		return;
+
+	printf("  %-26s %12.3f ms\n", label, (end - start) / 1e6);
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	int one_line = 0;
+	const char * table_name = NULL;
+	const char * mem_name = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?v1f:o:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case '1':
+			one_line = 1;
+			break;
+		case 'f':
+			table_name = optarg;
+			break;
+		case 'o':
+			mem_name = optarg;
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	if (mem_name)
+	{
+		if (map_window_image(mem_name) < 0)
+		{
+			perror(mem_name);
+			return EXIT_FAILURE;
+		}
+	}
+
+	size_t fpdt_len = 0;
+	uint8_t * fpdt = NULL;
+	if (table_name)
+	{
+		fpdt = read_file(table_name, &fpdt_len);
+		if (!fpdt)
+		{
+			perror(table_name);
+			return EXIT_FAILURE;
+		}
+	} else
+	if (!map_window_is_image())
+		fpdt = read_file(FPDT_SYSFS, &fpdt_len);
+
+	if (!fpdt)
+		fpdt = fpdt_find(&fpdt_len);
+	if (!fpdt)
+		return EXIT_FAILURE;
+
+	if (fpdt_len < sizeof(struct acpi_header)
+	||  memcmp(fpdt, "FPDT", 4) != 0
+	||  ((struct acpi_header *) fpdt)->length > fpdt_len
+	||  sum8(fpdt, ((struct acpi_header *) fpdt)->length) != 0)
+	{
+		fprintf(stderr, "Bad FPDT\n");
+		return EXIT_FAILURE;
+	}
+
+	timing_t t[MAX_TIMINGS];
+	unsigned n = 0;
+	uint32_t resume_count = 0;
+	int have_s3 = 0;
+
+	const uint32_t len = ((struct acpi_header *) fpdt)->length;
+	for (uint32_t off = sizeof(struct acpi_header) ; off + sizeof(struct perf_record) <= len ; )
+	{
+		struct perf_pointer ptr;
+		memcpy(&ptr, fpdt + off, sizeof(ptr.hdr));
+		if (ptr.hdr.length < sizeof(ptr.hdr) || ptr.hdr.length > len - off)
+			break;
+
+		const int is_fbpt = ptr.hdr.type == FPDT_FBPT_POINTER;
+		const int is_s3pt = ptr.hdr.type == FPDT_S3PT_POINTER;
+		if ((is_fbpt || is_s3pt) && ptr.hdr.length >= sizeof(ptr))
+		{
+			memcpy(&ptr, fpdt + off, sizeof(ptr));
+			const char * const sig = is_fbpt ? "FBPT" : "S3PT";
+			uint8_t * const table = copy_table(ptr.addr, sig);
+
+			if (verbose)
+				fprintf(stderr, "%s %08"PRIx64"\n", sig, ptr.addr);
+
+			if (!table)
+				fprintf(stderr, "%08"PRIx64": bad %s: %s\n",
+					ptr.addr, sig, strerror(errno));
+			else
+			if (is_fbpt)
+				fbpt_decode(table, t, &n);
+			else {
+				s3pt_decode(table, t, &n, &resume_count);
+				have_s3 = 1;
+			}
+
+			free(table);
+		}
+
+		off += ptr.hdr.length;
+	}
+
+	if (one_line)
+	{
+		for (unsigned i = 0 ; i < n ; i++)
+			printf("%s%s=%"PRIu64, i ? " " : "", t[i].name, t[i].ns / 1000);
+		if (have_s3)
+			printf("%ss3_resume_count=%"PRIu32, n ? " " : "", resume_count);
+		printf("\n");
+		return EXIT_SUCCESS;
+	}
+
+	if (n == 0 && !have_s3)
+	{
+		fprintf(stderr, "No boot performance records\n");
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned i = 0 ; i < n ; i++)
+		printf("%-28s %12.3f ms\n", t[i].name, t[i].ns / 1e6);
+	if (have_s3)
+		printf("%-28s %12"PRIu32"\n", "s3_resume_count", resume_count);
+
+	printf("\nphases:\n");
+	print_phase(t, n, "firmware", "reset_end", "os_loader_load");
+	print_phase(t, n, "os loader load", "os_loader_load", "os_loader_start");
+	print_phase(t, n, "os loader", "os_loader_start", "exit_boot_services_entry");
+	print_phase(t, n, "ExitBootServices", "exit_boot_services_entry", "exit_boot_services_exit");
+	print_phase(t, n, "s3 suspend", "s3_suspend_start", "s3_suspend_end");
+
+	return EXIT_SUCCESS;
+}
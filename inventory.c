@@ -0,0 +1,685 @@
+/** \file
+ * Bulk inventory of ROM images.
+ *
+ * Walks directory trees of firmware dumps, maps every image once,
+ * indexes it as CBFS and as UEFI firmware volumes and hashes each
+ * component.  Directories and images are jobs on a work stealing
+ * pool; each finished image is written to stdout as one JSON record
+ * per line as soon as it is done, so the output can be streamed into
+ * another tool while the scan is still running.
+ *
+ * With a mask, the volatile parts of each image are left out of the
+ * image hash and the components inside them are not hashed, so that
+ * dumps of the same build compare equal across a fleet.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "util.h"
+#include "pool.h"
+#include "sha256.h"
+#include "cbfs_index.h"
+#include "uefi_index.h"
+#include "mask.h"
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "threads",		1, NULL, 'j' },
+	{ "min-size",		1, NULL, 'm' },
+	{ "all",		0, NULL, 'a' },
+	{ "mask",		1, NULL, 'x' },
+	{ "mask-file",		1, NULL, 'X' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: inventory [options] path...\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -j | --threads N       Worker threads (default one per CPU)\n"
+"    -m | --min-size N      Skip files smaller than N bytes (default 0x10000)\n"
+"    -a | --all             Also report files with no CBFS or UEFI volumes\n"
+"    -x | --mask RULE,...   Leave volatile parts out of the hashes, see below\n"
+"    -X | --mask-file FILE  Read mask rules from a file, one per line\n"
+"\n"
+"Mask rules:\n"
+"    fmap:NAME              FMAP area, like RW_MRC_CACHE\n"
+"    cbfs:NAME              CBFS file, like mrc.cache\n"
+"    fv:GUID                Firmware volumes with this file system GUID\n"
+"    range:OFFSET:LEN       Byte range of the image\n"
+"\n"
+"Directories are scanned recursively.  One JSON record is written\n"
+"per image:\n"
+"\n"
+"  {\"path\":..., \"size\":..., \"sha256\":...,\n"
+"   \"cbfs\":[{\"name\",\"type\",\"offset\",\"len\",\"sha256\"}...],\n"
+"   \"fv\":[{\"guid\",\"offset\",\"len\"}...],\n"
+"   \"ffs\":[{\"guid\",\"name\",\"type\",\"fv\",\"offset\",\"len\",\"sha256\"}...]}\n"
+"\n"
+"With a mask the image sha256 covers only the unmasked bytes, the\n"
+"record has \"masked\" with the number of masked bytes, and masked\n"
+"components have \"masked\":true in place of their sha256.\n"
+"\n";
+
+
+typedef struct {
+	pool_t * pool;
+	uint64_t min_size;
+	int all;
+	const mask_spec_t * mask_spec;
+	pthread_mutex_t lock; // output and counters
+	unsigned long images;
+	unsigned long skipped;
+	unsigned long errors;
+} inventory_t;
+
+typedef struct {
+	inventory_t * inv;
+	char * path;
+} inventory_job_t;
+
+// output record under construction
+typedef struct {
+	char * buf;
+	size_t len;
+	size_t size;
+} record_t;
+
+
+static void
+record_printf(
+	record_t * const r,
+	const char * fmt,
+	...
+)
+{
+	while (1)
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		const int n = vsnprintf(r->buf + r->len, r->size - r->len, fmt, ap);
+		va_end(ap);
+
+		if (n < 0)
+			return;
+		if ((size_t) n < r->size - r->len)
+		{
+			r->len += n;
+			return;
+		}
+
+		const size_t size = r->size ? r->size * 2 + n : 4096;
+		char * const buf = realloc(r->buf, size);
+		if (!buf)
+		{
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		r->buf = buf;
+		r->size = size;
+	}
+}
+
+
+/*
+ * Length of the UTF-8 sequence at s, or 0 if it is not one:
+ * overlong forms, surrogates and code points past U+10FFFF
+ * are rejected as JSON readers would.
+ */
+static size_t
+utf8_len(
+	const char * const s
+)
+{
+	const unsigned char * const u = (const unsigned char *) s;
+	size_t n;
+	uint32_t cp;
+
+	if (u[0] < 0x80)
+		return 1;
+	else
+	if ((u[0] & 0xE0) == 0xC0)
+	{
+		n = 2;
+		cp = u[0] & 0x1F;
+	} else
+	if ((u[0] & 0xF0) == 0xE0)
+	{
+		n = 3;
+		cp = u[0] & 0x0F;
+	} else
+	if ((u[0] & 0xF8) == 0xF0)
+	{
+		n = 4;
+		cp = u[0] & 0x07;
+	} else
+		return 0;
+
+	for (size_t i = 1 ; i < n ; i++)
+	{
+		// the terminating NUL also stops a truncated sequence
+		if ((u[i] & 0xC0) != 0x80)
+			return 0;
+		cp = cp << 6 | (u[i] & 0x3F);
+	}
+
+	static const uint32_t min_cp[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	if (cp < min_cp[n] || cp > 0x10FFFF
+	|| (cp >= 0xD800 && cp <= 0xDFFF))
+		return 0;
+
+	return n;
+}
+
+
+static void
+record_string(
+	record_t * const r,
+	const char * s
+)
+{
+	record_printf(r, "\"");
+
+	while (*s)
+	{
+		const unsigned char c = *s;
+		const size_t n = utf8_len(s);
+		if (n > 1)
+		{
+			// valid UTF-8 goes through as it is
+			record_printf(r, "%.*s", (int) n, s);
+			s += n;
+			continue;
+		}
+
+		if (c == '"' || c == '\\')
+			record_printf(r, "\\%c", c);
+		else
+		if (c < 0x20 || c >= 0x7F)
+			// controls, and bytes that are not UTF-8 as Latin-1
+			record_printf(r, "\\u%04x", c);
+		else
+			record_printf(r, "%c", c);
+		s++;
+	}
+
+	record_printf(r, "\"");
+}
+
+
+static void
+record_hash(
+	record_t * const r,
+	const uint8_t * const data,
+	uint64_t len
+)
+{
+	uint8_t digest[SHA256_LEN];
+	char hex[2 * SHA256_LEN + 1];
+
+	sha256(data, len, digest);
+	record_printf(r, "\"%s\"", hex_digest(hex, digest, SHA256_LEN));
+}
+
+
+// Hash of the unmasked runs of the image, in order
+static void
+record_hash_masked(
+	record_t * const r,
+	const uint8_t * const rom,
+	uint64_t size,
+	const mask_t * const mask
+)
+{
+	sha256_ctx_t ctx;
+	uint8_t digest[SHA256_LEN];
+	char hex[2 * SHA256_LEN + 1];
+	uint64_t offset = 0;
+	uint64_t len;
+
+	sha256_init(&ctx);
+	while ((offset = mask_next(mask, offset, size, &len)), len != 0)
+	{
+		sha256_update(&ctx, rom + offset, len);
+		offset += len;
+	}
+	sha256_final(&ctx, digest);
+
+	record_printf(r, "\"%s\"", hex_digest(hex, digest, SHA256_LEN));
+}
+
+
+// Hash of a component, or a marker if it is masked
+static void
+record_component_hash(
+	record_t * const r,
+	const uint8_t * const rom,
+	uint64_t offset,
+	uint64_t len,
+	uint64_t data_offset,
+	uint64_t data_len,
+	const mask_t * const mask
+)
+{
+	if (mask_overlaps(mask, offset, len))
+	{
+		record_printf(r, "\"masked\":true");
+		return;
+	}
+
+	record_printf(r, "\"sha256\":");
+	record_hash(r, rom + data_offset, data_len);
+}
+
+
+static int
+record_cbfs(
+	record_t * const r,
+	const uint8_t * const rom,
+	uint64_t size,
+	const mask_t * const mask
+)
+{
+	cbfs_index_t cbfs;
+	if (cbfs_index_build(&cbfs, rom, size, NULL) < 0)
+		return 0;
+
+	record_printf(r, ",\"cbfs\":[");
+
+	int first = 1;
+	for (size_t i = 0 ; i < cbfs.num_files ; i++)
+	{
+		const cbfs_entry_t * const f = &cbfs.files[i];
+		if (f->type == CBFS_COMPONENT_NULL)
+			continue;
+
+		record_printf(r, "%s{\"name\":", first ? "" : ",");
+		record_string(r, f->name);
+		record_printf(r, ",\"type\":%"PRIu32",\"offset\":%"PRIu64
+			",\"len\":%"PRIu32",",
+			f->type, f->offset, f->len);
+		record_component_hash(r, rom,
+			f->offset, f->header_len + (uint64_t) f->len,
+			f->offset + f->header_len, f->len,
+			mask);
+		record_printf(r, "}");
+		first = 0;
+	}
+
+	record_printf(r, "]");
+	cbfs_index_free(&cbfs);
+	return 1;
+}
+
+
+static int
+record_uefi(
+	record_t * const r,
+	const uint8_t * const rom,
+	uint64_t size,
+	const mask_t * const mask
+)
+{
+	uefi_index_t uefi;
+	if (uefi_index_build(&uefi, rom, size, NULL) < 0)
+		return -1;
+
+	const int found = uefi.num_volumes != 0;
+	if (!found)
+		goto done;
+
+	char guid[GUID_STR_LEN];
+
+	record_printf(r, ",\"fv\":[");
+	for (size_t i = 0 ; i < uefi.num_volumes ; i++)
+	{
+		const uefi_volume_t * const v = &uefi.volumes[i];
+		record_printf(r, "%s{\"guid\":\"%s\",\"offset\":%"PRIu64
+			",\"len\":%"PRIu64"}",
+			i ? "," : "",
+			guid_format(guid, v->guid),
+			v->offset, v->len);
+	}
+
+	record_printf(r, "],\"ffs\":[");
+
+	int first = 1;
+	for (size_t i = 0 ; i < uefi.num_files ; i++)
+	{
+		const uefi_file_t * const f = &uefi.files[i];
+		if (f->type == EFI_FV_FILETYPE_FFS_PAD)
+			continue;
+
+		guid_format(guid, f->guid);
+		if (strcmp(guid, EFI_EMPTY_GUID) == 0)
+			continue;
+
+		record_printf(r, "%s{\"guid\":\"%s\",\"name\":",
+			first ? "" : ",", guid);
+		record_string(r, f->name);
+		record_printf(r, ",\"type\":%u,\"fv\":%u,\"offset\":%"PRIu64
+			",\"len\":%"PRIu64",",
+			f->type, f->volume, f->offset, f->len);
+		record_component_hash(r, rom,
+			f->offset, f->len,
+			f->offset + f->header_len, f->len - f->header_len,
+			mask);
+		record_printf(r, "}");
+		first = 0;
+	}
+
+	record_printf(r, "]");
+
+done:
+	uefi_index_free(&uefi);
+	return found;
+}
+
+
+static void
+record_emit(
+	inventory_t * const inv,
+	record_t * const r
+)
+{
+	pthread_mutex_lock(&inv->lock);
+	fwrite(r->buf, 1, r->len, stdout);
+	fflush(stdout);
+	pthread_mutex_unlock(&inv->lock);
+}
+
+
+static void
+inventory_count(
+	inventory_t * const inv,
+	unsigned long * const counter
+)
+{
+	pthread_mutex_lock(&inv->lock);
+	(*counter)++;
+	pthread_mutex_unlock(&inv->lock);
+}
+
+
+static void
+scan_image(
+	void * arg
+)
+{
+	inventory_job_t * const job = arg;
+	inventory_t * const inv = job->inv;
+	record_t r = {};
+
+	record_printf(&r, "{\"path\":");
+	record_string(&r, job->path);
+
+	uint64_t size;
+	const uint8_t * const rom = map_file(job->path, &size, 1);
+	if (!rom)
+	{
+		const int map_errno = errno;
+		if (map_errno == 0)
+		{
+			// empty file
+			inventory_count(inv, &inv->skipped);
+			goto done;
+		}
+
+		record_printf(&r, ",\"error\":");
+		record_string(&r, strerror(map_errno));
+		record_printf(&r, "}\n");
+		record_emit(inv, &r);
+		inventory_count(inv, &inv->errors);
+		goto done;
+	}
+
+	mask_t mask = {};
+	if (mask_resolve(&mask, inv->mask_spec, rom, size) < 0)
+	{
+		perror("mask_resolve");
+		exit(EXIT_FAILURE);
+	}
+
+	record_printf(&r, ",\"size\":%"PRIu64",\"sha256\":", size);
+	if (inv->mask_spec->num_rules)
+	{
+		record_hash_masked(&r, rom, size, &mask);
+		record_printf(&r, ",\"masked\":%"PRIu64, mask_bytes(&mask, size));
+	} else
+		record_hash(&r, rom, size);
+
+	int found = record_cbfs(&r, rom, size, &mask);
+	const int uefi_found = record_uefi(&r, rom, size, &mask);
+	munmap((void *) rom, size);
+	mask_free(&mask);
+
+	if (uefi_found < 0)
+	{
+		record_printf(&r, ",\"error\":\"unable to index the UEFI volumes\"}\n");
+		record_emit(inv, &r);
+		inventory_count(inv, &inv->errors);
+		goto done;
+	}
+	found += uefi_found;
+
+	if (!found && !inv->all)
+	{
+		if (verbose)
+			fprintf(stderr, "%s: no CBFS or UEFI volumes\n", job->path);
+		inventory_count(inv, &inv->skipped);
+		goto done;
+	}
+
+	record_printf(&r, "}\n");
+	record_emit(inv, &r);
+	inventory_count(inv, &inv->images);
+
+done:
+	free(r.buf);
+	free(job->path);
+	free(job);
+}
+
+
+static void scan_path(inventory_t *, char *);
+
+static void
+scan_dir(
+	void * arg
+)
+{
+	inventory_job_t * const job = arg;
+
+	DIR * const dir = opendir(job->path);
+	if (!dir)
+	{
+		fprintf(stderr, "%s: %s\n", job->path, strerror(errno));
+		inventory_count(job->inv, &job->inv->errors);
+		goto done;
+	}
+
+	const size_t dir_len = strlen(job->path);
+	struct dirent * d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+
+		char * const path = malloc(dir_len + strlen(d->d_name) + 2);
+		if (!path)
+		{
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		sprintf(path, "%s/%s", job->path, d->d_name);
+
+		scan_path(job->inv, path);
+	}
+
+	closedir(dir);
+
+done:
+	free(job->path);
+	free(job);
+}
+
+
+/*
+ * Queue a directory walk or an image scan for path; takes
+ * ownership of path.  Symbolic links are not followed so that
+ * a link cycle can not make the walk run forever.
+ */
+static void
+scan_path(
+	inventory_t * const inv,
+	char * const path
+)
+{
+	struct stat st;
+	if (lstat(path, &st) < 0)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		inventory_count(inv, &inv->errors);
+		free(path);
+		return;
+	}
+
+	pool_fn_t fn;
+	if (S_ISDIR(st.st_mode))
+		fn = scan_dir;
+	else
+	if (S_ISREG(st.st_mode) && (uint64_t) st.st_size >= inv->min_size)
+		fn = scan_image;
+	else
+	{
+		free(path);
+		return;
+	}
+
+	inventory_job_t * const job = calloc(1, sizeof(*job));
+	if (!job)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	job->inv = inv;
+	job->path = path;
+
+	if (pool_submit(inv->pool, fn, job) < 0)
+		fn(job);
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * const prog_name = argv[0];
+	unsigned threads = 0;
+	mask_spec_t mask_spec = {};
+	int opt;
+
+	inventory_t inv = {
+		.min_size = 0x10000,
+		.mask_spec = &mask_spec,
+	};
+
+	while ((opt = getopt_long(argc, argv, "h?vj:m:ax:X:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			inv.min_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'a':
+			inv.all = 1;
+			break;
+		case 'x':
+			if (mask_spec_add(&mask_spec, optarg) < 0)
+			{
+				fprintf(stderr, "%s: bad mask rule '%s'\n",
+					prog_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'X':
+			if (mask_spec_load(&mask_spec, optarg) < 0)
+			{
+				fprintf(stderr, "%s: bad mask file '%s'\n",
+					prog_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	inv.pool = pool_create(threads);
+	if (!inv.pool)
+	{
+		fprintf(stderr, "%s: unable to start worker threads\n", prog_name);
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_init(&inv.lock, NULL);
+
+	for (int i = 0 ; i < argc ; i++)
+	{
+		char * const path = malloc(strlen(argv[i]) + 1);
+		if (!path)
+		{
+			perror("malloc");
+			return EXIT_FAILURE;
+		}
+		strcpy(path, argv[i]);
+		scan_path(&inv, path);
+	}
+
+	pool_wait(inv.pool);
+	pool_destroy(inv.pool);
+	pthread_mutex_destroy(&inv.lock);
+
+	if (verbose)
+		fprintf(stderr, "%s: %lu images, %lu skipped, %lu errors\n",
+			prog_name, inv.images, inv.skipped, inv.errors);
+
+	return inv.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
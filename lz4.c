@@ -0,0 +1,310 @@
+/** \file
+ * LZ4 frame compression.
+ *
+ * A greedy single-probe compressor: a hash of the next four bytes
+ * looks up the last position that had the same hash, and a match is
+ * taken whenever the bytes agree.  This is the fast mode of the
+ * reference implementation, which is good enough for ROM payloads and
+ * needs only a small table on the stack.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "lz4.h"
+
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5     // the block must end with literals
+#define LZ4_MF_LIMIT 12         // no match may start this near the end
+#define LZ4_MAX_OFFSET 65535
+
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4 668265263U
+#define XXH_PRIME5 374761393U
+
+
+static uint32_t
+read32(
+	const uint8_t * p
+)
+{
+	uint32_t x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+
+static uint8_t *
+write_le32(
+	uint8_t * p,
+	uint32_t x
+)
+{
+	p[0] = x >> 0;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+	return p + 4;
+}
+
+
+static uint32_t
+rotl32(
+	uint32_t x,
+	unsigned r
+)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+
+static uint32_t
+le32(
+	const uint8_t * p
+)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+// xxHash32, for the frame descriptor checksum
+static uint32_t
+xxh32(
+	const uint8_t * p,
+	size_t len,
+	uint32_t seed
+)
+{
+	const uint8_t * const end = p + len;
+	uint32_t h;
+
+	if (len >= 16)
+	{
+		uint32_t v[4] = {
+			seed + XXH_PRIME1 + XXH_PRIME2,
+			seed + XXH_PRIME2,
+			seed,
+			seed - XXH_PRIME1,
+		};
+
+		while (end - p >= 16)
+		{
+			for (unsigned i = 0 ; i < 4 ; i++, p += 4)
+				v[i] = rotl32(v[i] + le32(p) * XXH_PRIME2, 13)
+					* XXH_PRIME1;
+		}
+
+		h = rotl32(v[0], 1) + rotl32(v[1], 7)
+		  + rotl32(v[2], 12) + rotl32(v[3], 18);
+	} else {
+		h = seed + XXH_PRIME5;
+	}
+
+	h += len;
+
+	for ( ; end - p >= 4 ; p += 4)
+		h = rotl32(h + le32(p) * XXH_PRIME3, 17) * XXH_PRIME4;
+	for ( ; p < end ; p++)
+		h = rotl32(h + *p * XXH_PRIME5, 11) * XXH_PRIME1;
+
+	h ^= h >> 15;
+	h *= XXH_PRIME2;
+	h ^= h >> 13;
+	h *= XXH_PRIME3;
+	h ^= h >> 16;
+	return h;
+}
+
+
+static unsigned
+lz4_hash(
+	uint32_t seq
+)
+{
+	return (seq * XXH_PRIME1) >> (32 - LZ4_HASH_BITS);
+}
+
+
+static uint8_t *
+write_length(
+	uint8_t * out,
+	size_t len
+)
+{
+	for ( ; len >= 255 ; len -= 255)
+		*out++ = 255;
+	*out++ = len;
+	return out;
+}
+
+
+static size_t
+lz4_block_bound(
+	size_t len
+)
+{
+	return len + len / 255 + 16;
+}
+
+
+/*
+ * Compress one block.  The caller provides lz4_block_bound(len) bytes
+ * of output, so there are no bounds checks in the loop.
+ */
+static size_t
+lz4_block_compress(
+	uint8_t * const dst,
+	const uint8_t * const src,
+	const size_t len
+)
+{
+	uint32_t table[1 << LZ4_HASH_BITS];
+	uint8_t * out = dst;
+	size_t anchor = 0;
+	size_t ip = 0;
+
+	memset(table, 0, sizeof(table));
+
+	const size_t match_limit = len > LZ4_LAST_LITERALS
+		? len - LZ4_LAST_LITERALS : 0;
+	const size_t mf_limit = len > LZ4_MF_LIMIT ? len - LZ4_MF_LIMIT : 0;
+
+	while (ip < mf_limit)
+	{
+		const uint32_t seq = read32(src + ip);
+		const unsigned h = lz4_hash(seq);
+		size_t ref = table[h];
+		table[h] = ip;
+
+		if (ref >= ip
+		||  ip - ref > LZ4_MAX_OFFSET
+		||  read32(src + ref) != seq)
+		{
+			// step faster through data that is not compressing
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		// extend the match backwards into the pending literals
+		while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+		{
+			ip--;
+			ref--;
+		}
+
+		size_t match_len = LZ4_MIN_MATCH;
+		while (ip + match_len < match_limit
+		&&     src[ip + match_len] == src[ref + match_len])
+			match_len++;
+
+		const size_t lit_len = ip - anchor;
+		const size_t ml = match_len - LZ4_MIN_MATCH;
+		uint8_t * const token = out++;
+		*token = (lit_len < 15 ? lit_len : 15) << 4
+		       | (ml < 15 ? ml : 15);
+
+		if (lit_len >= 15)
+			out = write_length(out, lit_len - 15);
+		memcpy(out, src + anchor, lit_len);
+		out += lit_len;
+
+		*out++ = (ip - ref) >> 0;
+		*out++ = (ip - ref) >> 8;
+
+		if (ml >= 15)
+			out = write_length(out, ml - 15);
+
+		ip += match_len;
+		anchor = ip;
+
+		// let the next search find the end of this match
+		if (ip - 2 < mf_limit)
+			table[lz4_hash(read32(src + ip - 2))] = ip - 2;
+	}
+
+	// the remaining input is the last literal run
+	const size_t lit_len = len - anchor;
+	*out++ = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		out = write_length(out, lit_len - 15);
+	memcpy(out, src + anchor, lit_len);
+	out += lit_len;
+
+	return out - dst;
+}
+
+
+size_t
+lz4_frame_bound(
+	size_t len
+)
+{
+	// header, stored blocks with their sizes, end mark
+	const size_t blocks = (len + LZ4_BLOCK_MAX - 1) / LZ4_BLOCK_MAX;
+	return 7 + len + 4 * blocks + 4;
+}
+
+
+size_t
+lz4_frame_compress(
+	void * const dst_ptr,
+	const size_t dst_len,
+	const void * const src_ptr,
+	const size_t len
+)
+{
+	uint8_t * const dst = dst_ptr;
+	const uint8_t * const src = src_ptr;
+	uint8_t * const dst_end = dst + dst_len;
+	uint8_t * out = dst;
+
+	if (dst_len < 7 + 4)
+		return 0;
+
+	// version 01, independent blocks, 4 MB maximum block size
+	out = write_le32(out, LZ4_FRAME_MAGIC);
+	out[0] = 0x60;
+	out[1] = 0x70;
+	out[2] = xxh32(out, 2, 0) >> 8;
+	out += 3;
+
+	// incompressible blocks are written directly, the others
+	// go through a scratch buffer that has room for the worst case
+	uint8_t * const block = malloc(lz4_block_bound(
+		len < LZ4_BLOCK_MAX ? len : LZ4_BLOCK_MAX));
+	if (!block)
+		return 0;
+
+	size_t pos = 0;
+	while (pos < len)
+	{
+		const size_t n = len - pos < LZ4_BLOCK_MAX
+			? len - pos : LZ4_BLOCK_MAX;
+		const size_t clen = lz4_block_compress(block, src + pos, n);
+
+		if (clen < n)
+		{
+			if ((size_t)(dst_end - out) < 4 + clen + 4)
+				break;
+			out = write_le32(out, clen);
+			memcpy(out, block, clen);
+			out += clen;
+		} else {
+			if ((size_t)(dst_end - out) < 4 + n + 4)
+				break;
+			out = write_le32(out, n | 0x80000000);
+			memcpy(out, src + pos, n);
+			out += n;
+		}
+
+		pos += n;
+	}
+
+	free(block);
+	if (pos < len)
+		return 0;
+
+	out = write_le32(out, 0);
+	return out - dst;
+}
@@ -0,0 +1,37 @@
+/** \file
+ * LZ4 frame compression, in the format that coreboot's CBFS loader
+ * decompresses: independent 4 MB blocks, no block or content
+ * checksums.
+ */
+#ifndef _lz4_h_
+#define _lz4_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define LZ4_BLOCK_MAX 0x400000
+
+
+// Worst case size of the frame for len bytes of input
+extern size_t
+lz4_frame_bound(
+	size_t len
+);
+
+
+/*
+ * Compress len bytes of src into a frame at dst.  Returns the size of
+ * the frame, or 0 if it does not fit in dst_len bytes.  Blocks that
+ * do not compress are stored, so the frame is never more than
+ * lz4_frame_bound(len) bytes.
+ */
+extern size_t
+lz4_frame_compress(
+	void * dst,
+	size_t dst_len,
+	const void * src,
+	size_t len
+);
+
+#endif
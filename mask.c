@@ -0,0 +1,398 @@
+/** \file
+ * Masks for the volatile parts of a ROM image.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "mask.h"
+#include "fmap.h"
+#include "cbfs_index.h"
+#include "uefi_index.h"
+
+
+static int
+mask_rule_parse(
+	mask_rule_t * const rule,
+	const char * const s,
+	size_t len
+)
+{
+	static const struct {
+		const char * prefix;
+		mask_kind_t kind;
+	} kinds[] = {
+		{ "fmap:", MASK_FMAP },
+		{ "cbfs:", MASK_CBFS },
+		{ "fv:", MASK_FV },
+		{ "range:", MASK_RANGE },
+	};
+
+	char arg[MASK_NAME_LEN];
+	memset(rule, 0, sizeof(*rule));
+
+	for (unsigned i = 0 ; i < sizeof(kinds)/sizeof(*kinds) ; i++)
+	{
+		const size_t prefix_len = strlen(kinds[i].prefix);
+		if (len <= prefix_len
+		||  strncmp(s, kinds[i].prefix, prefix_len) != 0)
+			continue;
+		if (len - prefix_len >= sizeof(arg))
+			return -1;
+
+		memcpy(arg, s + prefix_len, len - prefix_len);
+		arg[len - prefix_len] = '\0';
+		rule->kind = kinds[i].kind;
+
+		switch (rule->kind)
+		{
+		case MASK_FMAP:
+		case MASK_CBFS:
+			strcpy(rule->name, arg);
+			return 0;
+		case MASK_FV:
+			return guid_parse(arg, rule->guid);
+		case MASK_RANGE: {
+			char * end;
+			rule->offset = strtoull(arg, &end, 0);
+			if (*end != ':')
+				return -1;
+			rule->len = strtoull(end + 1, &end, 0);
+			return *end != '\0' || rule->len == 0 ? -1 : 0;
+		}
+		}
+	}
+
+	return -1;
+}
+
+
+int
+mask_spec_add(
+	mask_spec_t * const spec,
+	const char * rules
+)
+{
+	while (*rules)
+	{
+		const char * const comma = strchr(rules, ',');
+		const size_t len = comma ? (size_t)(comma - rules) : strlen(rules);
+
+		if (len != 0)
+		{
+			if (spec->num_rules == MASK_MAX_RULES)
+				return -1;
+			if (mask_rule_parse(&spec->rules[spec->num_rules],
+					rules, len) < 0)
+				return -1;
+			spec->num_rules++;
+		}
+
+		rules += len;
+		if (*rules == ',')
+			rules++;
+	}
+
+	return 0;
+}
+
+
+int
+mask_spec_load(
+	mask_spec_t * const spec,
+	const char * const filename
+)
+{
+	FILE * const file = fopen(filename, "r");
+	if (!file)
+		return -1;
+
+	char line[256];
+	int rc = 0;
+
+	while (rc == 0 && fgets(line, sizeof(line), file))
+	{
+		char * const comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		// trim the surrounding white space
+		char * s = line;
+		while (isspace((unsigned char) *s))
+			s++;
+		size_t len = strlen(s);
+		while (len && isspace((unsigned char) s[len - 1]))
+			s[--len] = '\0';
+
+		rc = mask_spec_add(spec, s);
+	}
+
+	fclose(file);
+	return rc;
+}
+
+
+static int
+mask_add_range(
+	mask_t * const mask,
+	uint64_t offset,
+	uint64_t len,
+	uint64_t size
+)
+{
+	if (offset >= size || len == 0)
+		return 0;
+	if (len > size - offset)
+		len = size - offset;
+
+	if (mask->num_ranges == mask->max_ranges)
+	{
+		const size_t n = mask->max_ranges ? mask->max_ranges * 2 : 16;
+		mask_range_t * const r = realloc(mask->ranges, n * sizeof(*r));
+		if (!r)
+			return -1;
+		mask->ranges = r;
+		mask->max_ranges = n;
+	}
+
+	mask->ranges[mask->num_ranges++] = (mask_range_t) {
+		.offset = offset,
+		.len = len,
+	};
+
+	return 1;
+}
+
+
+static int
+mask_range_cmp(
+	const void * a_ptr,
+	const void * b_ptr
+)
+{
+	const mask_range_t * const a = a_ptr;
+	const mask_range_t * const b = b_ptr;
+
+	if (a->offset != b->offset)
+		return a->offset < b->offset ? -1 : 1;
+	return 0;
+}
+
+
+static void
+mask_normalize(
+	mask_t * const mask
+)
+{
+	if (mask->num_ranges == 0)
+		return;
+
+	qsort(mask->ranges, mask->num_ranges, sizeof(*mask->ranges),
+		mask_range_cmp);
+
+	size_t out = 0;
+	for (size_t i = 1 ; i < mask->num_ranges ; i++)
+	{
+		mask_range_t * const prev = &mask->ranges[out];
+		const mask_range_t * const r = &mask->ranges[i];
+		const uint64_t prev_end = prev->offset + prev->len;
+
+		if (r->offset <= prev_end)
+		{
+			if (r->offset + r->len > prev_end)
+				prev->len = r->offset + r->len - prev->offset;
+			continue;
+		}
+
+		mask->ranges[++out] = *r;
+	}
+
+	mask->num_ranges = out + 1;
+}
+
+
+int
+mask_resolve(
+	mask_t * const mask,
+	const mask_spec_t * const spec,
+	const void * const rom,
+	uint64_t size
+)
+{
+	cbfs_index_t cbfs;
+	uefi_index_t uefi;
+	int have_cbfs = 0;
+	int have_uefi = 0;
+	int matched = 0;
+	int rc = 0;
+
+	// only index the image for the kinds of rules that need it
+	for (unsigned i = 0 ; i < spec->num_rules ; i++)
+	{
+		if (spec->rules[i].kind == MASK_CBFS && !have_cbfs)
+			have_cbfs = cbfs_index_build(&cbfs, rom, size, NULL) == 0
+				? 1 : -1;
+		if (spec->rules[i].kind == MASK_FV && !have_uefi)
+			have_uefi = uefi_index_build(&uefi, rom, size, NULL) == 0
+				? 1 : -1;
+	}
+
+	for (unsigned i = 0 ; i < spec->num_rules && rc >= 0 ; i++)
+	{
+		const mask_rule_t * const rule = &spec->rules[i];
+		int found = 0;
+
+		switch (rule->kind)
+		{
+		case MASK_FMAP: {
+			uint64_t offset, len;
+			if (fmap_area(rom, size, rule->name, &offset, &len) == 0)
+				found = rc = mask_add_range(mask, offset, len, size);
+			break;
+		}
+		case MASK_CBFS:
+			for (size_t j = 0 ; have_cbfs > 0 && j < cbfs.num_files ; j++)
+			{
+				const cbfs_entry_t * const f = &cbfs.files[j];
+				if (strcmp(f->name, rule->name) != 0)
+					continue;
+				rc = mask_add_range(mask, f->offset,
+					f->header_len + (uint64_t) f->len, size);
+				if (rc < 0)
+					break;
+				found |= rc;
+			}
+			break;
+		case MASK_FV:
+			for (size_t j = 0 ; have_uefi > 0 && j < uefi.num_volumes ; j++)
+			{
+				const uefi_volume_t * const v = &uefi.volumes[j];
+				if (memcmp(v->guid, rule->guid, 16) != 0)
+					continue;
+				rc = mask_add_range(mask, v->offset, v->len, size);
+				if (rc < 0)
+					break;
+				found |= rc;
+			}
+			break;
+		case MASK_RANGE:
+			found = rc = mask_add_range(mask, rule->offset, rule->len, size);
+			break;
+		}
+
+		matched += found > 0;
+	}
+
+	if (have_cbfs > 0)
+		cbfs_index_free(&cbfs);
+	if (have_uefi > 0)
+		uefi_index_free(&uefi);
+
+	if (rc < 0)
+		return -1;
+
+	mask_normalize(mask);
+	return matched;
+}
+
+
+void
+mask_free(
+	mask_t * const mask
+)
+{
+	free(mask->ranges);
+	memset(mask, 0, sizeof(*mask));
+}
+
+
+// Index of the first range that ends after offset
+static size_t
+mask_search(
+	const mask_t * const mask,
+	uint64_t offset
+)
+{
+	size_t lo = 0;
+	size_t hi = mask->num_ranges;
+
+	while (lo < hi)
+	{
+		const size_t mid = lo + (hi - lo) / 2;
+		const mask_range_t * const r = &mask->ranges[mid];
+		if (r->offset + r->len <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+int
+mask_overlaps(
+	const mask_t * const mask,
+	uint64_t offset,
+	uint64_t len
+)
+{
+	const size_t i = mask_search(mask, offset);
+	return len != 0
+		&& i < mask->num_ranges
+		&& mask->ranges[i].offset < offset + len;
+}
+
+
+uint64_t
+mask_next(
+	const mask_t * const mask,
+	uint64_t offset,
+	uint64_t end,
+	uint64_t * const len
+)
+{
+	size_t i = mask_search(mask, offset);
+
+	// ranges are merged, so at most one covers the offset
+	if (i < mask->num_ranges && mask->ranges[i].offset <= offset)
+	{
+		offset = mask->ranges[i].offset + mask->ranges[i].len;
+		i++;
+	}
+
+	if (offset >= end)
+	{
+		*len = 0;
+		return end;
+	}
+
+	uint64_t run_end = end;
+	if (i < mask->num_ranges && mask->ranges[i].offset < run_end)
+		run_end = mask->ranges[i].offset;
+
+	*len = run_end - offset;
+	return offset;
+}
+
+
+uint64_t
+mask_bytes(
+	const mask_t * const mask,
+	uint64_t size
+)
+{
+	uint64_t total = 0;
+
+	for (size_t i = 0 ; i < mask->num_ranges ; i++)
+	{
+		const mask_range_t * const r = &mask->ranges[i];
+		if (r->offset >= size)
+			break;
+		total += r->offset + r->len > size ? size - r->offset : r->len;
+	}
+
+	return total;
+}
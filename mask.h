@@ -0,0 +1,126 @@
+/** \file
+ * Masks for the volatile parts of a ROM image.
+ *
+ * NVRAM stores, MRC training caches and event logs change on every
+ * boot, so a live flash never matches its golden image there.  A
+ * mask names those parts by something that survives a rebuild:
+ *
+ *   fmap:NAME          an FMAP area, like RW_MRC_CACHE or SMMSTORE
+ *   cbfs:NAME          a CBFS file, header included, like mrc.cache
+ *   fv:GUID            every firmware volume with that file system
+ *                      GUID, like the NVRAM store
+ *   range:OFFSET:LEN   a fixed byte range of the image
+ *
+ * The specs are resolved against each image into a sorted list of
+ * byte ranges that hashing, compare and read loops step around.
+ */
+#ifndef _mask_h_
+#define _mask_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MASK_MAX_RULES 64
+#define MASK_NAME_LEN 64
+
+typedef enum {
+	MASK_FMAP,
+	MASK_CBFS,
+	MASK_FV,
+	MASK_RANGE,
+} mask_kind_t;
+
+typedef struct {
+	mask_kind_t kind;
+	char name[MASK_NAME_LEN];       // FMAP area or CBFS file
+	uint8_t guid[16];
+	uint64_t offset;
+	uint64_t len;
+} mask_rule_t;
+
+typedef struct {
+	mask_rule_t rules[MASK_MAX_RULES];
+	unsigned num_rules;
+} mask_spec_t;
+
+typedef struct {
+	uint64_t offset;
+	uint64_t len;
+} mask_range_t;
+
+// Resolved ranges, sorted by offset and with overlaps merged
+typedef struct {
+	mask_range_t * ranges;
+	size_t num_ranges;
+	size_t max_ranges;
+} mask_t;
+
+
+// Add a rule, or several separated by commas; -1 if one is malformed
+extern int
+mask_spec_add(
+	mask_spec_t * spec,
+	const char * rules
+);
+
+
+// Add the rules in a file, one per line, with # comments
+extern int
+mask_spec_load(
+	mask_spec_t * spec,
+	const char * filename
+);
+
+
+/*
+ * Add the ranges that the rules select in an image to the mask.
+ * Resolving against both sides of a comparison masks the union.
+ * Rules that match nothing in the image are skipped; returns the
+ * number of rules that matched, or -1 if out of memory.
+ */
+extern int
+mask_resolve(
+	mask_t * mask,
+	const mask_spec_t * spec,
+	const void * rom,
+	uint64_t size
+);
+
+
+extern void
+mask_free(
+	mask_t * mask
+);
+
+
+// Nonzero if any byte of the range is masked
+extern int
+mask_overlaps(
+	const mask_t * mask,
+	uint64_t offset,
+	uint64_t len
+);
+
+
+/*
+ * Find the next unmasked run in [offset, end).  Returns its start and
+ * sets *len to its length, or returns end with *len = 0 if the rest
+ * of the range is masked.
+ */
+extern uint64_t
+mask_next(
+	const mask_t * mask,
+	uint64_t offset,
+	uint64_t end,
+	uint64_t * len
+);
+
+
+// Number of masked bytes in [0, size)
+extern uint64_t
+mask_bytes(
+	const mask_t * mask,
+	uint64_t size
+);
+
+#endif
@@ -0,0 +1,485 @@
+/** \file
+ * Predict the measured boot event log and PCRs of CBFS images.
+ *
+ * With TPM measured boot, coreboot hashes every CBFS file as it is
+ * loaded, as stored in the flash (still compressed), and extends one
+ * PCR with the digest: stages, payloads and mrc.bin go into the SRTM
+ * PCR and everything else into the runtime data PCR.  The event is
+ * named "CBFS: " and the file name.  Every image is indexed once and
+ * the files of all of the images are hashed on a pool of worker
+ * threads; the PCRs are then extended in load order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <getopt.h>
+#include "util.h"
+#include "pool.h"
+#include "sha1.h"
+#include "sha256.h"
+#include "cbfs_index.h"
+
+#define CBFS_COMPONENT_BOOTBLOCK 0x01
+#define CBFS_COMPONENT_CBFSHEADER 0x02
+#define CBFS_COMPONENT_STAGE 0x10
+#define CBFS_COMPONENT_SELF 0x20
+#define CBFS_COMPONENT_FIT_PAYLOAD 0x21
+#define CBFS_COMPONENT_MRC 0x61
+
+#define MEASURE_SHA1 0x1
+#define MEASURE_SHA256 0x2
+
+#define MEASURE_NAME_LEN 50     // coreboot's log entry name, with the NUL
+#define MEASURE_MAX_PCRS 24
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "algorithm",		1, NULL, 'a' },
+	{ "boot-order",		1, NULL, 'b' },
+	{ "srtm-pcr",		1, NULL, 's' },
+	{ "data-pcr",		1, NULL, 'd' },
+	{ "threads",		1, NULL, 'j' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: measure [options] image...\n"
+"\n"
+"    -h | -? | --help           This help\n"
+"    -v | --verbose             Increase verbosity\n"
+"    -a | --algorithm ALG       sha256 (TPM 2.0, default), sha1 (TPM 1.2)\n"
+"                               or both\n"
+"    -b | --boot-order file     CBFS names in the order they are loaded\n"
+"    -s | --srtm-pcr N          PCR for code (default 2)\n"
+"    -d | --data-pcr N          PCR for runtime data (default 3)\n"
+"    -j | --threads N           Worker threads for hashing (default one per CPU)\n"
+"\n"
+"For each image the expected event log is printed, one line per\n"
+"measured file, followed by the final value of each PCR:\n"
+"\n"
+"  event PCR ALG DIGEST CBFS: name\n"
+"  pcr PCR ALG VALUE\n"
+"\n"
+"Without -b every file is assumed to be loaded once, the bootblock\n"
+"first and then the others in CBFS order.  Measurements made outside\n"
+"of CBFS, like the vboot GBB and firmware ID, are not included.\n"
+"\n";
+
+
+typedef struct {
+	char name[MEASURE_NAME_LEN];
+	uint32_t type;
+	uint64_t data_offset;
+	uint64_t len;
+	unsigned pcr;
+	uint8_t sha1[SHA1_LEN];
+	uint8_t sha256[SHA256_LEN];
+} measure_event_t;
+
+typedef struct {
+	const char * filename;
+	const uint8_t * rom;
+	uint64_t size;
+	measure_event_t * events;
+	size_t num_events;
+} measure_image_t;
+
+typedef struct {
+	const measure_image_t * image;
+	size_t start;
+	size_t count;
+	unsigned algorithms;
+} hash_job_t;
+
+typedef struct {
+	char ** names;
+	size_t num_names;
+} boot_order_t;
+
+static unsigned srtm_pcr = 2;
+static unsigned data_pcr = 3;
+
+
+// The PCR that coreboot extends with a file of this type
+static unsigned
+measure_pcr(
+	uint32_t type
+)
+{
+	switch (type)
+	{
+	case CBFS_COMPONENT_MRC:
+	case CBFS_COMPONENT_STAGE:
+	case CBFS_COMPONENT_SELF:
+	case CBFS_COMPONENT_FIT_PAYLOAD:
+		return srtm_pcr;
+	default:
+		return data_pcr;
+	}
+}
+
+
+static int
+boot_order_read(
+	boot_order_t * const order,
+	const char * const filename
+)
+{
+	FILE * const f = fopen(filename, "r");
+	if (!f)
+		return -1;
+
+	char line[512];
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		const char * const name = line + strspn(line, " \t");
+		if (*name == '\0' || *name == '#')
+			continue;
+
+		char ** const names = realloc(order->names,
+			(order->num_names + 1) * sizeof(*names));
+		char * const copy = malloc(strlen(name) + 1);
+		if (!names || !copy)
+		{
+			fclose(f);
+			return -1;
+		}
+
+		strcpy(copy, name);
+		order->names = names;
+		order->names[order->num_names++] = copy;
+	}
+
+	fclose(f);
+	return 0;
+}
+
+
+static void
+measure_add(
+	measure_image_t * const image,
+	const cbfs_entry_t * const f
+)
+{
+	if ((image->num_events & (image->num_events - 1)) == 0)
+	{
+		const size_t n = image->num_events ? image->num_events * 2 : 64;
+		measure_event_t * const e = realloc(image->events, n * sizeof(*e));
+		if (!e)
+		{
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		image->events = e;
+	}
+
+	measure_event_t * const e = &image->events[image->num_events++];
+	memset(e, 0, sizeof(*e));
+	// truncated like coreboot's log entries
+	snprintf(e->name, sizeof(e->name), "CBFS: %.*s",
+		(int) sizeof(e->name) - 7, f->name);
+	e->type = f->type;
+	e->data_offset = f->offset + f->header_len;
+	e->len = f->len;
+	e->pcr = measure_pcr(f->type);
+}
+
+
+static const cbfs_entry_t *
+cbfs_find(
+	const cbfs_index_t * const idx,
+	const char * const name
+)
+{
+	for (size_t i = 0 ; i < idx->num_files ; i++)
+		if (strcmp(idx->files[i].name, name) == 0)
+			return &idx->files[i];
+	return NULL;
+}
+
+
+// The files that are measured, in the order that they are loaded
+static int
+measure_index(
+	measure_image_t * const image,
+	const boot_order_t * const order
+)
+{
+	cbfs_index_t idx;
+	if (cbfs_index_build(&idx, image->rom, image->size, NULL) < 0)
+	{
+		fprintf(stderr, "%s: no CBFS found\n", image->filename);
+		return -1;
+	}
+
+	if (order->num_names)
+	{
+		for (size_t i = 0 ; i < order->num_names ; i++)
+		{
+			const cbfs_entry_t * const f = cbfs_find(&idx, order->names[i]);
+			if (f)
+				measure_add(image, f);
+			else
+			if (verbose)
+				fprintf(stderr, "%s: no CBFS file '%s'\n",
+					image->filename, order->names[i]);
+		}
+	} else {
+		const cbfs_entry_t * const bootblock = cbfs_find(&idx, "bootblock");
+		if (bootblock)
+			measure_add(image, bootblock);
+
+		for (size_t i = 0 ; i < idx.num_files ; i++)
+		{
+			const cbfs_entry_t * const f = &idx.files[i];
+			if (f == bootblock
+			||  f->name[0] == '\0'
+			||  f->type == CBFS_COMPONENT_NULL
+			||  f->type == CBFS_COMPONENT_CBFSHEADER)
+				continue;
+			measure_add(image, f);
+		}
+	}
+
+	cbfs_index_free(&idx);
+	return 0;
+}
+
+
+static void
+hash_events(
+	void * arg
+)
+{
+	hash_job_t * const job = arg;
+
+	for (size_t i = job->start ; i < job->start + job->count ; i++)
+	{
+		measure_event_t * const e = &job->image->events[i];
+		const uint8_t * const data = job->image->rom + e->data_offset;
+
+		if (job->algorithms & MEASURE_SHA1)
+			sha1(data, e->len, e->sha1);
+		if (job->algorithms & MEASURE_SHA256)
+			sha256(data, e->len, e->sha256);
+	}
+}
+
+
+static size_t
+submit_hashes(
+	pool_t * const pool,
+	measure_image_t * const image,
+	unsigned algorithms,
+	hash_job_t * const jobs
+)
+{
+	// small batches so that the payload and the ramstage
+	// do not leave the other workers idle
+	const size_t batch = 4;
+	size_t num_jobs = 0;
+
+	for (size_t i = 0 ; i < image->num_events ; i += batch)
+	{
+		hash_job_t * const job = &jobs[num_jobs++];
+		job->image = image;
+		job->start = i;
+		job->count = image->num_events - i < batch
+			? image->num_events - i : batch;
+		job->algorithms = algorithms;
+
+		if (pool_submit(pool, hash_events, job) < 0)
+			hash_events(job);
+	}
+
+	return num_jobs;
+}
+
+
+/*
+ * Replay the extends of one bank: every PCR starts at zero and
+ * becomes the digest of its old value followed by the event digest.
+ */
+static void
+print_bank(
+	const measure_image_t * const image,
+	const char * const alg,
+	size_t offset,
+	size_t digest_len,
+	void (*hash)(const void *, size_t, uint8_t *)
+)
+{
+	uint8_t pcrs[MEASURE_MAX_PCRS][SHA256_LEN];
+	int used[MEASURE_MAX_PCRS] = {};
+	char hex[2 * SHA256_LEN + 1];
+
+	memset(pcrs, 0, sizeof(pcrs));
+
+	for (size_t i = 0 ; i < image->num_events ; i++)
+	{
+		const measure_event_t * const e = &image->events[i];
+		const uint8_t * const digest = (const uint8_t *) e + offset;
+		uint8_t buf[2 * SHA256_LEN];
+
+		memcpy(buf, pcrs[e->pcr], digest_len);
+		memcpy(buf + digest_len, digest, digest_len);
+		hash(buf, 2 * digest_len, pcrs[e->pcr]);
+		used[e->pcr] = 1;
+
+		printf("event %u %s %s %s\n", e->pcr, alg,
+			hex_digest(hex, digest, digest_len), e->name);
+	}
+
+	for (unsigned pcr = 0 ; pcr < MEASURE_MAX_PCRS ; pcr++)
+		if (used[pcr])
+			printf("pcr %u %s %s\n", pcr, alg,
+				hex_digest(hex, pcrs[pcr], digest_len));
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * const prog_name = argv[0];
+	unsigned algorithms = MEASURE_SHA256;
+	boot_order_t order = {};
+	unsigned threads = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?va:b:s:d:j:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'a':
+			if (strcmp(optarg, "sha1") == 0)
+				algorithms = MEASURE_SHA1;
+			else
+			if (strcmp(optarg, "sha256") == 0)
+				algorithms = MEASURE_SHA256;
+			else
+			if (strcmp(optarg, "both") == 0)
+				algorithms = MEASURE_SHA1 | MEASURE_SHA256;
+			else
+			{
+				fprintf(stderr, "%s: unknown algorithm '%s'\n",
+					prog_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			if (boot_order_read(&order, optarg) < 0)
+			{
+				fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			srtm_pcr = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			data_pcr = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	if (srtm_pcr >= MEASURE_MAX_PCRS || data_pcr >= MEASURE_MAX_PCRS)
+	{
+		fprintf(stderr, "%s: PCRs must be less than %d\n",
+			prog_name, MEASURE_MAX_PCRS);
+		return EXIT_FAILURE;
+	}
+
+	measure_image_t * const images = calloc(argc, sizeof(*images));
+	if (!images)
+	{
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	int errors = 0;
+	size_t max_jobs = 0;
+	for (int i = 0 ; i < argc ; i++)
+	{
+		measure_image_t * const image = &images[i];
+		image->filename = argv[i];
+		image->rom = map_file(image->filename, &image->size, 1);
+		if (image->rom == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", image->filename,
+				errno ? strerror(errno) : "empty file");
+			errors++;
+			continue;
+		}
+
+		if (measure_index(image, &order) < 0)
+			errors++;
+		max_jobs += image->num_events / 4 + 1;
+	}
+
+	pool_t * const pool = pool_create(threads);
+	hash_job_t * const jobs = calloc(max_jobs + 1, sizeof(*jobs));
+	if (!pool || !jobs)
+	{
+		fprintf(stderr, "%s: unable to start worker threads\n", prog_name);
+		return EXIT_FAILURE;
+	}
+
+	// the files of every image are hashed before any is printed
+	size_t num_jobs = 0;
+	for (int i = 0 ; i < argc ; i++)
+		num_jobs += submit_hashes(pool, &images[i], algorithms,
+			&jobs[num_jobs]);
+
+	pool_wait(pool);
+	pool_destroy(pool);
+	free(jobs);
+
+	for (int i = 0 ; i < argc ; i++)
+	{
+		const measure_image_t * const image = &images[i];
+		if (image->num_events == 0)
+			continue;
+
+		printf("%s:\n", image->filename);
+		if (algorithms & MEASURE_SHA1)
+			print_bank(image, "sha1",
+				offsetof(measure_event_t, sha1), SHA1_LEN, sha1);
+		if (algorithms & MEASURE_SHA256)
+			print_bank(image, "sha256",
+				offsetof(measure_event_t, sha256), SHA256_LEN, sha256);
+	}
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
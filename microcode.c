@@ -0,0 +1,196 @@
+/** \file
+ * Intel microcode update headers.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "microcode.h"
+
+
+uint32_t
+microcode_size(
+	const void * const buf,
+	uint64_t remaining
+)
+{
+	struct microcode_header h;
+	if (remaining < sizeof(h))
+		return 0;
+
+	memcpy(&h, buf, sizeof(h));
+	if (h.header_version != MICROCODE_HEADER_VERSION
+	||  h.loader_revision != 1)
+		return 0;
+
+	const uint32_t data_size = h.data_size
+		? h.data_size : MICROCODE_DEFAULT_DATA_SIZE;
+	const uint32_t total_size = h.total_size
+		? h.total_size : MICROCODE_DEFAULT_TOTAL_SIZE;
+
+	if (total_size > remaining
+	||  (total_size & 3) != 0
+	||  data_size > total_size - sizeof(h))
+		return 0;
+
+	return total_size;
+}
+
+
+int
+microcode_checksum_ok(
+	const void * const buf
+)
+{
+	const uint8_t * const p = buf;
+	const uint32_t len = microcode_size(buf, UINT32_MAX);
+	uint32_t sum = 0;
+
+	for (uint32_t i = 0 ; i < len ; i += 4)
+	{
+		uint32_t word;
+		memcpy(&word, p + i, sizeof(word));
+		sum += word;
+	}
+
+	return len != 0 && sum == 0;
+}
+
+
+int
+microcode_matches(
+	const void * const buf,
+	uint32_t signature,
+	uint32_t flags
+)
+{
+	const uint8_t * const p = buf;
+	struct microcode_header h;
+	memcpy(&h, p, sizeof(h));
+
+	if (h.processor_signature == signature
+	&&  (h.processor_flags & flags) != 0)
+		return 1;
+
+	// the extended table follows the data when there is room for it
+	const uint32_t data_size = h.data_size
+		? h.data_size : MICROCODE_DEFAULT_DATA_SIZE;
+	const uint32_t total_size = h.total_size
+		? h.total_size : MICROCODE_DEFAULT_TOTAL_SIZE;
+	uint32_t off = sizeof(h) + data_size;
+
+	struct microcode_ext_header ext;
+	if (total_size < off + sizeof(ext))
+		return 0;
+
+	memcpy(&ext, p + off, sizeof(ext));
+	off += sizeof(ext);
+
+	for (uint32_t i = 0 ; i < ext.count ; i++)
+	{
+		struct microcode_ext_signature sig;
+		if (total_size < off + sizeof(sig))
+			break;
+
+		memcpy(&sig, p + off, sizeof(sig));
+		off += sizeof(sig);
+
+		if (sig.processor_signature == signature
+		&&  (sig.processor_flags & flags) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+unsigned
+microcode_count(
+	const void * const buf,
+	uint64_t len
+)
+{
+	const uint8_t * const p = buf;
+	unsigned count = 0;
+	uint64_t off = 0;
+
+	while (1)
+	{
+		const uint32_t size = microcode_size(p + off, len - off);
+		if (size == 0)
+			break;
+
+		off += size;
+		count++;
+	}
+
+	return count;
+}
+
+
+int64_t
+fit_offset(
+	uint64_t address,
+	uint64_t size
+)
+{
+	const uint64_t top = 0x100000000ULL;
+	if (address >= top || address < top - size)
+		return -1;
+	return address - (top - size);
+}
+
+
+int64_t
+fit_find(
+	const void * const rom_ptr,
+	uint64_t size,
+	unsigned * const entries
+)
+{
+	const uint8_t * const rom = rom_ptr;
+	if (size < FIT_POINTER_OFFSET)
+		return -1;
+
+	uint64_t pointer;
+	memcpy(&pointer, rom + size - FIT_POINTER_OFFSET, sizeof(pointer));
+
+	// the pointer is a 32-bit address, the upper half may be erased
+	const int64_t offset = fit_offset(pointer & 0xFFFFFFFF, size);
+	if (offset < 0 || (uint64_t) offset + sizeof(struct fit_entry) > size)
+		return -1;
+
+	struct fit_entry header;
+	memcpy(&header, rom + offset, sizeof(header));
+	if (memcmp(&header.address, FIT_SIGNATURE, 8) != 0
+	||  (header.type & FIT_TYPE_MASK) != FIT_TYPE_HEADER)
+		return -1;
+
+	const unsigned count = header.size[0]
+		| header.size[1] << 8
+		| header.size[2] << 16;
+	if (count == 0
+	||  (uint64_t) offset + count * sizeof(struct fit_entry) > size)
+		return -1;
+
+	*entries = count;
+	return offset;
+}
+
+
+void
+fit_checksum(
+	struct fit_entry * const table,
+	unsigned entries
+)
+{
+	if (!(table[0].type & FIT_CHECKSUM_VALID))
+		return;
+
+	const uint8_t * const p = (const void *) table;
+	uint8_t sum = 0;
+
+	table[0].checksum = 0;
+	for (size_t i = 0 ; i < entries * sizeof(*table) ; i++)
+		sum += p[i];
+	table[0].checksum = -sum;
+}
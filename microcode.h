@@ -0,0 +1,129 @@
+/** \file
+ * Intel microcode update headers.
+ *
+ * A microcode container (the CBFS cpu_microcode_blob.bin or a raw
+ * FFS file in the microcode volume) is a sequence of update patches,
+ * each starting with a 48 byte header and covered by a checksum that
+ * makes the 32-bit sum of the whole patch zero.  A patch may have an
+ * extended signature table after its data listing more processors.
+ */
+#ifndef _microcode_h_
+#define _microcode_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MICROCODE_HEADER_VERSION 1
+#define MICROCODE_DEFAULT_DATA_SIZE 2000
+#define MICROCODE_DEFAULT_TOTAL_SIZE 2048
+
+struct microcode_header {
+	uint32_t header_version;      // 0x00
+	uint32_t update_revision;     // 0x04
+	uint32_t date;                // 0x08 BCD mmddyyyy
+	uint32_t processor_signature; // 0x0c CPUID(1).EAX
+	uint32_t checksum;            // 0x10
+	uint32_t loader_revision;     // 0x14
+	uint32_t processor_flags;     // 0x18 platform ID bits
+	uint32_t data_size;           // 0x1c 0 means 2000
+	uint32_t total_size;          // 0x20 0 means 2048
+	uint32_t reserved[3];
+};
+
+struct microcode_ext_header {
+	uint32_t count;
+	uint32_t checksum;
+	uint32_t reserved[3];
+};
+
+struct microcode_ext_signature {
+	uint32_t processor_signature;
+	uint32_t processor_flags;
+	uint32_t checksum;
+};
+
+
+// Size of the patch at buf, or 0 if it does not have a sane header
+extern uint32_t
+microcode_size(
+	const void * buf,
+	uint64_t remaining
+);
+
+
+// Non-zero if the 32-bit sum over the patch is zero
+extern int
+microcode_checksum_ok(
+	const void * buf
+);
+
+
+// Non-zero if the patch applies to this signature and any of the flags
+extern int
+microcode_matches(
+	const void * buf,
+	uint32_t signature,
+	uint32_t flags
+);
+
+
+// Number of patches at the start of a container
+extern unsigned
+microcode_count(
+	const void * buf,
+	uint64_t len
+);
+
+
+/*
+ * Firmware Interface Table.  The CPU finds it through the pointer
+ * 0x40 bytes below 4 GiB, which is the top of the image, and loads
+ * the patch at each microcode entry before the reset vector runs.
+ * The first entry is a header that holds the number of entries and
+ * an optional checksum over the whole table.
+ */
+#define FIT_POINTER_OFFSET 0x40         // below the top of the image
+#define FIT_SIGNATURE "_FIT_   "
+#define FIT_TYPE_HEADER 0x00
+#define FIT_TYPE_MICROCODE 0x01
+#define FIT_TYPE_MASK 0x7F
+#define FIT_CHECKSUM_VALID 0x80
+
+struct fit_entry {
+	uint64_t address;
+	uint8_t size[3];
+	uint8_t reserved;
+	uint16_t version;
+	uint8_t type;               // and FIT_CHECKSUM_VALID
+	uint8_t checksum;
+} __attribute__((packed));
+
+
+/*
+ * ROM offset of the FIT in an image whose end is mapped at 4 GiB and
+ * its number of entries, header included, or -1 if there is none.
+ */
+extern int64_t
+fit_find(
+	const void * rom,
+	uint64_t size,
+	unsigned * entries
+);
+
+
+// ROM offset that a FIT address refers to, or -1 if outside the image
+extern int64_t
+fit_offset(
+	uint64_t address,
+	uint64_t size
+);
+
+
+// Recompute the header checksum if the table has one
+extern void
+fit_checksum(
+	struct fit_entry * table,
+	unsigned entries
+);
+
+#endif
@@ -0,0 +1,730 @@
+/** \file
+ * MMIO access recording and a simulated SPI controller for replay.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include "util.h"
+#include "mmio_trace.h"
+
+#define MMIO_TRACE_MAGIC "flashtools-mmio-trace 1"
+
+// The SPI controller registers, as in spiflash.c.  The SPI BAR is
+// at SPIBAR_OFFSET in the 64 KiB RCBA mapping.
+#define SIM_RCBA_LEN 0x10000
+#define SIM_SPIBAR_OFFSET 0x3800
+#define SIM_HSFS 0x04
+#define SIM_HSFC 0x06
+#define SIM_FADDR 0x08
+#define SIM_FDATA 0x10
+#define SIM_FDATA_LEN 64
+#define SIM_HSFS_FDONE 0x0001
+#define SIM_HSFS_FCERR 0x0002
+#define SIM_HSFS_AEL 0x0004
+#define SIM_HSFS_SCIP 0x0020
+#define SIM_HSFC_FGO 0x0001
+#define SIM_FLASH_SIZE MMIO_SIM_FLASH_SIZE
+#define SIM_ERASE_SIZE 0x1000
+
+#define FCYCLE_READ 0
+#define FCYCLE_WRITE 2
+#define FCYCLE_ERASE 3
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+//
+// Recording
+//
+static FILE * trace_file;
+static uint64_t trace_start;
+static struct {
+	const volatile uint8_t * base;
+	uint64_t len;
+} trace_regions[MMIO_TRACE_MAX_REGIONS];
+static unsigned trace_num_regions;
+
+
+static void
+trace_close(void)
+{
+	if (trace_file)
+		fclose(trace_file);
+	trace_file = NULL;
+}
+
+
+static int
+trace_open(void)
+{
+	if (trace_file)
+		return 0;
+
+	const char * filename = getenv(MMIO_TRACE_ENV);
+	if (!filename || !*filename)
+		filename = MMIO_TRACE_DEFAULT;
+
+	trace_file = fopen(filename, "w");
+	if (!trace_file)
+	{
+		perror(filename);
+		return -1;
+	}
+
+	fprintf(trace_file, "%s\n", MMIO_TRACE_MAGIC);
+	trace_start = now_ns();
+	atexit(trace_close);
+	return 0;
+}
+
+
+void *
+mmio_trace_map(
+	uint64_t phys,
+	size_t len
+)
+{
+	void * const ptr = map_physical(phys, len);
+	if (!ptr || trace_open() < 0)
+		return ptr;
+
+	if (trace_num_regions == MMIO_TRACE_MAX_REGIONS)
+		return ptr;
+
+	const unsigned region = trace_num_regions++;
+	trace_regions[region].base = ptr;
+	trace_regions[region].len = len;
+	fprintf(trace_file, "map %u %"PRIx64" %zx\n", region, phys, len);
+
+	return ptr;
+}
+
+
+void
+mmio_trace_access(
+	const volatile void * const addr,
+	unsigned width,
+	uint32_t value,
+	int write
+)
+{
+	if (!trace_file)
+		return;
+
+	const uint64_t ns = now_ns() - trace_start;
+	const volatile uint8_t * const p = addr;
+
+	for (unsigned i = 0 ; i < trace_num_regions ; i++)
+	{
+		if (p < trace_regions[i].base
+		||  p >= trace_regions[i].base + trace_regions[i].len)
+			continue;
+
+		fprintf(trace_file, "%"PRIu64" %c %u %u %x %x\n",
+			ns, write ? 'w' : 'r', i, width,
+			(unsigned)(p - trace_regions[i].base), value);
+		return;
+	}
+}
+
+
+//
+// Trace files
+//
+int
+mmio_trace_load(
+	mmio_trace_t * const trace,
+	const char * const filename
+)
+{
+	memset(trace, 0, sizeof(*trace));
+
+	FILE * const f = fopen(filename, "r");
+	if (!f)
+		return -1;
+
+	char line[256];
+	if (!fgets(line, sizeof(line), f)
+	||  strncmp(line, MMIO_TRACE_MAGIC, strlen(MMIO_TRACE_MAGIC)) != 0)
+		goto fail;
+
+	size_t max_records = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		unsigned region;
+		uint64_t phys, len;
+		if (sscanf(line, "map %u %"SCNx64" %"SCNx64, &region, &phys, &len) == 3)
+		{
+			if (region != trace->num_maps
+			||  region == MMIO_TRACE_MAX_REGIONS)
+				goto fail;
+			trace->maps[region].phys = phys;
+			trace->maps[region].len = len;
+			trace->num_maps++;
+			continue;
+		}
+
+		mmio_record_t r;
+		char op;
+		unsigned width, offset, value;
+		if (sscanf(line, "%"SCNu64" %c %u %u %x %x",
+			&r.ns, &op, &region, &width, &offset, &value) != 6
+		||  (op != 'r' && op != 'w')
+		||  region >= trace->num_maps
+		||  (width != 1 && width != 2 && width != 4)
+		||  offset + width > trace->maps[region].len)
+			goto fail;
+
+		r.region = region;
+		r.width = width;
+		r.offset = offset;
+		r.value = value;
+		r.write = op == 'w';
+
+		if (trace->num_records == max_records)
+		{
+			max_records = max_records ? max_records * 2 : 4096;
+			mmio_record_t * const n = realloc(trace->records,
+				max_records * sizeof(*n));
+			if (!n)
+				goto fail;
+			trace->records = n;
+		}
+
+		trace->records[trace->num_records++] = r;
+	}
+
+	fclose(f);
+	return 0;
+
+fail:
+	fclose(f);
+	mmio_trace_free(trace);
+	errno = EINVAL;
+	return -1;
+}
+
+
+void
+mmio_trace_free(
+	mmio_trace_t * const trace
+)
+{
+	free(trace->records);
+	memset(trace, 0, sizeof(*trace));
+}
+
+
+//
+// The simulated controller
+//
+static struct {
+	int active;
+	mmio_map_t maps[MMIO_TRACE_MAX_REGIONS];
+	uint8_t * regs[MMIO_TRACE_MAX_REGIONS];
+	unsigned num_maps;
+	int spi_region;         // -1 if the trace never mapped RCBA
+	uint8_t * flash;
+	mmio_sim_timing_t timing;
+	mmio_sim_stats_t stats;
+
+	// the cycle in flight
+	int busy;
+	unsigned cycle;
+	uint32_t addr;
+	unsigned count;
+	uint64_t complete_ns;
+} sim;
+
+
+static uint32_t
+get_le(
+	const uint8_t * const p,
+	unsigned width
+)
+{
+	uint32_t x = 0;
+	for (unsigned i = 0 ; i < width ; i++)
+		x |= (uint32_t) p[i] << (8 * i);
+	return x;
+}
+
+
+static void
+put_le(
+	uint8_t * const p,
+	unsigned width,
+	uint32_t x
+)
+{
+	for (unsigned i = 0 ; i < width ; i++)
+		p[i] = x >> (8 * i);
+}
+
+
+// least squares fit of latency = base + per_byte * count
+static void
+fit_line(
+	const uint64_t * const count,
+	const uint64_t * const ns,
+	unsigned n,
+	uint64_t * const base,
+	uint64_t * const per_byte
+)
+{
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	for (unsigned i = 0 ; i < n ; i++)
+	{
+		sx += count[i];
+		sy += ns[i];
+		sxx += (double) count[i] * count[i];
+		sxy += (double) count[i] * ns[i];
+	}
+
+	const double d = n * sxx - sx * sx;
+	double b = d > 0 ? (n * sxy - sx * sy) / d : 0;
+	if (b < 0)
+		b = 0;
+	double a = (sy - b * sx) / n;
+	if (a < 0)
+		a = 0;
+
+	*base = a;
+	*per_byte = b;
+}
+
+
+static int
+cmp_u64(
+	const void * a,
+	const void * b
+)
+{
+	const uint64_t x = *(const uint64_t *) a;
+	const uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Walk the trace as the controller saw it: registers start with the
+ * first value read before any write, the flash holds whatever the
+ * read cycles returned in FDATA, and a cycle's latency is taken as
+ * halfway between the last poll that saw it busy and the first that
+ * saw FDONE.  Cycles started while a stale FDONE was still set can
+ * not be timed and are skipped.
+ */
+static int
+sim_learn(
+	const mmio_trace_t * const trace
+)
+{
+	const size_t n = trace->num_records;
+	uint8_t * known[MMIO_TRACE_MAX_REGIONS] = { NULL };
+	uint64_t * samples[4] = { NULL };
+	uint64_t * counts[4] = { NULL };
+	uint64_t * gaps = NULL;
+	unsigned num_samples[4] = { 0 };
+	int rc = -1;
+
+	for (unsigned i = 0 ; i < sim.num_maps ; i++)
+		if (!(known[i] = calloc(1, sim.maps[i].len)))
+			goto out;
+	for (unsigned i = 0 ; i < 4 ; i++)
+		if (!(samples[i] = calloc(n + 1, sizeof(uint64_t)))
+		||  !(counts[i] = calloc(n + 1, sizeof(uint64_t))))
+			goto out;
+	if (!(gaps = calloc(n + 1, sizeof(*gaps))))
+		goto out;
+
+	const uint32_t spi = SIM_SPIBAR_OFFSET;
+	uint32_t faddr = 0;
+	int stale_done = 0;
+	int timing = 0;         // a cycle is in flight and can be timed
+	int reading = 0;        // FDATA holds the data of a read cycle
+	unsigned cycle = 0, count = 0;
+	uint64_t start_ns = 0, busy_ns = 0;
+	size_t num_gaps = 0;
+
+	for (size_t i = 0 ; i < n ; i++)
+	{
+		const mmio_record_t * const r = &trace->records[i];
+		uint8_t * const regs = sim.regs[r->region];
+
+		if (i > 0 && r->ns > trace->records[i-1].ns)
+			gaps[num_gaps++] = r->ns - trace->records[i-1].ns;
+
+		// initial register values
+		for (unsigned b = 0 ; b < r->width ; b++)
+		{
+			if (known[r->region][r->offset + b])
+				continue;
+			known[r->region][r->offset + b] = 1;
+			if (!r->write)
+				regs[r->offset + b] = r->value >> (8 * b);
+		}
+
+		if ((int) r->region != sim.spi_region)
+			continue;
+
+		const uint32_t off = r->offset - spi;
+		if (r->offset < spi)
+			continue;
+
+		if (r->write && off == SIM_FADDR)
+		{
+			faddr = r->value & 0x1FFFFFF;
+		} else
+		if (r->write && off == SIM_HSFS)
+		{
+			if (r->value & SIM_HSFS_FDONE)
+				stale_done = 0;
+		} else
+		if (r->write && off == SIM_HSFC && (r->value & SIM_HSFC_FGO))
+		{
+			cycle = (r->value >> 1) & 3;
+			count = ((r->value >> 8) & 0x3F) + 1;
+			timing = !stale_done;
+			reading = cycle == FCYCLE_READ;
+			start_ns = busy_ns = r->ns;
+		} else
+		if (!r->write && off == SIM_HSFS)
+		{
+			if ((r->value & (SIM_HSFS_FDONE | SIM_HSFS_FCERR)) == 0)
+			{
+				busy_ns = r->ns;
+				stale_done = 0;
+			} else {
+				if (timing)
+				{
+					const unsigned k = num_samples[cycle]++;
+					samples[cycle][k] = (busy_ns + r->ns) / 2 - start_ns;
+					counts[cycle][k] = count;
+				}
+				timing = 0;
+				stale_done = 1;
+			}
+		} else
+		if (!r->write && reading && r->width == 4
+		&&  off >= SIM_FDATA && off < SIM_FDATA + SIM_FDATA_LEN)
+		{
+			const uint32_t pos = off - SIM_FDATA;
+			for (unsigned b = 0 ; b < 4 && pos + b < count ; b++)
+				if (faddr + pos + b < SIM_FLASH_SIZE)
+					sim.flash[faddr + pos + b] = r->value >> (8 * b);
+		}
+	}
+
+	mmio_sim_timing_t * const t = &sim.timing;
+	if (num_samples[FCYCLE_READ])
+		fit_line(counts[FCYCLE_READ], samples[FCYCLE_READ],
+			num_samples[FCYCLE_READ], &t->read_base_ns, &t->read_byte_ns);
+	if (num_samples[FCYCLE_WRITE])
+		fit_line(counts[FCYCLE_WRITE], samples[FCYCLE_WRITE],
+			num_samples[FCYCLE_WRITE], &t->write_base_ns, &t->write_byte_ns);
+	if (num_samples[FCYCLE_ERASE])
+	{
+		uint64_t sum = 0;
+		for (unsigned i = 0 ; i < num_samples[FCYCLE_ERASE] ; i++)
+			sum += samples[FCYCLE_ERASE][i];
+		t->erase_ns = sum / num_samples[FCYCLE_ERASE];
+	}
+	for (unsigned i = 0 ; i < 4 ; i++)
+		t->samples[i] = num_samples[i];
+	if (n)
+		t->trace_ns = trace->records[n-1].ns - trace->records[0].ns;
+
+	// the typical spacing of back to back accesses is the cost
+	// of one access, including that of recording it
+	if (num_gaps)
+	{
+		qsort(gaps, num_gaps, sizeof(*gaps), cmp_u64);
+		t->access_ns = gaps[num_gaps / 2];
+	}
+
+	rc = 0;
+out:
+	for (unsigned i = 0 ; i < MMIO_TRACE_MAX_REGIONS ; i++)
+		free(known[i]);
+	for (unsigned i = 0 ; i < 4 ; i++)
+	{
+		free(samples[i]);
+		free(counts[i]);
+	}
+	free(gaps);
+	return rc;
+}
+
+
+int
+mmio_sim_start(
+	const mmio_trace_t * const trace,
+	mmio_sim_timing_t * const timing
+)
+{
+	mmio_sim_stop();
+
+	sim.num_maps = trace->num_maps;
+	sim.spi_region = -1;
+	for (unsigned i = 0 ; i < trace->num_maps ; i++)
+	{
+		sim.maps[i] = trace->maps[i];
+		if (!(sim.regs[i] = calloc(1, trace->maps[i].len)))
+			goto fail;
+		if (sim.spi_region < 0 && trace->maps[i].len == SIM_RCBA_LEN)
+			sim.spi_region = i;
+	}
+
+	sim.flash = malloc(SIM_FLASH_SIZE);
+	if (!sim.flash)
+		goto fail;
+	memset(sim.flash, 0xFF, SIM_FLASH_SIZE);
+
+	// typical hardware sequencing numbers, used when the trace
+	// has no cycles of a kind to measure
+	sim.timing = (mmio_sim_timing_t) {
+		.read_base_ns = 2000,
+		.read_byte_ns = 250,
+		.write_base_ns = 300000,
+		.write_byte_ns = 250,
+		.erase_ns = 45000000,
+		.access_ns = 200,
+	};
+
+	if (sim_learn(trace) < 0)
+		goto fail;
+
+	// the SPI registers start idle
+	if (sim.spi_region >= 0)
+	{
+		uint8_t * const spi = sim.regs[sim.spi_region] + SIM_SPIBAR_OFFSET;
+		put_le(spi + SIM_HSFS, 2, get_le(spi + SIM_HSFS, 2)
+			& ~(SIM_HSFS_SCIP | SIM_HSFS_FCERR | SIM_HSFS_AEL));
+		put_le(spi + SIM_HSFC, 2, get_le(spi + SIM_HSFC, 2) & ~SIM_HSFC_FGO);
+	}
+
+	if (timing)
+		*timing = sim.timing;
+
+	memset(&sim.stats, 0, sizeof(sim.stats));
+	sim.active = 1;
+	return 0;
+
+fail:
+	mmio_sim_stop();
+	errno = ENOMEM;
+	return -1;
+}
+
+
+void
+mmio_sim_stop(void)
+{
+	for (unsigned i = 0 ; i < MMIO_TRACE_MAX_REGIONS ; i++)
+		free(sim.regs[i]);
+	free(sim.flash);
+	memset(&sim, 0, sizeof(sim));
+}
+
+
+void
+mmio_sim_stats(
+	mmio_sim_stats_t * const stats
+)
+{
+	*stats = sim.stats;
+}
+
+
+const uint8_t *
+mmio_sim_flash(void)
+{
+	return sim.flash;
+}
+
+
+void *
+mmio_sim_map(
+	uint64_t phys,
+	size_t len
+)
+{
+	for (unsigned i = 0 ; sim.active && i < sim.num_maps ; i++)
+		if (sim.maps[i].phys == phys && sim.maps[i].len >= len)
+			return sim.regs[i];
+
+	// the driver asked for something the real machine never mapped
+	errno = ENODEV;
+	return NULL;
+}
+
+
+static int
+sim_find(
+	const volatile void * const addr,
+	unsigned width,
+	uint32_t * const offset
+)
+{
+	const volatile uint8_t * const p = addr;
+
+	for (unsigned i = 0 ; i < sim.num_maps ; i++)
+	{
+		if (p < sim.regs[i] || p + width > sim.regs[i] + sim.maps[i].len)
+			continue;
+		*offset = p - sim.regs[i];
+		return i;
+	}
+
+	return -1;
+}
+
+
+// spend the time that an uncached access takes on the real machine
+static void
+sim_access_delay(void)
+{
+	const uint64_t until = now_ns() + sim.timing.access_ns;
+	while (now_ns() < until)
+		;
+	sim.stats.accesses++;
+}
+
+
+static void
+sim_complete(void)
+{
+	if (!sim.busy || now_ns() < sim.complete_ns)
+		return;
+
+	uint8_t * const spi = sim.regs[sim.spi_region] + SIM_SPIBAR_OFFSET;
+
+	if (sim.cycle == FCYCLE_READ)
+	{
+		for (unsigned i = 0 ; i < sim.count ; i++)
+			spi[SIM_FDATA + i] = sim.addr + i < SIM_FLASH_SIZE
+				? sim.flash[sim.addr + i] : 0xFF;
+		sim.stats.bytes_read += sim.count;
+	} else
+	if (sim.cycle == FCYCLE_WRITE)
+	{
+		// programming can only clear bits
+		for (unsigned i = 0 ; i < sim.count ; i++)
+			if (sim.addr + i < SIM_FLASH_SIZE)
+				sim.flash[sim.addr + i] &= spi[SIM_FDATA + i];
+	} else
+	if (sim.cycle == FCYCLE_ERASE)
+	{
+		const uint32_t base = sim.addr & ~(SIM_ERASE_SIZE - 1);
+		if (base < SIM_FLASH_SIZE)
+			memset(sim.flash + base, 0xFF, SIM_ERASE_SIZE);
+	}
+
+	uint16_t hsfs = get_le(spi + SIM_HSFS, 2);
+	hsfs &= ~SIM_HSFS_SCIP;
+	hsfs |= SIM_HSFS_FDONE;
+	put_le(spi + SIM_HSFS, 2, hsfs);
+	sim.busy = 0;
+}
+
+
+static void
+sim_start_cycle(
+	uint8_t * const spi,
+	uint16_t hsfc
+)
+{
+	const mmio_sim_timing_t * const t = &sim.timing;
+
+	sim.cycle = (hsfc >> 1) & 3;
+	sim.count = ((hsfc >> 8) & 0x3F) + 1;
+	sim.addr = get_le(spi + SIM_FADDR, 4) & 0x1FFFFFF;
+	sim.busy = 1;
+	sim.stats.cycles[sim.cycle]++;
+
+	uint64_t latency = t->read_base_ns + t->read_byte_ns * sim.count;
+	if (sim.cycle == FCYCLE_WRITE)
+		latency = t->write_base_ns + t->write_byte_ns * sim.count;
+	if (sim.cycle == FCYCLE_ERASE)
+		latency = t->erase_ns;
+	sim.complete_ns = now_ns() + latency;
+
+	// FGO clears itself, and SCIP shows the cycle in progress;
+	// FDONE is write one to clear, so a stale one stays set
+	put_le(spi + SIM_HSFC, 2, hsfc & ~SIM_HSFC_FGO);
+	put_le(spi + SIM_HSFS, 2, get_le(spi + SIM_HSFS, 2) | SIM_HSFS_SCIP);
+}
+
+
+uint32_t
+mmio_sim_read(
+	const volatile void * const addr,
+	unsigned width
+)
+{
+	uint32_t offset;
+	const int region = sim.active ? sim_find(addr, width, &offset) : -1;
+	if (region < 0)
+		return ~0U; // like a read of unclaimed MMIO
+
+	sim_access_delay();
+	if (region == sim.spi_region)
+		sim_complete();
+
+	return get_le(sim.regs[region] + offset, width);
+}
+
+
+void
+mmio_sim_write(
+	volatile void * const addr,
+	unsigned width,
+	uint32_t value
+)
+{
+	uint32_t offset;
+	const int region = sim.active ? sim_find(addr, width, &offset) : -1;
+	if (region < 0)
+		return;
+
+	sim_access_delay();
+
+	uint8_t * const regs = sim.regs[region];
+	if (region != sim.spi_region || offset < SIM_SPIBAR_OFFSET)
+	{
+		put_le(regs + offset, width, value);
+		return;
+	}
+
+	sim_complete();
+
+	uint8_t * const spi = regs + SIM_SPIBAR_OFFSET;
+	const uint16_t hsfs = get_le(spi + SIM_HSFS, 2);
+	put_le(regs + offset, width, value);
+
+	// status bits are write one to clear, the rest are read only
+	const uint32_t off = offset - SIM_SPIBAR_OFFSET;
+	if (off <= SIM_HSFS + 1 && off + width > SIM_HSFS)
+	{
+		const uint16_t w1c = get_le(spi + SIM_HSFS, 2)
+			& (SIM_HSFS_FDONE | SIM_HSFS_FCERR | SIM_HSFS_AEL);
+		put_le(spi + SIM_HSFS, 2, hsfs & ~w1c);
+	}
+
+	const uint16_t hsfc = get_le(spi + SIM_HSFC, 2);
+	if (off <= SIM_HSFC + 1 && off + width > SIM_HSFC
+	&&  (hsfc & SIM_HSFC_FGO) && !sim.busy)
+		sim_start_cycle(spi, hsfc);
+}
@@ -0,0 +1,142 @@
+/** \file
+ * MMIO access recording and a simulated SPI controller for replay.
+ *
+ * When spiflash.c is built with -DSPIFLASH_TRACE every mapping and
+ * register access is logged, with a nanosecond timestamp and the
+ * value, to the file named by the SPIFLASH_TRACE environment variable
+ * (spiflash.trace by default):
+ *
+ *   flashtools-mmio-trace 1
+ *   map <region> <physical address> <length>
+ *   <ns> r|w <region> <width> <offset> <value>
+ *
+ * Built with -DSPIFLASH_SIM instead, the driver's mappings and
+ * accesses go to a simulated controller.  The simulator is set up
+ * from a trace: registers start with the values the real machine
+ * returned, flash contents are what the traced read cycles saw, and
+ * each hardware sequencing cycle completes after the latency measured
+ * for cycles of its type and size, in real time, so that the driver's
+ * wait loops behave as they did on the machine.
+ */
+#ifndef _mmio_trace_h_
+#define _mmio_trace_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MMIO_TRACE_MAX_REGIONS 8
+#define MMIO_TRACE_ENV "SPIFLASH_TRACE"
+#define MMIO_TRACE_DEFAULT "spiflash.trace"
+#define MMIO_SIM_FLASH_SIZE 0x2000000
+
+typedef struct {
+	uint64_t ns;            // since the trace was started
+	uint32_t offset;        // from the start of the mapping
+	uint32_t value;
+	uint8_t region;
+	uint8_t width;          // in bytes
+	uint8_t write;
+} mmio_record_t;
+
+typedef struct {
+	uint64_t phys;
+	uint64_t len;
+} mmio_map_t;
+
+typedef struct {
+	mmio_map_t maps[MMIO_TRACE_MAX_REGIONS];
+	unsigned num_maps;
+	mmio_record_t * records;
+	size_t num_records;
+} mmio_trace_t;
+
+
+// Recording, used by spiflash.c built with SPIFLASH_TRACE
+extern void *
+mmio_trace_map(
+	uint64_t phys,
+	size_t len
+);
+
+extern void
+mmio_trace_access(
+	const volatile void * addr,
+	unsigned width,
+	uint32_t value,
+	int write
+);
+
+
+// Trace files
+extern int
+mmio_trace_load(
+	mmio_trace_t * trace,
+	const char * filename
+);
+
+extern void
+mmio_trace_free(
+	mmio_trace_t * trace
+);
+
+
+/*
+ * The simulated controller.  There is one, since the driver's MMIO
+ * accessors have no context to pass through; mmio_sim_map and the
+ * accessors fail until mmio_sim_start has been called.
+ */
+typedef struct {
+	uint64_t read_base_ns;  // read cycle latency = base + per_byte * n
+	uint64_t read_byte_ns;
+	uint64_t write_base_ns;
+	uint64_t write_byte_ns;
+	uint64_t erase_ns;
+	uint64_t access_ns;     // cost of a single register access
+	unsigned samples[4];    // cycles measured, by FCYCLE
+	uint64_t trace_ns;      // from the first to the last access
+} mmio_sim_timing_t;
+
+typedef struct {
+	uint64_t cycles[4];     // by FCYCLE
+	uint64_t accesses;
+	uint64_t bytes_read;
+} mmio_sim_stats_t;
+
+extern int
+mmio_sim_start(
+	const mmio_trace_t * trace,
+	mmio_sim_timing_t * timing
+);
+
+extern void
+mmio_sim_stop(void);
+
+extern void
+mmio_sim_stats(
+	mmio_sim_stats_t * stats
+);
+
+// The simulated flash contents, MMIO_SIM_FLASH_SIZE bytes
+extern const uint8_t *
+mmio_sim_flash(void);
+
+extern void *
+mmio_sim_map(
+	uint64_t phys,
+	size_t len
+);
+
+extern uint32_t
+mmio_sim_read(
+	const volatile void * addr,
+	unsigned width
+);
+
+extern void
+mmio_sim_write(
+	volatile void * addr,
+	unsigned width,
+	uint32_t value
+);
+
+#endif
@@ -0,0 +1,463 @@
+/** \file
+ * Read and write model specific registers on every CPU.
+ *
+ * Each CPU is a job on the worker pool that opens its own
+ * /dev/cpu/N/msr and works through the whole list, so the cross-CPU
+ * calls that the kernel makes for every access run in parallel.  The
+ * results are then grouped by value, and any MSR that is not the same
+ * on every CPU is reported along with which CPUs have which value.
+ *
+ * WARNING: Like poke, writing the wrong MSR can crash or damage the
+ * machine.  The msr kernel module must be loaded.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "util.h"
+#include "pool.h"
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "cpus",		1, NULL, 'c' },
+	{ "and",		0, NULL, 'a' },
+	{ "or",			0, NULL, 'o' },
+	{ "threads",		1, NULL, 'j' },
+	{ "per-cpu",		0, NULL, 'p' },
+	{ "verbose",		0, NULL, 'v' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: sudo msr [options] msr[=value]...\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -c | --cpus LIST       CPUs to use, like 0-3,8 (default all online)\n"
+"    -a | --and             AND the values with the MSR contents\n"
+"    -o | --or              OR the values with the MSR contents\n"
+"    -j | --threads N       Worker threads (default one per CPU)\n"
+"    -p | --per-cpu         Print every CPU's value, not just the groups\n"
+"\n"
+"An msr alone is read, msr=value is written and then read back.\n"
+"Each MSR is printed with the CPUs that have each value; the exit\n"
+"status is non-zero if any MSR differs between CPUs or fails.\n"
+"The msr module must be loaded (modprobe msr).\n"
+"\n";
+
+
+typedef struct {
+	uint32_t msr;
+	int write;
+	uint64_t value;
+} msr_op_t;
+
+typedef struct {
+	unsigned cpu;
+	const msr_op_t * ops;
+	unsigned num_ops;
+	mem_op_t mem_op;
+	uint64_t * values;      // read back, one per op
+	int * errors;           // errno of the op, or 0
+} cpu_job_t;
+
+
+/*
+ * Parse a list of CPU numbers and ranges like 0-3,8,10-11 into a
+ * sorted array.  Returns the number of CPUs, or -1 if malformed.
+ */
+static int
+parse_cpus(
+	const char * s,
+	unsigned ** cpus_out
+)
+{
+	unsigned * cpus = NULL;
+	unsigned num_cpus = 0;
+	unsigned max_cpus = 0;
+
+	while (*s && *s != '\n')
+	{
+		char * end;
+		const unsigned long first = strtoul(s, &end, 0);
+		unsigned long last = first;
+		if (end == s)
+			goto fail;
+
+		s = end;
+		if (*s == '-')
+		{
+			last = strtoul(s + 1, &end, 0);
+			if (end == s + 1 || last < first)
+				goto fail;
+			s = end;
+		}
+
+		for (unsigned long cpu = first ; cpu <= last ; cpu++)
+		{
+			if (num_cpus == max_cpus)
+			{
+				max_cpus = max_cpus ? max_cpus * 2 : 64;
+				unsigned * const c = realloc(cpus, max_cpus * sizeof(*c));
+				if (!c)
+					goto fail;
+				cpus = c;
+			}
+
+			// keep the list sorted and without repeats
+			unsigned i = num_cpus;
+			while (i > 0 && cpus[i - 1] > cpu)
+				i--;
+			if (i > 0 && cpus[i - 1] == cpu)
+				continue;
+			memmove(&cpus[i + 1], &cpus[i], (num_cpus - i) * sizeof(*cpus));
+			cpus[i] = cpu;
+			num_cpus++;
+		}
+
+		if (*s == ',')
+			s++;
+		else
+		if (*s && *s != '\n')
+			goto fail;
+	}
+
+	*cpus_out = cpus;
+	return num_cpus;
+
+fail:
+	free(cpus);
+	return -1;
+}
+
+
+static int
+online_cpus(
+	unsigned ** cpus
+)
+{
+	char buf[4096];
+	FILE * const file = fopen("/sys/devices/system/cpu/online", "r");
+	if (!file)
+		return -1;
+
+	const int rc = fgets(buf, sizeof(buf), file) ? parse_cpus(buf, cpus) : -1;
+	fclose(file);
+	return rc;
+}
+
+
+static void
+cpu_job(
+	void * arg
+)
+{
+	cpu_job_t * const job = arg;
+	char path[64];
+	snprintf(path, sizeof(path), "/dev/cpu/%u/msr", job->cpu);
+
+	int has_writes = 0;
+	for (unsigned i = 0 ; i < job->num_ops ; i++)
+		has_writes |= job->ops[i].write;
+
+	const int fd = open(path, has_writes ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+	{
+		for (unsigned i = 0 ; i < job->num_ops ; i++)
+			job->errors[i] = errno;
+		return;
+	}
+
+	for (unsigned i = 0 ; i < job->num_ops ; i++)
+	{
+		const msr_op_t * const op = &job->ops[i];
+		uint64_t value = 0;
+		errno = 0;
+
+		if (op->write)
+		{
+			// AND and OR work on the current contents
+			if (job->mem_op != MEM_SET
+			&&  pread(fd, &value, sizeof(value), op->msr) != sizeof(value))
+				goto error;
+
+			memcpy_width(&value, &op->value, sizeof(value),
+				sizeof(value), job->mem_op);
+
+			if (pwrite(fd, &value, sizeof(value), op->msr) != sizeof(value))
+				goto error;
+		}
+
+		if (pread(fd, &value, sizeof(value), op->msr) != sizeof(value))
+			goto error;
+
+		job->values[i] = value;
+		job->errors[i] = 0;
+		continue;
+
+	error:
+		// a short transfer from the msr driver means EIO
+		job->errors[i] = errno ? errno : EIO;
+	}
+
+	close(fd);
+}
+
+
+// Print a sorted CPU list as ranges
+static void
+print_cpus(
+	const unsigned * const cpus,
+	unsigned num_cpus
+)
+{
+	for (unsigned i = 0 ; i < num_cpus ; )
+	{
+		unsigned j = i;
+		while (j + 1 < num_cpus && cpus[j + 1] == cpus[j] + 1)
+			j++;
+
+		printf("%s%u", i ? "," : "", cpus[i]);
+		if (j > i)
+			printf("-%u", cpus[j]);
+		i = j + 1;
+	}
+}
+
+
+/*
+ * Group the CPUs by the result for one op and print the groups.
+ * Returns 1 if the result is not the same on every CPU or any of
+ * them failed.
+ */
+static int
+print_op(
+	const msr_op_t * const op,
+	unsigned index,
+	const cpu_job_t * const jobs,
+	unsigned num_cpus,
+	int per_cpu,
+	unsigned * const group
+)
+{
+	unsigned * const members = group + num_cpus;
+	unsigned num_groups = 0;
+	int failed = 0;
+
+	// group[cpu] is the index of the first job with the same result
+	for (unsigned c = 0 ; c < num_cpus ; c++)
+	{
+		const cpu_job_t * const job = &jobs[c];
+		failed |= job->errors[index] != 0;
+
+		unsigned g = 0;
+		while (g < c)
+		{
+			const cpu_job_t * const first = &jobs[g];
+			if (group[g] == g
+			&&  first->errors[index] == job->errors[index]
+			&&  (job->errors[index] || first->values[index] == job->values[index]))
+				break;
+			g++;
+		}
+
+		group[c] = g;
+		num_groups += g == c;
+	}
+
+	printf("0x%08"PRIx32"%s", op->msr, op->write ? " (written)" : "");
+	if (num_groups > 1)
+		printf(" differs");
+	printf("\n");
+
+	for (unsigned g = 0 ; g < num_cpus ; g++)
+	{
+		if (group[g] != g)
+			continue;
+
+		unsigned n = 0;
+		for (unsigned c = g ; c < num_cpus ; c++)
+			if (group[c] == g)
+				members[n++] = jobs[c].cpu;
+
+		const cpu_job_t * const job = &jobs[g];
+		if (job->errors[index])
+			printf("  %-18s", strerror(job->errors[index]));
+		else
+			printf("  0x%016"PRIx64, job->values[index]);
+
+		printf(" cpus ");
+		print_cpus(members, n);
+		printf("\n");
+	}
+
+	if (per_cpu)
+	{
+		for (unsigned c = 0 ; c < num_cpus ; c++)
+		{
+			if (jobs[c].errors[index])
+				continue;
+			printf("    cpu %-4u 0x%016"PRIx64"\n",
+				jobs[c].cpu, jobs[c].values[index]);
+		}
+	}
+
+	return num_groups > 1 || failed;
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * const prog_name = argv[0];
+	const char * cpu_list = NULL;
+	mem_op_t mem_op = MEM_SET;
+	unsigned threads = 0;
+	int per_cpu = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?vc:aoj:p", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'c':
+			cpu_list = optarg;
+			break;
+		case 'a':
+			mem_op = MEM_AND;
+			break;
+		case 'o':
+			mem_op = MEM_OR;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			per_cpu = 1;
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	msr_op_t * const ops = calloc(argc, sizeof(*ops));
+	if (!ops)
+	{
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	const unsigned num_ops = argc;
+	for (unsigned i = 0 ; i < num_ops ; i++)
+	{
+		char * end;
+		ops[i].msr = strtoul(argv[i], &end, 0);
+		int bad = end == argv[i];
+		if (*end == '=')
+		{
+			const char * const value = end + 1;
+			ops[i].write = 1;
+			ops[i].value = strtoull(value, &end, 0);
+			bad |= end == value;
+		}
+
+		if (*end != '\0' || bad)
+		{
+			fprintf(stderr, "%s: Unable to parse '%s'\n", prog_name, argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	unsigned * cpus;
+	const int num_cpus = cpu_list
+		? parse_cpus(cpu_list, &cpus)
+		: online_cpus(&cpus);
+	if (num_cpus <= 0)
+	{
+		fprintf(stderr, "%s: no CPUs in '%s'\n", prog_name,
+			cpu_list ? cpu_list : "/sys/devices/system/cpu/online");
+		return EXIT_FAILURE;
+	}
+
+	cpu_job_t * const jobs = calloc(num_cpus, sizeof(*jobs));
+	uint64_t * const values = calloc(num_cpus * num_ops, sizeof(*values));
+	int * const errors = calloc(num_cpus * num_ops, sizeof(*errors));
+	unsigned * const group = calloc(2 * num_cpus, sizeof(*group));
+	if (!jobs || !values || !errors || !group)
+	{
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	pool_t * const pool = pool_create(threads);
+	if (!pool)
+	{
+		fprintf(stderr, "%s: unable to start worker threads\n", prog_name);
+		return EXIT_FAILURE;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int c = 0 ; c < num_cpus ; c++)
+	{
+		cpu_job_t * const job = &jobs[c];
+		job->cpu = cpus[c];
+		job->ops = ops;
+		job->num_ops = num_ops;
+		job->mem_op = mem_op;
+		job->values = &values[c * num_ops];
+		job->errors = &errors[c * num_ops];
+
+		if (pool_submit(pool, cpu_job, job) < 0)
+			cpu_job(job);
+	}
+
+	pool_wait(pool);
+	pool_destroy(pool);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (verbose)
+		fprintf(stderr, "%s: %u MSRs on %d CPUs in %.3f ms\n",
+			prog_name, num_ops, num_cpus,
+			(end.tv_sec - start.tv_sec) * 1e3
+			+ (end.tv_nsec - start.tv_nsec) / 1e6);
+
+	if (errors[0] == ENOENT || errors[0] == ENXIO)
+		fprintf(stderr, "%s: no /dev/cpu/%u/msr, is the msr module loaded?\n",
+			prog_name, cpus[0]);
+
+	int differs = 0;
+	for (unsigned i = 0 ; i < num_ops ; i++)
+		differs |= print_op(&ops[i], i, jobs, num_cpus, per_cpu, group);
+
+	return differs ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,17 @@
+/** \file
+ * Default PCIe extended config base for the tools that map the LPC
+ * bridge.  Not part of the library interface; a -p option overrides it.
+ */
+
+#ifndef _pciexbar_h_
+#define _pciexbar_h_
+
+//TODO: BEGIN NEEDS AUTODISCOVERING
+#ifdef __darwin__
+#define PCIEXBAR 0xE0000000 // MBP11,2
+#else
+#define PCIEXBAR 0x80000000 // Winterfell
+//#define PCIEXBAR 0xF8000000 // x230
+#endif
+
+#endif
@@ -0,0 +1,293 @@
+/** \file
+ * Work stealing worker thread pool.
+ *
+ * Each worker owns a deque of jobs.  Jobs submitted from inside a
+ * job go onto the submitting worker's own deque and are run newest
+ * first, which keeps a recursive walk on one thread and its data in
+ * cache.  Jobs submitted from outside the pool are dealt round robin.
+ * A worker whose deque is empty steals the oldest job from another
+ * worker, so one deep directory or large volume does not leave the
+ * other threads idle.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+
+struct pool_job {
+	struct pool_job * next;
+	struct pool_job * prev;
+	pool_fn_t fn;
+	void * arg;
+};
+
+struct pool_deque {
+	pthread_mutex_t lock;
+	struct pool_job * head; // oldest, taken by thieves
+	struct pool_job * tail; // newest, taken by the owner
+};
+
+struct pool_worker {
+	pool_t * pool;
+	unsigned id;
+	pthread_t thread;
+	struct pool_deque deque;
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work; // signalled when a job is queued
+	pthread_cond_t idle; // signalled when pending reaches zero
+	unsigned queued; // sitting in some deque
+	unsigned pending; // queued or running
+	unsigned next; // round robin for external submitters
+	int shutdown;
+	unsigned num_threads; // started, always workers[0..num_threads)
+	unsigned num_workers; // allocated
+	pthread_key_t self; // the pool_worker of the calling thread
+	struct pool_worker * workers;
+};
+
+
+static void
+deque_push(
+	struct pool_deque * const dq,
+	struct pool_job * const job
+)
+{
+	pthread_mutex_lock(&dq->lock);
+
+	job->next = NULL;
+	job->prev = dq->tail;
+	if (dq->tail)
+		dq->tail->next = job;
+	else
+		dq->head = job;
+	dq->tail = job;
+
+	pthread_mutex_unlock(&dq->lock);
+}
+
+
+static struct pool_job *
+deque_pop(
+	struct pool_deque * const dq,
+	const int oldest
+)
+{
+	pthread_mutex_lock(&dq->lock);
+
+	struct pool_job * const job = oldest ? dq->head : dq->tail;
+	if (job)
+	{
+		if (job->prev)
+			job->prev->next = job->next;
+		else
+			dq->head = job->next;
+
+		if (job->next)
+			job->next->prev = job->prev;
+		else
+			dq->tail = job->prev;
+	}
+
+	pthread_mutex_unlock(&dq->lock);
+	return job;
+}
+
+
+static struct pool_job *
+pool_take(
+	pool_t * const pool,
+	struct pool_worker * const self
+)
+{
+	struct pool_job * job = deque_pop(&self->deque, 0);
+
+	// steal from the other workers, starting with the next one
+	for (unsigned i = 1 ; !job && i < pool->num_threads ; i++)
+	{
+		const unsigned victim = (self->id + i) % pool->num_threads;
+		job = deque_pop(&pool->workers[victim].deque, 1);
+	}
+
+	return job;
+}
+
+
+static void *
+pool_worker(
+	void * arg
+)
+{
+	struct pool_worker * const self = arg;
+	pool_t * const pool = self->pool;
+
+	pthread_setspecific(pool->self, self);
+
+	while (1)
+	{
+		struct pool_job * const job = pool_take(pool, self);
+		if (job)
+		{
+			pthread_mutex_lock(&pool->lock);
+			pool->queued--;
+			pthread_mutex_unlock(&pool->lock);
+
+			job->fn(job->arg);
+			free(job);
+
+			pthread_mutex_lock(&pool->lock);
+			if (--pool->pending == 0)
+				pthread_cond_broadcast(&pool->idle);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+
+		// the counter is raised before the job reaches a deque,
+		// so a non-zero count with nothing to take is transient
+		pthread_mutex_lock(&pool->lock);
+		while (pool->queued == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		const int done = pool->queued == 0;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (done)
+			break;
+	}
+
+	return NULL;
+}
+
+
+pool_t *
+pool_create(
+	unsigned threads
+)
+{
+	if (threads == 0)
+	{
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+
+	pool_t * const pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	pool->workers = calloc(threads, sizeof(*pool->workers));
+	if (!pool->workers)
+	{
+		free(pool);
+		return NULL;
+	}
+
+	if (pthread_key_create(&pool->self, NULL) != 0)
+	{
+		free(pool->workers);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+
+	pool->num_workers = threads;
+	for (unsigned i = 0 ; i < threads ; i++)
+	{
+		struct pool_worker * const w = &pool->workers[i];
+		w->pool = pool;
+		w->id = i;
+		pthread_mutex_init(&w->deque.lock, NULL);
+	}
+
+	// the deques all exist before any worker can try to steal
+	for (unsigned i = 0 ; i < threads ; i++)
+	{
+		struct pool_worker * const w = &pool->workers[pool->num_threads];
+		if (pthread_create(&w->thread, NULL, pool_worker, w) != 0)
+			break;
+		pool->num_threads++;
+	}
+
+	if (pool->num_threads == 0)
+	{
+		pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+
+int
+pool_submit(
+	pool_t * const pool,
+	pool_fn_t fn,
+	void * arg
+)
+{
+	struct pool_job * const job = calloc(1, sizeof(*job));
+	if (!job)
+		return -1;
+
+	job->fn = fn;
+	job->arg = arg;
+
+	struct pool_worker * self = pthread_getspecific(pool->self);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->queued++;
+	pool->pending++;
+	if (!self)
+		self = &pool->workers[pool->next++ % pool->num_threads];
+	pthread_mutex_unlock(&pool->lock);
+
+	deque_push(&self->deque, job);
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+
+void
+pool_wait(
+	pool_t * const pool
+)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending != 0)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+void
+pool_destroy(
+	pool_t * const pool
+)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned i = 0 ; i < pool->num_threads ; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	// the workers drain every deque before they exit
+	for (unsigned i = 0 ; i < pool->num_workers ; i++)
+		pthread_mutex_destroy(&pool->workers[i].deque.lock);
+
+	pthread_key_delete(pool->self);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->idle);
+	free(pool->workers);
+	free(pool);
+}
@@ -0,0 +1,41 @@
+/** \file
+ * Work stealing worker thread pool.
+ *
+ * Jobs may submit more jobs; pool_wait() returns once every job,
+ * including the ones submitted by other jobs, has completed.
+ */
+#ifndef _pool_h_
+#define _pool_h_
+
+typedef struct pool pool_t;
+
+typedef void (*pool_fn_t)(void * arg);
+
+
+// threads == 0 starts one worker per online CPU
+extern pool_t *
+pool_create(
+	unsigned threads
+);
+
+
+extern int
+pool_submit(
+	pool_t * pool,
+	pool_fn_t fn,
+	void * arg
+);
+
+
+extern void
+pool_wait(
+	pool_t * pool
+);
+
+
+extern void
+pool_destroy(
+	pool_t * pool
+);
+
+#endif
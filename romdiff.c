@@ -0,0 +1,670 @@
+/** \file
+ * Structure aware diff of two ROM images.
+ *
+ * Both images are indexed as CBFS and as UEFI firmware volumes,
+ * every entry is hashed on a pool of worker threads, and the
+ * entries are matched by name (CBFS) or GUID (FFS).  Changes are
+ * reported per component along with the erase blocks they touch,
+ * followed by any changed blocks that are not inside an entry.
+ * Masked ranges, like the NVRAM store or the MRC cache, are left out
+ * of both the entries and the block compare.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "util.h"
+#include "pool.h"
+#include "sha256.h"
+#include "cbfs_index.h"
+#include "uefi_index.h"
+#include "mask.h"
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "block",		1, NULL, 'b' },
+	{ "threads",		1, NULL, 'j' },
+	{ "mask",		1, NULL, 'x' },
+	{ "mask-file",		1, NULL, 'X' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: romdiff [options] old.rom new.rom\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -b | --block N         Erase block size to group changes (default 0x1000)\n"
+"    -j | --threads N       Worker threads for hashing (default one per CPU)\n"
+"    -x | --mask RULE,...   Ignore volatile parts of the images, see below\n"
+"    -X | --mask-file FILE  Read mask rules from a file, one per line\n"
+"\n"
+"Mask rules:\n"
+"    fmap:NAME              FMAP area, like RW_MRC_CACHE\n"
+"    cbfs:NAME              CBFS file, like mrc.cache\n"
+"    fv:GUID                Firmware volumes with this file system GUID\n"
+"    range:OFFSET:LEN       Byte range of the image\n"
+"\n"
+"A rule masks its ranges in both images.\n"
+"\n";
+
+
+typedef enum {
+	COMPONENT_CBFS,
+	COMPONENT_UEFI,
+} component_t;
+
+static const char * const component_names[] = {
+	[COMPONENT_CBFS] = "cbfs",
+	[COMPONENT_UEFI] = "uefi",
+};
+
+typedef struct {
+	component_t component;
+	char key[CBFS_NAME_LEN + 8];
+	char name[CBFS_NAME_LEN + 80];
+	uint64_t offset; // of the whole entry
+	uint64_t len;
+	uint64_t data_offset; // of the hashed contents
+	uint64_t data_len;
+	uint32_t type;
+	uint8_t hash[SHA256_LEN];
+} rom_entry_t;
+
+typedef struct {
+	const char * filename;
+	const uint8_t * rom;
+	uint64_t size;
+	rom_entry_t * entries;
+	size_t num_entries;
+} rom_image_t;
+
+typedef struct {
+	const rom_image_t * image;
+	size_t start;
+	size_t count;
+} hash_job_t;
+
+
+static rom_entry_t *
+rom_add_entry(
+	rom_image_t * const image
+)
+{
+	if ((image->num_entries & (image->num_entries - 1)) == 0)
+	{
+		const size_t n = image->num_entries ? image->num_entries * 2 : 64;
+		rom_entry_t * const e = realloc(image->entries, n * sizeof(*e));
+		if (!e)
+		{
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		image->entries = e;
+	}
+
+	rom_entry_t * const e = &image->entries[image->num_entries++];
+	memset(e, 0, sizeof(*e));
+	return e;
+}
+
+
+static int
+rom_entry_key_cmp(
+	const void * a_ptr,
+	const void * b_ptr
+)
+{
+	const rom_entry_t * const a = a_ptr;
+	const rom_entry_t * const b = b_ptr;
+
+	if (a->component != b->component)
+		return a->component < b->component ? -1 : 1;
+	return strcmp(a->key, b->key);
+}
+
+
+static void
+rom_index(
+	rom_image_t * const image
+)
+{
+	cbfs_index_t cbfs;
+	if (cbfs_index_build(&cbfs, image->rom, image->size, NULL) == 0)
+	{
+		for (size_t i = 0 ; i < cbfs.num_files ; i++)
+		{
+			const cbfs_entry_t * const f = &cbfs.files[i];
+			if (f->type == CBFS_COMPONENT_NULL)
+				continue;
+
+			rom_entry_t * const e = rom_add_entry(image);
+			e->component = COMPONENT_CBFS;
+			snprintf(e->key, sizeof(e->key), "%s", f->name);
+			snprintf(e->name, sizeof(e->name), "%s", f->name);
+			e->offset = f->offset;
+			e->len = f->header_len + (uint64_t) f->len;
+			e->data_offset = f->offset + f->header_len;
+			e->data_len = f->len;
+			e->type = f->type;
+		}
+
+		cbfs_index_free(&cbfs);
+	} else
+	if (verbose)
+		fprintf(stderr, "%s: no CBFS found\n", image->filename);
+
+	uefi_index_t uefi;
+	if (uefi_index_build(&uefi, image->rom, image->size, NULL) == 0)
+	{
+		const size_t first = image->num_entries;
+
+		for (size_t i = 0 ; i < uefi.num_files ; i++)
+		{
+			const uefi_file_t * const f = &uefi.files[i];
+			if (f->type == EFI_FV_FILETYPE_FFS_PAD)
+				continue;
+
+			char * const guid = guid_string((uint8_t *) f->guid);
+			if (strcmp(guid, EFI_EMPTY_GUID) == 0)
+			{
+				free(guid);
+				continue;
+			}
+
+			// the same GUID can appear in more than one volume,
+			// so number the repeats in the order they are found
+			unsigned repeat = 0;
+			for (size_t j = first ; j < image->num_entries ; j++)
+				if (strncmp(image->entries[j].key, guid, 36) == 0)
+					repeat++;
+
+			rom_entry_t * const e = rom_add_entry(image);
+			e->component = COMPONENT_UEFI;
+			if (repeat)
+				snprintf(e->key, sizeof(e->key), "%s#%u", guid, repeat);
+			else
+				snprintf(e->key, sizeof(e->key), "%s", guid);
+			snprintf(e->name, sizeof(e->name), "%s%s%s",
+				e->key, f->name[0] ? " " : "", f->name);
+			e->offset = f->offset;
+			e->len = f->len;
+			e->data_offset = f->offset + f->header_len;
+			e->data_len = f->len - f->header_len;
+			e->type = f->type;
+			free(guid);
+		}
+
+		uefi_index_free(&uefi);
+	}
+
+	if (verbose)
+		fprintf(stderr, "%s: %zu entries\n",
+			image->filename, image->num_entries);
+}
+
+
+// Masked entries are neither hashed nor compared
+static void
+rom_drop_masked(
+	rom_image_t * const image,
+	const mask_t * const mask
+)
+{
+	size_t out = 0;
+
+	for (size_t i = 0 ; i < image->num_entries ; i++)
+	{
+		const rom_entry_t * const e = &image->entries[i];
+		if (mask_overlaps(mask, e->offset, e->len))
+		{
+			if (verbose > 1)
+				fprintf(stderr, "%s: masked %s\n",
+					image->filename, e->name);
+			continue;
+		}
+
+		image->entries[out++] = *e;
+	}
+
+	image->num_entries = out;
+}
+
+
+static void
+hash_entries(
+	void * arg
+)
+{
+	hash_job_t * const job = arg;
+
+	for (size_t i = job->start ; i < job->start + job->count ; i++)
+	{
+		rom_entry_t * const e = &job->image->entries[i];
+		sha256(job->image->rom + e->data_offset, e->data_len, e->hash);
+	}
+}
+
+
+static void
+submit_hashes(
+	pool_t * const pool,
+	rom_image_t * const image,
+	hash_job_t * const jobs,
+	size_t * const num_jobs
+)
+{
+	// small batches keep every worker busy even when a few
+	// entries, like the DXE volume, are much larger than the rest
+	const size_t batch = 4;
+
+	for (size_t i = 0 ; i < image->num_entries ; i += batch)
+	{
+		hash_job_t * const job = &jobs[(*num_jobs)++];
+		job->image = image;
+		job->start = i;
+		job->count = image->num_entries - i < batch
+			? image->num_entries - i : batch;
+
+		if (pool_submit(pool, hash_entries, job) < 0)
+			hash_entries(job);
+	}
+}
+
+
+typedef struct {
+	const rom_image_t * old;
+	const rom_image_t * new;
+	const mask_t * mask;
+	uint64_t block_size;
+	uint8_t * covered; // changed blocks accounted to an entry
+} diff_t;
+
+
+static int
+block_differs(
+	const diff_t * const d,
+	uint64_t block
+)
+{
+	const uint64_t start = block * d->block_size;
+	if (start >= d->old->size || start >= d->new->size)
+		return 1;
+
+	uint64_t len = d->block_size;
+	if (len > d->old->size - start)
+		len = d->old->size - start;
+	if (len > d->new->size - start)
+		len = d->new->size - start;
+
+	// only the unmasked runs of the block are compared
+	const uint64_t end = start + len;
+	uint64_t offset = start;
+	while (1)
+	{
+		offset = mask_next(d->mask, offset, end, &len);
+		if (len == 0)
+			return 0;
+		if (memcmp(d->old->rom + offset, d->new->rom + offset, len) != 0)
+			return 1;
+		offset += len;
+	}
+}
+
+
+/*
+ * Print the changed erase blocks in a range as a compact list of
+ * spans, and mark them as accounted for.
+ */
+static void
+print_blocks(
+	const diff_t * const d,
+	const char * const label,
+	uint64_t start,
+	uint64_t end
+)
+{
+	if (end <= start)
+		return;
+
+	const uint64_t first = start / d->block_size;
+	const uint64_t last = (end - 1) / d->block_size;
+	int64_t run = -1;
+	unsigned count = 0;
+
+	printf(" %s", label);
+
+	for (uint64_t b = first ; b <= last + 1 ; b++)
+	{
+		const int changed = b <= last && block_differs(d, b);
+		if (changed)
+		{
+			d->covered[b] = 1;
+			count++;
+			if (run < 0)
+				run = b;
+			continue;
+		}
+
+		if (run < 0)
+			continue;
+
+		printf(" %08"PRIx64"-%08"PRIx64,
+			run * d->block_size,
+			b * d->block_size - 1);
+		run = -1;
+	}
+
+	if (count == 0)
+		printf(" none");
+}
+
+
+static void
+print_change(
+	const diff_t * const d,
+	const char * const status,
+	const rom_entry_t * const old,
+	const rom_entry_t * const new
+)
+{
+	const rom_entry_t * const e = new ? new : old;
+
+	printf("  %-9s %-50s", status, e->name);
+
+	if (old)
+		printf(" %08"PRIx64"[%"PRIx64"]", old->offset, old->len);
+	else
+		printf(" -");
+	printf(" ->");
+	if (new)
+		printf(" %08"PRIx64"[%"PRIx64"]", new->offset, new->len);
+	else
+		printf(" -");
+
+	if (old && new && old->type != new->type)
+		printf(" type %x->%x", old->type, new->type);
+
+	// blocks in the new image that hold the entry, and the
+	// blocks that held it in the old image if it moved.
+	if (new)
+		print_blocks(d, "blocks", new->offset, new->offset + new->len);
+	if (old && (!new || old->offset != new->offset))
+		print_blocks(d, "old blocks", old->offset, old->offset + old->len);
+
+	printf("\n");
+}
+
+
+// Range of the sorted entries that belong to a component
+static size_t
+component_range(
+	const rom_image_t * const image,
+	component_t component,
+	size_t * const start
+)
+{
+	size_t i = 0;
+	while (i < image->num_entries && image->entries[i].component < component)
+		i++;
+	*start = i;
+	while (i < image->num_entries && image->entries[i].component == component)
+		i++;
+	return i;
+}
+
+
+static int
+diff_component(
+	const diff_t * const d,
+	component_t component
+)
+{
+	int changes = 0;
+	size_t i, j;
+	const size_t old_end = component_range(d->old, component, &i);
+	const size_t new_end = component_range(d->new, component, &j);
+
+	// both lists are sorted by key, so walk them together
+	while (i < old_end || j < new_end)
+	{
+		const rom_entry_t * old = i < old_end ? &d->old->entries[i] : NULL;
+		const rom_entry_t * new = j < new_end ? &d->new->entries[j] : NULL;
+		const char * status = NULL;
+
+		if (old && new)
+		{
+			const int cmp = strcmp(old->key, new->key);
+			if (cmp < 0)
+				new = NULL;
+			else
+			if (cmp > 0)
+				old = NULL;
+		}
+
+		if (old && new)
+		{
+			if (memcmp(old->hash, new->hash, SHA256_LEN) != 0
+			||  old->type != new->type)
+				status = "modified";
+			else
+			if (old->offset != new->offset)
+				status = "moved";
+			i++;
+			j++;
+		} else
+		if (old)
+		{
+			status = "removed";
+			i++;
+		} else {
+			status = "added";
+			j++;
+		}
+
+		if (!status)
+			continue;
+
+		if (changes++ == 0)
+			printf("%s:\n", component_names[component]);
+
+		print_change(d, status, old, new);
+	}
+
+	return changes;
+}
+
+
+static int
+diff_unaccounted(
+	const diff_t * const d
+)
+{
+	const uint64_t size = d->old->size > d->new->size
+		? d->old->size : d->new->size;
+	const uint64_t blocks = (size + d->block_size - 1) / d->block_size;
+	int64_t run = -1;
+	int changes = 0;
+
+	for (uint64_t b = 0 ; b <= blocks ; b++)
+	{
+		if (b < blocks && !d->covered[b] && block_differs(d, b))
+		{
+			if (run < 0)
+				run = b;
+			continue;
+		}
+
+		if (run < 0)
+			continue;
+
+		if (changes++ == 0)
+			printf("other:\n");
+		printf("  %-9s %08"PRIx64"-%08"PRIx64"\n",
+			"modified",
+			run * d->block_size,
+			b * d->block_size - 1);
+		run = -1;
+	}
+
+	return changes;
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * const prog_name = argv[0];
+	uint64_t block_size = 0x1000;
+	unsigned threads = 0;
+	mask_spec_t mask_spec = {};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?vb:j:x:X:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			if (mask_spec_add(&mask_spec, optarg) < 0)
+			{
+				fprintf(stderr, "%s: bad mask rule '%s'\n",
+					prog_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'X':
+			if (mask_spec_load(&mask_spec, optarg) < 0)
+			{
+				fprintf(stderr, "%s: bad mask file '%s'\n",
+					prog_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	if (block_size == 0 || (block_size & (block_size - 1)) != 0)
+	{
+		fprintf(stderr, "%s: block size must be a power of two\n", prog_name);
+		return EXIT_FAILURE;
+	}
+
+	rom_image_t images[2] = {};
+	mask_t mask = {};
+	for (int i = 0 ; i < 2 ; i++)
+	{
+		rom_image_t * const image = &images[i];
+		image->filename = argv[i];
+		image->rom = map_file(image->filename, &image->size, 1);
+		if (image->rom == NULL)
+		{
+			fprintf(stderr, "Failed to map ROM file: %s '%s'\n",
+				image->filename, strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		const int matched = mask_resolve(&mask, &mask_spec,
+			image->rom, image->size);
+		if (matched < 0)
+		{
+			perror("mask_resolve");
+			return EXIT_FAILURE;
+		}
+		if (verbose && mask_spec.num_rules)
+			fprintf(stderr, "%s: %d of %u mask rules matched\n",
+				image->filename, matched, mask_spec.num_rules);
+
+		rom_index(image);
+	}
+
+	for (int i = 0 ; i < 2 ; i++)
+		rom_drop_masked(&images[i], &mask);
+
+	pool_t * const pool = pool_create(threads);
+	if (!pool)
+	{
+		fprintf(stderr, "%s: unable to start worker threads\n", prog_name);
+		return EXIT_FAILURE;
+	}
+
+	hash_job_t * jobs = calloc(
+		images[0].num_entries + images[1].num_entries + 2,
+		sizeof(*jobs));
+	size_t num_jobs = 0;
+	if (!jobs)
+	{
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	submit_hashes(pool, &images[0], jobs, &num_jobs);
+	submit_hashes(pool, &images[1], jobs, &num_jobs);
+	pool_wait(pool);
+	pool_destroy(pool);
+	free(jobs);
+
+	for (int i = 0 ; i < 2 ; i++)
+		qsort(images[i].entries, images[i].num_entries,
+			sizeof(*images[i].entries), rom_entry_key_cmp);
+
+	const uint64_t max_size = images[0].size > images[1].size
+		? images[0].size : images[1].size;
+
+	diff_t d = {
+		.old = &images[0],
+		.new = &images[1],
+		.mask = &mask,
+		.block_size = block_size,
+		.covered = calloc(max_size / block_size + 2, 1),
+	};
+	if (!d.covered)
+	{
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	int changes = 0;
+	changes += diff_component(&d, COMPONENT_CBFS);
+	changes += diff_component(&d, COMPONENT_UEFI);
+	changes += diff_unaccounted(&d);
+
+	if (images[0].size != images[1].size)
+		printf("size %"PRIx64" -> %"PRIx64"\n", images[0].size, images[1].size);
+
+	return changes || images[0].size != images[1].size
+		? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,690 @@
+/** \file
+ * Read-only FUSE filesystem over a ROM image.
+ *
+ * The CBFS and UEFI indexes are built once and every component is
+ * exposed as a file:
+ *
+ *   rom.bin                                    the whole image
+ *   cbfs/<name>                                CBFS file data
+ *   uefi/<offset>-<fsguid>/<NN>-<guid>[-UI]/file.ffs
+ *   uefi/<offset>-<fsguid>/<NN>-<guid>[-UI]/<NN>.<section type>
+ *
+ * Nested volumes appear next to the volume that holds them.  Reads
+ * are answered straight from the mapped image with writev(), and the
+ * kernel is told to keep its page cache across opens, so repeated
+ * access costs no more than a page cache hit.
+ *
+ * This speaks the kernel protocol on /dev/fuse directly rather than
+ * going through libfuse, so mounting requires root.  Unmount with
+ * umount or by interrupting the process.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <linux/fuse.h>
+#include "util.h"
+#include "cbfs_index.h"
+#include "uefi_index.h"
+
+#define ROMFS_NAME_LEN 256
+#define ROMFS_MAX_WRITE 4096
+#define ROMFS_BUFFER_SIZE (0x20000 + 0x1000)
+#define ROMFS_TIMEOUT 3600 // seconds; the image never changes
+
+int verbose = 0;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "rom",		1, NULL, 'o' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: sudo romfs [options] mountpoint\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity (-vv traces requests)\n"
+"    -o | --rom file        Use local file instead of internal ROM\n"
+"\n"
+"Serves the CBFS files and UEFI volumes, files and sections of the\n"
+"ROM as a read-only tree until it is unmounted.\n"
+"\n";
+
+
+typedef struct {
+	char name[ROMFS_NAME_LEN];
+	int is_dir;
+	const uint8_t * data;
+	uint64_t len;
+	uint32_t parent;
+	uint32_t first_child; // 0 is the root, which is nobody's child
+	uint32_t last_child;
+	uint32_t next_sibling;
+} romfs_node_t;
+
+typedef struct {
+	const uint8_t * rom;
+	uint64_t size;
+	romfs_node_t * nodes;
+	uint32_t num_nodes;
+	uint32_t proto_minor;
+	uid_t uid;
+	gid_t gid;
+	time_t mount_time;
+} romfs_t;
+
+
+static romfs_node_t *
+node_find(
+	const romfs_t * const fs,
+	uint32_t parent,
+	const char * const name
+)
+{
+	for (uint32_t i = fs->nodes[parent].first_child ; i ; i = fs->nodes[i].next_sibling)
+		if (strcmp(fs->nodes[i].name, name) == 0)
+			return &fs->nodes[i];
+
+	return NULL;
+}
+
+
+static uint32_t
+node_add(
+	romfs_t * const fs,
+	uint32_t parent,
+	const char * const name,
+	int is_dir,
+	const uint8_t * const data,
+	uint64_t len
+)
+{
+	char unique[ROMFS_NAME_LEN];
+	snprintf(unique, sizeof(unique), "%s", name);
+
+	// directories merge, anything else gets a numbered name
+	romfs_node_t * existing = fs->num_nodes
+		? node_find(fs, parent, unique) : NULL;
+	if (existing && is_dir && existing->is_dir)
+		return existing - fs->nodes;
+
+	for (unsigned n = 1 ; existing ; n++)
+	{
+		snprintf(unique, sizeof(unique), "%.240s~%u", name, n);
+		existing = node_find(fs, parent, unique);
+	}
+
+	if ((fs->num_nodes & (fs->num_nodes - 1)) == 0)
+	{
+		const uint32_t n = fs->num_nodes ? fs->num_nodes * 2 : 64;
+		romfs_node_t * const nodes = realloc(fs->nodes, n * sizeof(*nodes));
+		if (!nodes)
+		{
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		fs->nodes = nodes;
+	}
+
+	const uint32_t id = fs->num_nodes++;
+	romfs_node_t * const node = &fs->nodes[id];
+	memset(node, 0, sizeof(*node));
+	snprintf(node->name, sizeof(node->name), "%s", unique);
+	node->is_dir = is_dir;
+	node->data = data;
+	node->len = len;
+	node->parent = parent;
+
+	if (id != 0)
+	{
+		romfs_node_t * const p = &fs->nodes[parent];
+		if (p->last_child)
+			fs->nodes[p->last_child].next_sibling = id;
+		else
+			p->first_child = id;
+		p->last_child = id;
+	}
+
+	return id;
+}
+
+
+// Add a file under a slash separated path, creating the directories
+static void
+node_add_path(
+	romfs_t * const fs,
+	uint32_t parent,
+	const char * path,
+	const uint8_t * const data,
+	uint64_t len
+)
+{
+	char component[ROMFS_NAME_LEN];
+
+	while (1)
+	{
+		while (*path == '/')
+			path++;
+
+		const char * const slash = strchr(path, '/');
+		if (!slash)
+			break;
+
+		snprintf(component, sizeof(component), "%.*s", (int)(slash - path), path);
+		parent = node_add(fs, parent, component, 1, NULL, 0);
+		path = slash;
+	}
+
+	if (*path)
+		node_add(fs, parent, path, 0, data, len);
+}
+
+
+static void
+romfs_build(
+	romfs_t * const fs
+)
+{
+	node_add(fs, 0, "", 1, NULL, 0);
+	node_add(fs, 0, "rom.bin", 0, fs->rom, fs->size);
+
+	cbfs_index_t cbfs;
+	if (cbfs_index_build(&cbfs, fs->rom, fs->size, NULL) == 0)
+	{
+		const uint32_t dir = node_add(fs, 0, "cbfs", 1, NULL, 0);
+		for (size_t i = 0 ; i < cbfs.num_files ; i++)
+		{
+			const cbfs_entry_t * const f = &cbfs.files[i];
+			if (f->type == CBFS_COMPONENT_NULL || f->name[0] == '\0')
+				continue;
+
+			node_add_path(fs, dir, f->name,
+				fs->rom + f->offset + f->header_len, f->len);
+		}
+
+		cbfs_index_free(&cbfs);
+	}
+
+	uefi_index_t uefi;
+	if (uefi_index_build(&uefi, fs->rom, fs->size, NULL) < 0)
+	{
+		perror("uefi_index_build");
+		exit(EXIT_FAILURE);
+	}
+
+	if (uefi.num_volumes == 0)
+		goto done;
+
+	const uint32_t dir = node_add(fs, 0, "uefi", 1, NULL, 0);
+	uint32_t * const vol_dirs = calloc(uefi.num_volumes, sizeof(*vol_dirs));
+	unsigned * const vol_files = calloc(uefi.num_volumes, sizeof(*vol_files));
+	uint32_t * const file_dirs = calloc(uefi.num_files + 1, sizeof(*file_dirs));
+	unsigned * const file_sections = calloc(uefi.num_files + 1, sizeof(*file_sections));
+	if (!vol_dirs || !vol_files || !file_dirs || !file_sections)
+	{
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	char name[ROMFS_NAME_LEN];
+	char guid[GUID_STR_LEN];
+
+	for (size_t i = 0 ; i < uefi.num_volumes ; i++)
+	{
+		const uefi_volume_t * const v = &uefi.volumes[i];
+		snprintf(name, sizeof(name), "%08"PRIx64"-%s",
+			v->offset, guid_format(guid, v->guid));
+		vol_dirs[i] = node_add(fs, dir, name, 1, NULL, 0);
+	}
+
+	for (size_t i = 0 ; i < uefi.num_files ; i++)
+	{
+		const uefi_file_t * const f = &uefi.files[i];
+
+		// UI names are free form, but must not create directories
+		char ui[sizeof(f->name)];
+		snprintf(ui, sizeof(ui), "%s", f->name);
+		for (char * p = ui ; *p ; p++)
+			if (*p == '/')
+				*p = '_';
+
+		snprintf(name, sizeof(name), "%02u-%s%s%s",
+			vol_files[f->volume]++,
+			guid_format(guid, f->guid),
+			ui[0] ? "-" : "", ui);
+		file_dirs[i] = node_add(fs, vol_dirs[f->volume], name, 1, NULL, 0);
+		node_add(fs, file_dirs[i], "file.ffs", 0, fs->rom + f->offset, f->len);
+	}
+
+	for (size_t i = 0 ; i < uefi.num_sections ; i++)
+	{
+		const uefi_section_t * const s = &uefi.sections[i];
+		snprintf(name, sizeof(name), "%02u.%s",
+			file_sections[s->file]++,
+			ffs_section_type_name(s->type));
+		node_add(fs, file_dirs[s->file], name, 0,
+			fs->rom + s->offset + s->header_len,
+			s->len - s->header_len);
+	}
+
+	free(vol_dirs);
+	free(vol_files);
+	free(file_dirs);
+	free(file_sections);
+
+done:
+	uefi_index_free(&uefi);
+
+	if (verbose)
+		fprintf(stderr, "romfs: %u nodes\n", fs->num_nodes);
+}
+
+
+static int
+romfs_reply(
+	int fd,
+	uint64_t unique,
+	int error,
+	const void * const data,
+	size_t len
+)
+{
+	struct fuse_out_header out = {
+		.len = sizeof(out) + (error ? 0 : len),
+		.error = error,
+		.unique = unique,
+	};
+
+	struct iovec iov[2] = {
+		{ .iov_base = &out, .iov_len = sizeof(out) },
+		{ .iov_base = (void *) data, .iov_len = len },
+	};
+
+	const int count = error || len == 0 ? 1 : 2;
+	if (writev(fd, iov, count) < 0 && errno != ENOENT)
+	{
+		// ENOENT just means the request was interrupted
+		perror("writev");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void
+romfs_attr(
+	const romfs_t * const fs,
+	uint32_t id,
+	struct fuse_attr * const attr
+)
+{
+	const romfs_node_t * const node = &fs->nodes[id];
+
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = id + FUSE_ROOT_ID;
+	attr->size = node->len;
+	attr->blocks = (node->len + 511) / 512;
+	attr->atime = attr->mtime = attr->ctime = fs->mount_time;
+	attr->mode = node->is_dir ? S_IFDIR | 0555 : S_IFREG | 0444;
+	attr->nlink = node->is_dir ? 2 : 1;
+	attr->uid = fs->uid;
+	attr->gid = fs->gid;
+	attr->blksize = 4096;
+}
+
+
+static void
+romfs_entry(
+	const romfs_t * const fs,
+	uint32_t id,
+	struct fuse_entry_out * const entry
+)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->nodeid = id + FUSE_ROOT_ID;
+	entry->entry_valid = ROMFS_TIMEOUT;
+	entry->attr_valid = ROMFS_TIMEOUT;
+	romfs_attr(fs, id, &entry->attr);
+}
+
+
+static int
+romfs_readdir(
+	const romfs_t * const fs,
+	int fd,
+	uint64_t unique,
+	uint32_t id,
+	const struct fuse_read_in * const in
+)
+{
+	uint8_t buf[ROMFS_MAX_WRITE * 4];
+	const size_t max = in->size < sizeof(buf) ? in->size : sizeof(buf);
+	size_t len = 0;
+	uint64_t index = 0;
+
+	for (uint32_t i = fs->nodes[id].first_child ; i ; i = fs->nodes[i].next_sibling, index++)
+	{
+		if (index < in->offset)
+			continue;
+
+		const romfs_node_t * const child = &fs->nodes[i];
+		const size_t namelen = strlen(child->name);
+		const size_t entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+		if (len + entlen > max)
+			break;
+
+		struct fuse_dirent * const d = (void *)(buf + len);
+		d->ino = i + FUSE_ROOT_ID;
+		d->off = index + 1;
+		d->namelen = namelen;
+		d->type = (child->is_dir ? S_IFDIR : S_IFREG) >> 12;
+		memcpy(d->name, child->name, namelen);
+		memset(d->name + namelen, 0, entlen - FUSE_NAME_OFFSET - namelen);
+		len += entlen;
+	}
+
+	return romfs_reply(fd, unique, 0, buf, len);
+}
+
+
+/*
+ * Handle one request; returns 1 when the filesystem is being
+ * destroyed and -1 if the device can not be written.
+ */
+static int
+romfs_request(
+	romfs_t * const fs,
+	int fd,
+	const uint8_t * const buf,
+	size_t len
+)
+{
+	const struct fuse_in_header * const in = (const void *) buf;
+	const void * const arg = buf + sizeof(*in);
+	const uint64_t unique = in->unique;
+	const uint64_t nodeid = in->nodeid;
+
+	if (len < sizeof(*in) || in->len > len)
+		return 0;
+
+	if (verbose > 1)
+		fprintf(stderr, "romfs: op %u node %"PRIu64"\n", in->opcode, nodeid);
+
+	// every request but INIT names a node we handed out
+	const uint32_t id = nodeid - FUSE_ROOT_ID;
+	if (in->opcode != FUSE_INIT && (nodeid < FUSE_ROOT_ID || id >= fs->num_nodes))
+		return romfs_reply(fd, unique, -ENOENT, NULL, 0);
+
+	const romfs_node_t * const node = &fs->nodes[id];
+
+	switch (in->opcode)
+	{
+	case FUSE_INIT: {
+		const struct fuse_init_in * const init = arg;
+		if (init->major != FUSE_KERNEL_VERSION)
+			return romfs_reply(fd, unique, -EPROTO, NULL, 0);
+
+		fs->proto_minor = init->minor < FUSE_KERNEL_MINOR_VERSION
+			? init->minor : FUSE_KERNEL_MINOR_VERSION;
+
+		struct fuse_init_out out = {
+			.major = FUSE_KERNEL_VERSION,
+			.minor = FUSE_KERNEL_MINOR_VERSION,
+			.max_readahead = init->max_readahead,
+			.max_write = ROMFS_MAX_WRITE,
+			.time_gran = 1,
+		};
+
+		return romfs_reply(fd, unique, 0, &out, fs->proto_minor < 23
+			? FUSE_COMPAT_22_INIT_OUT_SIZE : sizeof(out));
+	}
+
+	case FUSE_LOOKUP: {
+		const romfs_node_t * const child = node->is_dir
+			? node_find(fs, id, arg) : NULL;
+		if (!child)
+			return romfs_reply(fd, unique, -ENOENT, NULL, 0);
+
+		struct fuse_entry_out out;
+		romfs_entry(fs, child - fs->nodes, &out);
+		return romfs_reply(fd, unique, 0, &out, fs->proto_minor < 9
+			? FUSE_COMPAT_ENTRY_OUT_SIZE : sizeof(out));
+	}
+
+	case FUSE_GETATTR: {
+		struct fuse_attr_out out = {
+			.attr_valid = ROMFS_TIMEOUT,
+		};
+		romfs_attr(fs, id, &out.attr);
+		return romfs_reply(fd, unique, 0, &out, fs->proto_minor < 9
+			? FUSE_COMPAT_ATTR_OUT_SIZE : sizeof(out));
+	}
+
+	case FUSE_OPEN:
+	case FUSE_OPENDIR: {
+		const struct fuse_open_in * const open_in = arg;
+		if ((open_in->flags & O_ACCMODE) != O_RDONLY)
+			return romfs_reply(fd, unique, -EROFS, NULL, 0);
+		if (in->opcode == FUSE_OPEN && node->is_dir)
+			return romfs_reply(fd, unique, -EISDIR, NULL, 0);
+		if (in->opcode == FUSE_OPENDIR && !node->is_dir)
+			return romfs_reply(fd, unique, -ENOTDIR, NULL, 0);
+
+		struct fuse_open_out out = {
+			.open_flags = in->opcode == FUSE_OPEN ? FOPEN_KEEP_CACHE : 0,
+		};
+		return romfs_reply(fd, unique, 0, &out, sizeof(out));
+	}
+
+	case FUSE_READ: {
+		const struct fuse_read_in * const read_in = arg;
+		if (read_in->offset >= node->len)
+			return romfs_reply(fd, unique, 0, NULL, 0);
+
+		uint64_t count = node->len - read_in->offset;
+		if (count > read_in->size)
+			count = read_in->size;
+
+		// zero copy: the reply points into the mapped image
+		return romfs_reply(fd, unique, 0, node->data + read_in->offset, count);
+	}
+
+	case FUSE_READDIR:
+		return romfs_readdir(fs, fd, unique, id, arg);
+
+	case FUSE_STATFS: {
+		struct fuse_statfs_out out = {
+			.st = {
+				.blocks = (fs->size + 4095) / 4096,
+				.files = fs->num_nodes,
+				.bsize = 4096,
+				.frsize = 4096,
+				.namelen = ROMFS_NAME_LEN - 1,
+			},
+		};
+		return romfs_reply(fd, unique, 0, &out, sizeof(out));
+	}
+
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+	case FUSE_FLUSH:
+		return romfs_reply(fd, unique, 0, NULL, 0);
+
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+		// nodes live as long as the mount, and these have no reply
+		return 0;
+
+	case FUSE_DESTROY:
+		romfs_reply(fd, unique, 0, NULL, 0);
+		return 1;
+
+	default:
+		return romfs_reply(fd, unique, -ENOSYS, NULL, 0);
+	}
+}
+
+
+static void
+romfs_signal(
+	int sig
+)
+{
+	(void) sig;
+	interrupted = 1;
+}
+
+
+static int
+romfs_serve(
+	romfs_t * const fs,
+	const char * const mountpoint
+)
+{
+	const int fd = open("/dev/fuse", O_RDWR);
+	if (fd < 0)
+	{
+		perror("/dev/fuse");
+		return -1;
+	}
+
+	char opts[128];
+	snprintf(opts, sizeof(opts),
+		"fd=%d,rootmode=%o,user_id=%u,group_id=%u,default_permissions,allow_other",
+		fd, S_IFDIR, (unsigned) getuid(), (unsigned) getgid());
+
+	if (mount("romfs", mountpoint, "fuse.romfs",
+		MS_NOSUID | MS_NODEV | MS_RDONLY, opts) < 0)
+	{
+		perror(mountpoint);
+		close(fd);
+		return -1;
+	}
+
+	// no SA_RESTART, so the read below returns on a signal
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = romfs_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	uint8_t * const buf = malloc(ROMFS_BUFFER_SIZE);
+	if (!buf)
+	{
+		perror("malloc");
+		umount2(mountpoint, MNT_DETACH);
+		return -1;
+	}
+
+	int rc = 0;
+	while (!interrupted)
+	{
+		const ssize_t n = read(fd, buf, ROMFS_BUFFER_SIZE);
+		if (n < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == ENOENT)
+				continue;
+			if (errno == ENODEV)
+				break; // unmounted
+
+			perror("/dev/fuse");
+			rc = -1;
+			break;
+		}
+
+		const int status = romfs_request(fs, fd, buf, n);
+		if (status < 0)
+			rc = -1;
+		if (status != 0)
+			break;
+	}
+
+	if (interrupted)
+		umount2(mountpoint, MNT_DETACH);
+
+	free(buf);
+	close(fd);
+	return rc;
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * romname = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?vo:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'o':
+			romname = optarg;
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	romfs_t fs = {
+		.uid = getuid(),
+		.gid = getgid(),
+		.mount_time = time(NULL),
+	};
+
+	const uint64_t mem_end = 0x100000000;
+	if (romname)
+	{
+		fs.rom = map_file(romname, &fs.size, 1);
+	} else {
+		fs.size = 0x2000000;
+		fs.rom = map_physical(mem_end - fs.size, fs.size);
+	}
+
+	if (fs.rom == NULL)
+	{
+		fprintf(stderr, "Failed to map ROM: %s '%s'\n",
+			romname ? romname : "physical", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	romfs_build(&fs);
+
+	return romfs_serve(&fs, argv[0]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
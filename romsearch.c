@@ -0,0 +1,497 @@
+/** \file
+ * Search ROM images for many byte patterns at once.
+ *
+ * Every image is mapped, indexed as CBFS and as UEFI firmware
+ * volumes, and scanned for all patterns in one pass.  Each hit is
+ * reported with the CBFS file or the FV, FFS file and section that
+ * contains it.  Images are scanned in parallel on the thread pool.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "util.h"
+#include "pool.h"
+#include "search.h"
+#include "cbfs_index.h"
+#include "uefi_index.h"
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "pattern",		1, NULL, 'e' },
+	{ "file",		1, NULL, 'f' },
+	{ "count",		0, NULL, 'c' },
+	{ "threads",		1, NULL, 'j' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: romsearch [options] -e pattern... rom...\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -e | --pattern PAT     Pattern to search for (may be repeated)\n"
+"    -f | --file path       Read patterns from a file, one per line\n"
+"    -c | --count           Only print the number of hits per pattern\n"
+"    -j | --threads N       Worker threads (default one per CPU)\n"
+"\n"
+"Patterns are literal text unless prefixed with:\n"
+"    hex:001122...          Raw bytes\n"
+"    guid:xxxxxxxx-xxxx-... A GUID in its in-memory byte order\n"
+"    utf16:text             UCS-2 little endian text, as UEFI stores it\n"
+"\n"
+"Exits with 0 if any pattern was found, 1 otherwise.\n"
+"\n";
+
+
+typedef struct {
+	const search_t * search;
+	char ** labels;
+	size_t num_patterns;
+	int count;
+	pthread_mutex_t lock; // output and totals
+	unsigned long hits;
+	unsigned long errors;
+} romsearch_t;
+
+typedef struct {
+	romsearch_t * rs;
+	const char * path;
+	const uint8_t * rom;
+	uint64_t size;
+	cbfs_index_t cbfs;
+	int have_cbfs;
+	uefi_index_t uefi;
+	unsigned long * counts;
+	unsigned long hits;
+	FILE * out;
+} image_job_t;
+
+
+static int
+hexval(
+	char c
+)
+{
+	if ('0' <= c && c <= '9')
+		return c - '0';
+	if ('a' <= c && c <= 'f')
+		return c - 'a' + 10;
+	if ('A' <= c && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+
+/*
+ * Convert a pattern spec into bytes; returns the length or -1.
+ * out must have room for 2 * strlen(spec) bytes.
+ */
+static long
+parse_pattern(
+	const char * spec,
+	uint8_t * const out
+)
+{
+	if (strncmp(spec, "hex:", 4) == 0)
+	{
+		spec += 4;
+		long len = 0;
+		while (*spec)
+		{
+			if (*spec == ' ' || *spec == ':')
+			{
+				spec++;
+				continue;
+			}
+
+			const int h = hexval(spec[0]);
+			const int l = spec[1] ? hexval(spec[1]) : -1;
+			if (h < 0 || l < 0)
+				return -1;
+			out[len++] = h << 4 | l;
+			spec += 2;
+		}
+		return len;
+	}
+
+	if (strncmp(spec, "guid:", 5) == 0)
+		return guid_parse(spec + 5, out) < 0 ? -1 : 16;
+
+	if (strncmp(spec, "utf16:", 6) == 0)
+	{
+		spec += 6;
+		long len = 0;
+		while (*spec)
+		{
+			out[len++] = *spec++;
+			out[len++] = 0;
+		}
+		return len;
+	}
+
+	const long len = strlen(spec);
+	memcpy(out, spec, len);
+	return len;
+}
+
+
+static int
+add_pattern(
+	search_t * const search,
+	char *** const labels,
+	size_t * const num,
+	const char * const spec
+)
+{
+	uint8_t * const bytes = malloc(2 * strlen(spec) + 16);
+	char ** const l = realloc(*labels, (*num + 1) * sizeof(*l));
+	if (!bytes || !l)
+	{
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	*labels = l;
+
+	const long len = parse_pattern(spec, bytes);
+	if (len <= 0 || search_add(search, bytes, len, *num) < 0)
+	{
+		fprintf(stderr, "romsearch: bad pattern '%s'\n", spec);
+		free(bytes);
+		return -1;
+	}
+
+	l[*num] = malloc(strlen(spec) + 1);
+	if (!l[*num])
+	{
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(l[*num], spec);
+	(*num)++;
+
+	free(bytes);
+	return 0;
+}
+
+
+static int
+add_pattern_file(
+	search_t * const search,
+	char *** const labels,
+	size_t * const num,
+	const char * const filename
+)
+{
+	FILE * const f = fopen(filename, "r");
+	if (!f)
+	{
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	char * line = NULL;
+	size_t line_size = 0;
+	ssize_t n;
+	int rc = 0;
+
+	while ((n = getline(&line, &line_size, f)) > 0)
+	{
+		while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+			line[--n] = '\0';
+		if (n == 0)
+			continue;
+
+		if (add_pattern(search, labels, num, line) < 0)
+			rc = -1;
+	}
+
+	free(line);
+	fclose(f);
+	return rc;
+}
+
+
+// Describe where in the image structures offset falls
+static void
+annotate(
+	image_job_t * const job,
+	uint64_t offset
+)
+{
+	FILE * const out = job->out;
+
+	if (job->have_cbfs)
+	{
+		for (size_t i = 0 ; i < job->cbfs.num_files ; i++)
+		{
+			const cbfs_entry_t * const f = &job->cbfs.files[i];
+			const uint64_t data = f->offset + f->header_len;
+			if (offset < f->offset || offset >= data + f->len)
+				continue;
+
+			if (offset < data)
+				fprintf(out, " cbfs:%s header", f->name);
+			else
+				fprintf(out, " cbfs:%s+0x%"PRIx64, f->name, offset - data);
+			return;
+		}
+	}
+
+	// innermost section, then its file and volume
+	const uefi_index_t * const uefi = &job->uefi;
+	const uefi_section_t * sec = NULL;
+	for (size_t i = 0 ; i < uefi->num_sections ; i++)
+	{
+		const uefi_section_t * const s = &uefi->sections[i];
+		if (offset < s->offset || offset - s->offset >= s->len)
+			continue;
+		if (!sec || s->len < sec->len)
+			sec = s;
+	}
+
+	const uefi_file_t * file = sec ? &uefi->files[sec->file] : NULL;
+	if (!file)
+	{
+		for (size_t i = 0 ; i < uefi->num_files ; i++)
+		{
+			const uefi_file_t * const f = &uefi->files[i];
+			if (offset < f->offset || offset - f->offset >= f->len)
+				continue;
+			if (!file || f->len < file->len)
+				file = f;
+		}
+	}
+
+	const uefi_volume_t * vol = file ? &uefi->volumes[file->volume] : NULL;
+	if (!vol)
+	{
+		for (size_t i = 0 ; i < uefi->num_volumes ; i++)
+		{
+			const uefi_volume_t * const v = &uefi->volumes[i];
+			if (offset < v->offset || offset - v->offset >= v->len)
+				continue;
+			if (!vol || v->len < vol->len)
+				vol = v;
+		}
+	}
+
+	if (!vol)
+		return;
+
+	fprintf(out, " fv@%"PRIx64, vol->offset);
+	if (!file)
+	{
+		fprintf(out, "+0x%"PRIx64, offset - vol->offset);
+		return;
+	}
+
+	char guid[GUID_STR_LEN];
+	fprintf(out, " ffs:%s%s%s", guid_format(guid, file->guid),
+		file->name[0] ? "/" : "", file->name);
+	if (!sec)
+	{
+		fprintf(out, "+0x%"PRIx64, offset - file->offset);
+		return;
+	}
+
+	const uint64_t data = sec->offset + sec->header_len;
+	if (offset < data)
+		fprintf(out, " %s header", ffs_section_type_name(sec->type));
+	else
+		fprintf(out, " %s+0x%"PRIx64,
+			ffs_section_type_name(sec->type), offset - data);
+}
+
+
+static int
+report_hit(
+	void * arg,
+	unsigned id,
+	uint64_t offset
+)
+{
+	image_job_t * const job = arg;
+
+	job->hits++;
+	job->counts[id]++;
+
+	if (job->rs->count)
+		return 0;
+
+	fprintf(job->out, "%s:%08"PRIx64": %s", job->path, offset,
+		job->rs->labels[id]);
+	annotate(job, offset);
+	fprintf(job->out, "\n");
+
+	return 0;
+}
+
+
+static void
+search_image(
+	void * arg
+)
+{
+	image_job_t * const job = arg;
+	romsearch_t * const rs = job->rs;
+	char * buf = NULL;
+	size_t buf_len = 0;
+
+	job->rom = map_file(job->path, &job->size, 1);
+	if (!job->rom)
+	{
+		pthread_mutex_lock(&rs->lock);
+		fprintf(stderr, "%s: %s\n", job->path,
+			errno ? strerror(errno) : "empty file");
+		rs->errors++;
+		pthread_mutex_unlock(&rs->lock);
+		return;
+	}
+
+	job->out = open_memstream(&buf, &buf_len);
+	job->counts = calloc(rs->num_patterns, sizeof(*job->counts));
+	if (!job->out || !job->counts)
+	{
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	job->have_cbfs = cbfs_index_build(&job->cbfs, job->rom, job->size, NULL) == 0;
+	if (uefi_index_build(&job->uefi, job->rom, job->size, NULL) < 0)
+	{
+		perror("uefi_index_build");
+		exit(EXIT_FAILURE);
+	}
+
+	search_scan(rs->search, job->rom, job->size, report_hit, job);
+
+	if (rs->count)
+		for (size_t i = 0 ; i < rs->num_patterns ; i++)
+			fprintf(job->out, "%s: %s %lu\n",
+				job->path, rs->labels[i], job->counts[i]);
+
+	fclose(job->out);
+
+	pthread_mutex_lock(&rs->lock);
+	fwrite(buf, 1, buf_len, stdout);
+	fflush(stdout);
+	rs->hits += job->hits;
+	pthread_mutex_unlock(&rs->lock);
+
+	if (verbose)
+		fprintf(stderr, "%s: %lu hits\n", job->path, job->hits);
+
+	free(buf);
+	free(job->counts);
+	if (job->have_cbfs)
+		cbfs_index_free(&job->cbfs);
+	uefi_index_free(&job->uefi);
+	munmap((void *) job->rom, job->size);
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * const prog_name = argv[0];
+	unsigned threads = 0;
+	int opt;
+
+	romsearch_t rs = {};
+	search_t * const search = search_create();
+	if (!search)
+	{
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	while ((opt = getopt_long(argc, argv, "h?ve:f:cj:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'e':
+			if (add_pattern(search, &rs.labels, &rs.num_patterns, optarg) < 0)
+				return EXIT_FAILURE;
+			break;
+		case 'f':
+			if (add_pattern_file(search, &rs.labels, &rs.num_patterns, optarg) < 0)
+				return EXIT_FAILURE;
+			break;
+		case 'c':
+			rs.count = 1;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || rs.num_patterns == 0)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	if (search_compile(search) < 0)
+	{
+		fprintf(stderr, "%s: unable to compile patterns\n", prog_name);
+		return EXIT_FAILURE;
+	}
+	rs.search = search;
+	pthread_mutex_init(&rs.lock, NULL);
+
+	pool_t * const pool = pool_create(threads);
+	image_job_t * const jobs = calloc(argc, sizeof(*jobs));
+	if (!pool || !jobs)
+	{
+		fprintf(stderr, "%s: unable to start worker threads\n", prog_name);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 0 ; i < argc ; i++)
+	{
+		jobs[i].rs = &rs;
+		jobs[i].path = argv[i];
+		if (pool_submit(pool, search_image, &jobs[i]) < 0)
+			search_image(&jobs[i]);
+	}
+
+	pool_wait(pool);
+	pool_destroy(pool);
+
+	for (size_t i = 0 ; i < rs.num_patterns ; i++)
+		free(rs.labels[i]);
+	free(rs.labels);
+	free(jobs);
+	search_free(search);
+
+	if (rs.errors)
+		return EXIT_FAILURE;
+	return rs.hits ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,193 @@
+/** \file
+ * Move ROM dumps in and out of a chunk store.
+ *
+ * Existing dump files are added to the store with -p, which leaves a
+ * manifest behind, and are rebuilt from a manifest with -g.  Dumps
+ * taken on a live system can go straight into the store with
+ * flashtool -S.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include "util.h"
+#include "chunkstore.h"
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "store",		1, NULL, 'S' },
+	{ "put",		0, NULL, 'p' },
+	{ "get",		0, NULL, 'g' },
+	{ "block",		1, NULL, 'b' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: romstore -S DIR -p rom manifest\n"
+"       romstore -S DIR -g manifest rom\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -S | --store DIR       Chunk store directory\n"
+"    -p | --put             Add a ROM image to the store, write its manifest\n"
+"    -g | --get             Rebuild a ROM image from its manifest\n"
+"    -b | --block N         Erase block size for chunking (default 0x10000)\n"
+"\n";
+
+
+static int
+store_put(
+	const char * const store,
+	const char * const romname,
+	const char * const manifest_name,
+	uint32_t block_size
+)
+{
+	uint64_t size;
+	const uint8_t * const rom = map_file(romname, &size, 1);
+	if (!rom)
+	{
+		fprintf(stderr, "%s: %s\n", romname,
+			errno ? strerror(errno) : "empty file");
+		return EXIT_FAILURE;
+	}
+
+	manifest_t m;
+	if (chunk_split(rom, size, block_size, &m) < 0)
+	{
+		fprintf(stderr, "%s: unable to split\n", romname);
+		return EXIT_FAILURE;
+	}
+
+	unsigned stored;
+	uint64_t stored_bytes;
+	if (chunkstore_put(store, rom, &m, &stored, &stored_bytes) < 0)
+	{
+		perror(store);
+		return EXIT_FAILURE;
+	}
+
+	if (manifest_write(manifest_name, &m) < 0)
+	{
+		perror(manifest_name);
+		return EXIT_FAILURE;
+	}
+
+	if (verbose)
+		fprintf(stderr, "%s: %zu chunks, %u new (0x%"PRIx64" of 0x%"PRIx64" bytes)\n",
+			romname, m.num_chunks, stored, stored_bytes, size);
+
+	manifest_free(&m);
+	munmap((void *) rom, size);
+	return EXIT_SUCCESS;
+}
+
+
+static int
+store_get(
+	const char * const store,
+	const char * const manifest_name,
+	const char * const romname
+)
+{
+	manifest_t m;
+	if (manifest_read(manifest_name, &m) < 0)
+	{
+		perror(manifest_name);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t * const buf = malloc(m.size ? m.size : 1);
+	if (!buf)
+	{
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	if (chunkstore_get(store, &m, buf) < 0)
+	{
+		perror(store);
+		return EXIT_FAILURE;
+	}
+
+	FILE * const f = strcmp(romname, "-") == 0 ? stdout : fopen(romname, "wb");
+	if (!f)
+	{
+		perror(romname);
+		return EXIT_FAILURE;
+	}
+
+	if (fwrite(buf, 1, m.size, f) != m.size || fclose(f) != 0)
+	{
+		perror(romname);
+		return EXIT_FAILURE;
+	}
+
+	manifest_free(&m);
+	free(buf);
+	return EXIT_SUCCESS;
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * store = NULL;
+	uint32_t block_size = CHUNK_BLOCK_SIZE;
+	int do_put = 0;
+	int do_get = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?vS:pgb:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'S':
+			store = optarg;
+			break;
+		case 'p':
+			do_put = 1;
+			break;
+		case 'g':
+			do_get = 1;
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (!store || argc != 2 || do_put == do_get)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	if (do_put)
+		return store_put(store, argv[0], argv[1], block_size);
+
+	return store_get(store, argv[0], argv[1]);
+}
@@ -0,0 +1,316 @@
+/** \file
+ * Multi-pattern byte string search.
+ *
+ * The patterns are sorted and split into eight buckets.  For each of
+ * the first few bytes of the patterns there are two 16 entry tables,
+ * indexed by the low and high nibble of the input byte, holding a bit
+ * for every bucket that has a pattern with that nibble at that
+ * position.  ANDing the lookups for consecutive input bytes leaves
+ * the buckets that may match at a position; with SSSE3 the lookups
+ * are pshufb instructions over sixteen positions at once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "search.h"
+
+#ifdef __SSE2__
+#include <tmmintrin.h>
+#endif
+
+#define SEARCH_BUCKETS 8
+#define SEARCH_PREFIX 3
+
+struct search_pattern {
+	uint8_t * data;
+	size_t len;
+	unsigned id;
+};
+
+struct search {
+	struct search_pattern * patterns;
+	size_t num_patterns;
+	size_t min_len;
+	unsigned prefix; // fingerprint bytes, 1 to SEARCH_PREFIX
+	int compiled;
+
+	// patterns[bucket[b] .. bucket[b+1]) are in bucket b
+	size_t bucket[SEARCH_BUCKETS + 1];
+	uint8_t lo[SEARCH_PREFIX][16];
+	uint8_t hi[SEARCH_PREFIX][16];
+};
+
+
+search_t *
+search_create(void)
+{
+	return calloc(1, sizeof(search_t));
+}
+
+
+int
+search_add(
+	search_t * const s,
+	const void * const pattern,
+	size_t len,
+	unsigned id
+)
+{
+	if (len == 0 || s->compiled)
+		return -1;
+
+	if ((s->num_patterns & (s->num_patterns - 1)) == 0)
+	{
+		const size_t n = s->num_patterns ? s->num_patterns * 2 : 16;
+		struct search_pattern * const p = realloc(s->patterns, n * sizeof(*p));
+		if (!p)
+			return -1;
+		s->patterns = p;
+	}
+
+	uint8_t * const data = malloc(len);
+	if (!data)
+		return -1;
+	memcpy(data, pattern, len);
+
+	struct search_pattern * const p = &s->patterns[s->num_patterns++];
+	p->data = data;
+	p->len = len;
+	p->id = id;
+
+	return 0;
+}
+
+
+static int
+pattern_cmp(
+	const void * a_ptr,
+	const void * b_ptr
+)
+{
+	const struct search_pattern * const a = a_ptr;
+	const struct search_pattern * const b = b_ptr;
+	const size_t len = a->len < b->len ? a->len : b->len;
+
+	const int cmp = memcmp(a->data, b->data, len);
+	if (cmp)
+		return cmp;
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+	return a->id < b->id ? -1 : a->id > b->id;
+}
+
+
+int
+search_compile(
+	search_t * const s
+)
+{
+	if (s->num_patterns == 0)
+		return -1;
+
+	// sorting puts patterns with a shared prefix in the same
+	// bucket, which keeps the false candidates per bucket down
+	qsort(s->patterns, s->num_patterns, sizeof(*s->patterns), pattern_cmp);
+
+	s->min_len = s->patterns[0].len;
+	for (size_t i = 0 ; i < s->num_patterns ; i++)
+		if (s->patterns[i].len < s->min_len)
+			s->min_len = s->patterns[i].len;
+
+	s->prefix = s->min_len < SEARCH_PREFIX ? s->min_len : SEARCH_PREFIX;
+
+	memset(s->lo, 0, sizeof(s->lo));
+	memset(s->hi, 0, sizeof(s->hi));
+
+	for (unsigned b = 0 ; b <= SEARCH_BUCKETS ; b++)
+		s->bucket[b] = b * s->num_patterns / SEARCH_BUCKETS;
+
+	for (unsigned b = 0 ; b < SEARCH_BUCKETS ; b++)
+	{
+		for (size_t i = s->bucket[b] ; i < s->bucket[b+1] ; i++)
+		{
+			const uint8_t * const p = s->patterns[i].data;
+			for (unsigned k = 0 ; k < s->prefix ; k++)
+			{
+				s->lo[k][p[k] & 0xF] |= 1 << b;
+				s->hi[k][p[k] >> 4] |= 1 << b;
+			}
+		}
+	}
+
+	s->compiled = 1;
+	return 0;
+}
+
+
+static int
+search_verify(
+	const search_t * const s,
+	unsigned buckets,
+	const uint8_t * const buf,
+	uint64_t len,
+	uint64_t pos,
+	search_hit_fn fn,
+	void * arg
+)
+{
+	while (buckets)
+	{
+		const unsigned b = __builtin_ctz(buckets);
+		buckets &= buckets - 1;
+
+		for (size_t i = s->bucket[b] ; i < s->bucket[b+1] ; i++)
+		{
+			const struct search_pattern * const p = &s->patterns[i];
+			if (p->len > len - pos)
+				continue;
+			if (memcmp(buf + pos, p->data, p->len) != 0)
+				continue;
+
+			const int rc = fn(arg, p->id, pos);
+			if (rc)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+
+static int
+search_scan_scalar(
+	const search_t * const s,
+	const uint8_t * const buf,
+	uint64_t len,
+	uint64_t pos,
+	search_hit_fn fn,
+	void * arg
+)
+{
+	for ( ; pos + s->min_len <= len ; pos++)
+	{
+		unsigned buckets = 0xFF;
+		for (unsigned k = 0 ; k < s->prefix ; k++)
+		{
+			const uint8_t c = buf[pos + k];
+			buckets &= s->lo[k][c & 0xF] & s->hi[k][c >> 4];
+		}
+
+		if (!buckets)
+			continue;
+
+		const int rc = search_verify(s, buckets, buf, len, pos, fn, arg);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+
+#ifdef __SSE2__
+__attribute__((target("ssse3")))
+static int
+search_scan_ssse3(
+	const search_t * const s,
+	const uint8_t * const buf,
+	uint64_t len,
+	uint64_t * const done,
+	search_hit_fn fn,
+	void * arg
+)
+{
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo[SEARCH_PREFIX];
+	__m128i hi[SEARCH_PREFIX];
+
+	for (unsigned k = 0 ; k < s->prefix ; k++)
+	{
+		lo[k] = _mm_loadu_si128((const __m128i *) s->lo[k]);
+		hi[k] = _mm_loadu_si128((const __m128i *) s->hi[k]);
+	}
+
+	uint64_t pos = 0;
+	for ( ; pos + 16 + s->prefix - 1 <= len ; pos += 16)
+	{
+		__m128i res = _mm_set1_epi8(0xFF);
+		for (unsigned k = 0 ; k < s->prefix ; k++)
+		{
+			const __m128i v = _mm_loadu_si128((const __m128i *)(buf + pos + k));
+			const __m128i l = _mm_shuffle_epi8(lo[k],
+				_mm_and_si128(v, nibble));
+			const __m128i h = _mm_shuffle_epi8(hi[k],
+				_mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+			res = _mm_and_si128(res, _mm_and_si128(l, h));
+		}
+
+		unsigned candidates = ~_mm_movemask_epi8(_mm_cmpeq_epi8(res, zero)) & 0xFFFF;
+		if (!candidates)
+			continue;
+
+		uint8_t buckets[16];
+		_mm_storeu_si128((__m128i *) buckets, res);
+
+		while (candidates)
+		{
+			const unsigned j = __builtin_ctz(candidates);
+			candidates &= candidates - 1;
+
+			const int rc = search_verify(s, buckets[j], buf, len, pos + j, fn, arg);
+			if (rc)
+				return rc;
+		}
+	}
+
+	*done = pos;
+	return 0;
+}
+#endif
+
+
+int
+search_scan(
+	const search_t * const s,
+	const uint8_t * const buf,
+	uint64_t len,
+	search_hit_fn fn,
+	void * arg
+)
+{
+	if (!s->compiled)
+		return -1;
+
+	uint64_t pos = 0;
+
+#ifdef __SSE2__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3"))
+	{
+		const int rc = search_scan_ssse3(s, buf, len, &pos, fn, arg);
+		if (rc)
+			return rc;
+	}
+#endif
+
+	// the tail that is too short for a vector, or everything
+	// when the CPU does not have pshufb
+	return search_scan_scalar(s, buf, len, pos, fn, arg);
+}
+
+
+void
+search_free(
+	search_t * const s
+)
+{
+	if (!s)
+		return;
+
+	for (size_t i = 0 ; i < s->num_patterns ; i++)
+		free(s->patterns[i].data);
+
+	free(s->patterns);
+	free(s);
+}
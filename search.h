@@ -0,0 +1,63 @@
+/** \file
+ * Multi-pattern byte string search.
+ *
+ * All patterns are matched in one pass over the buffer.  Candidate
+ * positions are found from the first few bytes of every pattern with
+ * nibble lookup tables (the "Teddy" scheme from Hyperscan), sixteen
+ * positions at a time with SSSE3 when the CPU has it, and then each
+ * candidate is verified against the patterns in its bucket.
+ */
+#ifndef _search_h_
+#define _search_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct search search_t;
+
+// Called for each match; a non-zero return stops the scan
+typedef int (*search_hit_fn)(
+	void * arg,
+	unsigned id,
+	uint64_t offset
+);
+
+
+extern search_t *
+search_create(void);
+
+
+// id is passed back to the hit callback; the pattern is copied
+extern int
+search_add(
+	search_t * s,
+	const void * pattern,
+	size_t len,
+	unsigned id
+);
+
+
+// Must be called after the last search_add and before search_scan
+extern int
+search_compile(
+	search_t * s
+);
+
+
+// Thread safe once compiled; returns the callback's stop value or 0
+extern int
+search_scan(
+	const search_t * s,
+	const uint8_t * buf,
+	uint64_t len,
+	search_hit_fn fn,
+	void * arg
+);
+
+
+extern void
+search_free(
+	search_t * s
+);
+
+#endif
@@ -0,0 +1,256 @@
+/** \file
+ * SHA-1 message digest (FIPS 180-4).
+ *
+ * Like the SHA-256 code, the hardware rounds are used at run time
+ * on x86 CPUs with the SHA extensions.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "sha1.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_NI
+#include <immintrin.h>
+#endif
+
+
+static inline uint32_t
+rol32(
+	uint32_t x,
+	unsigned n
+)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+
+static void
+sha1_blocks_c(
+	uint32_t h[5],
+	const uint8_t * p,
+	size_t blocks
+)
+{
+	while (blocks--)
+	{
+		uint32_t w[80];
+		for (int i = 0 ; i < 16 ; i++)
+			w[i] = 0
+				| (uint32_t) p[4*i+0] << 24
+				| (uint32_t) p[4*i+1] << 16
+				| (uint32_t) p[4*i+2] <<  8
+				| (uint32_t) p[4*i+3] <<  0
+				;
+
+		for (int i = 16 ; i < 80 ; i++)
+			w[i] = rol32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+		for (int i = 0 ; i < 80 ; i++)
+		{
+			uint32_t f, k;
+			if (i < 20)
+			{
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			} else
+			if (i < 40)
+			{
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else
+			if (i < 60)
+			{
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			const uint32_t t = rol32(a, 5) + f + e + k + w[i];
+			e = d; d = c; c = rol32(b, 30); b = a; a = t;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+
+		p += 64;
+	}
+}
+
+
+#ifdef SHA1_NI
+/*
+ * Four rounds per instruction, with E carried in the top lane and
+ * recomputed from the old A by sha1nexte for each group of rounds.
+ */
+__attribute__((__target__("sha,ssse3,sse4.1")))
+static void
+sha1_blocks_ni(
+	uint32_t h[5],
+	const uint8_t * p,
+	size_t blocks
+)
+{
+	const __m128i bswap = _mm_set_epi64x(
+		0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const void *) h), 0x1B);
+	__m128i e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+	while (blocks--)
+	{
+		const __m128i abcd_save = abcd;
+		__m128i m[4];
+
+		for (int i = 0 ; i < 4 ; i++)
+			m[i] = _mm_shuffle_epi8(
+				_mm_loadu_si128((const void *)(p + 16 * i)), bswap);
+
+		__m128i e = _mm_add_epi32(e0, m[0]);
+		__m128i abcd_prev = abcd;
+
+		for (int i = 0 ; i < 20 ; i++)
+		{
+			if (i != 0)
+				e = _mm_sha1nexte_epu32(abcd_prev, m[i & 3]);
+			abcd_prev = abcd;
+
+			// the round function is an immediate operand
+			switch (i / 5)
+			{
+			case 0: abcd = _mm_sha1rnds4_epu32(abcd, e, 0); break;
+			case 1: abcd = _mm_sha1rnds4_epu32(abcd, e, 1); break;
+			case 2: abcd = _mm_sha1rnds4_epu32(abcd, e, 2); break;
+			default: abcd = _mm_sha1rnds4_epu32(abcd, e, 3); break;
+			}
+
+			if (i >= 16)
+				continue;
+
+			// words i+4 from words i to i+3
+			__m128i w = _mm_sha1msg1_epu32(m[i & 3], m[(i + 1) & 3]);
+			w = _mm_xor_si128(w, m[(i + 2) & 3]);
+			m[i & 3] = _mm_sha1msg2_epu32(w, m[(i + 3) & 3]);
+		}
+
+		e0 = _mm_sha1nexte_epu32(abcd_prev, e0);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		p += 64;
+	}
+
+	_mm_storeu_si128((void *) h, _mm_shuffle_epi32(abcd, 0x1B));
+	h[4] = _mm_extract_epi32(e0, 3);
+}
+#endif
+
+
+static void
+sha1_blocks(
+	uint32_t h[5],
+	const uint8_t * p,
+	size_t blocks
+)
+{
+#ifdef SHA1_NI
+	if (cpu_has_sha())
+	{
+		sha1_blocks_ni(h, p, blocks);
+		return;
+	}
+#endif
+
+	sha1_blocks_c(h, p, blocks);
+}
+
+
+void
+sha1_init(
+	sha1_ctx_t * const ctx
+)
+{
+	static const uint32_t iv[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+	};
+
+	memcpy(ctx->h, iv, sizeof(iv));
+	ctx->len = 0;
+	ctx->buf_len = 0;
+}
+
+
+void
+sha1_update(
+	sha1_ctx_t * const ctx,
+	const void * const data,
+	size_t len
+)
+{
+	const uint8_t * p = data;
+	ctx->len += len;
+
+	if (ctx->buf_len)
+	{
+		size_t n = sizeof(ctx->buf) - ctx->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buf_len, p, n);
+		ctx->buf_len += n;
+		p += n;
+		len -= n;
+
+		if (ctx->buf_len < sizeof(ctx->buf))
+			return;
+
+		sha1_blocks(ctx->h, ctx->buf, 1);
+		ctx->buf_len = 0;
+	}
+
+	sha1_blocks(ctx->h, p, len / 64);
+	p += len & ~(size_t) 63;
+	len &= 63;
+
+	memcpy(ctx->buf, p, len);
+	ctx->buf_len = len;
+}
+
+
+void
+sha1_final(
+	sha1_ctx_t * const ctx,
+	uint8_t digest[SHA1_LEN]
+)
+{
+	const uint64_t bits = ctx->len * 8;
+	uint8_t pad[72] = { 0x80 };
+	const size_t pad_len = (ctx->buf_len < 56 ? 56 : 120) - ctx->buf_len;
+
+	for (int i = 0 ; i < 8 ; i++)
+		pad[pad_len + i] = bits >> (56 - 8*i);
+
+	sha1_update(ctx, pad, pad_len + 8);
+
+	for (int i = 0 ; i < 5 ; i++)
+	{
+		digest[4*i+0] = ctx->h[i] >> 24;
+		digest[4*i+1] = ctx->h[i] >> 16;
+		digest[4*i+2] = ctx->h[i] >>  8;
+		digest[4*i+3] = ctx->h[i] >>  0;
+	}
+}
+
+
+void
+sha1(
+	const void * const data,
+	size_t len,
+	uint8_t digest[SHA1_LEN]
+)
+{
+	sha1_ctx_t ctx;
+	sha1_init(&ctx);
+	sha1_update(&ctx, data, len);
+	sha1_final(&ctx, digest);
+}
@@ -0,0 +1,50 @@
+/** \file
+ * SHA-1 message digest.
+ *
+ * Only for the TPM 1.2 PCR bank, which can not use anything else.
+ */
+#ifndef _sha1_h_
+#define _sha1_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA1_LEN 20
+
+typedef struct {
+	uint32_t h[5];
+	uint64_t len;
+	uint8_t buf[64];
+	size_t buf_len;
+} sha1_ctx_t;
+
+
+extern void
+sha1_init(
+	sha1_ctx_t * ctx
+);
+
+
+extern void
+sha1_update(
+	sha1_ctx_t * ctx,
+	const void * data,
+	size_t len
+);
+
+
+extern void
+sha1_final(
+	sha1_ctx_t * ctx,
+	uint8_t digest[SHA1_LEN]
+);
+
+
+extern void
+sha1(
+	const void * data,
+	size_t len,
+	uint8_t digest[SHA1_LEN]
+);
+
+#endif
@@ -0,0 +1,289 @@
+/** \file
+ * SHA-256 message digest (FIPS 180-4).
+ *
+ * On x86 CPUs with the SHA extensions the blocks are hashed with the
+ * hardware rounds, which is several times faster than the portable
+ * code; the choice is made at run time so one binary covers both.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "sha256.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_NI
+#include <immintrin.h>
+#endif
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+
+static inline uint32_t
+ror32(
+	uint32_t x,
+	unsigned n
+)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+
+static void
+sha256_blocks_c(
+	uint32_t h[8],
+	const uint8_t * p,
+	size_t blocks
+)
+{
+	while (blocks--)
+	{
+		uint32_t w[64];
+		for (int i = 0 ; i < 16 ; i++)
+			w[i] = 0
+				| (uint32_t) p[4*i+0] << 24
+				| (uint32_t) p[4*i+1] << 16
+				| (uint32_t) p[4*i+2] <<  8
+				| (uint32_t) p[4*i+3] <<  0
+				;
+
+		for (int i = 16 ; i < 64 ; i++)
+		{
+			const uint32_t s0 = ror32(w[i-15], 7)
+				^ ror32(w[i-15], 18) ^ (w[i-15] >> 3);
+			const uint32_t s1 = ror32(w[i-2], 17)
+				^ ror32(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		uint32_t e = h[4], f = h[5], g = h[6], k = h[7];
+
+		for (int i = 0 ; i < 64 ; i++)
+		{
+			const uint32_t S1 = ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25);
+			const uint32_t ch = (e & f) ^ (~e & g);
+			const uint32_t t1 = k + S1 + ch + sha256_k[i] + w[i];
+			const uint32_t S0 = ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22);
+			const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+			const uint32_t t2 = S0 + maj;
+
+			k = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+
+		p += 64;
+	}
+}
+
+
+#ifdef SHA256_NI
+/*
+ * The hardware keeps the state as ABEF and CDGH, and does two rounds
+ * per instruction; the message schedule is four words at a time.
+ */
+__attribute__((__target__("sha,ssse3,sse4.1")))
+static void
+sha256_blocks_ni(
+	uint32_t h[8],
+	const uint8_t * p,
+	size_t blocks
+)
+{
+	const __m128i bswap = _mm_set_epi64x(
+		0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const void *) &h[0]), 0xB1);
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const void *) &h[4]), 0x1B);
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	while (blocks--)
+	{
+		const __m128i save0 = state0;
+		const __m128i save1 = state1;
+		__m128i m[4];
+
+		for (int i = 0 ; i < 4 ; i++)
+			m[i] = _mm_shuffle_epi8(
+				_mm_loadu_si128((const void *)(p + 16 * i)), bswap);
+
+		for (int i = 0 ; i < 16 ; i++)
+		{
+			__m128i msg = _mm_add_epi32(m[i & 3],
+				_mm_loadu_si128((const void *) &sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+			if (i >= 12)
+				continue;
+
+			// words i+4 from words i to i+3
+			__m128i w = _mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]);
+			w = _mm_add_epi32(w,
+				_mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+			m[i & 3] = _mm_sha256msg2_epu32(w, m[(i + 3) & 3]);
+		}
+
+		state0 = _mm_add_epi32(state0, save0);
+		state1 = _mm_add_epi32(state1, save1);
+		p += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	_mm_storeu_si128((void *) &h[0], _mm_blend_epi16(tmp, state1, 0xF0));
+	_mm_storeu_si128((void *) &h[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+
+static void
+sha256_blocks(
+	uint32_t h[8],
+	const uint8_t * p,
+	size_t blocks
+)
+{
+#ifdef SHA256_NI
+	if (cpu_has_sha())
+	{
+		sha256_blocks_ni(h, p, blocks);
+		return;
+	}
+#endif
+
+	sha256_blocks_c(h, p, blocks);
+}
+
+
+void
+sha256_init(
+	sha256_ctx_t * const ctx
+)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->h, iv, sizeof(iv));
+	ctx->len = 0;
+	ctx->buf_len = 0;
+}
+
+
+void
+sha256_update(
+	sha256_ctx_t * const ctx,
+	const void * const data,
+	size_t len
+)
+{
+	const uint8_t * p = data;
+	ctx->len += len;
+
+	if (ctx->buf_len)
+	{
+		size_t n = sizeof(ctx->buf) - ctx->buf_len;
+		if (n > len)
+			n = len;
+		memcpy(ctx->buf + ctx->buf_len, p, n);
+		ctx->buf_len += n;
+		p += n;
+		len -= n;
+
+		if (ctx->buf_len < sizeof(ctx->buf))
+			return;
+
+		sha256_blocks(ctx->h, ctx->buf, 1);
+		ctx->buf_len = 0;
+	}
+
+	// hash whole blocks directly from the caller's buffer
+	sha256_blocks(ctx->h, p, len / 64);
+	p += len & ~(size_t) 63;
+	len &= 63;
+
+	memcpy(ctx->buf, p, len);
+	ctx->buf_len = len;
+}
+
+
+void
+sha256_final(
+	sha256_ctx_t * const ctx,
+	uint8_t digest[SHA256_LEN]
+)
+{
+	const uint64_t bits = ctx->len * 8;
+	uint8_t pad[72] = { 0x80 };
+	const size_t pad_len = (ctx->buf_len < 56 ? 56 : 120) - ctx->buf_len;
+
+	for (int i = 0 ; i < 8 ; i++)
+		pad[pad_len + i] = bits >> (56 - 8*i);
+
+	sha256_update(ctx, pad, pad_len + 8);
+
+	for (int i = 0 ; i < 8 ; i++)
+	{
+		digest[4*i+0] = ctx->h[i] >> 24;
+		digest[4*i+1] = ctx->h[i] >> 16;
+		digest[4*i+2] = ctx->h[i] >>  8;
+		digest[4*i+3] = ctx->h[i] >>  0;
+	}
+}
+
+
+void
+sha256(
+	const void * const data,
+	size_t len,
+	uint8_t digest[SHA256_LEN]
+)
+{
+	sha256_ctx_t ctx;
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, digest);
+}
+
+
+char *
+hex_digest(
+	char * const out,
+	const uint8_t * const digest,
+	size_t len
+)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	for (size_t i = 0 ; i < len ; i++)
+	{
+		out[2*i+0] = hex[digest[i] >> 4];
+		out[2*i+1] = hex[digest[i] & 0xF];
+	}
+
+	out[2*len] = '\0';
+	return out;
+}
@@ -0,0 +1,57 @@
+/** \file
+ * SHA-256 message digest.
+ */
+#ifndef _sha256_h_
+#define _sha256_h_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_LEN 32
+
+typedef struct {
+	uint32_t h[8];
+	uint64_t len;
+	uint8_t buf[64];
+	size_t buf_len;
+} sha256_ctx_t;
+
+
+extern void
+sha256_init(
+	sha256_ctx_t * ctx
+);
+
+
+extern void
+sha256_update(
+	sha256_ctx_t * ctx,
+	const void * data,
+	size_t len
+);
+
+
+extern void
+sha256_final(
+	sha256_ctx_t * ctx,
+	uint8_t digest[SHA256_LEN]
+);
+
+
+extern void
+sha256(
+	const void * data,
+	size_t len,
+	uint8_t digest[SHA256_LEN]
+);
+
+
+// Lowercase hex form of a digest, out must hold 2*len+1 bytes
+extern char *
+hex_digest(
+	char * out,
+	const uint8_t * digest,
+	size_t len
+);
+
+#endif
@@ -9,10 +9,13 @@
 #define fprintf(...) do { /* nothing */ } while(0)
 #define printf(...) do { /* nothing */ } while(0)
 #define snprintf(...) do { /* nothing */ } while(0)
+#define malloc(len) AllocatePool(len)
+#define free(ptr) FreePool(ptr)
 
 // there is nothing to map -- we are in direct mapped mode
 #define iopl(n) do { /* nothing */ } while(0)
 #define map_physical(addr, len) ((void*)(addr))
+#define unmap_physical(addr, len) do { /* nothing */ } while(0)
 
 #else
 #include <stdio.h>
@@ -36,6 +39,46 @@ get at all of memory
 // b is the offset,
 // c is the src/dst
 //
+#if defined(SPIFLASH_SIM)
+// Replay build: mappings and registers belong to the simulated
+// controller in mmio_trace.c rather than to the hardware
+#include "mmio_trace.h"
+#undef iopl
+#define iopl(n) do { /* nothing */ } while(0)
+#define map_physical(addr, len) mmio_sim_map(addr, len)
+#define unmap_physical(addr, len) do { /* nothing */ } while(0)
+
+#define MMIO_MACRO(TYPE,NAME) \
+static inline TYPE \
+read_mmio_##NAME( \
+	const void * const base, \
+	const unsigned offset \
+) \
+{ \
+	return mmio_sim_read(offset + (const uint8_t*) base, sizeof(TYPE)); \
+} \
+static inline void \
+write_mmio_##NAME( \
+	void * const base, \
+	const unsigned offset, \
+	const TYPE value \
+) \
+{ \
+	mmio_sim_write(offset + (uint8_t*) base, sizeof(TYPE), value); \
+} \
+
+#else
+
+#ifdef SPIFLASH_TRACE
+// Record every mapping and register access for later replay
+#include "mmio_trace.h"
+#define map_physical(addr, len) mmio_trace_map(addr, len)
+#define MMIO_TRACE(addr, width, value, write) \
+	mmio_trace_access(addr, width, value, write)
+#else
+#define MMIO_TRACE(addr, width, value, write) do { /* nothing */ } while(0)
+#endif
+
 #define MMIO_MACRO(TYPE,NAME) \
 static inline TYPE \
 read_mmio_##NAME( \
@@ -43,7 +86,11 @@ read_mmio_##NAME( \
 	const unsigned offset \
 ) \
 { \
-	return *(const volatile TYPE*)(offset + (const uint8_t*) base); \
+	const volatile TYPE * const addr \
+		= (const volatile TYPE*)(offset + (const uint8_t*) base); \
+	const TYPE value = *addr; \
+	MMIO_TRACE(addr, sizeof(TYPE), value, 0); \
+	return value; \
 } \
 static inline void \
 write_mmio_##NAME( \
@@ -52,10 +99,14 @@ write_mmio_##NAME( \
 	const TYPE value \
 ) \
 { \
-	*(volatile TYPE*)(offset + (uint8_t*) base) = value; \
+	volatile TYPE * const addr \
+		= (volatile TYPE*)(offset + (uint8_t*) base); \
+	MMIO_TRACE(addr, sizeof(TYPE), value, 1); \
+	*addr = value; \
 	__asm__ __volatile__ ("mfence" : : : "memory"); \
 } \
 
+#endif
 
 MMIO_MACRO(uint8_t,byte)
 MMIO_MACRO(uint16_t,short)
@@ -69,6 +120,8 @@ MMIO_MACRO(uint32_t,dword)
 #define BIOS_CNTL_OFFSET	0xdc
 #define BIOS_CNTL_BIOSWE	0x01
 #define BIOS_CNTL_BLE		0x02
+#define BIOS_CNTL_SRC_OFF	2	/* 2-3: SPI Read Configuration */
+#define BIOS_CNTL_SRC		(0x3 << BIOS_CNTL_SRC_OFF)
 #define BIOS_CNTL_TOPSWAP	0x10
 #define BIOS_CNTL_SMMBWP	0x20
 
@@ -150,14 +203,18 @@ spiflash_hsfs_flockdn(
 
 
 
+// buf must hold at least HSFS_STR_LEN bytes; the caller owns it
+// so that multiple flash handles can be used concurrently.
+#define HSFS_STR_LEN 80
+
 static const char *
 spiflash_hsfs_str(
-	spiflash_t * const sp
+	spiflash_t * const sp,
+	char * const buf
 )
 {
-	static char buf[80];
 	uint16_t hsfs = spiflash_hsfs(sp);
-	snprintf(buf, sizeof(buf), "%04x:%s%s%s%s%s%s%s BERASE=%d",
+	snprintf(buf, HSFS_STR_LEN, "%04x:%s%s%s%s%s%s%s BERASE=%d",
 		hsfs,
 		(hsfs & HSFS_FDONE) ? " FDONE" : "",
 		(hsfs & HSFS_FCERR) ? " FCERR" : "",
@@ -263,9 +320,10 @@ spiflash_wait(
 	spiflash_t * const sp
 )
 {
+	char hsfs_buf[HSFS_STR_LEN];
 	if (sp->verbose > 2)
 	fprintf(stderr, "%s: initial hsfs %s\n",
-		__func__, spiflash_hsfs_str(sp));
+		__func__, spiflash_hsfs_str(sp, hsfs_buf));
 
 	while (1)
 	{
@@ -347,8 +405,9 @@ spiflash_erase(
     
 	spiflash_hsfs_clear(sp);
 
+	char hsfs_buf[HSFS_STR_LEN];
 	if (sp->verbose > 2)
-	fprintf(stderr, "%s: HSFS %s\n", __func__, spiflash_hsfs_str(sp));
+	fprintf(stderr, "%s: HSFS %s\n", __func__, spiflash_hsfs_str(sp, hsfs_buf));
     
 	while (len > 0)
 	{
@@ -397,8 +456,9 @@ spiflash_write(
     
 	spiflash_hsfs_clear(sp);
 
+	char hsfs_buf[HSFS_STR_LEN];
 	if (sp->verbose > 2)
-		fprintf(stderr, "%s: HSFS %s\n", __func__, spiflash_hsfs_str(sp));
+		fprintf(stderr, "%s: HSFS %s\n", __func__, spiflash_hsfs_str(sp, hsfs_buf));
     	if (sp->verbose)
 		fprintf(stderr, "%s: %08x + %x bytes\n", __func__, fladdr, len);
 
@@ -499,15 +559,30 @@ spiflash_program_buffer(
 )
 {
 	const uint8_t * data = data_ptr;
+	int rc = -1;
 
 	spiflash_hsfs_clear(sp);
 
-	uint8_t buf[0x1000];
+	// erase blocks are up to 64 KiB, depending on the region,
+	// which is too large for the stack
+	uint8_t * buf = NULL;
+	unsigned buf_size = 0;
 
 	while (len > 0)
 	{
-		const unsigned erase_size
+		const int erase_size
 			= spiflash_erase_size(sp, fladdr);
+		if (erase_size < 0)
+			goto out;
+
+		if ((unsigned) erase_size > buf_size)
+		{
+			free(buf);
+			buf = malloc(erase_size);
+			if (!buf)
+				goto out;
+			buf_size = erase_size;
+		}
 
 		const unsigned block_mask = erase_size - 1;
 		const unsigned fladdr_base = fladdr & ~block_mask;
@@ -523,7 +598,7 @@ spiflash_program_buffer(
 
 		// read the entire erase block into our buffer
 		if (spiflash_read(sp, fladdr_base, buf, erase_size) < 0)
-			return -1;
+			goto out;
 
 		// copy our data over it at the right alignment
 		unsigned delta = 0;
@@ -543,21 +618,93 @@ spiflash_program_buffer(
 				printf("%s: %08x unchanged\n", __func__, fladdr_base);
 		} else {
 			if (spiflash_erase_page(sp, fladdr_base) < 0)
-				return -1;
+				goto out;
 
 			// and write our entire new buffer onto it, including the
 			// bit that we already copied
 			if (spiflash_write(sp, fladdr_base, buf, erase_size) < 0)
-				return -1;
+				goto out;
 		}
 
 		fladdr += block_len;
 		data += block_len;
 		len -= block_len;
 	}
-		
 
-	return 0; 
+	rc = 0;
+out:
+	free(buf);
+	return rc;
+}
+
+
+// Compare the new contents against the caller's copy of what is
+// currently in the flash and only erase/write the blocks that differ.
+// Returns the number of erase blocks that were reprogrammed.
+int
+spiflash_program_delta(
+	spiflash_t * const sp,
+	unsigned fladdr,
+	const void * old_ptr,
+	const void * new_ptr,
+	unsigned len
+)
+{
+	const uint8_t * old = old_ptr;
+	const uint8_t * new = new_ptr;
+	int changed = 0;
+
+	spiflash_hsfs_clear(sp);
+
+	while (len > 0)
+	{
+		const int erase_size
+			= spiflash_erase_size(sp, fladdr);
+		if (erase_size < 0)
+			return -1;
+
+		const unsigned block_offset = fladdr & (erase_size - 1);
+		unsigned block_len = erase_size - block_offset;
+		if (block_len > len)
+			block_len = len;
+
+		unsigned delta = 0;
+		for(unsigned i = 0 ; i < block_len ; i++)
+		{
+			if (old[i] == new[i])
+				continue;
+			delta = 1;
+			break;
+		}
+
+		if (delta == 0)
+		{
+			if (sp->verbose > 1)
+				fprintf(stderr, "%s: %08x unchanged\n", __func__, fladdr);
+		} else
+		if (block_len == (unsigned) erase_size)
+		{
+			// we have the entire block, no need to read it back
+			if (spiflash_program(sp, fladdr, new, block_len) < 0)
+				return -1;
+			changed++;
+		} else {
+			// partial block, preserve the data around it
+			if (spiflash_program_buffer(sp, fladdr, new, block_len) < 0)
+				return -1;
+			changed++;
+		}
+
+		fladdr += block_len;
+		old += block_len;
+		new += block_len;
+		len -= block_len;
+	}
+
+	if (sp->verbose)
+		fprintf(stderr, "%s: %d blocks reprogrammed\n", __func__, changed);
+
+	return changed;
 }
 
 
@@ -569,19 +716,53 @@ read_fdata(
 	unsigned len
 )
 {
+	// FDATA is read a dword at a time, but only len bytes are
+	// stored so that a short tail does not run past the buffer
 	for (unsigned i = 0; i < len; i += 4)
 	{
 		const uint32_t tmp
 			= read_mmio_dword(sp->spibar, FDATA_OFFSET + i);
 
-		data[i+0] = (tmp >>  0) & 0xFF;
-		data[i+1] = (tmp >>  8) & 0xFF;
-		data[i+2] = (tmp >> 16) & 0xFF;
-		data[i+3] = (tmp >> 24) & 0xFF;
+		for (unsigned j = 0 ; j < 4 && i + j < len ; j++)
+			data[i+j] = (tmp >> (8 * j)) & 0xFF;
 	}
 }
 
 
+// One hardware sequencing read cycle of at most 64 bytes.
+// FDONE, FCERR, AEL must be cleared before calling this
+static int
+read_cycle(
+	spiflash_t * const sp,
+	unsigned fladdr,
+	uint8_t * buf,
+	unsigned len
+)
+{
+	spiflash_set_addr(sp, fladdr);
+
+	uint16_t hsfc = spiflash_hsfc(sp);
+	hsfc &= ~HSFC_FCYCLE; // 0 is read
+	hsfc &= ~HSFC_FDBC; // clear byte count
+
+	// set flash data byte count
+	// 1 is automatically added to the number of bytes to read
+	hsfc |= (((len - 1) << HSFC_FDBC_OFFSET));
+	hsfc |= HSFC_FGO;
+
+	spiflash_command(sp, hsfc);
+
+	if (spiflash_wait(sp) < 0)
+	{
+		fprintf(stderr, "%s: spiflash_wait failed... bailing out.\n", __func__);
+		return -1;
+	}
+
+	read_fdata(sp, buf, len);
+	return 0;
+}
+
+
 //max len is 64bytes for this, as thats the most number of
 //bytes we can read in one go. Output to preallocated buf
 //FDONE, FCERR, AEL must be cleared before calling this
@@ -611,26 +792,8 @@ spiflash_read(
 		if (sp->verbose && offset % 4096 == 0)
 			fprintf(stderr, "%s: offset %08x\n", __func__, fladdr);
 
-		spiflash_set_addr(sp, fladdr);
-
-		uint16_t hsfc = spiflash_hsfc(sp);
-		hsfc &= ~HSFC_FCYCLE; // 0 is read
-		hsfc &= ~HSFC_FDBC; // clear byte count
-        
-		// set flash data byte count
-		// 1 is automatically added to the number of bytes to read
-		hsfc |= (((block_len - 1) << HSFC_FDBC_OFFSET));
-		hsfc |= HSFC_FGO;
-        
-		spiflash_command(sp, hsfc);
-
-		if (spiflash_wait(sp) < 0)
-		{
-			fprintf(stderr, "%s: spiflash_wait failed... bailing out.\n", __func__);
+		if (read_cycle(sp, fladdr, buf_ptr, block_len) < 0)
 			return -1;
-		}
-
-		read_fdata(sp, buf_ptr, block_len);
 
 		fladdr += block_len;
 		buf_ptr += block_len;
@@ -642,6 +805,98 @@ spiflash_read(
 }
 
 
+// shell sort by flash address; there is no qsort under EFI
+static void
+sort_iovec(
+	spiflash_iovec_t * const iov,
+	unsigned count
+)
+{
+	for (unsigned gap = count / 2 ; gap > 0 ; gap /= 2)
+	{
+		for (unsigned i = gap ; i < count ; i++)
+		{
+			const spiflash_iovec_t tmp = iov[i];
+			unsigned j = i;
+			for ( ; j >= gap && iov[j - gap].fladdr > tmp.fladdr ; j -= gap)
+				iov[j] = iov[j - gap];
+			iov[j] = tmp;
+		}
+	}
+}
+
+
+int
+spiflash_readv(
+	spiflash_t * const sp,
+	spiflash_iovec_t * const iov,
+	unsigned count
+)
+{
+	uint8_t cycle[64];
+	unsigned cycles = 0;
+	unsigned i = 0;
+	uint64_t done = 0; // everything below this has been scattered
+
+	sort_iovec(iov, count);
+	spiflash_hsfs_clear(sp);
+
+	while (1)
+	{
+		// skip the fragments that are already complete
+		while (i < count && (iov[i].len == 0
+		||  (uint64_t) iov[i].fladdr + iov[i].len <= done))
+			i++;
+		if (i == count)
+			break;
+
+		// start at the next byte that is wanted and read up to
+		// 64 bytes, but never across a 256 byte flash page
+		const uint64_t start = iov[i].fladdr > done ? iov[i].fladdr : done;
+		uint64_t limit = (start | 0xFF) + 1;
+		if (limit > start + 64)
+			limit = start + 64;
+
+		// extend the cycle over every fragment that starts in
+		// it, reading any gaps between them rather than starting
+		// another cycle
+		uint64_t end = start;
+		for (unsigned j = i ; j < count && iov[j].fladdr < limit ; j++)
+		{
+			uint64_t frag_end = (uint64_t) iov[j].fladdr + iov[j].len;
+			if (frag_end > limit)
+				frag_end = limit;
+			if (frag_end > end)
+				end = frag_end;
+		}
+
+		if (read_cycle(sp, start, cycle, end - start) < 0)
+			return -1;
+		cycles++;
+
+		// scatter to every fragment that overlaps the cycle
+		for (unsigned j = i ; j < count && iov[j].fladdr < end ; j++)
+		{
+			const uint64_t frag = iov[j].fladdr;
+			const uint64_t frag_end = frag + iov[j].len;
+			const uint64_t from = frag > start ? frag : start;
+			const uint64_t to = frag_end < end ? frag_end : end;
+			uint8_t * const dst = iov[j].buf;
+
+			for (uint64_t k = from ; k < to ; k++)
+				dst[k - frag] = cycle[k - start];
+		}
+
+		done = end;
+	}
+
+	if (sp->verbose)
+		fprintf(stderr, "%s: %u fragments in %u cycles\n", __func__, count, cycles);
+
+	return 0;
+}
+
+
 ///////////////////////////////////////////////////////
 //Configuration detect stuff:
 
@@ -673,6 +928,8 @@ find_spibar(
 	rcba &= ~1; //clear the bottom bit
 
 	uint8_t * const spibar_ptr = map_physical(rcba, 65536);
+	if (spibar_ptr == NULL)
+		return -1;
 
 	sp->spibar = spibar_ptr + SPIBAR_OFFSET;
 	if (sp->verbose)
@@ -738,6 +995,33 @@ spiflash_size(
 }
 
 
+int
+spiflash_region(
+	spiflash_t * const sp,
+	unsigned region,
+	uint32_t * const base,
+	uint32_t * const limit
+)
+{
+	if (region >= MAX_SPI_REGIONS)
+		return -1;
+
+	const uint32_t freg = get_freg(sp, region);
+	*base = get_region_base(freg);
+	*limit = get_region_limit(freg);
+
+	if (sp->verbose > 1)
+	fprintf(stderr, "%s: region %d: %08x @ %08x freg=%08x\n",
+		__func__, region, *base, *limit, freg);
+
+	//region not in use
+	if (*limit < *base)
+		return -1;
+
+	return 0;
+}
+
+
 uint8_t
 spiflash_bios_cntl(
 	spiflash_t * const sp
@@ -758,6 +1042,54 @@ spiflash_set_bios_cntl(
 }
 
 
+unsigned
+spiflash_read_config(
+	spiflash_t * const sp
+)
+{
+	return (spiflash_bios_cntl(sp) & BIOS_CNTL_SRC) >> BIOS_CNTL_SRC_OFF;
+}
+
+
+int
+spiflash_set_read_config(
+	spiflash_t * const sp,
+	unsigned src
+)
+{
+	if (src > SPIFLASH_SRC_PREFETCH_CACHE)
+		return -1;
+
+	// only SRC changes: BIOSWE is written back as it was, so this
+	// does not raise the SMI that setting it would with BLE
+	const uint8_t bios_cntl = spiflash_bios_cntl(sp);
+	const uint8_t new_bios_cntl = (bios_cntl & ~BIOS_CNTL_SRC)
+		| (src << BIOS_CNTL_SRC_OFF);
+
+	if (new_bios_cntl != bios_cntl
+	&&  (spiflash_set_bios_cntl(sp, new_bios_cntl) & BIOS_CNTL_SRC)
+		!= (new_bios_cntl & BIOS_CNTL_SRC))
+		return -1;
+
+	return 0;
+}
+
+
+const char *
+spiflash_read_config_name(
+	unsigned src
+)
+{
+	static const char * const names[] = {
+		[SPIFLASH_SRC_CACHE] = "cache",
+		[SPIFLASH_SRC_NONE] = "no prefetch or cache",
+		[SPIFLASH_SRC_PREFETCH_CACHE] = "prefetch+cache",
+	};
+
+	return src < sizeof(names)/sizeof(*names) ? names[src] : "reserved";
+}
+
+
 void
 spiflash_prr(
 	spiflash_t * const sp,
@@ -810,6 +1142,21 @@ spiflash_init(
 }
 
 
+void
+spiflash_fini(
+	spiflash_t * const sp
+)
+{
+	if (sp->spibar)
+		unmap_physical((uint8_t*) sp->spibar - SPIBAR_OFFSET, 65536);
+	if (sp->lpc_base)
+		unmap_physical(sp->lpc_base, 0x1000);
+
+	sp->spibar = NULL;
+	sp->lpc_base = NULL;
+}
+
+
 void
 spiflash_info(
 	spiflash_t * const sp
@@ -818,15 +1165,18 @@ spiflash_info(
         const uint8_t bios_cntl
 		= read_mmio_byte(sp->lpc_base, BIOS_CNTL_OFFSET);
 
-	printf("BIOS_CNTL=%02x:%s%s%s%s\n",
+	printf("BIOS_CNTL=%02x:%s%s%s%s SRC=%s\n",
 		bios_cntl,
 		bios_cntl & BIOS_CNTL_BIOSWE ? " BIOSWE" : "",
 		bios_cntl & BIOS_CNTL_BLE ? " BLE" : "",
 		bios_cntl & BIOS_CNTL_TOPSWAP ? " TOPSWAP" : "",
-		bios_cntl & BIOS_CNTL_SMMBWP ? " SMMBWP" : ""
+		bios_cntl & BIOS_CNTL_SMMBWP ? " SMMBWP" : "",
+		spiflash_read_config_name(
+			(bios_cntl & BIOS_CNTL_SRC) >> BIOS_CNTL_SRC_OFF)
 	);
 
-	printf("HSFS=%s\n", spiflash_hsfs_str(sp));
+	char hsfs_buf[HSFS_STR_LEN];
+	printf("HSFS=%s\n", spiflash_hsfs_str(sp, hsfs_buf));
 
 	for(int i = 0 ; i < 5 ; i++)
 	{
@@ -20,6 +20,13 @@ spiflash_init(
 );
 
 
+// Release the mappings made by spiflash_init
+extern void
+spiflash_fini(
+	spiflash_t * sp
+);
+
+
 extern void
 spiflash_info(
 	spiflash_t * sp
@@ -39,6 +46,35 @@ spiflash_set_bios_cntl(
 );
 
 
+/*
+ * SPI Read Configuration (BIOS_CNTL SRC): how the chipset prefetches
+ * and caches reads of the flash through the memory-mapped BIOS window.
+ * The fourth encoding is reserved.
+ */
+#define SPIFLASH_SRC_CACHE 0            // caching, no prefetch
+#define SPIFLASH_SRC_NONE 1             // neither
+#define SPIFLASH_SRC_PREFETCH_CACHE 2   // both
+
+extern unsigned
+spiflash_read_config(
+	spiflash_t * const sp
+);
+
+
+// Changes only the SRC bits; -1 if reserved or they do not stick
+extern int
+spiflash_set_read_config(
+	spiflash_t * const sp,
+	unsigned src
+);
+
+
+extern const char *
+spiflash_read_config_name(
+	unsigned src
+);
+
+
 extern void
 spiflash_prr(
 	spiflash_t * const sp,
@@ -77,6 +113,19 @@ spiflash_erase_size(
 );
 
 
+/*
+ * Base and limit (inclusive) of a flash descriptor region:
+ * 0 == descriptor, 1 == BIOS, 2 == ME, 3 == GbE, 4 == PDR
+ */
+extern int
+spiflash_region(
+	spiflash_t * sp,
+	unsigned region,
+	uint32_t * base,
+	uint32_t * limit
+);
+
+
 extern int
 spiflash_read(
 	spiflash_t * sp,
@@ -86,6 +135,27 @@ spiflash_read(
 );
 
 
+typedef struct {
+	unsigned fladdr;
+	unsigned len;
+	void * buf;
+} spiflash_iovec_t;
+
+/*
+ * Read many fragments in as few cycles as possible.  The vector is
+ * sorted by flash address in place, overlapping and nearby fragments
+ * are merged into the same 64 byte cycles, and no cycle crosses a
+ * 256 byte flash page.  A scan over scattered headers then costs one
+ * cycle per cluster of headers rather than one or more per header.
+ */
+extern int
+spiflash_readv(
+	spiflash_t * sp,
+	spiflash_iovec_t * iov,
+	unsigned count
+);
+
+
 extern int
 spiflash_erase(
 	spiflash_t * sp,
@@ -124,4 +194,17 @@ spiflash_program_buffer(
 	unsigned len
 );
 
+
+// Erase and write only the blocks where the new data differs
+// from the caller's copy of the old flash contents.
+// Returns the number of blocks reprogrammed.
+extern int
+spiflash_program_delta(
+	spiflash_t * const sp,
+	unsigned fladdr,
+	const void * old,
+	const void * new,
+	unsigned len
+);
+
 #endif
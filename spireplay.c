@@ -0,0 +1,296 @@
+/** \file
+ * Run the SPI flash driver against a controller simulated from a
+ * recorded MMIO trace.
+ *
+ * Record a trace on the real machine with a driver built with
+ * -DSPIFLASH_TRACE (make TRACE=1), then run the operations under test
+ * here.  This tool links the driver built with -DSPIFLASH_SIM, so
+ * changes to the wait and read strategies in spiflash.c can be timed
+ * offline against the latencies of each machine that a trace was
+ * taken on.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include "spiflash.h"
+#include "mmio_trace.h"
+
+// the LPC bridge is the first mapping spiflash_init makes, at this
+// offset in the PCIe extended config space (as in spiflash.c)
+#define PCIEXBAR_LPC_OFFSET 0xF8000
+#define SPIREPLAY_MAX_FRAGMENTS 4096
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "read",		1, NULL, 'r' },
+	{ "readv",		1, NULL, 'V' },
+	{ "repeat",		1, NULL, 'n' },
+	{ "pcibar",		1, NULL, 'p' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: spireplay [options] trace\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -r | --read off:len    Read a range with spiflash_read\n"
+"    -V | --readv off:len,...  Read fragments with spiflash_readv\n"
+"    -n | --repeat N        Run the operation N times (default 1)\n"
+"    -p | --pcibar 0x....   PCIE XBAR address (default from the trace)\n"
+"\n"
+"Without an operation, prints the controller model from the trace.\n"
+"\n";
+
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int
+parse_range(
+	const char * s,
+	char ** end,
+	unsigned * const offset,
+	unsigned * const len
+)
+{
+	*offset = strtoul(s, end, 0);
+	if (**end != ':')
+		return -1;
+	*len = strtoul(*end + 1, end, 0);
+	if (*len == 0 || *offset + (uint64_t) *len > MMIO_SIM_FLASH_SIZE)
+		return -1;
+	return 0;
+}
+
+
+static int
+parse_fragments(
+	const char * s,
+	spiflash_iovec_t * const iov,
+	unsigned * const count
+)
+{
+	*count = 0;
+	while (*s)
+	{
+		if (*count == SPIREPLAY_MAX_FRAGMENTS)
+			return -1;
+
+		char * end;
+		spiflash_iovec_t * const v = &iov[(*count)++];
+		if (parse_range(s, &end, &v->fladdr, &v->len) < 0)
+			return -1;
+		if (*end == ',')
+			end++;
+		else
+		if (*end != '\0')
+			return -1;
+		s = end;
+	}
+
+	return *count ? 0 : -1;
+}
+
+
+static void
+print_model(
+	const mmio_trace_t * const trace,
+	const mmio_sim_timing_t * const t
+)
+{
+	printf("trace: %zu accesses in %"PRIu64" ns\n",
+		trace->num_records, t->trace_ns);
+	for (unsigned i = 0 ; i < trace->num_maps ; i++)
+		printf("map %u: %08"PRIx64"[%"PRIx64"]\n",
+			i, trace->maps[i].phys, trace->maps[i].len);
+	printf("access: %"PRIu64" ns\n", t->access_ns);
+	printf("read cycle: %"PRIu64" + %"PRIu64" ns/byte (%u timed)\n",
+		t->read_base_ns, t->read_byte_ns, t->samples[0]);
+	printf("write cycle: %"PRIu64" + %"PRIu64" ns/byte (%u timed)\n",
+		t->write_base_ns, t->write_byte_ns, t->samples[2]);
+	printf("erase cycle: %"PRIu64" ns (%u timed)\n",
+		t->erase_ns, t->samples[3]);
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * read_arg = NULL;
+	const char * readv_arg = NULL;
+	unsigned repeat = 1;
+	uint64_t pcie_xbar = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?vr:V:n:p:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'r':
+			read_arg = optarg;
+			break;
+		case 'V':
+			readv_arg = optarg;
+			break;
+		case 'n':
+			repeat = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			pcie_xbar = strtoul(optarg, NULL, 0);
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc != 1 || (read_arg && readv_arg) || repeat == 0)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	mmio_trace_t trace;
+	if (mmio_trace_load(&trace, argv[0]) < 0)
+	{
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (trace.num_maps == 0)
+	{
+		fprintf(stderr, "%s: no mappings recorded\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	mmio_sim_timing_t timing;
+	if (mmio_sim_start(&trace, &timing) < 0)
+	{
+		perror("mmio_sim_start");
+		return EXIT_FAILURE;
+	}
+
+	if (!read_arg && !readv_arg)
+	{
+		print_model(&trace, &timing);
+		return EXIT_SUCCESS;
+	}
+
+	if (pcie_xbar == 0)
+		pcie_xbar = trace.maps[0].phys - PCIEXBAR_LPC_OFFSET;
+
+	spiflash_t sp = { .verbose = verbose };
+	if (spiflash_init(&sp, pcie_xbar) < 0)
+	{
+		fprintf(stderr, "spiflash_init: the trace has no such controller\n");
+		return EXIT_FAILURE;
+	}
+
+	static spiflash_iovec_t iov[SPIREPLAY_MAX_FRAGMENTS];
+	unsigned count = 0;
+	uint8_t * buf = NULL;
+	uint64_t total = 0;
+
+	if (read_arg)
+	{
+		char * end;
+		if (parse_range(read_arg, &end, &iov[0].fladdr, &iov[0].len) < 0
+		||  *end != '\0')
+		{
+			fprintf(stderr, "%s: bad range\n", read_arg);
+			return EXIT_FAILURE;
+		}
+		count = 1;
+	} else
+	if (parse_fragments(readv_arg, iov, &count) < 0)
+	{
+		fprintf(stderr, "%s: bad fragment list\n", readv_arg);
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned i = 0 ; i < count ; i++)
+		total += iov[i].len;
+
+	buf = malloc(total);
+	if (!buf)
+	{
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	uint64_t pos = 0;
+	for (unsigned i = 0 ; i < count ; i++)
+	{
+		iov[i].buf = buf + pos;
+		pos += iov[i].len;
+	}
+
+	mmio_sim_stats_t before, after;
+	mmio_sim_stats(&before);
+	const uint64_t start = now_ns();
+
+	for (unsigned n = 0 ; n < repeat ; n++)
+	{
+		const int rc = read_arg
+			? spiflash_read(&sp, iov[0].fladdr, iov[0].buf, iov[0].len)
+			: spiflash_readv(&sp, iov, count);
+		if (rc < 0)
+		{
+			fprintf(stderr, "read failed\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	const uint64_t elapsed = now_ns() - start;
+	mmio_sim_stats(&after);
+
+	// the data must be what the traced machine returned
+	const uint8_t * const flash = mmio_sim_flash();
+	unsigned bad = 0;
+	for (unsigned i = 0 ; i < count ; i++)
+		if (memcmp(iov[i].buf, flash + iov[i].fladdr, iov[i].len) != 0)
+			bad++;
+
+	printf("%s: %u x 0x%"PRIx64" bytes in %"PRIu64" ns"
+		" (%"PRIu64" ns each), %"PRIu64" cycles, %"PRIu64" accesses\n",
+		read_arg ? "read" : "readv",
+		repeat, total, elapsed, elapsed / repeat,
+		(after.cycles[0] - before.cycles[0]) / repeat,
+		(after.accesses - before.accesses) / repeat);
+
+	if (bad)
+	{
+		printf("%u of %u fragments differ from the trace\n", bad, count);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,698 @@
+/** \file
+ * List and refresh the Intel microcode updates in a ROM.
+ *
+ * Microcode lives in the CBFS file cpu_microcode_blob.bin on coreboot
+ * and in a raw FFS file of the microcode volume on UEFI.  Patches in
+ * those containers are replaced in place by newer revisions for the
+ * same processor, the container is padded back to its original size
+ * so that nothing else in the image moves, and the FFS checksum is
+ * adjusted for the new contents.  Patches after one that changed size
+ * move, so the FIT microcode entries that point at them are updated
+ * along with the FIT checksum.  On a live system only the erase
+ * blocks that the container occupies, and that actually change, are
+ * reprogrammed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "util.h"
+#include "spiflash.h"
+#include "pciexbar.h"
+#include "microcode.h"
+#include "cbfs_index.h"
+#include "uefi_index.h"
+
+#define MICROCODE_CBFS_NAME "cpu_microcode_blob.bin"
+
+int verbose = 0;
+
+static const struct option long_options[] = {
+	{ "verbose",		0, NULL, 'v' },
+	{ "rom",		1, NULL, 'o' },
+	{ "list",		0, NULL, 'l' },
+	{ "update",		1, NULL, 'u' },
+	{ "dry-run",		0, NULL, 'n' },
+	{ "pcibar",		1, NULL, 'p' },
+	{ "help",		0, NULL, 'h' },
+	{ NULL,			0, NULL, 0 },
+};
+
+
+static const char usage[] =
+"Usage: sudo ucode [options]\n"
+"\n"
+"    -h | -? | --help       This help\n"
+"    -v | --verbose         Increase verbosity\n"
+"    -o | --rom file        Use local file instead of internal ROM\n"
+"    -l | --list            List the microcode patches\n"
+"    -u | --update file     Replace older patches with ones from file\n"
+"                           (may be repeated)\n"
+"    -n | --dry-run         Show what would be replaced\n"
+"    -p | --pcibar 0x....   PCIE XBAR address for flash writes\n"
+"\n"
+"Without -o, updates only reprogram the flash blocks that change.\n"
+"\n";
+
+
+typedef struct {
+	char name[CBFS_NAME_LEN + 8];
+	uint64_t offset;        // region to rewrite: CBFS data or FFS file
+	uint64_t len;
+	uint64_t data_offset;   // of the patches
+	uint64_t data_len;
+	int ffs;                // the region starts with an FFS header
+} container_t;
+
+typedef struct {
+	const uint8_t * patch;
+	const char * filename;
+} update_t;
+
+typedef struct {
+	uint64_t old_offset;    // of a patch in the ROM
+	uint64_t new_offset;
+} patch_move_t;
+
+// The new FIT and, if it is in a checksummed FFS file, its file sum
+typedef struct {
+	struct fit_entry * table;
+	uint64_t offset;
+	uint64_t len;
+	int64_t sum_offset;     // -1 if there is no file sum to adjust
+	uint8_t sum;
+} fit_update_t;
+
+
+static void
+print_patch(
+	const uint8_t * const patch,
+	uint64_t offset
+)
+{
+	struct microcode_header h;
+	memcpy(&h, patch, sizeof(h));
+
+	printf("  %08"PRIx64" sig %08x pf %02x rev %08x %04x-%02x-%02x size %x%s\n",
+		offset,
+		h.processor_signature,
+		h.processor_flags,
+		h.update_revision,
+		h.date & 0xFFFF,
+		h.date >> 24,
+		(h.date >> 16) & 0xFF,
+		microcode_size(patch, UINT32_MAX),
+		microcode_checksum_ok(patch) ? "" : " BAD CHECKSUM"
+	);
+}
+
+
+static size_t
+find_containers(
+	const uint8_t * const rom,
+	uint64_t size,
+	container_t * const containers,
+	size_t max
+)
+{
+	size_t count = 0;
+
+	cbfs_index_t cbfs;
+	if (cbfs_index_build(&cbfs, rom, size, NULL) == 0)
+	{
+		for (size_t i = 0 ; i < cbfs.num_files && count < max ; i++)
+		{
+			const cbfs_entry_t * const f = &cbfs.files[i];
+			if (strcmp(f->name, MICROCODE_CBFS_NAME) != 0)
+				continue;
+
+			container_t * const c = &containers[count++];
+			snprintf(c->name, sizeof(c->name), "cbfs %s", f->name);
+			c->offset = c->data_offset = f->offset + f->header_len;
+			c->len = c->data_len = f->len;
+			c->ffs = 0;
+		}
+
+		cbfs_index_free(&cbfs);
+	}
+
+	uefi_index_t uefi;
+	if (uefi_index_build(&uefi, rom, size, NULL) == 0)
+	{
+		// the microcode file is a raw file that holds the patches
+		// directly, so recognize it by its contents
+		for (size_t i = 0 ; i < uefi.num_files && count < max ; i++)
+		{
+			const uefi_file_t * const f = &uefi.files[i];
+			const uint64_t data = f->offset + f->header_len;
+			if (f->type != EFI_FV_FILETYPE_RAW
+			||  microcode_count(rom + data, f->len - f->header_len) == 0)
+				continue;
+
+			char guid[GUID_STR_LEN];
+			container_t * const c = &containers[count++];
+			snprintf(c->name, sizeof(c->name), "ffs %s",
+				guid_format(guid, f->guid));
+			c->offset = f->offset;
+			c->len = f->len;
+			c->data_offset = data;
+			c->data_len = f->len - f->header_len;
+			c->ffs = 1;
+		}
+
+		uefi_index_free(&uefi);
+	}
+
+	return count;
+}
+
+
+static void
+list_container(
+	const uint8_t * const rom,
+	const container_t * const c
+)
+{
+	const uint8_t * const data = rom + c->data_offset;
+	printf("%s @%08"PRIx64"[%"PRIx64"]: %u patches\n",
+		c->name, c->data_offset, c->data_len,
+		microcode_count(data, c->data_len));
+
+	uint64_t off = 0;
+	uint32_t size;
+	while ((size = microcode_size(data + off, c->data_len - off)) != 0)
+	{
+		print_patch(data + off, c->data_offset + off);
+		off += size;
+	}
+}
+
+
+static int
+load_updates(
+	const char * const filename,
+	update_t ** const updates,
+	size_t * const num_updates
+)
+{
+	uint64_t size;
+	const uint8_t * const buf = map_file(filename, &size, 1);
+	if (!buf)
+	{
+		fprintf(stderr, "%s: %s\n", filename,
+			errno ? strerror(errno) : "empty file");
+		return -1;
+	}
+
+	uint64_t off = 0;
+	uint32_t patch_size;
+	while ((patch_size = microcode_size(buf + off, size - off)) != 0)
+	{
+		if (!microcode_checksum_ok(buf + off))
+		{
+			fprintf(stderr, "%s: bad checksum on patch at %"PRIx64"\n",
+				filename, off);
+			return -1;
+		}
+
+		update_t * const u = realloc(*updates, (*num_updates + 1) * sizeof(*u));
+		if (!u)
+		{
+			perror("realloc");
+			return -1;
+		}
+		*updates = u;
+		u[*num_updates].patch = buf + off;
+		u[*num_updates].filename = filename;
+		(*num_updates)++;
+
+		off += patch_size;
+	}
+
+	if (off == 0)
+	{
+		fprintf(stderr, "%s: no microcode patches\n", filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// Newest update for the processors the existing patch is for, if any
+static const update_t *
+find_update(
+	const uint8_t * const patch,
+	const update_t * const updates,
+	size_t num_updates
+)
+{
+	struct microcode_header h;
+	memcpy(&h, patch, sizeof(h));
+
+	const update_t * best = NULL;
+	uint32_t best_rev = h.update_revision;
+
+	for (size_t i = 0 ; i < num_updates ; i++)
+	{
+		struct microcode_header u;
+		memcpy(&u, updates[i].patch, sizeof(u));
+
+		if (u.update_revision <= best_rev)
+			continue;
+		if (!microcode_matches(updates[i].patch,
+			h.processor_signature, h.processor_flags))
+			continue;
+
+		best = &updates[i];
+		best_rev = u.update_revision;
+	}
+
+	return best;
+}
+
+
+static int
+rom_write(
+	uint8_t * const rom,
+	uint64_t offset,
+	const void * const data,
+	uint64_t len,
+	spiflash_t * const flash,
+	uint32_t flash_base
+)
+{
+	if (!flash)
+	{
+		memcpy(rom + offset, data, len);
+		return 0;
+	}
+
+	const uint32_t fladdr = flash_base + offset;
+	const int blocks = spiflash_program_delta(flash, fladdr,
+		rom + offset, data, len);
+	if (blocks < 0)
+		return -1;
+
+	if (verbose)
+		fprintf(stderr, "reprogrammed %d blocks at %x[%"PRIx64"]\n",
+			blocks, fladdr, len);
+	return 0;
+}
+
+
+/*
+ * Point the FIT microcode entries for the patches of a container at
+ * where they moved to.  Returns 1 with the new table in *fit if any
+ * entry changes, 0 if none do or there is no FIT, and -1 if an entry
+ * can not be followed.  Nothing is written here, so that a bad FIT
+ * stops the update before the container is touched.
+ */
+static int
+fit_prepare(
+	const uint8_t * const rom,
+	uint64_t size,
+	const container_t * const c,
+	const patch_move_t * const moves,
+	size_t num_moves,
+	fit_update_t * const fit
+)
+{
+	unsigned entries;
+	const int64_t fit_off = fit_find(rom, size, &entries);
+	if (fit_off < 0)
+		return 0;
+
+	fit->offset = fit_off;
+	fit->len = entries * sizeof(struct fit_entry);
+	fit->sum_offset = -1;
+
+	if (fit->offset < c->offset + c->len && c->offset < fit->offset + fit->len)
+	{
+		fprintf(stderr, "%s: FIT at %"PRIx64" overlaps the container\n",
+			c->name, fit->offset);
+		return -1;
+	}
+
+	fit->table = malloc(fit->len);
+	if (!fit->table)
+	{
+		perror("malloc");
+		return -1;
+	}
+	memcpy(fit->table, rom + fit->offset, fit->len);
+
+	unsigned changed = 0;
+	for (unsigned i = 1 ; i < entries ; i++)
+	{
+		struct fit_entry * const e = &fit->table[i];
+		if ((e->type & FIT_TYPE_MASK) != FIT_TYPE_MICROCODE)
+			continue;
+
+		const int64_t off = fit_offset(e->address, size);
+		if (off < 0
+		||  (uint64_t) off < c->data_offset
+		||  (uint64_t) off >= c->data_offset + c->data_len)
+			continue;
+
+		size_t j = 0;
+		while (j < num_moves && moves[j].old_offset != (uint64_t) off)
+			j++;
+		if (j == num_moves)
+		{
+			fprintf(stderr, "%s: FIT entry %u at %08"PRIx64
+				" is not the start of a patch\n",
+				c->name, i, e->address);
+			free(fit->table);
+			return -1;
+		}
+
+		if (moves[j].new_offset == moves[j].old_offset)
+			continue;
+
+		const uint64_t address = e->address
+			- moves[j].old_offset + moves[j].new_offset;
+		printf("%s: FIT entry %u %08"PRIx64" -> %08"PRIx64"\n",
+			c->name, i, e->address, address);
+		e->address = address;
+		changed++;
+	}
+
+	if (changed == 0)
+	{
+		free(fit->table);
+		return 0;
+	}
+
+	fit_checksum(fit->table, entries);
+
+	// on UEFI the FIT is usually in a raw file of the boot volume
+	uefi_index_t uefi;
+	if (uefi_index_build(&uefi, rom, size, NULL) == 0)
+	{
+		for (size_t i = 0 ; i < uefi.num_files ; i++)
+		{
+			const uefi_file_t * const f = &uefi.files[i];
+			if (fit->offset < f->offset + f->header_len
+			||  fit->offset + fit->len > f->offset + f->len
+			||  !(f->attr & FFS_ATTRIB_CHECKSUM))
+				continue;
+
+			fit->sum_offset = f->offset
+				+ offsetof(struct efi_file_header, file_sum);
+			fit->sum = checksum8_update(rom[fit->sum_offset],
+				rom + fit->offset, fit->table, fit->len);
+		}
+
+		uefi_index_free(&uefi);
+	}
+
+	return 1;
+}
+
+
+static int
+update_container(
+	uint8_t * const rom,
+	uint64_t rom_size,
+	const container_t * const c,
+	const update_t * const updates,
+	size_t num_updates,
+	spiflash_t * const flash,
+	uint32_t flash_base,
+	int dry_run
+)
+{
+	uint8_t * const new = malloc(c->len);
+	if (!new)
+	{
+		perror("malloc");
+		return -1;
+	}
+
+	memcpy(new, rom + c->offset, c->len);
+
+	const unsigned num_patches = microcode_count(rom + c->data_offset,
+		c->data_len);
+	patch_move_t * const moves = calloc(num_patches + 1, sizeof(*moves));
+	if (!moves)
+	{
+		perror("calloc");
+		free(new);
+		return -1;
+	}
+	size_t num_moves = 0;
+
+	const uint8_t * const old_data = rom + c->data_offset;
+	uint8_t * const new_data = new + (c->data_offset - c->offset);
+	uint64_t old_off = 0;
+	uint64_t new_off = 0;
+	unsigned replaced = 0;
+	uint32_t size;
+
+	while ((size = microcode_size(old_data + old_off, c->data_len - old_off)) != 0)
+	{
+		const uint8_t * patch = old_data + old_off;
+		const update_t * const u = find_update(patch, updates, num_updates);
+		if (u)
+		{
+			struct microcode_header oh, nh;
+			memcpy(&oh, patch, sizeof(oh));
+			memcpy(&nh, u->patch, sizeof(nh));
+			printf("%s: sig %08x rev %08x -> %08x from %s\n",
+				c->name, oh.processor_signature,
+				oh.update_revision, nh.update_revision,
+				u->filename);
+
+			patch = u->patch;
+			replaced++;
+		}
+
+		const uint32_t patch_size = microcode_size(patch, UINT32_MAX);
+		if (patch_size > c->data_len - new_off)
+		{
+			fprintf(stderr, "%s: updated patches do not fit in %"PRIx64" bytes\n",
+				c->name, c->data_len);
+			free(moves);
+			free(new);
+			return -1;
+		}
+
+		moves[num_moves++] = (patch_move_t) {
+			.old_offset = c->data_offset + old_off,
+			.new_offset = c->data_offset + new_off,
+		};
+
+		memcpy(new_data + new_off, patch, patch_size);
+		new_off += patch_size;
+		old_off += size;
+	}
+
+	fit_update_t fit;
+	const int fit_changed = replaced
+		? fit_prepare(rom, rom_size, c, moves, num_moves, &fit) : 0;
+	free(moves);
+
+	if (fit_changed < 0)
+	{
+		free(new);
+		return -1;
+	}
+
+	if (replaced == 0 || dry_run)
+	{
+		if (fit_changed)
+			free(fit.table);
+		free(new);
+		return 0;
+	}
+
+	// keep the container the same size so nothing else moves;
+	// the loaders stop at the first header that is not sane
+	memset(new_data + new_off, 0xFF, c->data_len - new_off);
+
+	if (c->ffs)
+	{
+		struct efi_file_header * const file = (void *) new;
+		if (file->attr & FFS_ATTRIB_CHECKSUM)
+			file->file_sum = checksum8_update(file->file_sum,
+				old_data, new_data, c->data_len);
+	}
+
+	int rc = replaced;
+	if (rom_write(rom, c->offset, new, c->len, flash, flash_base) < 0)
+	{
+		fprintf(stderr, "%s: failed to program %x\n",
+			c->name, flash_base + (uint32_t) c->offset);
+		rc = -1;
+	} else
+	if (fit_changed)
+	{
+		if (rom_write(rom, fit.offset, fit.table, fit.len,
+			flash, flash_base) < 0
+		||  (fit.sum_offset >= 0 && rom_write(rom, fit.sum_offset,
+			&fit.sum, 1, flash, flash_base) < 0))
+		{
+			fprintf(stderr, "%s: failed to program the FIT at %x\n",
+				c->name, flash_base + (uint32_t) fit.offset);
+			rc = -1;
+		}
+	}
+
+	if (fit_changed)
+		free(fit.table);
+	free(new);
+	return rc;
+}
+
+
+int
+main(
+	int argc,
+	char ** argv
+)
+{
+	const char * const prog_name = argv[0];
+	const char * romname = NULL;
+	uint64_t pcie_xbar = PCIEXBAR;
+	int do_list = 0;
+	int dry_run = 0;
+	update_t * updates = NULL;
+	size_t num_updates = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h?vo:lu:np:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'v':
+			verbose++;
+			break;
+		case 'o':
+			romname = optarg;
+			break;
+		case 'l':
+			do_list = 1;
+			break;
+		case 'u':
+			if (load_updates(optarg, &updates, &num_updates) < 0)
+				return EXIT_FAILURE;
+			break;
+		case 'n':
+			dry_run = 1;
+			break;
+		case 'p':
+			pcie_xbar = strtoull(optarg, NULL, 0);
+			break;
+		case '?': case 'h':
+			printf("%s", usage);
+			return EXIT_SUCCESS;
+		default:
+			fprintf(stderr, "%s", usage);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc != optind)
+	{
+		fprintf(stderr, "%s: Excess arguments?\n", prog_name);
+		return EXIT_FAILURE;
+	}
+
+	if (!do_list && num_updates == 0)
+	{
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	const int do_write = num_updates != 0 && !dry_run;
+	const uint64_t mem_end = 0x100000000;
+	spiflash_t * flash = NULL;
+	uint32_t flash_base = 0;
+	uint8_t * rom;
+	uint64_t size;
+
+	if (romname)
+	{
+		rom = map_file(romname, &size, !do_write);
+	} else {
+		size = 0x2000000;
+
+		if (do_write)
+		{
+			// the mapped window is read-only, so the patches
+			// are programmed through the SPI controller instead
+			flash = calloc(1, sizeof(*flash));
+			if (!flash)
+				return EXIT_FAILURE;
+			flash->verbose = verbose;
+
+			if (spiflash_init(flash, pcie_xbar) < 0)
+			{
+				perror("spiflash_init");
+				return EXIT_FAILURE;
+			}
+
+			uint32_t bios_base, bios_limit;
+			if (spiflash_region(flash, 1, &bios_base, &bios_limit) < 0)
+			{
+				fprintf(stderr, "Failed to find BIOS region\n");
+				return EXIT_FAILURE;
+			}
+
+			if (spiflash_write_enable(flash) < 0)
+			{
+				fprintf(stderr, "spiflash: unable to enable writes\n");
+				return EXIT_FAILURE;
+			}
+
+			size = (uint64_t) bios_limit - bios_base + 1;
+			if (size > 0x2000000)
+				size = 0x2000000;
+			flash_base = bios_limit + 1 - size;
+		}
+
+		rom = map_physical(mem_end - size, size);
+	}
+
+	if (rom == NULL)
+	{
+		fprintf(stderr, "Failed to map ROM: %s '%s'\n",
+			romname ? romname : "physical", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	container_t containers[16];
+	const size_t num_containers = find_containers(rom, size,
+		containers, sizeof(containers) / sizeof(*containers));
+
+	if (num_containers == 0)
+	{
+		fprintf(stderr, "%s: no microcode found\n", prog_name);
+		return EXIT_FAILURE;
+	}
+
+	if (do_list)
+		for (size_t i = 0 ; i < num_containers ; i++)
+			list_container(rom, &containers[i]);
+
+	int replaced = 0;
+	for (size_t i = 0 ; i < num_containers && num_updates ; i++)
+	{
+		const int rc = update_container(rom, size, &containers[i],
+			updates, num_updates, flash, flash_base, dry_run);
+		if (rc < 0)
+			return EXIT_FAILURE;
+		replaced += rc;
+	}
+
+	if (num_updates && replaced == 0 && !dry_run)
+		printf("%s: microcode is up to date\n", prog_name);
+
+	return EXIT_SUCCESS;
+}
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
@@ -10,20 +11,24 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <lzma.h>
 #include "util.h"
+#include "spiflash.h"
+#include "pciexbar.h"
+#include "pool.h"
+#include "uefi_index.h"
+#include "descriptor.h"
+#include "capsule.h"
 
-#define EFI_PAGE_SIZE 0x1000
-#define EFI_VOLUME_SIGNATURE 0x4856465F
-#define EFI_FIRMWARE_GUID1 "8c8ce578-8a3d-4f1c-9935-896185c32dd3"
-#define EFI_FIRMWARE_GUID2 "5473c07a-3dcb-4dca-bd6f-1e9689e7349a"
-#define EFI_EMPTY_GUID "ffffffff-ffff-ffff-ffff-ffffffffffff"
-#define EFI_SECTION_VERSION               0x14
-#define EFI_SECTION_USER_INTERFACE        0x15
-#define EFI_SECTION_FIRMWARE_VOLUME_IMAGE 0x17
-#define EFI_SECTION_RAW                   0x19
+#define EXTRACT_PATH_LEN 4096
 
 int verbose = 0;
 
+// when writing directly to flash, the SPI driver and the flash
+// linear address that corresponds to the start of the mapped ROM
+static spiflash_t * flash = NULL;
+static uint32_t flash_base = 0;
+
 static const struct option long_options[] = {
 	{ "verbose", 0, NULL, 'v' },
 	{ "file",    1, NULL, 'f' },
@@ -31,6 +36,12 @@ static const struct option long_options[] = {
 	{ "read",    1, NULL, 'r' },
 	{ "rom",     1, NULL, 'o' },
 	{ "list",    0, NULL, 'l' },
+	{ "pcibar",  1, NULL, 'p' },
+	{ "extract-all", 1, NULL, 'x' },
+	{ "threads", 1, NULL, 'j' },
+	{ "payload", 1, NULL, 'P' },
+	{ "space",   0, NULL, 's' },
+	{ "defrag",  0, NULL, 'd' },
 	{ "help",    0, NULL, 'h' },
 	{ NULL,      0, NULL, 0 },
 };
@@ -45,113 +56,187 @@ static const char usage[] =
 "    -l | --list                         List the GUID and names of EFI files\n"
 "    -r | --read GUID                    Export an EFI file to stdout\n"
 "    -w | --write GUID -f | --file path  Replace an existing EFI file\n"
+"    -p | --pcibar 0x....                PCIE XBAR address for flash writes\n"
+"    -x | --extract-all DIR              Write every FV/FFS/section to DIR\n"
+"    -j | --threads N                    Worker threads for extraction\n"
+"    -P | --payload N                    Capsule payload to use (default 0)\n"
+"    -s | --space                        Report the free space in each FV\n"
+"    -d | --defrag                       Move files down to join the free space\n"
+"\n"
+"The space report counts the files, the erased pad and deleted\n"
+"files, the pad not needed for alignment, the bytes lost to\n"
+"alignment, the erased space after the last file and the largest\n"
+"run that a new file could use.  A * marks a volume with data after\n"
+"its last file.  Pad files that hold data count as fixed files.\n"
+"\n"
+"Without -o, writes only reprogram the flash blocks that change.\n"
+"A capsule given with -o is parsed in place, without unpacking it.\n"
 "\n";
 
-struct efi_volume_header {
-	uint8_t zero_vector[16];  // 0x00
-	uint8_t guid[16];         // 0x10
-	uint64_t len;             // 0x20
-	uint32_t sig;             // 0x28
-	uint32_t attr;            // 0x2c
-	uint16_t header_len;      // 0x30
-	uint16_t checksum;        // 0x32
-	uint16_t ext_header_off;  // 0x34
-	uint8_t reserved;         // 0x36
-	uint8_t revision;         // 0x37
-	uint32_t num_blocks;      // 0x38
-	uint32_t block_size;      // 0x3c
-	uint64_t terminate_block; // 0x40 - must be 0
-};
-
-struct efi_file_header {
-	uint8_t guid[16];         // 0x00
-	uint8_t header_sum;       // 0x10
-	uint8_t file_sum;         // 0x11
-	uint8_t type;             // 0x12
-	uint8_t attr;             // 0x13
-	uint8_t len[3];           // 0x14
-	uint8_t state;            // 0x17
-	uint64_t len64;           // 0x18 optional extended length field
-};
-
-struct efi_section_header {
-	uint8_t len[3];
-	uint8_t type;
-};
-
-uint32_t size24(uint8_t len[3]) {
-	return (uint32_t)len[0] +
-		((uint32_t)(len[1]) << 8) +
-		((uint32_t)(len[2]) << 16);
-}
-
-void setsize24(uint8_t len[3], uint32_t size) {
-	len[2] = size >> 16 & 0xFF;
-	len[1] = size >> 8 & 0xFF;
-	len[0] = size & 0xFF;
-}
-
-char *guid_string(uint8_t guid[16]) {
-	char *s = malloc(37);
-	snprintf(s, 37,
-		"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
-		guid[3], guid[2], guid[1], guid[0],
-		guid[5], guid[4],
-		guid[7], guid[6],
-		guid[8], guid[9],
-		guid[10],
-		guid[11],
-		guid[12],
-		guid[13],
-		guid[14],
-		guid[15]);
-	return s;
-}
-
-int copy_buffer(void **dst, void *end, void *src, size_t len) {
-	if (*dst + len >= end) {
-		return EXIT_FAILURE;
+int copy_buffer(void **dst, void *end, const void *src, size_t len) {
+	if (len > (size_t)(end - *dst)) {
+		return -1;
 	}
 	memcpy(*dst, src, len);
 	*dst += len;
-	return EXIT_SUCCESS;
+	return 0;
 }
 
 int align_buffer(void **dst, void *start, void *end, int align, char fill) {
 	while (((*dst - start) & (align - 1)) % align != 0) {
 		if (*dst >= end) {
-			return EXIT_FAILURE;
+			return -1;
 		}
 		*((char *)*dst) = fill;
 		*dst += 1;
 	}
-	return EXIT_SUCCESS;
+	return 0;
 }
 
 int add_section(
 	void **dst,
 	void *end,
 	void *start,
-	uint32_t len24,
+	uint64_t data_len,
 	uint8_t type,
-	void *src
+	const void *src
 ) {
 	if (align_buffer(dst, start, end, 0x4, 0x00) < 0) {
-		return EXIT_FAILURE;
+		return -1;
 	}
-	if (copy_buffer(dst, end, &len24, 3) < 0) {
-		return EXIT_FAILURE;
+
+	uint8_t header[8];
+	uint32_t header_len = 4;
+	if (data_len + 4 < 0xFFFFFF) {
+		setsize24(header, data_len + 4);
+	} else {
+		if (data_len + 8 > UINT32_MAX) {
+			return -1;
+		}
+		uint32_t len32 = data_len + 8;
+		setsize24(header, 0xFFFFFF);
+		memcpy(header + 4, &len32, sizeof(len32));
+		header_len = 8;
 	}
-	if (copy_buffer(dst, end, &type, sizeof(type)) < 0) {
-		return EXIT_FAILURE;
+	header[3] = type;
+
+	if (copy_buffer(dst, end, header, header_len) < 0) {
+		return -1;
 	}
-	if (copy_buffer(dst, end, src, len24-0x4) < 0) {
-		return EXIT_FAILURE;
+	if (copy_buffer(dst, end, src, data_len) < 0) {
+		return -1;
 	}
-	return EXIT_SUCCESS;
+	return 0;
+}
+
+/*
+ * FFS layout helpers shared by file replacement and defragmentation.
+ *
+ * Files that execute in place (SEC, PEI core and PEIMs), fixed files
+ * and the volume top file were linked for their address and are
+ * never moved.  A gap between two files is filled with pad files,
+ * so it is either empty or large enough for a pad file header.
+ */
+#define FFS_PAD_HEADER_LEN 0x18
+#define FFS_PAD_MAX_LEN 0xFFFFF8
+
+/*
+ * First offset at or after pos where a file can start with its data
+ * aligned; a gap before it has to be large enough for a pad file.
+ */
+static uint64_t ffs_place(uint64_t pos, uint64_t align, uint32_t header_len) {
+	if (align < 8) {
+		align = 8;
+	}
+
+	uint64_t off = align_up(pos + header_len, align) - header_len;
+	if (off != pos && off - pos < FFS_PAD_HEADER_LEN) {
+		off = align_up(pos + FFS_PAD_HEADER_LEN + header_len, align)
+			- header_len;
+	}
+	return off;
 }
 
-// assumes the full FV and a single FFS exists
+static int ffs_fixed(const struct efi_file_header *file) {
+	char guid[GUID_STR_LEN];
+
+	if (file->attr & FFS_ATTRIB_FIXED) {
+		return 1;
+	}
+
+	switch (file->type) {
+	case EFI_FV_FILETYPE_SECURITY_CORE:
+	case EFI_FV_FILETYPE_PEI_CORE:
+	case EFI_FV_FILETYPE_PEIM:
+	case EFI_FV_FILETYPE_COMBINED_PEIM_DRIVER:
+		return 1;
+	}
+
+	return strcmp(guid_format(guid, file->guid),
+		EFI_FFS_VOLUME_TOP_FILE_GUID) == 0;
+}
+
+/*
+ * A pad file holds nothing only if its body is erased; some vendors
+ * keep data like FIT or Boot Guard tables in pads at fixed addresses.
+ */
+static int ffs_pad_free(
+	const struct efi_file_header *file,
+	uint64_t file_len,
+	uint32_t header_len,
+	int polarity
+) {
+	const uint8_t erased = polarity ? 0xFF : 0x00;
+	const uint8_t *buf = (const void *) file;
+
+	if (file->type != EFI_FV_FILETYPE_FFS_PAD) {
+		return 0;
+	}
+	for (uint64_t off = header_len ; off < file_len ; off++) {
+		if (buf[off] != erased) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Fill a gap with pad files, which are split if the gap is too large
+static void ffs_write_pad(uint8_t *dst, uint64_t len, int polarity) {
+	const uint8_t state = EFI_FILE_HEADER_CONSTRUCTION |
+		EFI_FILE_HEADER_VALID | EFI_FILE_DATA_VALID;
+
+	while (len != 0) {
+		uint64_t n = len < FFS_PAD_MAX_LEN ? len : FFS_PAD_MAX_LEN;
+		if (len - n != 0 && len - n < FFS_PAD_HEADER_LEN) {
+			n -= 0x20;
+		}
+
+		struct efi_file_header *pad = (void *) dst;
+		memset(pad->guid, 0xFF, sizeof(pad->guid));
+		pad->header_sum = 0;
+		pad->file_sum = 0;
+		pad->type = EFI_FV_FILETYPE_FFS_PAD;
+		pad->attr = 0;
+		setsize24(pad->len, n);
+		pad->state = 0;
+
+		// the header sum excludes the file sum and the state
+		pad->header_sum = -sum8(pad, FFS_PAD_HEADER_LEN);
+		pad->file_sum = FFS_FIXED_CHECKSUM;
+		pad->state = polarity ? (uint8_t) ~state : state;
+
+		dst += n;
+		len -= n;
+	}
+}
+
+/*
+ * Replace the raw section of a file, keeping its name and version
+ * sections.  The rest of the volume is kept: the files after it stay
+ * in place where they still fit, are moved up where they do not and
+ * the gaps are refilled with pad files.  Erased pad files give up
+ * their space; fixed files and pads that hold data are never moved.
+ */
 int replace_fv_ffs_raw(
 	void *rom,
 	struct efi_volume_header *vol,
@@ -162,85 +247,937 @@ int replace_fv_ffs_raw(
 ) {
 	void *newfiledata = NULL;
 	uint64_t newsize;
-	newfiledata = map_file(filename, &newsize, 0);
+	newfiledata = map_file(filename, &newsize, 1);
+	if (newfiledata == NULL && errno > 0) {
+		fprintf(stderr, "Failed to map file: %s '%s'\n", filename,
+			strerror(errno));
+		return -1;
+	}
 
 	uint64_t volsize = vol->len;
-	void *new = malloc(volsize), *newend = new+volsize;
-	void *newoff = new;
+	if (fv_files_offset(vol, volsize) == 0) {
+		return -1;
+	}
 
-	if (copy_buffer(&newoff, newend, vol, vol->header_len) < 0) {
-		return EXIT_FAILURE;
+	const int ffs3 = fv_ffs_version(vol) == 3;
+	const int polarity = (vol->attr & EFI_FVB2_ERASE_POLARITY) != 0;
+	const uint8_t erased = polarity ? 0xFF : 0x00;
+	const uint8_t *old = (const void *) vol;
+	const uint64_t file_off = (const uint8_t *) file - old;
+
+	void *new = malloc(volsize), *newend = new+volsize;
+	void *newoff = new + file_off;
+	if (new == NULL) {
+		return -1;
 	}
 
+	// keep the volume header and the files before this one
+	memcpy(new, vol, file_off);
+	memset(newoff, erased, volsize - file_off);
+
 	struct efi_file_header *newfile = newoff;
-	if (copy_buffer(&newoff, newend, file, 0x18) < 0) {
-		return EXIT_FAILURE;
+	if (copy_buffer(&newoff, newend, file, file_header_len) < 0) {
+		goto fail;
 	}
 
 	// start of data
 	void *newdata = newoff;
 	if (add_section(&newoff, newend, new,
-		newsize + 0x4, EFI_SECTION_RAW, newfiledata) < 0
+		newsize, EFI_SECTION_RAW, newfiledata) < 0
 	) {
-		return EXIT_FAILURE;
+		goto fail;
 	}
 
 	// copy guid / version sections
-	void *soff = (void *)file + file_header_len;
-	while (soff < (void *)file + file_len) {
-		struct efi_section_header *section = soff;
-		uint32_t section_len = size24(section->len);
+	uint64_t soff = file_header_len;
+	while (soff < file_len) {
+		void *section = (void *)file + soff;
+		uint32_t section_header_len;
+		uint64_t section_len = ffs_section_len(section,
+			file_len - soff, &section_header_len);
 		if (section_len == 0) {
 			break;
 		}
 
+		uint8_t type = ((struct efi_section_header *) section)->type;
 		if (verbose) {
-			fprintf(stderr, "Checking old file for sections: %lx %x %x to %lx\n",
-				(soff - rom), section_len, section->type, (newoff - (void*)newfile));
+			fprintf(stderr, "Checking old file for sections: %lx %lx %x to %lx\n",
+				(section - rom), section_len, type, (newoff - (void*)newfile));
 		}
-		if (section->type == EFI_SECTION_USER_INTERFACE ||
-			section->type == EFI_SECTION_VERSION
+		if (type == EFI_SECTION_USER_INTERFACE ||
+			type == EFI_SECTION_VERSION
 		) {
 			if (verbose) {
-				fprintf(stderr, "Copying old file section: %lx %x %x\n",
-					(soff - rom), section_len, section->type);
+				fprintf(stderr, "Copying old file section: %lx %lx %x\n",
+					(section - rom), section_len, type);
 			}
 			if (add_section(&newoff, newend, new,
-				section_len, section->type, soff + 0x4) < 0
+				section_len - section_header_len, type,
+				section + section_header_len) < 0
 			) {
-				return EXIT_FAILURE;
+				goto fail;
 			}
 		}
 		soff += align_up(section_len, 4);
 	}
 
-	// fix the FFS header
-	uint32_t newfilesize = newoff - (void *)newfile;
-	setsize24(newfile->len, newfilesize);
-	newfile->header_sum = 0;
-	newfile->file_sum = 0;
-	uint32_t sum = 0;
-	for (int n = 0; n < 0x17; n++) {
-		sum -= *((uint8_t *) newfile + n);
+	// fix the FFS header. The header checksum excludes the file
+	// checksum and state, so only the new length needs accounting for.
+	uint64_t newfilesize = newoff - (void *)newfile;
+	if (file_header_len == 0x20) {
+		newfile->header_sum = checksum8_update(newfile->header_sum,
+			&newfile->len64, &newfilesize, sizeof(newfilesize));
+		newfile->len64 = newfilesize;
+	} else
+	if (newfilesize < 0xFFFFFF) {
+		uint8_t newlen[3];
+		setsize24(newlen, newfilesize);
+		newfile->header_sum = checksum8_update(newfile->header_sum,
+			newfile->len, newlen, sizeof(newlen));
+		memcpy(newfile->len, newlen, sizeof(newlen));
+	} else {
+		fprintf(stderr, "New file %lx bytes needs a large FFS header\n",
+			newfilesize);
+		goto fail;
 	}
-	newfile->header_sum = sum & 0xFF;
 
-	soff = newdata;
-	sum = 0;
-	while (soff < newoff) {
-		sum -= *((uint8_t *) soff);
-		soff++;
+	if (newfile->attr & FFS_ATTRIB_CHECKSUM) {
+		newfile->file_sum = -sum8(newdata, newoff - newdata);
+	} else {
+		newfile->file_sum = FFS_FIXED_CHECKSUM;
 	}
-	newfile->file_sum = sum & 0xFF;
 
-	// pad the remainder of FV
-	memset(newoff, 0xFF, newend - newoff);
+	// the files after it, in their old order
+	uint64_t cursor = align_up(newoff - new, 8);
+	uint64_t off = file_off + align_up(file_len, 8);
+	while (off < volsize) {
+		const struct efi_file_header *next = (const void *)(old + off);
+		uint32_t next_header_len;
+		const uint64_t next_len = ffs_file_len(next, volsize - off,
+			ffs3, &next_header_len);
+		if (next_len == 0) {
+			break;
+		}
+
+		if (ffs_pad_free(next, next_len, next_header_len, polarity)) {
+			off += align_up(next_len, 8);
+			continue;
+		}
+
+		uint64_t dst = off;
+		if (dst < cursor ||
+			(dst != cursor && dst - cursor < FFS_PAD_HEADER_LEN)
+		) {
+			if (ffs_fixed(next) || next->type == EFI_FV_FILETYPE_FFS_PAD) {
+				fprintf(stderr, "New file overlaps the fixed file at %lx\n",
+					(off + (void *) vol - rom));
+				goto fail;
+			}
+			dst = ffs_place(cursor,
+				ffs_file_alignment(next->attr, ffs3), next_header_len);
+		}
+
+		if (dst + next_len > volsize) {
+			fprintf(stderr, "New file does not fit in the FV\n");
+			goto fail;
+		}
+		if (dst > cursor) {
+			ffs_write_pad(new + cursor, dst - cursor, polarity);
+		}
+		memcpy(new + dst, old + off, next_len);
+		cursor = dst + align_up(next_len, 8);
+		off += align_up(next_len, 8);
+	}
 
-	// copy over old FV
-	memcpy(vol, new, volsize);
+	// whatever follows the last file has to be erased to be reused
+	for ( ; off < volsize ; off++) {
+		if (old[off] != erased) {
+			fprintf(stderr, "FV has data after its last file at %lx\n",
+				(off + (void *) vol - rom));
+			goto fail;
+		}
+	}
+
+	if (flash) {
+		// only reprogram the erase blocks of the FV that changed
+		uint32_t fladdr = flash_base + ((void *)vol - rom);
+		int blocks = spiflash_program_delta(flash, fladdr,
+			vol, new, volsize);
+		if (blocks < 0) {
+			fprintf(stderr, "Failed to program FV at %x\n", fladdr);
+			goto fail;
+		}
+		if (verbose) {
+			fprintf(stderr, "Reprogrammed %d blocks of FV at %x[%lx]\n",
+				blocks, fladdr, volsize);
+		}
+	} else {
+		// copy over old FV
+		memcpy(vol, new, volsize);
+	}
 
 	free(new);
-	return EXIT_SUCCESS;
+	return 0;
+
+fail:
+	free(new);
+	return -1;
+}
+
+/*
+ * Extract-all support.
+ *
+ * The volumes, files and sections are walked once by the submitting
+ * thread, which creates the directory tree and hands the section
+ * writes and decompression to the worker pool.  Decompressed data
+ * lives in a reference counted blob that is freed after the last
+ * write that points into it has finished.
+ */
+struct extract_blob {
+	void * data;
+	int refs;
+};
+
+struct extract_job {
+	char path[EXTRACT_PATH_LEN];
+	const void * data;
+	uint64_t len;
+	struct extract_blob * blob;
+};
+
+static pool_t * extract_pool = NULL;
+static int extract_errors = 0;
+
+static void extract_sections(const char *, const void *, uint64_t,
+	struct extract_blob *);
+
+static struct extract_blob *
+extract_blob_get(
+	struct extract_blob * blob
+) {
+	if (blob)
+		__atomic_add_fetch(&blob->refs, 1, __ATOMIC_SEQ_CST);
+	return blob;
+}
+
+static void
+extract_blob_put(
+	struct extract_blob * blob
+) {
+	if (!blob || __atomic_sub_fetch(&blob->refs, 1, __ATOMIC_SEQ_CST) != 0)
+		return;
+	free(blob->data);
+	free(blob);
+}
+
+static void
+extract_error(
+	const char * path,
+	const char * msg
+) {
+	fprintf(stderr, "%s: %s\n", path, msg);
+	__atomic_add_fetch(&extract_errors, 1, __ATOMIC_SEQ_CST);
+}
+
+static void
+extract_write_job(
+	void * arg
+) {
+	struct extract_job * const job = arg;
+
+	int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		extract_error(job->path, strerror(errno));
+		goto done;
+	}
+
+	for (uint64_t offset = 0 ; offset < job->len ; ) {
+		const ssize_t rc = write(fd,
+			(const uint8_t *) job->data + offset,
+			job->len - offset);
+		if (rc <= 0) {
+			extract_error(job->path, strerror(errno));
+			break;
+		}
+		offset += rc;
+	}
+
+	close(fd);
+done:
+	extract_blob_put(job->blob);
+	free(job);
+}
+
+static void
+extract_decompress_job(
+	void * arg
+) {
+	struct extract_job * const job = arg;
+	lzma_stream strm = LZMA_STREAM_INIT;
+	struct extract_blob * blob = NULL;
+
+	// EDK2 LZMA sections use the 13 byte .lzma header,
+	// which ends with the 64-bit decompressed size.
+	uint64_t out_len;
+	if (job->len < 13) {
+		extract_error(job->path, "truncated LZMA header");
+		goto done;
+	}
+	memcpy(&out_len, (const uint8_t *) job->data + 5, sizeof(out_len));
+
+	blob = calloc(1, sizeof(*blob));
+	if (!blob || out_len > job->len * 1024 ||
+		!(blob->data = malloc(out_len ? out_len : 1))
+	) {
+		extract_error(job->path, "unable to allocate LZMA output");
+		goto done;
+	}
+	blob->refs = 1;
+
+	if (lzma_alone_decoder(&strm, UINT64_MAX) != LZMA_OK) {
+		extract_error(job->path, "lzma_alone_decoder failed");
+		goto done;
+	}
+
+	strm.next_in = job->data;
+	strm.avail_in = job->len;
+	strm.next_out = blob->data;
+	strm.avail_out = out_len;
+	lzma_ret rc = lzma_code(&strm, LZMA_FINISH);
+	lzma_end(&strm);
+	if (rc != LZMA_STREAM_END && rc != LZMA_OK) {
+		extract_error(job->path, "LZMA decompression failed");
+		goto done;
+	}
+
+	extract_sections(job->path, blob->data, out_len - strm.avail_out, blob);
+
+done:
+	extract_blob_put(blob);
+	extract_blob_put(job->blob);
+	free(job);
+}
+
+static void
+extract_submit(
+	pool_fn_t fn,
+	const char * path,
+	const void * data,
+	uint64_t len,
+	struct extract_blob * blob
+) {
+	struct extract_job * const job = calloc(1, sizeof(*job));
+	if (!job) {
+		extract_error(path, "unable to allocate job");
+		return;
+	}
+
+	snprintf(job->path, sizeof(job->path), "%s", path);
+	job->data = data;
+	job->len = len;
+	job->blob = extract_blob_get(blob);
+
+	if (pool_submit(extract_pool, fn, job) < 0) {
+		extract_error(path, "unable to submit job");
+		extract_blob_put(job->blob);
+		free(job);
+	}
+}
+
+static int
+extract_mkdir(
+	const char * path
+) {
+	if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+		extract_error(path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void extract_volume(const char *, const void *, uint64_t,
+	struct extract_blob *);
+
+static void
+extract_sections(
+	const char * dir,
+	const void * buf,
+	uint64_t len,
+	struct extract_blob * blob
+) {
+	char path[EXTRACT_PATH_LEN];
+	unsigned index = 0;
+	uint64_t off = 0;
+
+	while (off < len) {
+		const uint8_t * const section = (const uint8_t *) buf + off;
+		uint32_t header_len;
+		const uint64_t section_len = ffs_section_len(section,
+			len - off, &header_len);
+		if (section_len == 0)
+			break;
+
+		const uint8_t type = section[3];
+		const uint8_t * data = section + header_len;
+		uint64_t data_len = section_len - header_len;
+
+		snprintf(path, sizeof(path), "%s/%02u.%s",
+			dir, index++, ffs_section_type_name(type));
+
+		if (type == EFI_SECTION_FIRMWARE_VOLUME_IMAGE) {
+			if (extract_mkdir(path) == 0)
+				extract_volume(path, data, data_len, blob);
+		} else
+		if (type == EFI_SECTION_COMPRESSION && data_len >= 5 &&
+			data[4] == EFI_NOT_COMPRESSED
+		) {
+			if (extract_mkdir(path) == 0)
+				extract_sections(path, data + 5, data_len - 5, blob);
+		} else
+		if (type == EFI_SECTION_GUID_DEFINED && data_len >= 20) {
+			uint16_t data_offset, attr;
+			memcpy(&data_offset, data + 16, sizeof(data_offset));
+			memcpy(&attr, data + 18, sizeof(attr));
+			char *guid = guid_string((uint8_t *) data);
+
+			if (data_offset < header_len + 20 ||
+				data_offset > section_len
+			) {
+				extract_submit(extract_write_job, path,
+					data, data_len, blob);
+			} else
+			if (strcmp(guid, EFI_LZMA_GUID) == 0) {
+				if (extract_mkdir(path) == 0)
+					extract_submit(extract_decompress_job, path,
+						section + data_offset,
+						section_len - data_offset, blob);
+			} else
+			if ((attr & EFI_GUIDED_SECTION_PROCESSING_REQUIRED) == 0) {
+				if (extract_mkdir(path) == 0)
+					extract_sections(path, section + data_offset,
+						section_len - data_offset, blob);
+			} else {
+				// unknown encapsulation, keep it as-is
+				extract_submit(extract_write_job, path,
+					data, data_len, blob);
+			}
+			free(guid);
+		} else {
+			extract_submit(extract_write_job, path, data, data_len, blob);
+		}
+
+		off += align_up(section_len, 4);
+	}
+}
+
+static void
+extract_volume(
+	const char * dir,
+	const void * buf,
+	uint64_t len,
+	struct extract_blob * blob
+) {
+	const struct efi_volume_header * const vol = buf;
+	char path[EXTRACT_PATH_LEN];
+
+	uint64_t off = fv_files_offset(vol, len);
+	if (off == 0) {
+		extract_error(dir, "invalid firmware volume");
+		return;
+	}
+
+	const int ffs3 = fv_ffs_version(vol) == 3;
+	unsigned index = 0;
+	while (off < vol->len) {
+		struct efi_file_header * const file = (void *)((uint8_t *) buf + off);
+
+		// free space or a corrupt entry ends the volume
+		uint32_t header_len;
+		const uint64_t file_len = ffs_file_len(file, vol->len - off,
+			ffs3, &header_len);
+		if (file_len == 0)
+			break;
+
+		if (file->type != EFI_FV_FILETYPE_FFS_PAD) {
+			const uint8_t * const data = (uint8_t *) file + header_len;
+			const uint64_t data_len = file_len - header_len;
+
+			// name the directory after the user interface section
+			char name[64] = "";
+			for (uint64_t soff = 0 ; soff < data_len ; ) {
+				uint32_t sh_len;
+				const uint64_t s_len = ffs_section_len(data + soff,
+					data_len - soff, &sh_len);
+				if (s_len == 0)
+					break;
+				if (data[soff+3] == EFI_SECTION_USER_INTERFACE) {
+					ffs_ui_name(name, sizeof(name),
+						data + soff + sh_len, s_len - sh_len);
+					break;
+				}
+				soff += align_up(s_len, 4);
+			}
+
+			char *file_guid = guid_string(file->guid);
+			snprintf(path, sizeof(path), "%s/%02u-%s%s%s",
+				dir, index++, file_guid, name[0] ? "-" : "", name);
+			free(file_guid);
+
+			if (verbose) {
+				fprintf(stderr, "Extracting FFS %s type %02x\n",
+					path, file->type);
+			}
+
+			if (extract_mkdir(path) == 0)
+				extract_sections(path, data, data_len, blob);
+		}
+
+		off += align_up(file_len, 8);
+	}
+}
+
+static int
+extract_all(
+	const void * rom,
+	uint64_t size,
+	const char * dir,
+	unsigned threads
+) {
+	char path[EXTRACT_PATH_LEN];
+
+	if (extract_mkdir(dir) < 0)
+		return EXIT_FAILURE;
+
+	extract_pool = pool_create(threads);
+	if (!extract_pool) {
+		fprintf(stderr, "Failed to start worker threads\n");
+		return EXIT_FAILURE;
+	}
+
+	// volumes are page aligned; skip over each one that is found
+	// so that nested volumes are only extracted inside their parent
+	uint64_t off = 0;
+	while (off + sizeof(struct efi_volume_header) <= size) {
+		const struct efi_volume_header * const vol =
+			(const void *)((const uint8_t *) rom + off);
+
+		if (fv_files_offset(vol, size - off) == 0 ||
+			vol->len < EFI_PAGE_SIZE
+		) {
+			off += EFI_PAGE_SIZE;
+			continue;
+		}
+
+		char *fv_guid = guid_string((uint8_t *) vol->guid);
+		snprintf(path, sizeof(path), "%s/%08lx-%s", dir, off, fv_guid);
+		free(fv_guid);
+
+		if (verbose)
+			fprintf(stderr, "Extracting FV %s[%lx]\n", path, vol->len);
+
+		if (extract_mkdir(path) == 0)
+			extract_volume(path, vol, vol->len, NULL);
+
+		off += align_up(vol->len, EFI_PAGE_SIZE);
+	}
+
+	pool_wait(extract_pool);
+	pool_destroy(extract_pool);
+
+	return extract_errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Free space analysis and defragmentation.
+ *
+ * Space in a volume is lost to pad files, to deleted files, to the
+ * padding that keeps each file's data aligned and to the 8 byte
+ * alignment of the file headers.  Defragmenting moves the files
+ * down in order and drops the erased pad files, so that the free
+ * space ends up after the last file.
+ */
+struct fv_space {
+	unsigned files;
+	unsigned pads;              // erased pad files and deleted files
+	uint64_t used;              // by the other files, headers included
+	uint64_t pad;               // in pads that are not needed for alignment
+	uint64_t align;             // lost to file and header alignment
+	uint64_t free;              // erased space after the last file
+	uint64_t other;             // after the last file but not erased
+	uint64_t largest;           // largest run that a new file could use
+};
+
+struct fv_file {
+	uint64_t offset;
+	uint64_t len;
+	uint32_t header_len;
+	uint64_t align;
+	int fixed;
+};
+
+/*
+ * The live files of a volume in order, skipping and counting erased
+ * pad files and deleted files.  Pads that hold data are returned as
+ * fixed files, since something may expect the data at that address.
+ * Returns the number found and sets *end to the offset after the last
+ * entry that could be parsed, or -1 if out of memory.
+ */
+static int fv_files(
+	const struct efi_volume_header *vol,
+	struct fv_file **files_out,
+	unsigned *pads,
+	uint64_t *end
+) {
+	const int ffs3 = fv_ffs_version(vol) == 3;
+	const int polarity = (vol->attr & EFI_FVB2_ERASE_POLARITY) != 0;
+	struct fv_file *files = NULL;
+	int num_files = 0;
+
+	*pads = 0;
+	uint64_t off = fv_files_offset(vol, vol->len);
+	while (off < vol->len) {
+		const struct efi_file_header *file =
+			(const void *)((const uint8_t *) vol + off);
+
+		uint32_t header_len;
+		const uint64_t file_len = ffs_file_len(file, vol->len - off,
+			ffs3, &header_len);
+		if (file_len == 0) {
+			break;
+		}
+
+		if (ffs_pad_free(file, file_len, header_len, polarity) ||
+			!ffs_file_valid(file, polarity)
+		) {
+			(*pads)++;
+		} else {
+			if ((num_files & (num_files - 1)) == 0) {
+				const int n = num_files ? num_files * 2 : 16;
+				struct fv_file *f = realloc(files, n * sizeof(*f));
+				if (!f) {
+					free(files);
+					return -1;
+				}
+				files = f;
+			}
+
+			struct fv_file *f = &files[num_files++];
+			f->offset = off;
+			f->len = file_len;
+			f->header_len = header_len;
+			f->align = ffs_file_alignment(file->attr, ffs3);
+			f->fixed = ffs_fixed(file) ||
+				file->type == EFI_FV_FILETYPE_FFS_PAD;
+		}
+
+		off += align_up(file_len, 8);
+	}
+
+	*files_out = files;
+	*end = off < vol->len ? off : vol->len;
+	return num_files;
+}
+
+static int fv_space(
+	const struct efi_volume_header *vol,
+	struct fv_space *sp
+) {
+	const uint8_t erased = vol->attr & EFI_FVB2_ERASE_POLARITY ? 0xFF : 0x00;
+	const uint8_t *buf = (const void *) vol;
+	struct fv_file *files;
+	uint64_t end;
+
+	memset(sp, 0, sizeof(*sp));
+	const int num_files = fv_files(vol, &files, &sp->pads, &end);
+	if (num_files < 0) {
+		return -1;
+	}
+
+	// the gap before each file holds pads, of which only what
+	// the alignment of the file needs is lost
+	uint64_t cursor = fv_files_offset(vol, vol->len);
+	for (int i = 0 ; i < num_files ; i++) {
+		const struct fv_file *f = &files[i];
+		const uint64_t gap = f->offset - cursor;
+		uint64_t need = ffs_place(cursor, f->align, f->header_len) - cursor;
+		if (need > gap) {
+			need = gap;
+		}
+
+		sp->files++;
+		sp->used += f->len;
+		sp->align += need + align_up(f->len, 8) - f->len;
+		sp->pad += gap - need;
+		if (gap - need > sp->largest) {
+			sp->largest = gap - need;
+		}
+
+		cursor = f->offset + align_up(f->len, 8);
+	}
+
+	// pads after the last file join the erased space behind them
+	uint64_t tail = 0;
+	sp->pad += end - cursor;
+	for (uint64_t off = end ; off < vol->len ; off++) {
+		if (buf[off] == erased) {
+			sp->free++;
+			tail++;
+		} else {
+			sp->other++;
+			tail = 0;
+		}
+	}
+
+	if (tail == vol->len - end) {
+		tail += end - cursor;
+	}
+	if (tail > sp->largest) {
+		sp->largest = tail;
+	}
+
+	free(files);
+	return 0;
+}
+
+static void fv_space_print(
+	uint64_t offset,
+	const struct efi_volume_header *vol,
+	const struct fv_space *sp
+) {
+	char guid[GUID_STR_LEN];
+
+	printf("%08"PRIx64" %8"PRIx64" %5u %8"PRIx64" %4u %8"PRIx64
+		" %8"PRIx64" %8"PRIx64" %8"PRIx64"%s %s\n",
+		offset, vol->len, sp->files, sp->used,
+		sp->pads, sp->pad, sp->align, sp->free, sp->largest,
+		sp->other ? "*" : " ",
+		guid_format(guid, vol->guid));
+}
+
+static void fv_space_header(void) {
+	printf("%-8s %8s %5s %8s %4s %8s %8s %8s %8s  %s\n",
+		"offset", "len", "files", "used", "pads", "pad", "align",
+		"free", "largest", "guid");
+}
+
+/*
+ * Defragment one volume.  Returns the number of bytes that changed,
+ * 0 if the layout was already tight, or -1 if the volume can not be
+ * rewritten; *first and *last are the range of the change.
+ */
+static int64_t fv_defrag(
+	void *rom,
+	struct efi_volume_header *vol,
+	uint64_t *first,
+	uint64_t *last
+) {
+	const int polarity = (vol->attr & EFI_FVB2_ERASE_POLARITY) != 0;
+	const uint8_t erased = polarity ? 0xFF : 0x00;
+	const uint64_t files_off = fv_files_offset(vol, vol->len);
+	const uint8_t *old = (const void *) vol;
+	struct fv_file *files;
+	unsigned pads;
+	uint64_t end;
+
+	const int num_files = fv_files(vol, &files, &pads, &end);
+	if (num_files < 0) {
+		return -1;
+	}
+
+	// anything that is not erased after the last file is kept
+	for (uint64_t off = end ; off < vol->len ; off++) {
+		if (old[off] != erased) {
+			fprintf(stderr, "FV at %lx: data after the last file at %lx,"
+				" leaving it unchanged\n",
+				(const uint8_t *) vol - (uint8_t *) rom, off);
+			free(files);
+			return -1;
+		}
+	}
+
+	uint8_t *new = malloc(vol->len);
+	if (!new) {
+		free(files);
+		return -1;
+	}
+	memcpy(new, vol, files_off);
+	memset(new + files_off, erased, vol->len - files_off);
+
+	uint64_t cursor = files_off;
+	int next_fixed = 0;
+	for (int i = 0 ; i < num_files ; i++) {
+		const struct fv_file *f = &files[i];
+		uint64_t dst;
+
+		if (!f->fixed) {
+			// a file that does not fit before the next fixed
+			// file goes after it instead; what is left of the
+			// gap must be empty or hold a pad file
+			while (next_fixed < num_files && (next_fixed <= i ||
+				files[next_fixed].fixed <= 0)
+			) {
+				next_fixed++;
+			}
+
+			dst = ffs_place(cursor, f->align, f->header_len);
+			const uint64_t dst_end = dst + align_up(f->len, 8);
+			if (next_fixed == num_files ||
+				dst_end == files[next_fixed].offset ||
+				dst_end + FFS_PAD_HEADER_LEN <= files[next_fixed].offset
+			) {
+				goto place;
+			}
+
+			// the fixed file is placed now and skipped later
+			const struct fv_file *fx = &files[next_fixed];
+			if (fx->offset < cursor ||
+				(fx->offset != cursor &&
+				fx->offset - cursor < FFS_PAD_HEADER_LEN)
+			) {
+				goto gap;
+			}
+			if (fx->offset > cursor) {
+				ffs_write_pad(new + cursor, fx->offset - cursor, polarity);
+			}
+			memcpy(new + fx->offset, old + fx->offset, fx->len);
+			cursor = fx->offset + align_up(fx->len, 8);
+			files[next_fixed].fixed = -1;
+			i--;
+			continue;
+		}
+
+		if (f->fixed < 0) {
+			continue;
+		}
+
+		// fixed files keep their offset
+		dst = f->offset;
+		if (dst < cursor ||
+			(dst != cursor && dst - cursor < FFS_PAD_HEADER_LEN)
+		) {
+			goto gap;
+		}
+
+	place:
+		// nothing is written past the end of the volume
+		if (dst + f->len > vol->len) {
+			goto gap;
+		}
+		if (dst > cursor) {
+			ffs_write_pad(new + cursor, dst - cursor, polarity);
+		}
+		memcpy(new + dst, old + f->offset, f->len);
+		cursor = dst + align_up(f->len, 8);
+	}
+
+	if (cursor > vol->len) {
+		goto gap;
+	}
+
+	free(files);
+
+	uint64_t changed = 0;
+	for (uint64_t off = 0 ; off < vol->len ; off++) {
+		if (new[off] == old[off]) {
+			continue;
+		}
+		if (changed++ == 0) {
+			*first = off;
+		}
+		*last = off;
+	}
+
+	if (changed == 0) {
+		free(new);
+		return 0;
+	}
+
+	if (flash) {
+		// only reprogram the erase blocks of the FV that changed
+		uint32_t fladdr = flash_base + ((uint8_t *) vol - (uint8_t *) rom);
+		int blocks = spiflash_program_delta(flash, fladdr,
+			vol, new, vol->len);
+		if (blocks < 0) {
+			fprintf(stderr, "Failed to program FV at %x\n", fladdr);
+			free(new);
+			return -1;
+		}
+		if (verbose) {
+			fprintf(stderr, "Reprogrammed %d blocks of FV at %x[%lx]\n",
+				blocks, fladdr, vol->len);
+		}
+	} else {
+		memcpy(vol, new, vol->len);
+	}
+
+	free(new);
+	return changed;
+
+gap:
+	fprintf(stderr, "FV at %lx: no room for the files around a fixed file,"
+		" leaving it unchanged\n",
+		(const uint8_t *) vol - (uint8_t *) rom);
+	free(files);
+	free(new);
+	return -1;
+}
+
+/*
+ * Report the free space in each top level volume, and defragment
+ * them if asked.  Only FFS volumes are included; NVRAM stores and
+ * other volumes have no files to account for.
+ */
+static int fv_space_all(void *rom, uint64_t size, int defrag) {
+	int errors = 0;
+
+	fv_space_header();
+
+	uint64_t off = 0;
+	while (off + sizeof(struct efi_volume_header) <= size) {
+		struct efi_volume_header *vol = (void *)((uint8_t *) rom + off);
+
+		if (fv_files_offset(vol, size - off) == 0 ||
+			vol->len < EFI_PAGE_SIZE
+		) {
+			off += EFI_PAGE_SIZE;
+			continue;
+		}
+
+		if (fv_ffs_version(vol) == 0) {
+			off += align_up(vol->len, EFI_PAGE_SIZE);
+			continue;
+		}
+
+		struct fv_space sp;
+		if (fv_space(vol, &sp) < 0) {
+			perror("fv_space");
+			return EXIT_FAILURE;
+		}
+		fv_space_print(off, vol, &sp);
+
+		uint64_t first, last;
+		const int64_t changed = defrag ? fv_defrag(rom, vol, &first, &last) : 0;
+		if (changed < 0) {
+			errors++;
+		} else
+		if (changed > 0) {
+			// the erase blocks that need programming
+			const uint64_t start = (off + first) & ~(uint64_t)(EFI_PAGE_SIZE - 1);
+			const uint64_t end = align_up(off + last + 1, EFI_PAGE_SIZE);
+			printf("  defragmented: changed %08"PRIx64"-%08"PRIx64
+				", %"PRIu64" blocks of %x\n",
+				off + first, off + last,
+				(end - start) / EFI_PAGE_SIZE, EFI_PAGE_SIZE);
+
+			if (!flash && fv_space(vol, &sp) == 0) {
+				fv_space_print(off, vol, &sp);
+			}
+		}
+
+		off += align_up(vol->len, EFI_PAGE_SIZE);
+	}
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int main(int argc, char** argv) {
@@ -256,10 +1193,16 @@ int main(int argc, char** argv) {
 	int do_read = 0;
 	int do_list = 0;
 	int do_write = 0;
+	int do_space = 0;
+	int do_defrag = 0;
+	unsigned threads = 0;
+	unsigned payload = 0;
 	const char * romname = NULL;
+	const char * extract_dir = NULL;
 	const char * target_guid = NULL;
 	const char * filename = NULL;
-	while ((opt = getopt_long(argc, argv, "h?vlw:f:o:r:",
+	uint64_t pcie_xbar = PCIEXBAR;
+	while ((opt = getopt_long(argc, argv, "h?vlw:f:o:r:p:x:j:P:sd",
 		long_options, NULL)) != -1)
 	{
 		switch(opt)
@@ -285,6 +1228,24 @@ int main(int argc, char** argv) {
 		case 'f':
 			filename = optarg;
 			break;
+		case 'p':
+			pcie_xbar = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			extract_dir = optarg;
+			break;
+		case 'j':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			payload = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			do_space = 1;
+			break;
+		case 'd':
+			do_defrag = 1;
+			break;
 		case '?': case 'h':
 			fprintf(stderr, "%s", usage);
 			return EXIT_SUCCESS;
@@ -294,7 +1255,15 @@ int main(int argc, char** argv) {
 		}
 	}
 
-	if (!do_list && !do_read && !do_write) {
+	if (!do_list && !do_read && !do_write && !extract_dir &&
+		!do_space && !do_defrag
+	) {
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+
+	if (do_write && filename == NULL) {
+		fprintf(stderr, "-f || --file is required to replace a file\n");
 		fprintf(stderr, "%s", usage);
 		return EXIT_FAILURE;
 	}
@@ -312,8 +1281,40 @@ int main(int argc, char** argv) {
 	const uint64_t mem_end = 0x100000000;
 
 	if (use_file) {
-		int readonly = do_write ? 0 : 1;
+		int readonly = do_write || do_defrag ? 0 : 1;
 		rom = map_file(romname, &size, readonly);
+	} else
+	if (do_write || do_defrag) {
+		// the mapped window is read-only, so the new FV is
+		// programmed through the SPI controller instead
+		flash = calloc(1, sizeof(*flash));
+		if (!flash)
+			return EXIT_FAILURE;
+		flash->verbose = verbose;
+
+		if (spiflash_init(flash, pcie_xbar) < 0) {
+			perror("spiflash_init");
+			return EXIT_FAILURE;
+		}
+
+		uint32_t bios_base, bios_limit;
+		if (spiflash_region(flash, 1, &bios_base, &bios_limit) < 0) {
+			fprintf(stderr, "Failed to find BIOS region\n");
+			return EXIT_FAILURE;
+		}
+
+		if (spiflash_write_enable(flash) < 0) {
+			fprintf(stderr, "spiflash: unable to enable writes\n");
+			return EXIT_FAILURE;
+		}
+
+		// the BIOS region is mapped so that it ends at 4 GB,
+		// but only the top of it might be visible
+		size = (uint64_t) bios_limit - bios_base + 1;
+		if (size > 0x2000000)
+			size = 0x2000000;
+		flash_base = bios_limit + 1 - size;
+		rom = map_physical(mem_end - size, size);
 	} else {
 		size = 0x2000000; // GRRR: FIX TO BE REAL
 		rom = map_physical(mem_end - size, size);
@@ -325,40 +1326,75 @@ int main(int argc, char** argv) {
 		return EXIT_FAILURE;
 	}
 
-	// search for FVs
+	// a capsule is viewed in place: rom is moved to the payload
+	// inside the mapped file, which is never copied out
+	capsule_t cap;
+	if (use_file && capsule_parse(&cap, rom, size) == 0) {
+		if (payload >= cap.num_payloads) {
+			fprintf(stderr, "%s: %s capsule has %u payloads\n",
+				romname, capsule_type_name(cap.type), cap.num_payloads);
+			return EXIT_FAILURE;
+		}
+		if (verbose) {
+			fprintf(stderr, "%s capsule payload %u at %lx[%lx]\n",
+				capsule_type_name(cap.type), payload,
+				cap.payloads[payload].offset, cap.payloads[payload].len);
+		}
+		rom += cap.payloads[payload].offset;
+		size = cap.payloads[payload].len;
+	}
+
+	// a full chip dump is parsed like the BIOS region alone,
+	// so that the ME region is not scanned for volumes
+	if (use_file) {
+		uint64_t bios_offset, bios_len;
+		if (descriptor_bios_region(rom, size, &bios_offset, &bios_len) > 0 &&
+			verbose
+		) {
+			fprintf(stderr, "BIOS region at %lx[%lx]\n",
+				bios_offset, bios_len);
+		}
+		rom += bios_offset;
+		size = bios_len;
+	}
+
+	if (extract_dir)
+		return extract_all(rom, size, extract_dir, threads);
+
+	if (do_space || do_defrag)
+		return fv_space_all(rom, size, do_defrag);
 
-	void *voff = rom + size;
-	while (voff >= rom) {
+	// search for FVs, starting with the last page of the ROM
+	for (uint64_t vpos = size & ~(uint64_t)(EFI_PAGE_SIZE - 1) ; vpos > 0 ; ) {
+		vpos -= EFI_PAGE_SIZE;
+		void *voff = rom + vpos;
 		struct efi_volume_header *vol = voff;
 
-		if (vol->sig != EFI_VOLUME_SIGNATURE) {
-			voff -= EFI_PAGE_SIZE;
+		uint64_t files_off = fv_files_offset(vol, size - vpos);
+		if (files_off == 0) {
 			continue;
 		}
 
 		char *fv_guid = guid_string(vol->guid);
 		if (verbose) {
 			fprintf(stderr, "Possible FV at %lx[%lx]+%x\n",
-				(voff-rom), vol->len, vol->header_len);
+				vpos, vol->len, vol->header_len);
 			fprintf(stderr, "FV GUID: %s\n", fv_guid);
 		}
+		free(fv_guid);
 
-		int parse_sections =
-			strcmp(fv_guid, EFI_FIRMWARE_GUID1) == 0 ||
-			strcmp(fv_guid, EFI_FIRMWARE_GUID2) == 0;
+		const int ffs_version = fv_ffs_version(vol);
+		const int parse_sections = ffs_version != 0;
 
-		void *foff = voff + vol->header_len;
-		while (foff < voff+vol->len) {
+		uint64_t fpos = files_off;
+		while (fpos < vol->len) {
+			void *foff = voff + fpos;
 			struct efi_file_header *file = foff;
 
-			uint64_t file_len = size24(file->len);
-			uint32_t header_len = 0x18;
-			if (file_len == 0xFFFFFF) {
-				file_len = file->len64;
-				header_len = 0x20;
-			}
-
-			if (file_len > size || (foff-voff)+file_len > size) {
+			uint32_t header_len;
+			uint64_t file_len = ffs_file_len(file, vol->len - fpos,
+				ffs_version == 3, &header_len);
+			if (file_len == 0) {
 				break;
 			}
 
@@ -392,20 +1428,27 @@ int main(int argc, char** argv) {
 					fprintf(stderr, "Failed to replace FFS\n");
 					return EXIT_FAILURE;
 				}
+
+				// the volume has been rewritten, so continue
+				// with the new length of the replaced file
+				file_len = ffs_file_len(file, vol->len - fpos,
+					ffs_version == 3, &header_len);
+				if (file_len == 0) {
+					free(file_guid);
+					break;
+				}
 			}
 
-			void *soff = foff+header_len;
-			while (soff < foff+file_len) {
+			uint64_t spos = header_len;
+			while (spos < file_len) {
+				void *soff = foff + spos;
 				struct efi_section_header *section = soff;
-				uint64_t section_len = size24(section->len);
-				uint32_t section_data_offset = 0x4;
+				uint32_t section_data_offset;
+				uint64_t section_len = ffs_section_len(section,
+					file_len - spos, &section_data_offset);
 				if (section_len == 0) {
 					break;
 				}
-				if (section_len == 0xFFFFFF) {
-					section_len = *((uint64_t *) section + 0x4);
-					section_data_offset += 0x4;
-				}
 
 				if (verbose) {
 					fprintf(stderr, "Possible Section at %lx[%lx]\n",
@@ -437,14 +1480,13 @@ int main(int argc, char** argv) {
 					do_read++;
 				}
 
-				soff += section_len;
+				spos += align_up(section_len, 4);
 			}
 
 			end_file:
 			free(file_guid);
-			foff += align_up(file_len, 8);
+			fpos += align_up(file_len, 8);
 		}
-		voff -= EFI_PAGE_SIZE;
 	}
 
 	if (do_read == 1) {
@@ -0,0 +1,471 @@
+/** \file
+ * UEFI firmware volume, FFS file and section parsing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "util.h"
+#include "uefi_index.h"
+#include "descriptor.h"
+
+uint32_t size24(uint8_t len[3]) {
+	return (uint32_t)len[0] +
+		((uint32_t)(len[1]) << 8) +
+		((uint32_t)(len[2]) << 16);
+}
+
+void setsize24(uint8_t len[3], uint32_t size) {
+	len[2] = size >> 16 & 0xFF;
+	len[1] = size >> 8 & 0xFF;
+	len[0] = size & 0xFF;
+}
+
+char *guid_format(char out[GUID_STR_LEN], const uint8_t guid[16]) {
+	snprintf(out, GUID_STR_LEN,
+		"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		guid[3], guid[2], guid[1], guid[0],
+		guid[5], guid[4],
+		guid[7], guid[6],
+		guid[8], guid[9],
+		guid[10],
+		guid[11],
+		guid[12],
+		guid[13],
+		guid[14],
+		guid[15]);
+	return out;
+}
+
+char *guid_string(uint8_t guid[16]) {
+	char *s = malloc(GUID_STR_LEN);
+	if (s == NULL) {
+		return NULL;
+	}
+	return guid_format(s, guid);
+}
+
+
+/*
+ * Offset of the first file in a volume or 0 if the volume header
+ * does not fit in the remaining space.  Files start after the
+ * extended header when there is one.
+ */
+uint64_t fv_files_offset(
+	const struct efi_volume_header *vol,
+	uint64_t remaining
+) {
+	if (remaining < sizeof(*vol) ||
+		vol->sig != EFI_VOLUME_SIGNATURE ||
+		vol->len > remaining ||
+		vol->header_len < offsetof(struct efi_volume_header, num_blocks) ||
+		vol->header_len > vol->len
+	) {
+		return 0;
+	}
+
+	uint64_t off = vol->header_len;
+	if (vol->ext_header_off != 0 &&
+		vol->ext_header_off + sizeof(struct efi_volume_ext_header) <= vol->len
+	) {
+		const struct efi_volume_ext_header *ext =
+			(const void *)((const uint8_t *) vol + vol->ext_header_off);
+		uint64_t ext_end = vol->ext_header_off + (uint64_t) ext->len;
+		if (ext_end > off && ext_end <= vol->len) {
+			off = ext_end;
+		}
+	}
+
+	return align_up(off, 8);
+}
+
+/*
+ * Length of an FFS file and its header, or 0 if it does not fit
+ * in the remaining space of the volume.  FFSv3 volumes mark large
+ * files with an attribute and store the length after the header.
+ */
+uint64_t ffs_file_len(
+	const struct efi_file_header *file,
+	uint64_t remaining,
+	int ffs3,
+	uint32_t *header_len
+) {
+	if (remaining < 0x18) {
+		return 0;
+	}
+
+	uint64_t len = size24((uint8_t *) file->len);
+	*header_len = 0x18;
+	if (len == 0xFFFFFF || (ffs3 && (file->attr & FFS_ATTRIB_LARGE_FILE))) {
+		if (remaining < 0x20) {
+			return 0;
+		}
+		len = file->len64;
+		*header_len = 0x20;
+	}
+
+	if (len < *header_len || len > remaining) {
+		return 0;
+	}
+	return len;
+}
+
+/*
+ * The data after the header is aligned relative to the start of the
+ * volume.  FFSv3 adds DATA_ALIGNMENT2 for 128 KiB to 16 MiB.
+ */
+uint64_t ffs_file_alignment(uint8_t attr, int ffs3) {
+	static const uint64_t alignment[8] = {
+		1, 16, 128, 512, 1024, 4 * 1024, 32 * 1024, 64 * 1024,
+	};
+	const unsigned code = (attr & FFS_ATTRIB_DATA_ALIGNMENT) >> 3;
+
+	if (ffs3 && (attr & FFS_ATTRIB_DATA_ALIGNMENT2)) {
+		return (uint64_t) 128 * 1024 << code;
+	}
+	return alignment[code];
+}
+
+/*
+ * The state bits are set one at a time as a file is written and
+ * deleted, so the highest one that is set is the current state.
+ */
+int ffs_file_valid(const struct efi_file_header *file, int polarity) {
+	uint8_t state = polarity ? (uint8_t) ~file->state : file->state;
+	uint8_t top = 0;
+	while (state) {
+		top = state & -state;
+		state &= state - 1;
+	}
+	return top == EFI_FILE_DATA_VALID || top == EFI_FILE_MARKED_FOR_UPDATE;
+}
+
+/*
+ * Length of a section and its header, or 0 if it does not fit
+ * in the remaining space of the file.  Large sections store a
+ * 32-bit length immediately after the common header.
+ */
+uint64_t ffs_section_len(
+	const void *section,
+	uint64_t remaining,
+	uint32_t *header_len
+) {
+	if (remaining < 4) {
+		return 0;
+	}
+
+	uint64_t len = size24((uint8_t *) section);
+	*header_len = 4;
+	if (len == 0xFFFFFF) {
+		uint32_t len32;
+		if (remaining < 8) {
+			return 0;
+		}
+		memcpy(&len32, (const uint8_t *) section + 4, sizeof(len32));
+		len = len32;
+		*header_len = 8;
+	}
+
+	if (len < *header_len || len > remaining) {
+		return 0;
+	}
+	return len;
+}
+
+// FFS version from the file system GUID, or 0 if it is not one we parse
+int fv_ffs_version(
+	const struct efi_volume_header *vol
+) {
+	char fv_guid[GUID_STR_LEN];
+	guid_format(fv_guid, vol->guid);
+	int version = 0;
+	if (strcmp(fv_guid, EFI_FIRMWARE_GUID1) == 0) {
+		version = 2;
+	} else
+	if (strcmp(fv_guid, EFI_FIRMWARE_GUID2) == 0) {
+		version = 3;
+	}
+	return version;
+}
+
+
+int guid_parse(const char *s, uint8_t guid[16]) {
+	// byte order of each character pair in the text form
+	static const int order[16] = {
+		3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15
+	};
+	if (strlen(s) != 36) {
+		return -1;
+	}
+
+	int n = 0;
+	for (int i = 0; i < 36; ) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (s[i++] != '-') {
+				return -1;
+			}
+			continue;
+		}
+		unsigned byte;
+		if (sscanf(s + i, "%2x", &byte) != 1) {
+			return -1;
+		}
+		guid[order[n++]] = byte;
+		i += 2;
+	}
+	return 0;
+}
+
+const char *
+ffs_section_type_name(
+	uint8_t type
+) {
+	switch (type) {
+	case 0x01: return "compression";
+	case 0x02: return "guid_defined";
+	case 0x03: return "disposable";
+	case 0x10: return "pe32";
+	case 0x11: return "pic";
+	case 0x12: return "te";
+	case 0x13: return "dxe_depex";
+	case 0x14: return "version";
+	case 0x15: return "ui";
+	case 0x16: return "compat16";
+	case 0x17: return "fv_image";
+	case 0x18: return "freeform_guid";
+	case 0x19: return "raw";
+	case 0x1b: return "pei_depex";
+	case 0x1c: return "mm_depex";
+	default:   return "unknown";
+	}
+}
+
+// Convert a UCS-2 user interface name into something safe for a path
+void
+ffs_ui_name(
+	char * out,
+	size_t out_len,
+	const uint8_t * ui,
+	uint64_t ui_len
+) {
+	size_t n = 0;
+	for (uint64_t i = 0 ; i + 1 < ui_len && n + 1 < out_len ; i += 2) {
+		const uint16_t c = ui[i] | (ui[i+1] << 8);
+		if (c == 0)
+			break;
+		out[n++] = (c < 0x80 && c > 0x20 && c != '/') ? (char) c : '_';
+	}
+	out[n] = '\0';
+}
+
+
+static int index_grow(
+	const allocator_t *alloc,
+	void **array,
+	size_t num,
+	size_t size
+) {
+	// grow in powers of two
+	if (num & (num - 1)) {
+		return 0;
+	}
+	void *n = allocator_realloc(alloc, *array, (num ? num * 2 : 16) * size);
+	if (n == NULL) {
+		return -1;
+	}
+	*array = n;
+	return 0;
+}
+
+static int index_volume(uefi_index_t *, const uint8_t *, uint64_t,
+	uint64_t, int);
+
+static int index_sections(
+	uefi_index_t *idx,
+	const uint8_t *rom,
+	uint64_t off,
+	uint64_t len,
+	unsigned file,
+	int parent
+) {
+	uint64_t pos = 0;
+	while (pos < len) {
+		const uint8_t *section = rom + off + pos;
+		uint32_t header_len;
+		uint64_t section_len = ffs_section_len(section, len - pos,
+			&header_len);
+		if (section_len == 0) {
+			break;
+		}
+
+		if (index_grow(idx->alloc, (void **) &idx->sections, idx->num_sections,
+			sizeof(*idx->sections)) < 0
+		) {
+			return -1;
+		}
+		// the array may move while nested sections are indexed
+		const int self = idx->num_sections++;
+		const uint8_t type = section[3];
+		uefi_section_t *s = &idx->sections[self];
+		s->offset = off + pos;
+		s->len = section_len;
+		s->header_len = header_len;
+		s->type = type;
+		s->file = file;
+		s->parent = parent;
+
+		const uint8_t *data = section + header_len;
+		uint64_t data_off = off + pos + header_len;
+		uint64_t data_len = section_len - header_len;
+
+		if (type == EFI_SECTION_USER_INTERFACE &&
+			idx->files[file].name[0] == '\0'
+		) {
+			ffs_ui_name(idx->files[file].name,
+				sizeof(idx->files[file].name), data, data_len);
+		} else
+		if (type == EFI_SECTION_FIRMWARE_VOLUME_IMAGE) {
+			if (index_volume(idx, rom, data_off, data_len, self) < 0) {
+				return -1;
+			}
+		} else
+		if (type == EFI_SECTION_COMPRESSION && data_len >= 5 &&
+			data[4] == EFI_NOT_COMPRESSED
+		) {
+			if (index_sections(idx, rom, data_off + 5, data_len - 5,
+				file, self) < 0
+			) {
+				return -1;
+			}
+		} else
+		if (type == EFI_SECTION_GUID_DEFINED && data_len >= 20) {
+			uint16_t data_offset, attr;
+			memcpy(&data_offset, data + 16, sizeof(data_offset));
+			memcpy(&attr, data + 18, sizeof(attr));
+			if ((attr & EFI_GUIDED_SECTION_PROCESSING_REQUIRED) == 0 &&
+				data_offset >= header_len + 20 &&
+				data_offset <= section_len &&
+				index_sections(idx, rom, off + pos + data_offset,
+					section_len - data_offset, file, self) < 0
+			) {
+				return -1;
+			}
+		}
+
+		pos += align_up(section_len, 4);
+	}
+	return 0;
+}
+
+static int index_volume(
+	uefi_index_t *idx,
+	const uint8_t *rom,
+	uint64_t off,
+	uint64_t remaining,
+	int parent
+) {
+	const struct efi_volume_header *vol = (const void *)(rom + off);
+	uint64_t pos = fv_files_offset(vol, remaining);
+	if (pos == 0) {
+		return 0;
+	}
+
+	if (index_grow(idx->alloc, (void **) &idx->volumes, idx->num_volumes,
+		sizeof(*idx->volumes)) < 0
+	) {
+		return -1;
+	}
+	const unsigned volume = idx->num_volumes++;
+	uefi_volume_t *v = &idx->volumes[volume];
+	v->offset = off;
+	v->len = vol->len;
+	memcpy(v->guid, vol->guid, sizeof(v->guid));
+	v->ffs_version = fv_ffs_version(vol);
+	v->parent = parent;
+
+	if (v->ffs_version == 0) {
+		return 0;
+	}
+
+	const int ffs3 = v->ffs_version == 3;
+	const uint64_t vol_len = vol->len;
+	while (pos < vol_len) {
+		const struct efi_file_header *file = (const void *)(rom + off + pos);
+		uint32_t header_len;
+		uint64_t file_len = ffs_file_len(file, vol_len - pos, ffs3,
+			&header_len);
+		if (file_len == 0) {
+			break;
+		}
+
+		if (index_grow(idx->alloc, (void **) &idx->files, idx->num_files,
+			sizeof(*idx->files)) < 0
+		) {
+			return -1;
+		}
+		const unsigned self = idx->num_files++;
+		uefi_file_t *f = &idx->files[self];
+		f->offset = off + pos;
+		f->len = file_len;
+		f->header_len = header_len;
+		memcpy(f->guid, file->guid, sizeof(f->guid));
+		f->type = file->type;
+		f->attr = file->attr;
+		f->volume = volume;
+		f->name[0] = '\0';
+
+		if (file->type != EFI_FV_FILETYPE_FFS_PAD &&
+			index_sections(idx, rom, off + pos + header_len,
+				file_len - header_len, self, -1) < 0
+		) {
+			return -1;
+		}
+
+		pos += align_up(file_len, 8);
+	}
+	return 0;
+}
+
+int uefi_index_build(
+	uefi_index_t *idx,
+	const void *rom,
+	uint64_t size,
+	const allocator_t *alloc
+) {
+	memset(idx, 0, sizeof(*idx));
+	idx->alloc = alloc;
+
+	// only the BIOS region of a full chip dump holds volumes;
+	// the ME region has its own format
+	uint64_t off, len;
+	descriptor_bios_region(rom, size, &off, &len);
+	size = off + len;
+
+	// volumes are page aligned; skip over each one that is found
+	// so that nested volumes are only indexed through their parent
+	while (off + sizeof(struct efi_volume_header) <= size) {
+		const struct efi_volume_header *vol =
+			(const void *)((const uint8_t *) rom + off);
+		if (fv_files_offset(vol, size - off) == 0 ||
+			vol->len < EFI_PAGE_SIZE
+		) {
+			off += EFI_PAGE_SIZE;
+			continue;
+		}
+
+		if (index_volume(idx, rom, off, size - off, -1) < 0) {
+			uefi_index_free(idx);
+			return -1;
+		}
+		off += align_up(vol->len, EFI_PAGE_SIZE);
+	}
+	return 0;
+}
+
+void uefi_index_free(uefi_index_t *idx) {
+	allocator_free(idx->alloc, idx->volumes);
+	allocator_free(idx->alloc, idx->files);
+	allocator_free(idx->alloc, idx->sections);
+	memset(idx, 0, sizeof(*idx));
+}
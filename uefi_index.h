@@ -0,0 +1,193 @@
+/** \file
+ * UEFI firmware volume, FFS file and section parsing.
+ *
+ * All lengths are validated against the space remaining in the
+ * enclosing volume or file before they are returned.
+ */
+#ifndef _uefi_index_h_
+#define _uefi_index_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "util.h"
+
+#define EFI_PAGE_SIZE 0x1000
+#define EFI_VOLUME_SIGNATURE 0x4856465F
+#define EFI_FIRMWARE_GUID1 "8c8ce578-8a3d-4f1c-9935-896185c32dd3"
+#define EFI_FIRMWARE_GUID2 "5473c07a-3dcb-4dca-bd6f-1e9689e7349a"
+#define EFI_EMPTY_GUID "ffffffff-ffff-ffff-ffff-ffffffffffff"
+#define EFI_LZMA_GUID "ee4e5898-3914-4259-9d6e-dc7bd79403cf"
+#define EFI_FFS_VOLUME_TOP_FILE_GUID "1ba0062e-c779-4582-8566-336ae8f78f09"
+#define EFI_SECTION_COMPRESSION           0x01
+#define EFI_SECTION_GUID_DEFINED          0x02
+#define EFI_SECTION_VERSION               0x14
+#define EFI_SECTION_USER_INTERFACE        0x15
+#define EFI_SECTION_FIRMWARE_VOLUME_IMAGE 0x17
+#define EFI_SECTION_RAW                   0x19
+
+#define EFI_FVB2_ERASE_POLARITY 0x00000800
+
+#define FFS_ATTRIB_LARGE_FILE 0x01
+#define FFS_ATTRIB_DATA_ALIGNMENT2 0x02
+#define FFS_ATTRIB_FIXED 0x04
+#define FFS_ATTRIB_DATA_ALIGNMENT 0x38
+#define FFS_ATTRIB_CHECKSUM 0x40
+#define FFS_FIXED_CHECKSUM  0xAA
+#define EFI_FV_FILETYPE_RAW 0x01
+#define EFI_FV_FILETYPE_SECURITY_CORE 0x03
+#define EFI_FV_FILETYPE_PEI_CORE 0x04
+#define EFI_FV_FILETYPE_PEIM 0x06
+#define EFI_FV_FILETYPE_COMBINED_PEIM_DRIVER 0x08
+#define EFI_FV_FILETYPE_FFS_PAD 0xF0
+#define EFI_GUIDED_SECTION_PROCESSING_REQUIRED 0x01
+
+// file states, with the bits inverted in erase polarity 1 volumes
+#define EFI_FILE_HEADER_CONSTRUCTION 0x01
+#define EFI_FILE_HEADER_VALID 0x02
+#define EFI_FILE_DATA_VALID 0x04
+#define EFI_FILE_MARKED_FOR_UPDATE 0x08
+#define EFI_FILE_DELETED 0x10
+#define EFI_FILE_HEADER_INVALID 0x20
+#define EFI_NOT_COMPRESSED 0x00
+
+struct efi_volume_header {
+	uint8_t zero_vector[16];  // 0x00
+	uint8_t guid[16];         // 0x10
+	uint64_t len;             // 0x20
+	uint32_t sig;             // 0x28
+	uint32_t attr;            // 0x2c
+	uint16_t header_len;      // 0x30
+	uint16_t checksum;        // 0x32
+	uint16_t ext_header_off;  // 0x34
+	uint8_t reserved;         // 0x36
+	uint8_t revision;         // 0x37
+	uint32_t num_blocks;      // 0x38
+	uint32_t block_size;      // 0x3c
+	uint64_t terminate_block; // 0x40 - must be 0
+};
+
+struct efi_file_header {
+	uint8_t guid[16];         // 0x00
+	uint8_t header_sum;       // 0x10
+	uint8_t file_sum;         // 0x11
+	uint8_t type;             // 0x12
+	uint8_t attr;             // 0x13
+	uint8_t len[3];           // 0x14
+	uint8_t state;            // 0x17
+	uint64_t len64;           // 0x18 optional extended length field
+};
+
+struct efi_section_header {
+	uint8_t len[3];
+	uint8_t type;
+};
+
+struct efi_volume_ext_header {
+	uint8_t guid[16];         // 0x00
+	uint32_t len;             // 0x10
+};
+
+extern uint32_t size24(uint8_t len[3]);
+extern void setsize24(uint8_t len[3], uint32_t size);
+
+// Caller must free the returned string
+#define GUID_STR_LEN 37
+
+// Formats into a caller buffer; guid_string returns a malloc'd copy
+extern char *guid_format(char out[GUID_STR_LEN], const uint8_t guid[16]);
+extern char *guid_string(uint8_t guid[16]);
+
+// Parse the canonical text form of a GUID, returns -1 if malformed
+extern int guid_parse(const char *s, uint8_t guid[16]);
+
+extern int fv_ffs_version(const struct efi_volume_header *vol);
+
+extern uint64_t fv_files_offset(
+	const struct efi_volume_header *vol,
+	uint64_t remaining
+);
+
+extern uint64_t ffs_file_len(
+	const struct efi_file_header *file,
+	uint64_t remaining,
+	int ffs3,
+	uint32_t *header_len
+);
+
+// Alignment of the file data from the FFS attributes, in bytes
+extern uint64_t ffs_file_alignment(uint8_t attr, int ffs3);
+
+// Nonzero if the file state says the header and data are valid
+extern int ffs_file_valid(const struct efi_file_header *file, int polarity);
+
+extern uint64_t ffs_section_len(
+	const void *section,
+	uint64_t remaining,
+	uint32_t *header_len
+);
+
+extern const char *ffs_section_type_name(uint8_t type);
+
+extern void ffs_ui_name(
+	char *out,
+	size_t out_len,
+	const uint8_t *ui,
+	uint64_t ui_len
+);
+
+
+/*
+ * Flat index of every volume, file and section that can be reached
+ * in place in a ROM image.  Volumes nested inside uncompressed FV
+ * image sections are included; compressed data is not expanded
+ * since its contents have no offset in the ROM.
+ */
+typedef struct {
+	uint64_t offset;        // of the volume header in the ROM
+	uint64_t len;
+	uint8_t guid[16];       // file system GUID
+	int ffs_version;        // 2, 3 or 0 if the files are not parsed
+	int parent;             // enclosing section, or -1
+} uefi_volume_t;
+
+typedef struct {
+	uint64_t offset;        // of the FFS header in the ROM
+	uint64_t len;           // including the header
+	uint32_t header_len;
+	uint8_t guid[16];
+	uint8_t type;
+	uint8_t attr;
+	unsigned volume;
+	char name[64];          // from the user interface section
+} uefi_file_t;
+
+typedef struct {
+	uint64_t offset;        // of the section header in the ROM
+	uint64_t len;           // including the header
+	uint32_t header_len;
+	uint8_t type;
+	unsigned file;
+	int parent;             // enclosing section, or -1
+} uefi_section_t;
+
+typedef struct {
+	uefi_volume_t *volumes;
+	size_t num_volumes;
+	uefi_file_t *files;
+	size_t num_files;
+	uefi_section_t *sections;
+	size_t num_sections;
+	const allocator_t *alloc;
+} uefi_index_t;
+
+// alloc may be NULL to use libc; it is kept for uefi_index_free
+extern int uefi_index_build(
+	uefi_index_t *idx,
+	const void *rom,
+	uint64_t size,
+	const allocator_t *alloc
+);
+
+extern void uefi_index_free(uefi_index_t *idx);
+
+#endif
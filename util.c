@@ -13,6 +13,12 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 #include "util.h"
 
 
@@ -89,7 +95,7 @@ MEMCPY_N(16)
 MEMCPY_N(32)
 MEMCPY_N(64)
 
-void
+int
 memcpy_width(
 	volatile void * dest,
 	const volatile void * src,
@@ -110,10 +116,9 @@ memcpy_width(
 	if (width == 8)
 		memcpy_64(dest, src, len, op);
 	else
-	{
-		fprintf(stderr, "width %zu not supported\n", width);
-		exit(EXIT_FAILURE);
-	}
+		return -1;
+
+	return 0;
 }
 
 
@@ -155,20 +160,33 @@ map_physical(
 }
 
 void
+unmap_physical(
+	volatile void * addr,
+	size_t len
+)
+{
+	// undo the page alignment fixup from map_physical
+	const uintptr_t page_mask = 0xFFF;
+	const uintptr_t page_offset = (uintptr_t) addr & page_mask;
+	len = (len + page_offset + page_mask) & ~page_mask;
+
+	munmap((void *)((uintptr_t) addr - page_offset), len);
+}
+
+int
 copy_physical(
 	uint64_t phys_addr,
 	size_t len,
 	volatile void * dest
 )
 {
-	const uint8_t * const buf = map_physical(phys_addr, len);
+	uint8_t * const buf = map_physical(phys_addr, len);
 	if (buf == NULL)
-	{
-		perror("mmap");
-		exit(EXIT_FAILURE);
-	}
+		return -1;
 
-	memcpy(dest, buf, len);
+	memcpy((void *) dest, buf, len);
+	unmap_physical(buf, len);
+	return 0;
 }
 
 void *map_file(
@@ -183,11 +201,15 @@ void *map_file(
 	}
 	struct stat st;
 	if (fstat(fd, &st) < 0) {
+		int tmp_errno = errno;
+		close(fd);
+		errno = tmp_errno;
 		return NULL;
 	}
 
 	*size = st.st_size;
 	if (*size == 0) {
+		close(fd);
 		errno = 0; // not a failure
 		return NULL;
 	}
@@ -210,6 +232,54 @@ void *map_file(
 	return map;
 }
 
+
+// a dump of physical memory, or NULL to use /dev/mem
+static const uint8_t * mem_image;
+static uint64_t mem_image_size;
+
+int
+map_window_image(
+	const char * name
+)
+{
+	mem_image = map_file(name, &mem_image_size, 1);
+	return mem_image ? 0 : -1;
+}
+
+int
+map_window_is_image(void)
+{
+	return mem_image != NULL;
+}
+
+const void *
+map_window(
+	uint64_t phys,
+	size_t len
+)
+{
+	if (!mem_image)
+		return map_physical(phys, len);
+
+	if (phys > mem_image_size || len > mem_image_size - phys)
+	{
+		errno = EFAULT;
+		return NULL;
+	}
+
+	return mem_image + phys;
+}
+
+void
+unmap_window(
+	const void * addr,
+	size_t len
+)
+{
+	if (!mem_image)
+		unmap_physical((volatile void *) addr, len);
+}
+
 uint64_t align_up(
 	uint64_t off,
 	uint32_t align
@@ -217,3 +287,98 @@ uint64_t align_up(
 {
 	return (align + off - 1) & (~(align-1));
 }
+
+int
+cpu_has_sha(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	static int has_sha = -1;
+	if (has_sha >= 0)
+		return has_sha;
+
+	unsigned eax, ebx, ecx, edx;
+	int sha = 0;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+	&&  (ecx & bit_SSSE3) && (ecx & bit_SSE4_1)
+	&&  __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		sha = (ebx & bit_SHA) != 0;
+
+	// every thread computes the same answer, so racing is harmless
+	has_sha = sha;
+	return sha;
+#else
+	return 0;
+#endif
+}
+
+
+uint8_t
+sum8(
+	const void * const buf,
+	size_t len
+)
+{
+	const uint8_t * p = buf;
+	uint64_t sum = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// psadbw against zero adds each 8 byte half into a 64-bit lane
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for ( ; i + 16 <= len ; i += 16)
+	{
+		const __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+	}
+
+	// a store works on 32-bit x86 too, which has no 64-bit movq
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *) lanes, acc);
+	sum = lanes[0] + lanes[1];
+#endif
+
+	for ( ; i < len ; i++)
+		sum += p[i];
+
+	return sum & 0xFF;
+}
+
+uint8_t
+checksum8_update(
+	uint8_t checksum,
+	const void * old,
+	const void * new,
+	size_t len
+)
+{
+	// the checksum is chosen so that everything sums to zero,
+	// so it moves opposite to the sum of the changed bytes.
+	return (uint8_t)(checksum + sum8(old, len) - sum8(new, len));
+}
+
+void *
+allocator_realloc(
+	const allocator_t * const alloc,
+	void * ptr,
+	size_t size
+)
+{
+	if (alloc)
+		return alloc->realloc(alloc->ctx, ptr, size);
+	return realloc(ptr, size);
+}
+
+void
+allocator_free(
+	const allocator_t * const alloc,
+	void * ptr
+)
+{
+	if (!ptr)
+		return;
+	if (alloc)
+		alloc->free(alloc->ctx, ptr);
+	else
+		free(ptr);
+}
@@ -26,7 +26,8 @@ typedef enum {
 } mem_op_t;
 
 
-extern void
+// Returns -1 if the width is not supported
+extern int
 memcpy_width(
 	volatile void * dest,
 	const volatile void * src,
@@ -35,13 +36,20 @@ memcpy_width(
 	mem_op_t op
 );
 
-extern void
+// Returns -1 with errno set if the region could not be mapped
+extern int
 copy_physical(
 	uint64_t phys_addr,
 	size_t len,
 	volatile void *dest
 );
 
+extern void
+unmap_physical(
+	volatile void * addr,
+	size_t len
+);
+
 extern void *
 map_file(
 	const char *name,
@@ -49,10 +57,88 @@ map_file(
 	const int readonly
 );
 
+/*
+ * Physical memory for the tools that read firmware tables: from
+ * /dev/mem, or from a dump file once map_window_image has opened one,
+ * in which case the physical address is the offset into the file.
+ */
+extern int
+map_window_image(
+	const char * name
+);
+
+extern int
+map_window_is_image(void);
+
+extern const void *
+map_window(
+	uint64_t phys,
+	size_t len
+);
+
+extern void
+unmap_window(
+	const void * addr,
+	size_t len
+);
+
+/*
+ * Byte-wise additive sum of a buffer, as used by the
+ * 8-bit checksums in the UEFI firmware file system.
+ */
+extern uint8_t
+sum8(
+	const void * buf,
+	size_t len
+);
+
+/*
+ * Adjust an 8-bit checksum for a range that is about to change
+ * from old to new, without summing the rest of the data again.
+ */
+extern uint8_t
+checksum8_update(
+	uint8_t checksum,
+	const void * old,
+	const void * new,
+	size_t len
+);
+
 extern uint64_t
 align_up(
 	uint64_t off,
 	uint32_t align
 );
 
+/*
+ * Nonzero if the CPU has the SHA extensions, and the SSSE3 and
+ * SSE4.1 shuffles that go with them, so that the digests can use
+ * the hardware rounds.  Always 0 on other architectures.
+ */
+extern int
+cpu_has_sha(void);
+
+/*
+ * Caller supplied memory allocator for the library code.
+ * A NULL allocator means the libc functions.
+ */
+typedef struct {
+	void * (*realloc)(void * ctx, void * ptr, size_t size);
+	void (*free)(void * ctx, void * ptr);
+	void * ctx;
+} allocator_t;
+
+extern void *
+allocator_realloc(
+	const allocator_t * alloc,
+	void * ptr,
+	size_t size
+);
+
+extern void
+allocator_free(
+	const allocator_t * alloc,
+	void * ptr
+);
+
 #endif